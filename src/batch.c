@@ -0,0 +1,461 @@
+//=============================================================
+// batch.c                                   Date: 2026/10/17
+//
+// Copyright (c) 2003-2024 Simon Southwell
+//
+// This file is part of bmp.
+//
+// bmp is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// bmp is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with bmp. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+//
+// Batch processing for the bitmap program. A list of input and
+// output file pairs, from a list file, standard input or a glob
+// pattern with an output directory, is processed in a single
+// process by a pool of worker threads. Each worker processes its
+// files through an image context, with the contexts' buffers drawn
+// from a buffer pool shared by all the workers, so that steady
+// state processing does no allocation.
+//
+//=============================================================
+
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "main.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#include <glob.h>
+#endif
+
+#define BATCHLINESIZE 4096
+
+// A single input/output file pair, and its outcome
+typedef struct {
+    char *ifname;
+    char *ofname;
+    int status;
+    uint64_t insize;
+} job_t, *pjob_t;
+
+// State shared by all the workers of a batch
+typedef struct {
+    pjob_t jobs;                                        // Job list
+    uint32_t njobs;                                     // Number of jobs in list
+    uint32_t listsize;                                  // Allocated size of job list
+    uint32_t next;                                      // Next job to be taken
+    uint32_t failed;                                    // Count of failed jobs
+    uint64_t inbytes;                                   // Total bytes of successful inputs
+    trans_t control;                                    // Per file transform controls
+    prect_t rect;                                       // Clip rectangle, or NULL
+    uint32_t striprows;                                 // Rows per strip if streaming, else 0
+    uint32_t outflags;                                  // Output format flags
+    pbmpop_t ops;                                       // Pipeline operations, or NULL
+    uint32_t nops;                                      // Number of pipeline operations
+    pbmpool_t pool;                                     // Buffer pool shared by the workers' contexts
+#ifndef WIN32
+    pthread_mutex_t lock;                               // Guards job taking and reporting
+#endif
+} batch_t, *pbatch_t;
+
+//=================================================================
+// Now()
+//
+// Returns a monotonic time in seconds, for throughput reporting.
+//
+//=================================================================
+
+static double Now(void)
+{
+#ifndef WIN32
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+//=================================================================
+// AddJob()
+//
+// Appends a copy of the input and output names to the batch's job
+// list. If 'ofname' is NULL, the output is named as the input's
+// base name placed in directory 'outdir'.
+//
+//=================================================================
+
+static int AddJob(pbatch_t b, const char *ifname, const char *ofname, const char *outdir)
+{
+    const char *base;
+    pjob_t jobs;
+    pjob_t j;
+
+    if (ofname == NULL && outdir == NULL) {
+        fprintf(stderr, "***Error: no output name or directory for %s.\n", ifname);
+        return BADSTATUS;
+    }
+
+    if (b->njobs == b->listsize) {
+        b->listsize = b->listsize ? 2 * b->listsize : 64;
+        if ((jobs = (pjob_t)realloc(b->jobs, b->listsize * sizeof(job_t))) == NULL) {
+            fprintf(stderr, "***Error: unable to allocate memory.\n");
+            return BADSTATUS;
+        }
+        b->jobs = jobs;
+    }
+
+    j = &b->jobs[b->njobs];
+    j->status = BADSTATUS;
+    j->insize = 0;
+
+    if ((j->ifname = (char *)malloc(strlen(ifname) + 1)) == NULL) {
+        fprintf(stderr, "***Error: unable to allocate memory.\n");
+        return BADSTATUS;
+    }
+    strcpy(j->ifname, ifname);
+
+    if (ofname != NULL) {
+        j->ofname = (char *)malloc(strlen(ofname) + 1);
+        if (j->ofname != NULL)
+            strcpy(j->ofname, ofname);
+    } else {
+        // Strip any directory from the input name
+        for (base = ifname + strlen(ifname); base > ifname && base[-1] != '/' && base[-1] != '\\'; base--)
+            ;
+        j->ofname = (char *)malloc(strlen(outdir) + strlen(base) + 2);
+        if (j->ofname != NULL)
+            sprintf(j->ofname, "%s/%s", outdir, base);
+    }
+
+    if (j->ofname == NULL) {
+        free(j->ifname);
+        fprintf(stderr, "***Error: unable to allocate memory.\n");
+        return BADSTATUS;
+    }
+
+    b->njobs++;
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// ReadList()
+//
+// Adds a job for each line of list file 'listname' ("-" for
+// standard input). Each line holds an input name followed by an
+// output name, separated by white space. A line with only an input
+// name has its output placed in 'outdir'. Blank lines, and those
+// starting with '#', are ignored.
+//
+//=================================================================
+
+static int ReadList(pbatch_t b, const char *listname, const char *outdir)
+{
+    FILE *fp;
+    char line[BATCHLINESIZE];
+    char *ifname, *ofname;
+    int status = GOODSTATUS;
+
+    if (strcmp(listname, "-") == 0)
+        fp = stdin;
+    else if ((fp = fopen(listname, "r")) == NULL) {
+        fprintf(stderr, "***Error: unable to open list file %s for reading.\n", listname);
+        return BADSTATUS;
+    }
+
+    while (status == GOODSTATUS && fgets(line, BATCHLINESIZE, fp) != NULL) {
+        if ((ifname = strtok(line, " \t\r\n")) == NULL || ifname[0] == '#')
+            continue;
+
+        ofname = strtok(NULL, " \t\r\n");
+        status = AddJob(b, ifname, ofname, outdir);
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+
+    return status;
+}
+
+//=================================================================
+// GlobList()
+//
+// Adds a job for each file matching 'pattern', with outputs of
+// the same base name placed in 'outdir'.
+//
+//=================================================================
+
+static int GlobList(pbatch_t b, const char *pattern, const char *outdir)
+{
+#ifndef WIN32
+    glob_t g;
+    size_t i;
+    int status = GOODSTATUS;
+
+    if (outdir == NULL) {
+        fprintf(stderr, "***Error: an output directory (-D) is required with -G.\n");
+        return BADSTATUS;
+    }
+
+    switch (glob(pattern, 0, NULL, &g)) {
+    case 0:
+        break;
+    case GLOB_NOMATCH:
+        fprintf(stderr, "***Error: no files match %s.\n", pattern);
+        return BADSTATUS;
+    default:
+        fprintf(stderr, "***Error: unable to expand %s.\n", pattern);
+        globfree(&g);
+        return BADSTATUS;
+    }
+
+    for (i = 0; status == GOODSTATUS && i < g.gl_pathc; i++)
+        status = AddJob(b, g.gl_pathv[i], NULL, outdir);
+
+    globfree(&g);
+
+    return status;
+#else
+    fprintf(stderr, "***Error: file patterns not supported on this platform.\n");
+    return BADSTATUS;
+#endif
+}
+
+//=================================================================
+// ProcessJob()
+//
+// Converts, transforms and writes a single file of the batch, using
+// the worker's image context 'ctx'. If streaming (without a filter),
+// the file is processed in strips instead, and needs no whole image
+// buffers.
+// Images are converted to the working format (see WORKFMT()), except
+// for indexed images if keeping palettes (OUTKEEPPAL). With pipeline
+// operations, the file is mapped and made by a planned pipeline (see
+// PlanPipeline()), reading only the pixels it needs.
+//
+//=================================================================
+
+static int ProcessJob(pbatch_t b, pjob_t j, pbmpctx_t ctx, perrmsg_t e)
+{
+    unsigned char *bmp;
+    struct stat st;
+    bmplan_t plan;
+    uint32_t comp;
+
+    if (stat(j->ifname, &st) == 0)
+        j->insize = (uint64_t)st.st_size;
+
+    if (b->striprows && !(b->outflags & OUTKEEPPAL) && !OUTBPP(b->outflags) && b->ops == NULL && b->control.filter == NULL)
+        return StreamBitmap(j->ifname, j->ofname, &b->control, b->rect, b->striprows, e);
+
+    if (ctx == NULL) {
+        snprintf(e->errbuf, e->errsize, "***Error: unable to allocate memory.\n");
+        return BADSTATUS;
+    }
+
+    if (b->ops != NULL) {
+        if (LoadBmpContext(ctx, j->ifname, LBMP_MAPRO, e) == BADSTATUS)
+            return BADSTATUS;
+
+        // Run length encoded images have no rows to pick from, so are expanded first
+        comp = SWPEND32(((pbmhdr_t)GetBmpContextImage(ctx))->i.biCompression);
+        if ((comp == BMP_RLE8 || comp == BMP_RLE4) && ConvertBmpContext(ctx, BMP_FMT24, e) == BADSTATUS)
+            return BADSTATUS;
+
+        bmp = GetBmpContextImage(ctx);
+
+        if (PlanPipeline(bmp, b->ops, b->nops, &plan, e) == BADSTATUS)
+            return BADSTATUS;
+
+        return RunPipeline(bmp, &plan, j->ofname, b->striprows, 1, e);
+    }
+
+    if (LoadBmpContext(ctx, j->ifname, LBMP_READ, e) == BADSTATUS)
+        return BADSTATUS;
+
+    bmp = GetBmpContextImage(ctx);
+
+    if (!((b->outflags & OUTKEEPPAL) && SWPEND16(((pbmhdr_t)bmp)->i.biBitCount) <= BYTEWIDTH)) {
+        if (ConvertBmpContext(ctx, WORKFMT(b->outflags), e) == BADSTATUS)
+            return BADSTATUS;
+        bmp = GetBmpContextImage(ctx);
+    }
+
+    return WriteOutput(j->ofname, bmp, &b->control, b->rect, b->outflags, e);
+}
+
+//=================================================================
+// BatchWorker()
+//
+// Worker thread body. Takes jobs from the shared list until none
+// remain, reporting the status of each as it completes.
+//
+//=================================================================
+
+static void *BatchWorker(void *arg)
+{
+    pbatch_t b = (pbatch_t)arg;
+    pbmpctx_t ctx;
+    char errbuf[ERRBUFSIZE];
+    errmsg_t err;
+    pjob_t j;
+    double start;
+
+    err.errbuf  = errbuf;
+    err.errsize = ERRBUFSIZE;
+
+    ctx = CreateBmpContext(b->pool);
+
+    for (;;) {
+#ifndef WIN32
+        pthread_mutex_lock(&b->lock);
+#endif
+        j = (b->next < b->njobs) ? &b->jobs[b->next++] : NULL;
+#ifndef WIN32
+        pthread_mutex_unlock(&b->lock);
+#endif
+        if (j == NULL)
+            break;
+
+        err.errnum = 0;
+        start      = Now();
+        j->status  = ProcessJob(b, j, ctx, &err);
+
+#ifndef WIN32
+        pthread_mutex_lock(&b->lock);
+#endif
+        if (j->status == GOODSTATUS) {
+            b->inbytes += j->insize;
+            fprintf(stdout, "ok   %s -> %s (%.1f ms)\n", j->ifname, j->ofname, (Now() - start) * 1e3);
+        } else {
+            b->failed++;
+            fprintf(stdout, "FAIL %s -> %s\n", j->ifname, j->ofname);
+            fprintf(stderr, "%s", err.errbuf);
+        }
+#ifndef WIN32
+        pthread_mutex_unlock(&b->lock);
+#endif
+    }
+
+    DestroyBmpContext(ctx);
+
+    return NULL;
+}
+
+//=================================================================
+// RunBatch()
+//
+// Processes the files listed in 'listname' and/or matching 'pattern'
+// (see ReadList() and GlobList()) on 'workers' concurrent threads,
+// with each file converted, transformed by 'control' and clipped by
+// 'rect' (if not NULL) as for a single file. If 'striprows' is
+// non-zero the files are streamed, unless 'outflags' has OUTKEEPPAL
+// set to keep indexed images in their own format, with only their
+// colour tables transformed, or selects an output pixel format.
+// Output is written as for WriteViewAs(), unless the 'nops' pipeline
+// operations 'ops' are given (not NULL), when each file is made by
+// them, as planned by PlanPipeline(). The workers' images are
+// held in contexts drawing on a shared buffer pool. Reports the
+// status of each file, and a throughput summary (with the pool's
+// allocation count) at the end, returning BADSTATUS if any file
+// failed.
+//
+//=================================================================
+
+int RunBatch(const char *listname, const char *pattern, const char *outdir, const ptrans_t control,
+             const prect_t rect, uint32_t striprows, uint32_t workers, uint32_t outflags, const pbmpop_t ops, 
+             uint32_t nops)
+{
+    batch_t b;
+    bmpoolstats_t stats;
+    uint32_t i;
+    double start, secs;
+#ifndef WIN32
+    pthread_t *tids;
+#endif
+
+    memset(&b, 0, sizeof(batch_t));
+
+    // Files are processed concurrently, so each is transformed on a single thread
+    b.control         = *control;
+    b.control.threads = 1;
+    b.rect            = rect;
+    b.striprows       = striprows;
+    b.outflags        = outflags;
+    b.ops             = ops;
+    b.nops            = nops;
+
+    if ((listname != NULL && ReadList(&b, listname, outdir) == BADSTATUS) ||
+        (pattern  != NULL && GlobList(&b, pattern, outdir)  == BADSTATUS))
+        b.failed = 1;
+
+    if (b.failed == 0 && (b.pool = CreateBmpPool(0)) == NULL) {
+        fprintf(stderr, "***Error: unable to allocate memory.\n");
+        b.failed = 1;
+    }
+
+    if (b.failed == 0) {
+        if (workers > b.njobs)
+            workers = b.njobs;
+        if (workers == 0)
+            workers = 1;
+
+        start = Now();
+#ifndef WIN32
+        pthread_mutex_init(&b.lock, NULL);
+
+        if ((tids = (pthread_t *)malloc(workers * sizeof(pthread_t))) == NULL)
+            workers = 1;
+
+        // The calling thread is one of the workers
+        for (i = 1; i < workers; i++)
+            if (pthread_create(&tids[i], NULL, BatchWorker, &b) != 0)
+                break;
+        workers = i;
+
+        BatchWorker(&b);
+
+        for (i = 1; i < workers; i++)
+            pthread_join(tids[i], NULL);
+
+        free(tids);
+        pthread_mutex_destroy(&b.lock);
+#else
+        workers = 1;
+        BatchWorker(&b);
+#endif
+        secs = Now() - start;
+
+        GetBmpPoolStats(b.pool, &stats);
+        DestroyBmpPool(b.pool);
+
+        fprintf(stdout, "%d files, %d failed, %d workers: %.1f MB in %.3f s (%.1f files/s, %.1f MB/s, %d buffer allocations)\n",
+                b.njobs, b.failed, workers, (double)b.inbytes / 1e6, secs,
+                secs > 0 ? (b.njobs - b.failed) / secs : 0.0, secs > 0 ? (double)b.inbytes / 1e6 / secs : 0.0,
+                (int)stats.allocs);
+    }
+
+    for (i = 0; i < b.njobs; i++) {
+        free(b.jobs[i].ifname);
+        free(b.jobs[i].ofname);
+    }
+    free(b.jobs);
+
+    return b.failed ? BADSTATUS : GOODSTATUS;
+}
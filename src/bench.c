@@ -0,0 +1,865 @@
+//=============================================================
+// bench.c                                   Date: 2026/10/17
+//
+// Copyright (c) 2003-2024 Simon Southwell
+//
+// This file is part of bmp.
+//
+// bmp is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// bmp is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with bmp. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+//
+// Benchmark for the bitmap library. Synthetic 1, 4, 8, 16, 24 and
+// 32 bit bitmaps of the requested sizes are generated in memory, and
+// each library stage is timed separately over a number of iterations:
+//
+//   read      : GetBitmap() from an in memory file image
+//   thumb     : RunPipeline() box resize to an eighth of the size,
+//               from the file image, to a scratch file
+//   thumbbilin: as thumb, with the bilinear filter
+//   convert   : ConvertBmpFormat() to the working format (if needed)
+//   <option>  : TransformBmp() with each transform option alone
+//   copygrey  : copy of the image, then TransformBmp() grey scale on it
+//   greyto    : TransformBmpTo() grey scale into a separate buffer
+//   stats     : GetBmpStats() of the image
+//   greystats : as greyto, gathering the statistics of the result as
+//               it is made, for comparison with greyto then stats
+//   stretch   : TransformBmpTo() auto levels, clipping 0.5% at each end,
+//               into a separate buffer (statistics and table passes)
+//   equalize  : as stretch, with luma histogram equalization
+//   <filter>  : TransformBmpTo() with a radius 2 blur, sharpen, edge, and
+//               radius 2 blur with brightness, into a separate buffer
+//   blurnaive : radius 2 blur as a direct 5 x 5 convolution, for
+//               comparison
+//   clip      : ClipBitmap() to the central quarter of the image
+//   rotate<n> : RotateViewTo() by 90, 180 and 270 degrees, into a
+//               separate buffer
+//   rotnaive90: 90 degree rotation a pixel at a time, reading each
+//               output row down an input column, for comparison
+//   write     : WriteBitmap() of the whole image to a scratch file
+//
+// The stages after reading are run for each working format: 24 bit,
+// and 32 bit BGRX (reported as "convert32" etc., and with bpp 32),
+// so that the two may be compared.
+//
+// The best time of the iterations is reported for each stage, as
+// MB/s of the stage's input image and megapixels/s. The results
+// are also appended, as CSV, to a results file so that they may be
+// compared across builds and releases.
+//
+//=============================================================
+
+#include <string.h>
+#include <time.h>
+
+#include "general.h"
+#include "bitmap.h"
+
+#define ERRBUFSIZE       1024
+#define DEFAULTSIZES     "640x480 4096x4096"
+#define DEFAULTBPPS      "1 4 8 16 24 32"
+#define DEFAULTWORKS     "24 32"
+#define DEFAULTITERS     5
+#define DEFAULTRESULTS   "bench_results.csv"
+#define DEFAULTSCRATCH   "bmpbench.tmp"
+#define DEFAULTSEED      1
+
+#define BENCHUSAGE \
+fprintf(stderr, "\nUsage: bmpbench [-h] [-s <sizes>] [-b <bpps>] [-n <iters>] [-j <threads>]\n"   \
+             "           [-w <formats>] [-l <label>] [-o <file>] [-t <file>]\n\n"              \
+             "    -h Display this message\n"                                                   \
+             "    -s Image sizes as WxH list (default \"%s\")\n"                               \
+             "    -b Bits per pixel list (default \"%s\")\n"                                   \
+             "    -w Working formats list, 24 and/or 32 bit (default \"%s\")\n"                \
+             "    -n Iterations per stage, best reported (default %d)\n"                       \
+             "    -j Number of threads for transforms (default 1)\n"                           \
+             "    -l Label for results rows (default none)\n"                                  \
+             "    -o Results file, appended as CSV (default %s)\n"                             \
+             "    -t Scratch file for write timing (default %s)\n"                             \
+             "\n", DEFAULTSIZES, DEFAULTBPPS, DEFAULTWORKS, DEFAULTITERS, DEFAULTRESULTS, DEFAULTSCRATCH)
+
+// Benchmark settings
+typedef struct {
+    uint32_t iters;
+    uint32_t threads;
+    const char *works;
+    const char *label;
+    const char *scratch;
+    FILE *results;
+    errmsg_t err;
+} bench_t, *pbench_t;
+
+static uint32_t seed = DEFAULTSEED;
+
+//=================================================================
+// Now()
+//
+// Returns a monotonic time in seconds.
+//
+//=================================================================
+
+static double Now(void)
+{
+#ifndef WIN32
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+//=================================================================
+// Random()
+//
+// Simple linear congruential generator, so that the synthetic
+// images are the same from run to run and platform to platform.
+//
+//=================================================================
+
+static uint32_t Random(void)
+{
+    seed = seed * 1103515245 + 12345;
+
+    return seed >> 8;
+}
+
+//=================================================================
+// MakeBitmap()
+//
+// Generates, in allocated memory, a complete bitmap file image of
+// 'width' x 'height' pixels at 'bpp' bits per pixel, with a random
+// colour table (if indexed) and random pixel data. 16 and 32 bit
+// images are uncompressed, so are 5-5-5 and BGRX respectively.
+//
+//=================================================================
+
+static unsigned char *MakeBitmap(uint32_t width, uint32_t height, uint32_t bpp)
+{
+    unsigned char *buf, *p;
+    pbmhdr_t hdr;
+    uint32_t ncolours = (bpp > 8) ? 0 : (1U << bpp);
+    uint32_t rowlen    = (width * bpp + 7) / 8;
+    uint32_t padrowlen = 4 * ((width * bpp + 31) / 32);
+    uint32_t offbits   = HDRSIZE + ncolours * sizeof(rgbquad_t);
+    uint32_t i, j;
+
+    if ((buf = (unsigned char *)calloc(1, offbits + padrowlen * height)) == NULL)
+        return NULL;
+
+    hdr = (pbmhdr_t)buf;
+    hdr->f.bfType[0]     = 'B';
+    hdr->f.bfType[1]     = 'M';
+    hdr->f.bfSize        = offbits + padrowlen * height;
+    hdr->f.bfOffBits     = offbits;
+    hdr->i.biSize        = INFOHDRSIZE;
+    hdr->i.biWidth       = width;
+    hdr->i.biHeight      = height;
+    hdr->i.biPlanes      = 1;
+    hdr->i.biBitCount    = bpp;
+    hdr->i.biSizeImage   = padrowlen * height;
+    hdr->i.biClrUsed     = ncolours;
+    HDRENDIAN(hdr);
+
+    for (p = &buf[HDRSIZE], i = 0; i < ncolours * sizeof(rgbquad_t); i++)
+        *p++ = (i % 4 == 3) ? 0 : (unsigned char)Random();
+
+    // Row padding is left as zero
+    for (p = &buf[offbits], i = 0; i < height; i++, p += padrowlen)
+        for (j = 0; j < rowlen; j++)
+            p[j] = (unsigned char)Random();
+
+    return buf;
+}
+
+//=================================================================
+// NaiveRotate90()
+//
+// Rotates the image 'src' clockwise by 90 degrees into 'dst', a
+// pixel at a time, taking each output row from an input column
+// (as a comparison for RotateViewTo()).
+//
+//=================================================================
+
+static void NaiveRotate90(const pbmview_t src, const pbmview_t dst)
+{
+    uint32_t pixbytes = src->hdr.i.biBitCount / 8;
+    uint32_t width    = src->hdr.i.biHeight;
+    uint32_t height   = src->hdr.i.biWidth;
+    uint32_t x, y, k;
+    unsigned char *o;
+    const unsigned char *s;
+
+    for (y = 0; y < height; y++) {
+        o = dst->rows + (int64_t)y * dst->stride;
+        s = src->rows + (uint64_t)(height - 1 - y) * pixbytes;
+        for (x = 0; x < width; x++, s += src->stride)
+            for (k = 0; k < pixbytes; k++)
+                *o++ = s[k];
+    }
+}
+
+//=================================================================
+// NaiveBlur2()
+//
+// Blurs the image 'src' into 'dst' with the 5 x 5 binomial kernel
+// of a radius 2 blur (see MakeFilter()), summing all 25 products
+// for each output byte (as a comparison for the separable filter).
+//
+//=================================================================
+
+static void NaiveBlur2(const pbmview_t src, const pbmview_t dst)
+{
+    static const uint32_t binomial[5] = {1, 4, 6, 4, 1};
+
+    uint32_t pixbytes = src->hdr.i.biBitCount / 8;
+    uint32_t width    = src->hdr.i.biWidth;
+    uint32_t height   = src->hdr.i.biHeight;
+    uint32_t x, y, k, i, j, sum;
+    int64_t xx, yy;
+    unsigned char *o;
+    const unsigned char *s;
+
+    for (y = 0; y < height; y++) {
+        o = dst->rows + (int64_t)y * dst->stride;
+        for (x = 0; x < width; x++) {
+            for (k = 0; k < pixbytes; k++) {
+                for (sum = 128, i = 0; i < 5; i++) {
+                    yy = (int64_t)y + i - 2;
+                    yy = (yy < 0) ? 0 : (yy >= height) ? height - 1 : yy;
+                    s  = src->rows + yy * src->stride;
+                    for (j = 0; j < 5; j++) {
+                        xx   = (int64_t)x + j - 2;
+                        xx   = (xx < 0) ? 0 : (xx >= width) ? width - 1 : xx;
+                        sum += binomial[i] * binomial[j] * s[xx * pixbytes + k];
+                    }
+                }
+                *o++ = (unsigned char)(sum >> 8);
+            }
+        }
+    }
+}
+
+//=================================================================
+// Report()
+//
+// Prints a stage's best time, for an input of 'bytes' bytes and
+// 'pixels' pixels, and appends it to the results file.
+//
+//=================================================================
+
+static void Report(pbench_t b, const char *stage, uint32_t width, uint32_t height, uint32_t bpp, uint64_t bytes,
+                   double best)
+{
+    double mbps = (double)bytes / 1e6 / best;
+    double mpps = (double)width * height / 1e6 / best;
+
+    fprintf(stdout, "%-10s %5dx%-5d %2d bit %10.3f ms %10.1f MB/s %10.1f MP/s\n",
+            stage, width, height, bpp, best * 1e3, mbps, mpps);
+
+    if (b->results != NULL)
+        fprintf(b->results, "%s,%ld,%s,%d,%d,%d,%d,%d,%d,%.6f,%.1f,%.1f\n",
+                b->label, (long)time(NULL), stage, width, height, bpp, b->iters, b->threads, GetSimdLevel(),
+                best, mbps, mpps);
+}
+
+//=================================================================
+// BenchWork()
+//
+// Times the stages following the read on the bitmap file image
+// 'file', of 'filesize' bytes and 'bpp' bits per pixel, with the
+// image first converted to working format 'work' (if not already
+// in it). Returns BADSTATUS on any library error.
+//
+//=================================================================
+
+static int BenchWork(pbench_t b, unsigned char *file, uint32_t filesize, uint32_t width, uint32_t height, 
+                     uint32_t bpp, uint32_t work)
+{
+    // Transform stages, each timed with just the one option set
+    static const char *xfnames[] = {"reverse", "bright", "contrast", "grey", "mono", "flipv", "fliph"};
+    const uint32_t nxforms = sizeof(xfnames) / sizeof(xfnames[0]);
+
+    // Filter stages, followed by the naive blur
+    static const char *convnames[] = {"blur", "sharpen", "edge", "blurbright"};
+    const uint32_t nconvs = sizeof(convnames) / sizeof(convnames[0]);
+
+    // Rotation stages, followed by the naive 90 degree rotation
+    static const uint32_t rotangles[] = {90, 180, 270};
+    const uint32_t nrots = sizeof(rotangles) / sizeof(rotangles[0]);
+
+    unsigned char *img, *tmp, *rot;
+    pbmhdr_t bmp;
+    prgbquad_t r;
+    unsigned char *data;
+    uint64_t imgsize = 0, bufsize = 0, size;
+    uint32_t i, k, rw;
+    double start, t, best;
+    char stage[32];
+    const char *suffix = (work == BMP_FMT32) ? "32" : "";
+    trans_t control;
+    bmpfilter_t filter;
+    rect_t rect;
+    bmview_t view, dst;
+    bmpstats_t stats;
+
+    // Convert to the working format, if not already, keeping the last conversion for
+    // the stages that follow
+    img = NULL;
+    if (GetPixelFormat(file) != work) {
+        bmp  = (pbmhdr_t)file;
+        r    = (prgbquad_t)&file[HDRSIZE];
+        data = &file[SWPEND32(bmp->f.bfOffBits)];
+
+        for (best = 1e30, i = 0; i < b->iters; i++) {
+            start = Now();
+            imgsize = ConvertBmpFormat(&img, &bufsize, bmp, r, data, work, &b->err);
+            t = Now() - start;
+
+            if (imgsize == 0) {
+                fprintf(stderr, "%s", b->err.errbuf);
+                free(img);
+                return BADSTATUS;
+            }
+
+            best = (t < best) ? t : best;
+        }
+        snprintf(stage, sizeof(stage), "convert%s", suffix);
+        Report(b, stage, width, height, bpp, filesize, best);
+    } else {
+        if ((img = (unsigned char *)malloc(filesize)) == NULL) {
+            fprintf(stderr, "***Error: unable to allocate memory.\n");
+            return BADSTATUS;
+        }
+        memcpy(img, file, filesize);
+        imgsize = filesize;
+    }
+
+    // Each transform option on its own, in place
+    for (k = 0; k < nxforms; k++) {
+        memset(&control, 0, sizeof(trans_t));
+        control.threads = b->threads;
+
+        switch (k) {
+        case 0: control.reverse    = TRUE;    break;
+        case 1: control.brightness = 120;     break;
+        case 2: control.contrast   = 70;      break;
+        case 3: control.grey       = TRUE;    break;
+        case 4: control.mono       = MONORED; break;
+        case 5: control.flipv      = TRUE;    break;
+        case 6: control.fliph      = TRUE;    break;
+        }
+
+        for (best = 1e30, i = 0; i < b->iters; i++) {
+            start = Now();
+            if (TransformBmp(img, &control, &b->err) == BADSTATUS) {
+                fprintf(stderr, "%s", b->err.errbuf);
+                free(img);
+                return BADSTATUS;
+            }
+            t = Now() - start;
+
+            best = (t < best) ? t : best;
+        }
+        snprintf(stage, sizeof(stage), "%s%s", xfnames[k], suffix);
+        Report(b, stage, width, height, work, imgsize, best);
+    }
+
+    if ((tmp = (unsigned char *)malloc((size_t)imgsize)) == NULL) {
+        fprintf(stderr, "***Error: unable to allocate memory.\n");
+        free(img);
+        return BADSTATUS;
+    }
+
+    // Grey scale out of place, as a copy followed by an in place transform, and
+    // then with the copy fused into the transform
+    memset(&control, 0, sizeof(trans_t));
+    control.threads = b->threads;
+    control.grey    = TRUE;
+
+    for (best = 1e30, i = 0; i < b->iters; i++) {
+        start = Now();
+        memcpy(tmp, img, (size_t)imgsize);
+        k = TransformBmp(tmp, &control, &b->err);
+        t = Now() - start;
+
+        if (k == BADSTATUS) {
+            fprintf(stderr, "%s", b->err.errbuf);
+            free(tmp);
+            free(img);
+            return BADSTATUS;
+        }
+
+        best = (t < best) ? t : best;
+    }
+    snprintf(stage, sizeof(stage), "copygrey%s", suffix);
+    Report(b, stage, width, height, work, imgsize, best);
+
+    // Destination rows laid out as in the source image
+    ClipView(img, NULL, &view, NULL);
+    memcpy(tmp, img, (size_t)(view.hdr.f.bfOffBits));
+
+    for (best = 1e30, i = 0; i < b->iters; i++) {
+        dst.rows   = tmp + (view.rows - img);
+        dst.stride = view.stride;
+        dst.pal    = NULL;
+
+        start = Now();
+        k = TransformBmpTo(img, NULL, &dst, &control, &b->err);
+        t = Now() - start;
+
+        if (k == BADSTATUS) {
+            fprintf(stderr, "%s", b->err.errbuf);
+            free(tmp);
+            free(img);
+            return BADSTATUS;
+        }
+
+        best = (t < best) ? t : best;
+    }
+    snprintf(stage, sizeof(stage), "greyto%s", suffix);
+    Report(b, stage, width, height, work, imgsize, best);
+
+    // Statistics on their own, then gathered as the grey scale copy is made
+    for (best = 1e30, i = 0; i < b->iters; i++) {
+        start = Now();
+        k = GetBmpStats(img, NULL, b->threads, &stats, &b->err);
+        t = Now() - start;
+
+        if (k == BADSTATUS) {
+            fprintf(stderr, "%s", b->err.errbuf);
+            free(tmp);
+            free(img);
+            return BADSTATUS;
+        }
+
+        best = (t < best) ? t : best;
+    }
+    snprintf(stage, sizeof(stage), "stats%s", suffix);
+    Report(b, stage, width, height, work, imgsize, best);
+
+    control.stats = &stats;
+
+    for (best = 1e30, i = 0; i < b->iters; i++) {
+        dst.rows   = tmp + (view.rows - img);
+        dst.stride = view.stride;
+        dst.pal    = NULL;
+
+        start = Now();
+        k = TransformBmpTo(img, NULL, &dst, &control, &b->err);
+        t = Now() - start;
+
+        if (k == BADSTATUS) {
+            fprintf(stderr, "%s", b->err.errbuf);
+            free(tmp);
+            free(img);
+            return BADSTATUS;
+        }
+
+        best = (t < best) ? t : best;
+    }
+    snprintf(stage, sizeof(stage), "greystats%s", suffix);
+    Report(b, stage, width, height, work, imgsize, best);
+
+    // Auto levels and equalization, each a statistics pass then a table pass
+    for (k = 0; k < 2; k++) {
+        memset(&control, 0, sizeof(trans_t));
+        control.threads   = b->threads;
+        control.levels    = (k == 0) ? BMP_LEVELSSTRETCH : BMP_LEVELSEQUALIZE;
+        control.levelclip = 5;
+
+        for (best = 1e30, i = 0; i < b->iters; i++) {
+            dst.rows   = tmp + (view.rows - img);
+            dst.stride = view.stride;
+            dst.pal    = NULL;
+
+            start = Now();
+            if (TransformBmpTo(img, NULL, &dst, &control, &b->err) == BADSTATUS) {
+                fprintf(stderr, "%s", b->err.errbuf);
+                free(tmp);
+                free(img);
+                return BADSTATUS;
+            }
+            t = Now() - start;
+
+            best = (t < best) ? t : best;
+        }
+        snprintf(stage, sizeof(stage), "%s%s", (k == 0) ? "stretch" : "equalize", suffix);
+        Report(b, stage, width, height, work, imgsize, best);
+    }
+
+    // Filters out of place, so that each is of the original image
+    for (k = 0; k <= nconvs; k++) {
+        memset(&control, 0, sizeof(trans_t));
+        control.threads    = b->threads;
+        control.filter     = &filter;
+        control.brightness = (k == 3) ? 120 : 0;
+        MakeFilter(&filter, (k == 1) ? BMP_CONVSHARPEN : (k == 2) ? BMP_CONVEDGE : BMP_CONVBLUR, (k == 1) ? 100 : 2, 
+                   NULL);
+
+        for (best = 1e30, i = 0; i < b->iters; i++) {
+            dst.rows   = tmp + (view.rows - img);
+            dst.stride = view.stride;
+            dst.pal    = NULL;
+
+            start = Now();
+            if (k == nconvs)
+                NaiveBlur2(&view, &dst);
+            else if (TransformBmpTo(img, NULL, &dst, &control, &b->err) == BADSTATUS) {
+                fprintf(stderr, "%s", b->err.errbuf);
+                free(tmp);
+                free(img);
+                return BADSTATUS;
+            }
+            t = Now() - start;
+
+            best = (t < best) ? t : best;
+        }
+        snprintf(stage, sizeof(stage), "%s%s", (k == nconvs) ? "blurnaive" : convnames[k], suffix);
+        Report(b, stage, width, height, work, imgsize, best);
+    }
+
+    // Rotations, into a buffer big enough for either orientation, touched first so that
+    // its pages are not faulted in whilst timed
+    size = (uint64_t)(((uint64_t)height * work + 31) / 32) * 4 * width;
+    if (size < imgsize)
+        size = imgsize;
+    if ((rot = (unsigned char *)malloc((size_t)size)) == NULL) {
+        fprintf(stderr, "***Error: unable to allocate memory.\n");
+        free(tmp);
+        free(img);
+        return BADSTATUS;
+    }
+    memset(rot, 0, (size_t)size);
+
+    for (k = 0; k <= nrots; k++) {
+        for (best = 1e30, i = 0; i < b->iters; i++) {
+            // Rows are of the rotated image's width
+            rw         = (k < nrots && rotangles[k] == 180) ? width : height;
+            dst.rows   = rot;
+            dst.stride = (int32_t)((((uint64_t)rw * work + 31) / 32) * 4);
+            dst.pal    = NULL;
+
+            start = Now();
+            if (k == nrots)
+                NaiveRotate90(&view, &dst);
+            else if (RotateViewTo(&view, &dst, rotangles[k], b->threads, &b->err) == BADSTATUS) {
+                fprintf(stderr, "%s", b->err.errbuf);
+                free(rot);
+                free(tmp);
+                free(img);
+                return BADSTATUS;
+            }
+            t = Now() - start;
+
+            best = (t < best) ? t : best;
+        }
+        if (k == nrots)
+            snprintf(stage, sizeof(stage), "rotnaive90%s", suffix);
+        else
+            snprintf(stage, sizeof(stage), "rotate%d%s", rotangles[k], suffix);
+        Report(b, stage, width, height, work, imgsize, best);
+    }
+    free(rot);
+
+    // Clip to the central quarter, on a fresh copy each time as clipping is in place
+    for (best = 1e30, i = 0; i < b->iters; i++) {
+        memcpy(tmp, img, (size_t)imgsize);
+
+        rect.left   = width / 4;
+        rect.right  = rect.left + (width + 1) / 2;
+        rect.bottom = height / 4;
+        rect.top    = rect.bottom + (height + 1) / 2;
+
+        start = Now();
+        k = ClipBitmap(tmp, &rect, &size);
+        t = Now() - start;
+
+        if (k == BADSTATUS) {
+            fprintf(stderr, "***Error: bad clipping rectangle.\n");
+            free(tmp);
+            free(img);
+            return BADSTATUS;
+        }
+
+        best = (t < best) ? t : best;
+    }
+    snprintf(stage, sizeof(stage), "clip%s", suffix);
+    Report(b, stage, width, height, work, imgsize, best);
+    free(tmp);
+
+    // Write the whole image out
+    for (best = 1e30, i = 0; i < b->iters; i++) {
+        start = Now();
+        if (WriteBitmap(b->scratch, img, NULL, &b->err) == BADSTATUS) {
+            fprintf(stderr, "%s", b->err.errbuf);
+            free(img);
+            return BADSTATUS;
+        }
+        t = Now() - start;
+
+        best = (t < best) ? t : best;
+    }
+    snprintf(stage, sizeof(stage), "write%s", suffix);
+    Report(b, stage, width, height, work, imgsize, best);
+    remove(b->scratch);
+
+    free(img);
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// BenchImage()
+//
+// Times each stage on a synthetic 'width' x 'height' image of 'bpp'
+// bits per pixel, for each of the working formats in the list (see
+// BenchWork()). Returns BADSTATUS on any library error.
+//
+//=================================================================
+
+static int BenchImage(pbench_t b, uint32_t width, uint32_t height, uint32_t bpp)
+{
+    unsigned char *file;
+    pbmhdr_t bmp;
+    prgbquad_t r;
+    unsigned char *data;
+    uint32_t filesize, i, k;
+    unsigned long work;
+    const char *w;
+    char *end;
+    double start, t, best;
+    int status = GOODSTATUS;
+    bmpop_t op;
+    bmplan_t plan;
+    FILE *fp;
+
+    if ((file = MakeBitmap(width, height, bpp)) == NULL) {
+        fprintf(stderr, "***Error: unable to allocate memory.\n");
+        return BADSTATUS;
+    }
+    filesize = SWPEND32(((pbmhdr_t)file)->f.bfSize);
+
+    // Read, from the file image in memory where supported, so only the library is timed
+    for (best = 1e30, i = 0; i < b->iters; i++) {
+#ifndef WIN32
+        fp = fmemopen(file, filesize, "rb");
+#else
+        if ((fp = tmpfile()) != NULL) {
+            fwrite(file, 1, filesize, fp);
+            rewind(fp);
+        }
+#endif
+        if (fp == NULL) {
+            fprintf(stderr, "***Error: unable to open memory file.\n");
+            free(file);
+            return BADSTATUS;
+        }
+
+        start = Now();
+        k = GetBitmap(fp, &bmp, &r, &data, &b->err);
+        t = Now() - start;
+
+        fclose(fp);
+        if (k == BADSTATUS) {
+            fprintf(stderr, "%s", b->err.errbuf);
+            free(file);
+            return BADSTATUS;
+        }
+        free(bmp);
+
+        best = (t < best) ? t : best;
+    }
+    Report(b, "read", width, height, bpp, filesize, best);
+
+    // Thumbnails, straight from the file image, with each filter
+    for (k = BMP_FILTERBOX; status == GOODSTATUS && k <= BMP_FILTERBILINEAR; k++) {
+        memset(&op, 0, sizeof(bmpop_t));
+        op.op         = BMP_OP_RESIZE;
+        op.arg        = k;
+        op.rect.right = (width  + 7) / 8;
+        op.rect.top   = (height + 7) / 8;
+
+        if (PlanPipeline(file, &op, 1, &plan, &b->err) == BADSTATUS) {
+            fprintf(stderr, "%s", b->err.errbuf);
+            free(file);
+            return BADSTATUS;
+        }
+
+        for (best = 1e30, i = 0; i < b->iters; i++) {
+            start = Now();
+            if (RunPipeline(file, &plan, b->scratch, 0, b->threads, &b->err) == BADSTATUS) {
+                fprintf(stderr, "%s", b->err.errbuf);
+                free(file);
+                return BADSTATUS;
+            }
+            t = Now() - start;
+
+            best = (t < best) ? t : best;
+        }
+        Report(b, (k == BMP_FILTERBOX) ? "thumb" : "thumbbilin", width, height, bpp, filesize, best);
+        remove(b->scratch);
+    }
+
+    // Each working format in the list, separated by spaces
+    for (w = b->works; status == GOODSTATUS && *w != '\0'; w = end) {
+        while (*w == ' ' || *w == '\t' || *w == ',')
+            w++;
+        if (*w == '\0')
+            break;
+
+        work = strtoul(w, &end, 0);
+        if (end == w || (work != BMP_FMT24 && work != BMP_FMT32)) {
+            fprintf(stderr, "***Error: bad 'working format' specification (24 or 32).\n");
+            status = BADSTATUS;
+            break;
+        }
+
+        status = BenchWork(b, file, filesize, width, height, bpp, (uint32_t)work);
+    }
+
+    free(file);
+
+    return status;
+}
+
+//=================================================================
+// main()
+//
+// Parses the command line, and benchmarks each combination of the
+// image sizes, bits per pixel and working formats.
+//
+//=================================================================
+
+int main(int argc, char **argv)
+{
+    bench_t b;
+    int option, status = GOODSTATUS;
+    const char *sizes = DEFAULTSIZES, *bpps = DEFAULTBPPS, *resname = DEFAULTRESULTS;
+    const char *s, *p;
+    char *end, *bppend;
+    unsigned long width, height, bpp;
+    long tmp;
+
+    b.iters   = DEFAULTITERS;
+    b.threads = 1;
+    b.works   = DEFAULTWORKS;
+    b.label   = "";
+    b.scratch = DEFAULTSCRATCH;
+
+    while ((option = getopt(argc, argv, "hs:b:w:n:j:l:o:t:")) != EOF) {
+        switch (option) {
+        case 's':
+            sizes = optarg;
+            break;
+        case 'b':
+            bpps = optarg;
+            break;
+        case 'w':
+            b.works = optarg;
+            break;
+        case 'n':
+            if ((tmp = strtol(optarg, NULL, 0)) <= 0) {
+                fprintf(stderr, "***Error: bad 'iterations' specification (iterations > 0).\n");
+                return BADSTATUS;
+            }
+            b.iters = (uint32_t)tmp;
+            break;
+        case 'j':
+            if ((tmp = strtol(optarg, NULL, 0)) < 0) {
+                fprintf(stderr, "***Error: bad 'threads' specification (threads >= 0).\n");
+                return BADSTATUS;
+            }
+            b.threads = (uint32_t)tmp;
+            break;
+        case 'l':
+            b.label = optarg;
+            break;
+        case 'o':
+            resname = optarg;
+            break;
+        case 't':
+            b.scratch = optarg;
+            break;
+        case 'h':
+        default:
+            BENCHUSAGE;
+            return (option == 'h') ? GOODSTATUS : BADSTATUS;
+        }
+    }
+
+    b.err.errsize = ERRBUFSIZE;
+    b.err.errnum  = 0;
+    if ((b.err.errbuf = (char *)malloc(b.err.errsize)) == NULL) {
+        fprintf(stderr, "***Error: unable to allocate memory.\n");
+        return BADSTATUS;
+    }
+
+    // Results are appended, with a column header only for a new file
+    if ((b.results = fopen(resname, "a")) == NULL) {
+        fprintf(stderr, "***Error: unable to open %s for writing.\n", resname);
+        return BADSTATUS;
+    }
+    fseek(b.results, 0, SEEK_END);
+    if (ftell(b.results) == 0)
+        fprintf(b.results, "label,time,stage,width,height,bpp,iterations,threads,simd,seconds,mbps,mpps\n");
+
+    // Each size in the list, as WxH, separated by spaces
+    for (s = sizes; status == GOODSTATUS && *s != '\0'; s = end) {
+        while (*s == ' ' || *s == '\t' || *s == ',')
+            s++;
+        if (*s == '\0')
+            break;
+
+        width = strtoul(s, &end, 0);
+        if (*end != 'x' && *end != 'X') {
+            fprintf(stderr, "***Error: bad 'size' specification (WxH).\n");
+            status = BADSTATUS;
+            break;
+        }
+        height = strtoul(end + 1, &end, 0);
+
+        // Converted (32 bit) image must fit in the 32 bit header fields
+        if (width == 0 || height == 0 || width > 0xffff || height > 0xffff ||
+            (uint64_t)(4 * width) * height + HDRSIZE > 0xffffffffULL) {
+            fprintf(stderr, "***Error: bad 'size' specification (1 to 65535 pixels, 4GB image).\n");
+            status = BADSTATUS;
+            break;
+        }
+
+        // Each bits per pixel in the list, for this size
+        for (p = bpps; status == GOODSTATUS && *p != '\0'; p = bppend) {
+            while (*p == ' ' || *p == '\t' || *p == ',')
+                p++;
+            if (*p == '\0')
+                break;
+
+            bpp = strtoul(p, &bppend, 0);
+            if (bppend == p || (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32)) {
+                fprintf(stderr, "***Error: bad 'bpp' specification (1, 4, 8, 16, 24 or 32).\n");
+                status = BADSTATUS;
+                break;
+            }
+
+            status = BenchImage(&b, (uint32_t)width, (uint32_t)height, (uint32_t)bpp);
+        }
+    }
+
+    fclose(b.results);
+    free(b.err.errbuf);
+
+    return status;
+}
@@ -20,17 +20,780 @@
 //
 //=============================================================
 //
-// Contains four library functions for bitmap manipulation:
+// Contains the following library functions for bitmap manipulation:
 //
-//   GetBitmap()         : reads a bitmap file into internal structures
-//   ConvertBmpTo24bit() : Convert 2, 4 or 8 to 24 bit bitmap
-//   TransformBmp()      : Performs varoius 24 bit bitmap transformations
-//   ClipBitmap()        : Clips bitmap to a defined input rectangle
+//   GetBitmap()            : reads a bitmap file into internal structures
+//   LoadBitmap()           : reads or memory maps a bitmap file in one go
+//   UnloadBitmap()         : releases a bitmap loaded with LoadBitmap()
+//   ConvertBmpTo24bit()    : Convert 2, 4 or 8 to 24 bit bitmap
+//   ConvertBmpTo24bitBuf() : Convert into a reusable buffer
+//   ConvertBmpFormat()     : Convert to 16, 24 or 32 bit pixel formats
+//   GetPixelFormat()       : Returns the pixel format of a bitmap
+//   TransformBmp()         : Performs varoius 24 bit bitmap transformations
+//   TransformView()        : Transforms a clipped region of a bitmap in place
+//   TransformViewTo()      : Transforms a clipped region into a caller's buffer
+//   TransformBmpTo()       : Transforms a bitmap, or region, into a caller's buffer
+//   TransformRegion()      : Transforms a bitmap in place for a clipped region
+//   MakeFilter()           : Makes a blur, sharpen or edge convolution filter
+//   MakeKernelFilter()     : Makes a convolution filter from a kernel
+//   GetViewStats()         : Gathers histograms and statistics of a region
+//   GetBmpStats()          : Gathers histograms and statistics of a bitmap
+//   MakeLevels()           : Makes auto levels or equalization from statistics
+//   GetSimdLevel()         : Returns the SIMD transform kernel level in use
+//   SetSimdLevel()         : Limits the SIMD transform kernel level
+//   TransformSelfTest()    : Checks SIMD transform kernels against scalar ones
+//   ClipBitmap()           : Clips bitmap to a defined input rectangle
+//   ClipView()             : Describes a clipped region without copying it
+//   ClipBitmapTo()         : Copies a clipped region into a caller's buffer
+//   RotateViewTo()         : Rotates a region into a caller's buffer
+//   RotateBmp()            : Makes a rotated copy of a bitmap
+//   WriteBitmap()          : Writes a bitmap, or a clipped region of it, to file
+//   WriteView()            : Writes a clipped region described by a view
+//   WriteRleView()         : Writes an 8 or 4 bit view run length encoded
+//   WriteViewFormat()      : Writes a view converted to another pixel format
+//   StreamBitmap()         : Converts, transforms and clips a file in row strips
+//   PlanPipeline()         : Plans a list of operations as a single pass
+//   RunPipeline()          : Runs a planned pipeline, writing the result to file
+//   CreateBmpPool()        : Creates a size classed buffer pool
+//   DestroyBmpPool()       : Frees a buffer pool and the buffers it holds
+//   BmpPoolAlloc()         : Takes a buffer from a pool
+//   BmpPoolFree()          : Returns a buffer to its pool
+//   GetBmpPoolStats()      : Returns a pool's allocation statistics
+//   CreateBmpContext()     : Creates an image context drawing on a pool
+//   DestroyBmpContext()    : Releases and frees an image context
+//   LoadBmpContext()       : Loads a bitmap file into a context
+//   ReadBmpContext()       : Reads a bitmap from a stream into a context
+//   ConvertBmpContext()    : Converts a context's image to a pixel format
+//   GetBmpContextImage()   : Returns a context's current image
+//   ReleaseBmpContext()    : Returns a context's buffers to its pool
 //
 //=============================================================
 
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#endif
+
 #include "bitmap.h"
 
+// x86 SIMD kernels are built with GCC compatible compilers, with each
+// kernel's instruction set selected per function and chosen at run time
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define X86SIMD
+#include <immintrin.h>
+#endif
+
+// Multipliers for exact division by 100 (x < 25500, with a further
+// shift by 3) and by 3 (x < 766), using the high half of a 16 bit product
+#define XFORMDIV100          0x147b
+#define XFORMDIV3            0x5556
+
+// Size of the red, green and blue colour masks following the information header (with
+// any alpha mask after them), size of header holding an alpha mask, and size of a V4 header
+#define MASKSSIZE            12
+#define ALPHAHDRSIZE         56
+#define V4HDRSIZE            108
+
+// Maximum row width, and resize filter taps, used by TransformSelfTest()
+#define TESTROWPIXELS        300
+#define TESTTAPS             7
+
+// Largest tile side used by TransformSelfTest() for the rotate kernels
+#define TESTROTPIXELS        21
+
+// Header 'h' describes run length encoded pixel data
+#define ISRLE(h) ((h)->i.biCompression == BMP_RLE8 || (h)->i.biCompression == BMP_RLE4)
+
+// Little endian 32 bit value at byte pointer 'p'
+#define GETLE32(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+// Luma of the BGR pixel at byte pointer 'p', (77 red + 150 green + 29 blue) / 256, rounded
+#define LUMA(p) ((77 * (uint32_t)(p)[2] + 150 * (uint32_t)(p)[1] + 29 * (uint32_t)(p)[0] + 128) >> 8)
+
+// Sets pixel 'x' of a (cleared) 4 bit row to 'v'
+#define PUTNIBBLE(row, x, v) ((row)[(x) >> 1] |= (v) << (((x) & 1) ? 0 : 4))
+
+// Maximum number of I/O vectors gathered in a single write
+#if !defined(WIN32) && defined(IOV_MAX) && IOV_MAX < 1024
+#define MAXIOVECS            IOV_MAX
+#else
+#define MAXIOVECS            1024
+#endif
+
+// Target size of the strips of converted rows written by WriteViewFormat()
+#define CONVSTRIPSIZE        (1 << 20)
+
+// Transform thread bands (and thread ids) held on the stack, rather than allocated
+#define STACKTHREADS         16
+
+// Resize filter weight fraction bits, and fraction bits of horizontally filtered
+// values (keeping 255 << RSZFRACBITS, and the weights, within 16 bit signed values)
+#define RSZWEIGHTBITS        14
+#define RSZFRACBITS          7
+
+// Pixels along each side of the square tiles an image is rotated a tile at a
+// time in, so that the input rows of a tile, and output rows, stay in the cache
+#define ROTBLOCK             64
+
+// Convolution horizontal weight fraction bits, fraction bits of horizontally filtered
+// values (as for resizing), most fraction bits of the vertical weights, and largest
+// sum of the vertical weights' magnitudes (keeping the vertical sums within 32 bits)
+#define CONVWEIGHTBITS       14
+#define CONVFRACBITS         7
+#define CONVVERTBITS         14
+#define CONVMAXSUM           65000
+
+// Largest magnitude of MakeKernelFilter() coefficients and divisor
+#define CONVMAXCOEFF         1023
+#define CONVMAXDIV           (1 << 20)
+
+// Vertical convolution kernel flags: add to the sums so far, take magnitudes,
+// and round and clamp the sums to bytes, rather than keeping them
+#define CONVADD              0x1
+#define CONVABS              0x2
+#define CONVPACK             0x4
+
+// Buffer pool size classes. Each power of two from 4KB up is split into
+// four classes (4, 5, 6 and 7 quarters of it), so that a buffer is never
+// more than 25% larger than asked for.
+#define POOLMINSHIFT         12
+#define POOLCLASSES          192
+#define POOLHDRSIZE          32
+
+// Pixel conversion table for ConvertRow(). Each indexed input byte value
+// maps to the BGR (or BGRX) pixels it contains, whilst each colour field
+// of a masked 16 or 32 bit input pixel maps to an 8 bit colour value.
+typedef struct {
+    uint32_t      bpp;                  // Input bits per pixel
+    uint32_t      fmt;                  // Output pixel format
+    uint32_t      opix;                 // Bytes per converted pixel (3 for BGR, 4 for BGRX)
+    uint32_t      bgrx;                 // Input is 32 bit BGRX, with no fields to extract
+    uint32_t      shift[4];             // Masked input field shifts (blue, green, red and alpha)
+    uint32_t      mask[4];              // Masked input field masks, after shifting
+    unsigned char scale[4][256];        // Masked input field values to colour values
+    unsigned char pixels[256][32];      // Indexed input byte values to converted pixels
+} cvtlut_t, *pcvtlut_t;
+
+// Precomputed TransformRow() parameters and kernels
+typedef struct xform_s {
+    uint32_t      pixbytes;             // Bytes per pixel (3 for BGR, 4 for BGRX)
+    uint32_t      flipv;                // Flip about vertical axis
+    uint32_t      levels;               // Levels stage required (BMP_LEVELSxxx, 0 for none)
+    uint32_t      channel;              // Channel stage required
+    uint32_t      cross;                // Cross channel stage required
+    uint32_t      reverse;              // Reverse mask (0xff or 0x00)
+    uint32_t      brightness;           // Brightness percentage, 0 if disabled
+    uint32_t      bright_a;             // Brightness as 100*bright_a + bright_c
+    uint32_t      bright_c;
+    uint32_t      mono;                 // Mono colour flags
+    uint32_t      pair;                 // Mono colours are a pair
+    uint32_t      grey;                 // Grey scale
+    uint32_t      greydiv;              // Grey scale divisor (1, 2 or 3)
+    unsigned char monomask[96];         // Mono colour byte masks, repeating BGR (or BGR0)
+    unsigned char lut[3][256];          // Channel stage tables for blue, green and red
+    unsigned char levlut[3][256];       // Levels stage tables for blue, green and red
+    unsigned char levlow[96];           // Stretch low limits, repeating BGR (or BGRX, with X unchanged)
+    unsigned char levhigh[96];          // Stretch high limits
+    uint16_t      levmul[96];           // Stretch multipliers (see StretchMul())
+    void (*levelsfn) (unsigned char *, uint32_t, struct xform_s *);
+    void (*channelfn)(unsigned char *, uint32_t, struct xform_s *);
+    void (*crossfn)  (unsigned char *, uint32_t, struct xform_s *);
+} xform_t, *pxform_t;
+
+// Resize filter along one axis (see BuildAxis()). Output pixel i is the sum of 'taps'
+// input pixels, from first[i], each multiplied by its weight from weights[i*taps].
+typedef struct {
+    uint32_t      taps;                 // Input pixels for each output pixel
+    uint32_t     *first;                // First input pixel for each output pixel
+    int16_t      *weights;              // Weights for each output pixel
+} rszaxis_t, *prszaxis_t;
+
+// Resize kernels, selected for the SIMD level by SelectResizeKernels()
+typedef struct {
+    void (*vertfn)  (unsigned char *, const int16_t **, const int16_t *, uint32_t, uint32_t, uint32_t);
+    void (*boxsumfn)(uint32_t *, const unsigned char *, uint32_t, uint32_t);
+} rszkern_t, *prszkern_t;
+
+// Histograms of the pixels counted by a thread, for merging into a bmpstats_t. Alternate
+// pixels go to separate copies, so that runs of equal values don't each wait on the last
+// increment of the same bin.
+typedef struct {
+    uint64_t      bins[2][BMP_STATCHANS][256];
+} stathist_t, *pstathist_t;
+
+// GetViewStats() worker thread arguments. Each worker counts a band of rows.
+typedef struct {
+    const unsigned char *rows;          // First (bottom) row of pixel data
+    int32_t        stride;              // Bytes from one row to the next
+    uint32_t       width;               // Image width in pixels
+    uint32_t       pixbytes;            // Bytes per (24 or 32 bit BGRX) pixel counted
+    uint32_t       first;               // First row of band
+    uint32_t       last;                // One beyond last row of band
+    const cvtlut_t *lut;                // Conversion to 24 bits for other formats (else NULL)
+    unsigned char *rowbuf;              // Converted row buffer
+    pstathist_t    hist;                // Band's histograms
+} statband_t, *pstatband_t;
+
+// Convolution kernels, selected for the SIMD level by SelectConvKernels()
+typedef void (*convhorzfn_t)(int16_t *, const unsigned char *, const int16_t *, uint32_t, uint32_t, uint32_t, uint32_t);
+typedef void (*convvertfn_t)(unsigned char *, int32_t *, const int16_t **, const int16_t *, uint32_t, uint32_t, uint32_t, 
+                             uint32_t, uint32_t);
+
+// Convolution filter, as prepared by BuildConv() from a bmpfilter_t
+typedef struct {
+    uint32_t      pixbytes;             // Bytes per pixel
+    uint32_t      radius;               // Kernel pixels either side of the centre
+    uint32_t      taps;                 // Kernel side (2*radius + 1)
+    uint32_t      nterms;               // Number of separable terms
+    uint32_t      magnitude;            // Sum the magnitudes of the terms
+    uint32_t      shift;                // Fraction bits of the vertical sums
+    int16_t       h[BMP_MAXTERMS][BMP_MAXKERNEL]; // Horizontal weights of each term
+    int16_t       v[BMP_MAXTERMS][BMP_MAXKERNEL]; // Vertical weights of each term, in row order
+    convhorzfn_t  horzfn;               // Horizontal kernel
+    convvertfn_t  vertfn;               // Vertical kernel
+} conv_t, *pconv_t;
+
+// Convolution worker thread arguments. Each worker filters a band of rows, from the
+// source rows (the image itself when in place). When in place, the rows just beyond
+// the band, which neighbouring bands overwrite, are read from copies made beforehand.
+typedef struct {
+    pconv_t        cv;                  // Prepared filter
+    pxform_t       xf;                  // Row transforms made on each filtered row (NULL if none)
+    unsigned char *rows;                // First (bottom) output row
+    int32_t        stride;              // Bytes from one output row to the next
+    const unsigned char *src;           // First source row
+    int32_t        srcstride;           // Bytes from one source row to the next
+    uint32_t       width;               // Image width in pixels
+    uint32_t       height;              // Image height in rows
+    uint32_t       first;               // First row of band
+    uint32_t       last;                // One beyond last row of band
+    uint32_t       rowlen;              // Bytes of pixel data in a row
+    uint32_t       padlen;              // Bytes of output row, with padding to be zeroed
+    const unsigned char *below;         // Copies of the rows below the band, nearest first (or NULL)
+    const unsigned char *above;         // Copies of the rows above the band, nearest first (or NULL)
+    unsigned char *edgerow;             // Input row with its edge pixels repeated either side
+    int16_t       *hrows;               // Horizontally filtered rows, 'taps' for each term
+    int32_t       *acc;                 // Sums of the terms so far
+    pstathist_t    hist;                // Histograms of the output rows (NULL if not gathered)
+} cvband_t, *pcvband_t;
+
+// Rotate kernel, copying a tile of 'w' x 'h' output pixels, of 'pixbytes' bytes, to
+// rows 'ostride' apart, from the input pixel for output pixel (x, y) at 'in' + x*dx + y*dy
+typedef void (*rotfn_t)(unsigned char *, int32_t, const unsigned char *, int64_t, int64_t, uint32_t, uint32_t, 
+                        uint32_t);
+
+// RotateViewTo() worker thread arguments. Each worker makes a band of output rows.
+typedef struct {
+    unsigned char *rows;                // First (bottom) output row
+    int32_t        stride;              // Bytes from one output row to the next
+    const unsigned char *src;           // Input pixel for the first output pixel
+    int64_t        dx;                  // Input bytes from one output column to the next
+    int64_t        dy;                  // Input bytes from one output row to the next
+    uint32_t       pixbytes;            // Bytes per pixel
+    uint32_t       width;               // Output width in pixels
+    uint32_t       tilewidth;           // Tile width in pixels (whole rows if not turned 90 or 270)
+    uint32_t       first;               // First row of band
+    uint32_t       last;                // One beyond last row of band
+    uint32_t       rowlen;              // Bytes of pixel data in a row
+    uint32_t       padlen;              // Bytes of row, with padding to be zeroed
+    rotfn_t        tilefn;              // Tile kernel
+} rotband_t, *protband_t;
+
+// TransformBmp() worker thread arguments. Each worker transforms a band of rows,
+// first copying each from a source image when transforming out of place.
+typedef struct {
+    unsigned char *rows;                // First (bottom) row of pixel data
+    pxform_t       xf;                  // Precomputed row transforms (NULL for a copy only)
+    uint32_t       width;               // Image width in pixels
+    int32_t        stride;              // Bytes from one row to the next
+    uint32_t       first;               // First row of band
+    uint32_t       last;                // One beyond last row of band
+    const unsigned char *src;           // First row of source pixel data (NULL if in place)
+    int32_t        srcstride;           // Bytes from one source row to the next
+    uint32_t       rowlen;              // Bytes of pixel data in a row
+    uint32_t       padlen;              // Bytes of row, with padding to be zeroed
+    uint32_t       pixbytes;            // Bytes per pixel
+    pstathist_t    hist;                // Histograms of the finished rows (NULL if not gathered)
+} xfband_t, *pxfband_t;
+
+// RLE8/RLE4 decoder position, at the start of a row
+typedef struct {
+    uint32_t       pos;                 // Offset of next compressed byte
+    uint32_t       x;                   // Column at which decoding resumes
+    uint32_t       y;                   // Row at which decoding resumes
+    uint32_t       done;                // End of bitmap (or of data) reached
+} rlepos_t, *prlepos_t;
+
+// StreamBitmap() state
+typedef struct {
+    FILE          *ifp;                 // Input file
+    FILE          *ofp;                 // Output file
+    bmhdr_t        hdr;                 // Host endian input header
+    rgbquad_t      pal[256];            // Input RGB quad table (if not 24 bit)
+    cvtlut_t       lut;                 // Pixel conversion table (if not 24 bit)
+    rect_t         rect;                // Region of input being output
+    uint32_t       convert;             // Input to be converted to 24 bits
+    uint32_t       topdown;             // Input rows stored top down
+    uint32_t       striprows;           // Maximum rows in a strip
+    uint32_t       i_padrowlen;         // Input row length, as padded to 32 bits
+    uint32_t       o_rowlen;            // Output row length
+    uint32_t       o_padrowlen;         // Output row length, as padded to 32 bits
+    unsigned char *istrip;              // Input strip buffer
+    unsigned char *ostrip;              // Output strip buffer
+    unsigned char *rowbuf;              // Converted row buffer
+    unsigned char *rle;                 // Compressed pixel data (if run length encoded)
+    uint32_t       rlesize;             // Size of compressed pixel data
+    prlepos_t      rowpos;              // Decoder position at the start of each row
+    pstathist_t    hist;                // Histograms of the output rows (NULL if not gathered)
+} strm_t, *pstrm_t;
+
+// RunPipeline() state, shared by the threads processing each strip
+typedef struct {
+    const unsigned char *rows;          // First (bottom) row of input pixel data
+    int32_t        stride;              // Bytes from one input row to the next
+    rect_t         rect;                // Region of input being output
+    uint32_t       fliph;               // Region's rows taken from the top down
+    uint32_t       bpp;                 // Input bits per pixel
+    uint64_t       offset;              // Byte of each input row the region starts in
+    uint32_t       skip;                // Input pixels before the region in that byte
+    uint32_t       convert;             // Input to be converted to the working format
+    uint32_t       pack;                // Working rows to be packed to the output format
+    uint32_t       workbytes;           // Bytes per working format pixel (3 or 4)
+    cvtlut_t       lut;                 // Input conversion table
+    cvtlut_t       olut;                // Output packing table
+    uint32_t       nxforms;             // Number of row transform stages
+    uint32_t       npre;                // Number of stages applied before any resize
+    xform_t        xf[BMP_MAXSTAGES+1]; // Row transform stages, applied in turn
+    uint32_t       resize;              // Region is resized
+    rect_t         crop;                // Region of the resized image output
+    uint32_t       fx;                  // Whole number box filter ratios (0 if not)
+    uint32_t       fy;
+    rszaxis_t      ax;                  // Horizontal and vertical resize filters
+    rszaxis_t      ay;
+    rszkern_t      rk;                  // Resize kernels
+    unsigned char *ostrip;              // Output strip buffer
+    uint32_t       o_padrowlen;         // Output row length, as padded to 32 bits
+    uint32_t       strip;               // First output row of the current strip
+} pipe_t, *ppipe_t;
+
+// RunPipeline() thread arguments. Each thread makes a band of a strip's rows.
+typedef struct {
+    ppipe_t        p;                   // Shared pipeline state
+    unsigned char *rowbuf;              // Working row buffer
+    unsigned char *orow;                // Resized working row buffer
+    uint32_t      *sums;                // Box filter sums (whole number ratios)
+    int16_t       *hrows;               // Horizontally filtered rows, one for each vertical tap
+    uint32_t      *tags;                // Input row held in each of hrows (or ~0)
+    const int16_t **taprows;            // Horizontally filtered rows for an output row
+    uint32_t       first;               // First row of band, within the strip
+    uint32_t       last;                // One beyond last row of band
+} pipeband_t, *ppipeband_t;
+
+// Buffer pool block header, placed before each buffer handed out
+typedef union poolblk_u {
+    struct {
+        union poolblk_u *next;          // Next free block of the same class
+        pbmpool_t        pool;          // Owning pool
+        uint32_t         cls;           // Size class
+    } b;
+    unsigned char pad[POOLHDRSIZE];     // Keeps buffers aligned as for malloc()
+} poolblk_t, *ppoolblk_t;
+
+// Buffer pool
+struct bmpool_s {
+    ppoolblk_t     free[POOLCLASSES];   // Free block list for each size class
+    uint64_t       limit;               // Most bytes of free blocks to retain (0 for no limit)
+    bmpoolstats_t  stats;               // Allocation statistics
+#ifndef WIN32
+    pthread_mutex_t lock;               // Guards the lists and statistics
+#endif
+};
+
+// Image context
+struct bmpctx_s {
+    pbmpool_t      pool;                // Pool buffers are drawn from
+    uint32_t       ownpool;             // Pool was created for (and goes with) the context
+    bmpmap_t       map;                 // Loaded (or read) file image
+    unsigned char *work;                // Converted image buffer
+    uint64_t       worksize;            // Size of converted image buffer
+    unsigned char *image;               // Current image (loaded or converted), or NULL
+};
+
+#ifdef WIN32
+// 64 bit file offsets
+#define fseeko _fseeki64
+#define ftello _ftelli64
+
+// No gathered writes on windows, so write each vector in turn
+struct iovec {
+    void   *iov_base;
+    size_t  iov_len;
+};
+#endif
+
+//=================================================================
+// PadRowLen()
+//
+// Returns the length in bytes of a row of 'width' pixels of 'bpp'
+// bits, as padded to 32 bits, in 64 bits so that it cannot overflow.
+//
+//=================================================================
+
+static uint64_t PadRowLen(uint32_t width, uint32_t bpp)
+{
+    return 4 * (((uint64_t)width * bpp + 31) / 32);
+}
+
+//=================================================================
+// ImageSize()
+//
+// Returns the size of the file image described by the (host endian)
+// header 'hdr', from the start of the file to the end of the pixel
+// data. Uncompressed data is sized from the image dimensions, and
+// not from the header's size fields, so that images beyond 4 GB
+// (with their sizes written as 0) are read correctly.
+//
+//=================================================================
+
+static uint64_t ImageSize(const pbmhdr_t hdr)
+{
+    return (uint64_t)hdr->f.bfOffBits + (ISRLE(hdr) ? hdr->i.biSizeImage : 
+                                         PadRowLen(hdr->i.biWidth, hdr->i.biBitCount) * BMPHEIGHT(hdr));
+}
+
+//=================================================================
+// ColourTable()
+//
+// Returns the offset, in the file image described by the (host
+// endian) header 'hdr', of a 1, 4 or 8 bit image's colour table,
+// placing its number of entries in 'ncolours'. The table follows
+// the information header, which is larger than 40 bytes for V4
+// and V5 headers, and has biClrUsed entries (or all 2^bpp if
+// zero), limited to those before the pixel data. For other images
+// it is the offset of anything after a 40 byte header (such as
+// colour masks), with 'ncolours' the quads to the pixel data.
+//
+//=================================================================
+
+static uint64_t ColourTable(const pbmhdr_t hdr, uint32_t *ncolours)
+{
+    uint64_t offset, avail;
+    uint32_t n;
+
+    if (hdr->i.biBitCount > BYTEWIDTH) {
+        *ncolours = (hdr->f.bfOffBits > HDRSIZE) ? (hdr->f.bfOffBits - HDRSIZE) / sizeof(rgbquad_t) : 0;
+        return HDRSIZE;
+    }
+
+    offset = FORMATHDRSIZE + (uint64_t)hdr->i.biSize;
+    avail  = (hdr->f.bfOffBits > offset) ? (hdr->f.bfOffBits - offset) / sizeof(rgbquad_t) : 0;
+    n      = (hdr->i.biClrUsed && hdr->i.biClrUsed < (1U << hdr->i.biBitCount)) ? hdr->i.biClrUsed : 
+                                                                                 1U << hdr->i.biBitCount;
+
+    *ncolours = (n < avail) ? n : (uint32_t)avail;
+
+    return offset;
+}
+
+//=================================================================
+// SetImageSizes()
+//
+// Sets the file and image size fields of the (host endian) header
+// 'hdr' for 'datasize' bytes of pixel data following bfOffBits.
+// Any size that does not fit its 32 bit field is set to 0, which
+// is valid for uncompressed data (see bitmap.h).
+//
+//=================================================================
+
+static void SetImageSizes(pbmhdr_t hdr, uint64_t datasize)
+{
+    uint64_t filesize = hdr->f.bfOffBits + datasize;
+
+    hdr->i.biSizeImage = (datasize <= 0xffffffffULL) ? (uint32_t)datasize : 0;
+    hdr->f.bfSize      = (filesize <= 0xffffffffULL) ? (uint32_t)filesize : 0;
+}
+
+//=================================================================
+// CheckHeader()
+//
+// Validates a (host endian) bitmap header against the number of
+// bytes available in the file image, 'size'. Called before any of
+// the image body is read or touched. Returns GOODSTATUS if the
+// bitmap is one that can be processed, else BADSTATUS with an
+// error message placed in 'e' (if not NULL). A missing compressed
+// data size is filled in from the file size. If 'size' is not
+// known, it is given as UINT64_MAX and reads are left to find the
+// end of the file.
+//
+//=================================================================
+
+static int CheckHeader(const pbmhdr_t hdr, uint64_t size, const char *funcname, perrmsg_t e)
+{
+    uint64_t filesize;
+
+    // Check it's a bitmap
+    if (hdr->f.bfType[0] != 'B' || hdr->f.bfType[1] != 'M') {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - not a bitmap file.\n", funcname);
+            e->errnum = GBMP_ERR_NOTBMP;
+        }
+        return BADSTATUS;
+    }
+
+    // Check there's only one plane
+    if (hdr->i.biPlanes != 1) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported number of planes (%d).\n", 
+                          funcname, hdr->i.biPlanes);
+            e->errnum = GBMP_ERR_BADPLANES;
+        }
+        return BADSTATUS;
+    }
+
+    // Check valid bits per pixel
+    if (hdr->i.biBitCount != 1  && hdr->i.biBitCount != 4  && hdr->i.biBitCount != 8 && 
+        hdr->i.biBitCount != 16 && hdr->i.biBitCount != 24 && hdr->i.biBitCount != 32) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - invalid bits per pixel (%d).\n", 
+                          funcname, hdr->i.biBitCount);
+            e->errnum = GBMP_ERR_BADPIXELS;
+        }
+        return BADSTATUS;
+    }
+
+    // Check there's no compression, other than run length encoding of (bottom up) 8 and 4 bit images, or
+    // colour masks (just after the 40 byte information header, or within a V4/V5 header)
+    // for 16 and 32 bit images
+    if (hdr->i.biCompression != BMP_RGB &&
+        !(hdr->i.biCompression == BMP_RLE8 && hdr->i.biBitCount == 8 && !BMPTOPDOWN(hdr)) &&
+        !(hdr->i.biCompression == BMP_RLE4 && hdr->i.biBitCount == 4 && !BMPTOPDOWN(hdr)) &&
+        !((hdr->i.biCompression == BMP_BITFIELDS || hdr->i.biCompression == BMP_ALPHABITFIELDS) &&
+          (hdr->i.biBitCount == 16 || hdr->i.biBitCount == 32) && 
+          hdr->f.bfOffBits >= HDRSIZE + MASKSSIZE + ((hdr->i.biCompression == BMP_ALPHABITFIELDS) ? 4 : 0))) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported compressed format (%d).\n", 
+                          funcname, hdr->i.biCompression);
+            e->errnum = GBMP_ERR_BADCOMPRESS;
+        }
+        return BADSTATUS;
+    }
+
+    // Check there are pixels, and the height (which may be negative for a top down
+    // image) has a magnitude that fits its field
+    if (hdr->i.biWidth == 0 || hdr->i.biHeight == 0 || hdr->i.biHeight == INT32_MIN) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad image size (%u x %d).\n", funcname,
+                     hdr->i.biWidth, hdr->i.biHeight);
+            e->errnum = GBMP_ERR_BADSIZE;
+        }
+        return BADSTATUS;
+    }
+
+    // Check rows are within the supported length
+    if (PadRowLen(hdr->i.biWidth, hdr->i.biBitCount) > BMP_MAXROWLEN) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - image too large (%u pixel rows).\n", funcname, 
+                     hdr->i.biWidth);
+            e->errnum = GBMP_ERR_BADSIZE;
+        }
+        return BADSTATUS;
+    }
+
+    // Check the whole file, as described by the header, is available (a file size of 0
+    // being unknown)
+    if (hdr->f.bfSize > size) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        return BADSTATUS;
+    }
+
+    // Compressed data without a size in the header runs to the end of the file
+    filesize = hdr->f.bfSize ? hdr->f.bfSize : size;
+    if (ISRLE(hdr) && hdr->i.biSizeImage == 0 && hdr->f.bfOffBits < filesize && filesize <= 0xffffffffULL)
+        hdr->i.biSizeImage = (uint32_t)(filesize - hdr->f.bfOffBits);
+
+    // Check the pixel data lies within the file image (for compressed data, as sized in the header)
+    if (hdr->f.bfOffBits < HDRSIZE || ImageSize(hdr) > size) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - image data does not fit in file.\n", funcname);
+            e->errnum = GBMP_ERR_BADSIZE;
+        }
+        return BADSTATUS;
+    }
+
+    // Check an indexed image's information header (and so its colour table, which follows
+    // it) starts before the pixel data
+    if (hdr->i.biBitCount <= BYTEWIDTH && 
+        (hdr->i.biSize < INFOHDRSIZE || FORMATHDRSIZE + (uint64_t)hdr->i.biSize > hdr->f.bfOffBits)) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad information header size (%u).\n", funcname, 
+                     hdr->i.biSize);
+            e->errnum = GBMP_ERR_BADHEADER;
+        }
+        return BADSTATUS;
+    }
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// RleRow()
+//
+// Decodes row 'row' of 'width' pixels of 'bpp' (8 or 4) bits from
+// the RLE8/RLE4 data 'in' of 'insize' bytes into 'out', which is
+// cleared first, starting from, and advancing, the decoder
+// position 'p'. Rows must be decoded in order from the position at
+// the start of the first. Pixels skipped by delta escapes, or not
+// reached by the data, are left as index 0, and any beyond the row
+// width are dropped. If 'out' is NULL the row is only parsed, to
+// find the position of the next. Malformed or truncated data ends
+// the bitmap rather than failing.
+//
+//=================================================================
+
+static void RleRow(const unsigned char *in, uint32_t insize, uint32_t bpp, uint32_t width, prlepos_t p, 
+                   uint32_t row, unsigned char *out)
+{
+    uint32_t x, n, v, k, i, bytes;
+
+    if (out != NULL)
+        memset(out, 0, (size_t)(((uint64_t)width * bpp + 7) / BYTEWIDTH));
+
+    // Row skipped over by a delta, or after the end of the bitmap
+    if (p->done || p->y > row)
+        return;
+
+    x = p->x;
+
+    while (p->pos + 2 <= insize) {
+        n = in[p->pos];
+        v = in[p->pos+1];
+        p->pos += 2;
+
+        if (n) {
+            // Encoded run of n pixels, alternating nibbles of v for RLE4
+            if (out != NULL && x < width) {
+                k = (n < width - x) ? n : width - x;
+                if (bpp == BYTEWIDTH)
+                    memset(&out[x], v, k);
+                else
+                    for (i = 0; i < k; i++)
+                        PUTNIBBLE(out, x + i, (i & 1) ? v & 0xf : v >> 4);
+            }
+            x += n;
+            continue;
+        }
+
+        switch (v) {
+        case 0:
+            // End of line
+            p->x = 0;
+            p->y++;
+            return;
+
+        case 1:
+            // End of bitmap
+            p->done = TRUE;
+            return;
+
+        case 2:
+            // Delta---move right and up, ending this row if moving up
+            if (p->pos + 2 > insize) {
+                p->done = TRUE;
+                return;
+            }
+            x += in[p->pos];
+            k  = in[p->pos+1];
+            p->pos += 2;
+            if (k) {
+                p->x  = x;
+                p->y += k;
+                return;
+            }
+            break;
+
+        default:
+            // Absolute mode run of v pixels, padded to a 16 bit boundary
+            bytes = (bpp == BYTEWIDTH) ? v : (v + 1) / 2;
+            if (p->pos + bytes > insize) {
+                p->done = TRUE;
+                return;
+            }
+            if (out != NULL && x < width) {
+                k = (v < width - x) ? v : width - x;
+                if (bpp == BYTEWIDTH)
+                    memcpy(&out[x], &in[p->pos], k);
+                else
+                    for (i = 0; i < k; i++)
+                        PUTNIBBLE(out, x + i, (i & 1) ? in[p->pos + (i >> 1)] & 0xf : in[p->pos + (i >> 1)] >> 4);
+            }
+            x      += v;
+            p->pos += (bytes + 1) & ~1U;
+            break;
+        }
+    }
+
+    // Ran out of data without an end of bitmap
+    p->done = TRUE;
+}
+
+//=================================================================
+// DecodeRle()
+//
+// Expands the RLE8/RLE4 compressed file image 'image', with host
+// endian header 'hdr', into a newly allocated uncompressed file
+// image, returned with a host endian header updated to match, or
+// NULL if no memory is available. The expanded image's size is
+// returned in 'size'. The new image is taken from buffer pool
+// 'pool', if not NULL.
+//
+//=================================================================
+
+static unsigned char *DecodeRle(const unsigned char *image, const pbmhdr_t hdr, uint64_t *size, pbmpool_t pool)
+{
+    unsigned char *buf;
+    pbmhdr_t nhdr;
+    rlepos_t p = {0, 0, 0, FALSE};
+    uint64_t padrowlen;
+    uint32_t i;
+
+    padrowlen = PadRowLen(hdr->i.biWidth, hdr->i.biBitCount);
+    *size     = hdr->f.bfOffBits + padrowlen * hdr->i.biHeight;
+
+    if (*size > SIZE_MAX)
+        return NULL;
+
+    if (pool != NULL) {
+        if ((buf = (unsigned char *)BmpPoolAlloc(pool, *size)) == NULL)
+            return NULL;
+        memset(buf, 0, (size_t)*size);
+    } else if ((buf = (unsigned char *)calloc(1, (size_t)*size)) == NULL) {
+        return NULL;
+    }
+
+    // Header and colour table (or anything else before the data) as for the input
+    memcpy(buf, image, hdr->f.bfOffBits);
+    nhdr = (pbmhdr_t)buf;
+    *nhdr = *hdr;
+    nhdr->i.biCompression = BMP_RGB;
+    SetImageSizes(nhdr, padrowlen * hdr->i.biHeight);
+
+    for (i = 0; i < (uint32_t)hdr->i.biHeight; i++)
+        RleRow(&image[hdr->f.bfOffBits], hdr->i.biSizeImage, hdr->i.biBitCount, hdr->i.biWidth, &p, i,
+               &buf[hdr->f.bfOffBits + i * padrowlen]);
+
+    return buf;
+}
+
 //=================================================================
 // GetBitmap()
 //
@@ -47,8 +810,8 @@ int GetBitmap(FILE *fp, pbmhdr_t *bmp, prgbquad_t *r, unsigned char **data, perr
     static const char *funcname = "GetBitmap()";
 
     unsigned char *buf, *tmp_buf;
-    int byte;
-    uint32_t i;
+    uint64_t size;
+    uint32_t ncolours;
 
     *r    = NULL;
     *bmp  = NULL;
@@ -64,16 +827,13 @@ int GetBitmap(FILE *fp, pbmhdr_t *bmp, prgbquad_t *r, unsigned char **data, perr
     }
 
     // Read in header bytes
-    for (i = 0; i < HDRSIZE; i++) {
-        if ((byte = getc(fp)) == EOF) {
-            if (e != NULL) {
-                snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file reading header.\n", funcname);
-                e->errnum = GBMP_ERR_EOF;
-            }
-            free(buf);
-            return BADSTATUS;
+    if (fread(buf, 1, HDRSIZE, fp) != HDRSIZE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file reading header.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
         }
-        buf[i] = (unsigned char)(byte & BYTEMASK);
+        free(buf);
+        return BADSTATUS;
     }
 
     // Cast to header structure
@@ -82,463 +842,7066 @@ int GetBitmap(FILE *fp, pbmhdr_t *bmp, prgbquad_t *r, unsigned char **data, perr
     // Header endian conversion for big endian machines. 
     HDRENDIAN(*bmp);
 
-    // Reallocate the buffer so that the whole file will fit
+    // Validate the header before committing to reading the rest of the file, whose
+    // size is not known until it is read
+    if (CheckHeader(*bmp, UINT64_MAX, funcname, e) == BADSTATUS) {
+        free(buf);
+        *bmp = NULL;
+        return BADSTATUS;
+    }
+
+    // Reallocate the buffer so that the file image (up to the end of the pixel data) will fit
+    size    = ImageSize(*bmp);
     tmp_buf = buf;
-    buf = (unsigned char *)realloc(tmp_buf, (*bmp)->f.bfSize);
+    buf     = (size <= SIZE_MAX) ? (unsigned char *)realloc(tmp_buf, (size_t)size) : NULL;
     if (buf == NULL) {
         if (e != NULL) {
             snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
             e->errnum = GBMP_ERR_MEM;
         }
         free(tmp_buf);
+        *bmp = NULL;
+        return BADSTATUS;
+    }
+    *bmp = (pbmhdr_t) buf;
+
+    // Get rest of file---information table, RGB Quad table and data
+    if (fread(&buf[HDRSIZE], 1, (size_t)size - HDRSIZE, fp) != (size_t)size - HDRSIZE) {
+        if (e != NULL) {
+             snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
+             e->errnum = GBMP_ERR_EOF;
+        }
+        free(buf);
+        *bmp = NULL;
         return BADSTATUS;
     }
-    *bmp = (pbmhdr_t) buf;
 
-    // Get rest of file---information table, RGB Quad table and data
-    for (i = HDRSIZE; i < (*bmp)->f.bfSize; i++) {
-        if ((byte = getc(fp)) == EOF) {
-            if (e != NULL) {
-                 snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
-                 e->errnum = GBMP_ERR_EOF;
+    // Expand any run length encoded data to uncompressed rows
+    if (ISRLE(*bmp)) {
+        tmp_buf = buf;
+        buf = DecodeRle(tmp_buf, *bmp, &size, NULL);
+        free(tmp_buf);
+        if (buf == NULL) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                e->errnum = GBMP_ERR_MEM;
+            }
+            *bmp = NULL;
+            return BADSTATUS;
+        }
+        *bmp = (pbmhdr_t) buf;
+    }
+
+    // If not a 24 bit bitmap, point to the colour table (or colour masks)
+    if ((*bmp)->i.biBitCount != 24) 
+        // Cast the colour table to an RGB Quad structure array
+        *r = (prgbquad_t) &buf[ColourTable(*bmp, &ncolours)];
+
+    // Point to data
+    *data = &buf[(*bmp)->f.bfOffBits];
+
+    // Header endian put back before exit
+    HDRENDIAN(*bmp);
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// PoolClass()
+//
+// Returns the buffer pool size class for a buffer of 'size' bytes:
+// the smallest class at least that size (see POOLCLASSES).
+//
+//=================================================================
+
+static uint32_t PoolClass(uint64_t size)
+{
+    uint64_t n, m;
+    uint32_t b;
+
+    // Size in quarters of the smallest class, rounded up
+    n = (size + (1ULL << (POOLMINSHIFT-2)) - 1) >> (POOLMINSHIFT-2);
+    if (n <= 4)
+        return 0;
+
+    // Top bit, and the top three bits rounded up
+    for (b = 2; (n >> (b+1)) != 0; b++)
+        ;
+    m = (n + (1ULL << (b-2)) - 1) >> (b-2);
+    if (m == 8) {
+        m = 4;
+        b++;
+    }
+
+    return 4 * (b-2) + (uint32_t)(m-4);
+}
+
+//=================================================================
+// PoolClassSize()
+//
+// Returns the size in bytes of buffers of pool size class 'cls'.
+//
+//=================================================================
+
+static uint64_t PoolClassSize(uint32_t cls)
+{
+    return (uint64_t)(4 + (cls & 3)) << (cls/4 + POOLMINSHIFT-2);
+}
+
+//=================================================================
+// PoolBufSize()
+//
+// Returns the usable size of the pool buffer 'buf'.
+//
+//=================================================================
+
+static uint64_t PoolBufSize(const void *buf)
+{
+    return PoolClassSize(((const poolblk_t *)buf - 1)->b.cls);
+}
+
+//=================================================================
+// MapBuffer()
+//
+// Makes sure the descriptor 'map' holds a read buffer of at least
+// 'size' bytes, reusing any it has that is large enough, else
+// taking a new one from its buffer pool (or malloc() if it has
+// none). Returns BADSTATUS if no memory is available.
+//
+//=================================================================
+
+static int MapBuffer(pbmpmap_t map, uint64_t size)
+{
+    if (map->base != NULL && map->mode == LBMP_READ && map->bufsize >= size)
+        return GOODSTATUS;
+
+    if (map->base != NULL)
+        UnloadBitmap(map);
+
+    if (size > SIZE_MAX)
+        return BADSTATUS;
+
+    map->base = (map->pool != NULL) ? (unsigned char *)BmpPoolAlloc(map->pool, size) : 
+                                      (unsigned char *)malloc((size_t)size);
+    if (map->base == NULL)
+        return BADSTATUS;
+
+    map->bufsize = (map->pool != NULL) ? PoolBufSize(map->base) : size;
+    map->mode    = LBMP_READ;
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// ExpandMap()
+//
+// Replaces the run length encoded file image loaded in 'map', with
+// host endian header 'hdr', with its uncompressed expansion (see
+// DecodeRle()), owned by the descriptor as a read buffer. The
+// header is updated to match. Returns BADSTATUS, with the image
+// unloaded, if no memory is available.
+//
+//=================================================================
+
+static int ExpandMap(pbmpmap_t map, pbmhdr_t hdr)
+{
+    unsigned char *buf;
+    uint64_t size;
+
+    buf = DecodeRle(map->base, hdr, &size, map->pool);
+    UnloadBitmap(map);
+
+    if (buf == NULL)
+        return BADSTATUS;
+
+    *hdr         = *(pbmhdr_t)buf;
+    map->base    = buf;
+    map->size    = size;
+    map->bufsize = (map->pool != NULL) ? PoolBufSize(buf) : size;
+    map->mode    = LBMP_READ;
+    HDRENDIAN((pbmhdr_t)map->base);
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// LoadBitmap()
+//
+// Loads the bitmap file 'fname' as a single contiguous file image,
+// described in 'map', without any per byte processing. The header
+// is validated before the image body is read. In LBMP_READ mode the
+// file is read with one bulk read into an allocated buffer. The
+// LBMP_MAPRO mode memory maps the file read only, so that only the
+// pages actually referenced (e.g. just the header) are ever read,
+// whilst LBMP_MAPCOPY maps a private copy on write image that may
+// be modified in place without affecting the file. On return the
+// 'bmp', 'r' and 'data' pointers are set as for GetBitmap(). The
+// image must be released with UnloadBitmap(). Run length encoded
+// files are expanded into a read buffer, whatever the mode. Read
+// buffers are taken from the descriptor's buffer pool, if it has
+// one.
+//
+//=================================================================
+
+int LoadBitmap(const char *fname, uint32_t mode, pbmpmap_t map, pbmhdr_t *bmp, prgbquad_t *r, unsigned char **data, 
+               perrmsg_t e)
+{
+    static const char *funcname = "LoadBitmap()";
+
+    bmhdr_t hdr;                                        // Host endian copy of header
+    uint64_t size;                                      // File size in bytes
+    uint64_t idx = 0;                                   // Bytes read
+    uint32_t ncolours;                                  // Colour table entries
+#ifndef WIN32
+    int fd;
+    struct stat st;
+    ssize_t len;
+#else
+    FILE *fp;
+    int64_t len;
+#endif
+
+    *r    = NULL;
+    *bmp  = NULL;
+    *data = NULL;
+
+#ifndef WIN32
+    if ((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for reading.\n", funcname, fname);
+            e->errnum = GBMP_ERR_OPEN;
+        }
+        if (fd >= 0)
+            close(fd);
+        return BADSTATUS;
+    }
+
+    // Files must fit in the address space (only a concern for 32 bit hosts)
+    if ((uint64_t)st.st_size > SIZE_MAX) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - file too large.\n", funcname);
+            e->errnum = GBMP_ERR_BADSIZE;
+        }
+        close(fd);
+        return BADSTATUS;
+    }
+    size = (uint64_t)st.st_size;
+#else
+    // No memory mapping support, so all modes read into a buffer
+    mode = LBMP_READ;
+
+    if ((fp = fopen(fname, "rb")) == NULL || fseeko(fp, 0, SEEK_END) != 0 || (len = ftello(fp)) < 0) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for reading.\n", funcname, fname);
+            e->errnum = GBMP_ERR_OPEN;
+        }
+        if (fp != NULL)
+            fclose(fp);
+        return BADSTATUS;
+    }
+    size = (uint64_t)len;
+    rewind(fp);
+#endif
+
+    if (size < HDRSIZE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file reading header.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+#ifndef WIN32
+        close(fd);
+#else
+        fclose(fp);
+#endif
+        return BADSTATUS;
+    }
+
+#ifndef WIN32
+    if (mode != LBMP_READ) {
+        // Any previously loaded image is not reusable for a mapping
+        if (map->base != NULL)
+            UnloadBitmap(map);
+
+        map->base = (unsigned char *)mmap(NULL, (size_t)size, (mode == LBMP_MAPRO) ? PROT_READ : (PROT_READ | PROT_WRITE),
+                                          (mode == LBMP_MAPRO) ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (map->base == (unsigned char *)MAP_FAILED) {
+            map->base = NULL;
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unable to map %s.\n", funcname, fname);
+                e->errnum = GBMP_ERR_MAP;
+            }
+            return BADSTATUS;
+        }
+        map->size    = size;
+        map->mode    = mode;
+        map->bufsize = 0;
+
+        // Validate from a copy of the header, as the mapping may not be writable
+        hdr = *(pbmhdr_t)map->base;
+        HDRENDIAN(&hdr);
+    } else {
+        // Read and validate just the header before allocating for the rest of the file
+        if (read(fd, &hdr, HDRSIZE) != HDRSIZE) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file reading header.\n", funcname);
+                e->errnum = GBMP_ERR_EOF;
+            }
+            close(fd);
+            return BADSTATUS;
+        }
+        HDRENDIAN(&hdr);
+    }
+#else
+    if (fread(&hdr, 1, HDRSIZE, fp) != HDRSIZE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file reading header.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        fclose(fp);
+        return BADSTATUS;
+    }
+    HDRENDIAN(&hdr);
+#endif
+
+    if (CheckHeader(&hdr, size, funcname, e) == BADSTATUS) {
+        if (mode == LBMP_READ) {
+#ifndef WIN32
+            close(fd);
+#else
+            fclose(fp);
+#endif
+        } else {
+            UnloadBitmap(map);
+        }
+        return BADSTATUS;
+    }
+
+    if (mode == LBMP_READ) {
+        // Reuse any existing buffer if large enough, else get a new one
+        if (MapBuffer(map, size) == BADSTATUS) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                e->errnum = GBMP_ERR_MEM;
+            }
+#ifndef WIN32
+            close(fd);
+#else
+            fclose(fp);
+#endif
+            return BADSTATUS;
+        }
+
+        // Header already read, so place it and then bulk read the remainder
+        memcpy(map->base, &hdr, HDRSIZE);
+        HDRENDIAN((pbmhdr_t)map->base);
+
+#ifndef WIN32
+        for (idx = HDRSIZE; idx < size; idx += (uint64_t)len) {
+            if ((len = read(fd, &map->base[idx], (size_t)(size - idx))) <= 0)
+                break;
+        }
+        close(fd);
+#else
+        len = (int64_t)fread(&map->base[HDRSIZE], 1, (size_t)size - HDRSIZE, fp);
+        fclose(fp);
+        if ((uint64_t)len == size - HDRSIZE)
+            idx = size;
+#endif
+        if (idx < size) {
+            if (e != NULL) {
+                 snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
+                 e->errnum = GBMP_ERR_EOF;
+            }
+            return BADSTATUS;
+        }
+    }
+
+    map->size = size;
+    map->mode = mode;
+
+    // Expand any run length encoded data, replacing the loaded (or mapped) image with an
+    // uncompressed one, owned by the descriptor as a read buffer
+    if (ISRLE(&hdr) && ExpandMap(map, &hdr) == BADSTATUS) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = GBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
+
+    // Return pointers into the image as for GetBitmap()
+    *bmp = (pbmhdr_t)map->base;
+
+    if (hdr.i.biBitCount != 24)
+        *r = (prgbquad_t) &map->base[ColourTable(&hdr, &ncolours)];
+
+    *data = &map->base[hdr.f.bfOffBits];
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// UnloadBitmap()
+//
+// Releases a file image loaded with LoadBitmap(), unmapping or 
+// freeing it (or returning it to its pool) as appropriate, and
+// clears the descriptor, other than its pool.
+//
+//=================================================================
+
+void UnloadBitmap(pbmpmap_t map)
+{
+    if (map->base != NULL) {
+#ifndef WIN32
+        if (map->mode != LBMP_READ)
+            munmap(map->base, (size_t)map->size);
+        else
+#endif
+        if (map->pool != NULL)
+            BmpPoolFree(map->base);
+        else
+            free(map->base);
+    }
+
+    map->base    = NULL;
+    map->size    = 0;
+    map->bufsize = 0;
+    map->mode    = LBMP_READ;
+}
+
+//=================================================================
+// GetMasks()
+//
+// Places in 'masks' the blue, green, red and alpha colour masks of
+// the 16 or 32 bit image with (host endian) header 'hdr', from the
+// bytes following the 40 byte information header, 'extra', where
+// given (directly or, for V4 and V5 headers, as part of the header),
+// or else the defaults for the bits per pixel.
+//
+//=================================================================
+
+static void GetMasks(const pbmhdr_t hdr, const unsigned char *extra, uint32_t masks[4])
+{
+    if (hdr->i.biCompression == BMP_BITFIELDS || hdr->i.biCompression == BMP_ALPHABITFIELDS) {
+        masks[2] = GETLE32(&extra[0]);
+        masks[1] = GETLE32(&extra[4]);
+        masks[0] = GETLE32(&extra[8]);
+        masks[3] = (hdr->i.biCompression == BMP_ALPHABITFIELDS || 
+                    (hdr->i.biSize >= ALPHAHDRSIZE && hdr->f.bfOffBits >= HDRSIZE + MASKSSIZE + 4)) ? 
+                   GETLE32(&extra[12]) : 0;
+    } else if (hdr->i.biBitCount == 16) {
+        masks[2] = 0x7c00;
+        masks[1] = 0x03e0;
+        masks[0] = 0x001f;
+        masks[3] = 0;
+    } else {
+        masks[2] = 0x00ff0000;
+        masks[1] = 0x0000ff00;
+        masks[0] = 0x000000ff;
+        masks[3] = 0;
+    }
+}
+
+//=================================================================
+// PixelFormat()
+//
+// Returns the pixel format (BMP_FMTxxx, or the bits per pixel for
+// indexed images) of the image with (host endian) header 'hdr' and
+// following bytes 'extra' (see GetMasks()).
+//
+//=================================================================
+
+static uint32_t PixelFormat(const pbmhdr_t hdr, const unsigned char *extra)
+{
+    uint32_t masks[4];
+
+    if (hdr->i.biBitCount != 16 && hdr->i.biBitCount != 32)
+        return hdr->i.biBitCount;
+
+    GetMasks(hdr, extra, masks);
+
+    if (hdr->i.biBitCount == 32)
+        return (masks[2] == 0x00ff0000 && masks[1] == 0x0000ff00 && masks[0] == 0x000000ff) ? BMP_FMT32 : BMP_FMTOTHER;
+
+    if (masks[2] == 0x7c00 && masks[1] == 0x03e0 && masks[0] == 0x001f)
+        return BMP_FMT555;
+
+    if (masks[2] == 0xf800 && masks[1] == 0x07e0 && masks[0] == 0x001f)
+        return BMP_FMT565;
+
+    return BMP_FMTOTHER;
+}
+
+//=================================================================
+// GetPixelFormat()
+//
+// Returns the pixel format of the bitmap image 'bmp': the bits
+// per pixel for 1, 4, 8 and 24 bit images, BMP_FMT555 or 
+// BMP_FMT565 for the common 16 bit formats, BMP_FMT32 for 32 bit
+// BGRX (the format TransformBmp() works on directly) and
+// BMP_FMTOTHER for 16 and 32 bit images with other colour masks.
+//
+//=================================================================
+
+uint32_t GetPixelFormat(const unsigned char *bmp)
+{
+    bmhdr_t hdr;
+
+    hdr = *(pbmhdr_t)bmp;
+    HDRENDIAN(&hdr);
+
+    return PixelFormat(&hdr, &bmp[HDRSIZE]);
+}
+
+//=================================================================
+// BuildConvertLut()
+//
+// Builds the conversion table used by ConvertRow() for pixels of
+// the image with (host endian) header 'hdr' and following bytes
+// 'extra', holding the 'ncolours' entry RGB quad table for indexed
+// images, or any colour masks (see GetMasks()), to be converted to
+// pixel format 'fmt'. For indexed images, each of the 256 possible
+// input bytes is mapped to the ready made BGR (BGRX for BMP_FMT32)
+// pixels it contains (MSB first), with indexes beyond the end of
+// the quad table expanding to black. For masked images, each colour
+// field of up to 8 bits (the most significant 8 of any longer) is
+// mapped to a full range colour value.
+//
+//=================================================================
+
+static void BuildConvertLut(pcvtlut_t lut, const pbmhdr_t hdr, const unsigned char *extra, uint32_t ncolours, 
+                            uint32_t fmt)
+{
+    const prgbquad_t r = (prgbquad_t)extra;
+    uint32_t pixelsperbyte, bpp, bits;
+    uint32_t masks[4];
+    uint32_t byte, k, idx, c;
+
+    bpp = hdr->i.biBitCount;
+
+    lut->bpp  = bpp;
+    lut->fmt  = fmt;
+    lut->opix = (fmt == BMP_FMT32) ? 4 : 3;
+    lut->bgrx = (PixelFormat(hdr, extra) == BMP_FMT32);
+
+    if (bpp <= BYTEWIDTH) {
+        pixelsperbyte = BYTEWIDTH/bpp;
+
+        for (byte = 0; byte < 256; byte++) {
+            for (k = 0; k < pixelsperbyte; k++) {
+                idx = (byte >> ((pixelsperbyte-1-k) * bpp)) & ((1 << bpp) - 1);
+                lut->pixels[byte][lut->opix*k]   = (idx < ncolours) ? r[idx].Blue  : 0;
+                lut->pixels[byte][lut->opix*k+1] = (idx < ncolours) ? r[idx].Green : 0;
+                lut->pixels[byte][lut->opix*k+2] = (idx < ncolours) ? r[idx].Red   : 0;
+                if (lut->opix == 4)
+                    lut->pixels[byte][lut->opix*k+3] = 0;
+            }
+        }
+    } else if (bpp != 24) {
+        GetMasks(hdr, extra, masks);
+
+        for (c = 0; c < 4; c++) {
+            // Position and width of the field, limited to its top 8 bits
+            for (k = 0; k < 32 && !(masks[c] & (1U << k)); k++)
+                ;
+            for (bits = 0; k + bits < 32 && (masks[c] & (1U << (k + bits))); bits++)
+                ;
+            if (bits > BYTEWIDTH) {
+                k   += bits - BYTEWIDTH;
+                bits = BYTEWIDTH;
+            }
+
+            lut->shift[c] = (k < 32) ? k : 0;
+            lut->mask[c]  = (1U << bits) - 1;
+
+            for (idx = 0; idx < 256; idx++)
+                lut->scale[c][idx] = (idx <= lut->mask[c] && lut->mask[c]) ? 
+                                     (unsigned char)((idx * 255 + lut->mask[c]/2) / lut->mask[c]) : 0;
+        }
+    }
+}
+
+//=================================================================
+// ConvertRow()
+//
+// Converts a single row of 'width' pixels, pointed to by 'in', to
+// BGR triplets (or BGRX quads) at 'out', using the conversion table
+// 'lut'. For indexed images, each whole input byte is a single fixed
+// size copy from the table. No row padding is added to the output.
+//
+//=================================================================
+
+static void ConvertRow(unsigned char *out, const unsigned char *in, uint32_t width, const pcvtlut_t lut)
+{
+    uint32_t pixelsperbyte, wholebytes, partial;        // Input row parameters
+    uint32_t j, v;                                      // Indexing and pixel value
+
+    // Whole byte pixels
+    if (lut->bpp > BYTEWIDTH) {
+        if (lut->bgrx && lut->opix == 4) {
+            memcpy(out, in, 4 * width);
+        } else if (lut->bgrx) {
+            for (j = 0; j < width; j++, in += 4, out += 3)
+                memcpy(out, in, 3);
+        } else if (lut->bpp == 24) {
+            for (j = 0; j < width; j++, in += 3, out += 4) {
+                memcpy(out, in, 3);
+                out[3] = 0;
+            }
+        } else {
+            for (j = 0; j < width; j++, in += lut->bpp / BYTEWIDTH, out += lut->opix) {
+                v = (lut->bpp == 16) ? (uint32_t)in[0] | ((uint32_t)in[1] << 8) : GETLE32(in);
+                out[0] = lut->scale[0][(v >> lut->shift[0]) & lut->mask[0]];
+                out[1] = lut->scale[1][(v >> lut->shift[1]) & lut->mask[1]];
+                out[2] = lut->scale[2][(v >> lut->shift[2]) & lut->mask[2]];
+                if (lut->opix == 4)
+                    out[3] = lut->scale[3][(v >> lut->shift[3]) & lut->mask[3]];
+            }
+        }
+        return;
+    }
+
+    // Number of pixels in each (whole) byte. Either 1, 2 or 8.
+    pixelsperbyte = BYTEWIDTH/lut->bpp;
+
+    // Number of whole input bytes, and pixels in a last partial byte
+    wholebytes = width / pixelsperbyte;
+    partial    = width % pixelsperbyte;
+
+    // Separate loops so that each copy is of a constant size
+    switch (lut->opix * pixelsperbyte) {
+    case 24:
+        for (j = 0; j < wholebytes; j++, out += 24)
+            memcpy(out, lut->pixels[in[j]], 24);
+        break;
+    case 32:
+        for (j = 0; j < wholebytes; j++, out += 32)
+            memcpy(out, lut->pixels[in[j]], 32);
+        break;
+    case 6:
+        for (j = 0; j < wholebytes; j++, out += 6)
+            memcpy(out, lut->pixels[in[j]], 6);
+        break;
+    case 8:
+        for (j = 0; j < wholebytes; j++, out += 8)
+            memcpy(out, lut->pixels[in[j]], 8);
+        break;
+    case 3:
+        for (j = 0; j < wholebytes; j++, out += 3)
+            memcpy(out, lut->pixels[in[j]], 3);
+        break;
+    default:
+        for (j = 0; j < wholebytes; j++, out += 4)
+            memcpy(out, lut->pixels[in[j]], 4);
+        break;
+    }
+
+    // Only the leading pixels of any partial last byte
+    if (partial)
+        memcpy(out, lut->pixels[in[wholebytes]], lut->opix * partial);
+}
+
+//=================================================================
+// ConvertPixels()
+//
+// Converts a row of 'width' pixels from 'in' to the pixel format
+// of 'lut' at 'out', as for ConvertRow(), but packing the colours
+// into 16 bit pixels for BMP_FMT555 and BMP_FMT565 (via the row
+// buffer 'tmp', of 3*width bytes, unless the input is 24 bit).
+//
+//=================================================================
+
+static void ConvertPixels(unsigned char *out, const unsigned char *in, uint32_t width, const pcvtlut_t lut, 
+                          unsigned char *tmp)
+{
+    uint32_t j, v;
+
+    if (lut->fmt != BMP_FMT555 && lut->fmt != BMP_FMT565) {
+        ConvertRow(out, in, width, lut);
+        return;
+    }
+
+    if (lut->bpp != 24) {
+        ConvertRow(tmp, in, width, lut);
+        in = tmp;
+    }
+
+    for (j = 0; j < width; j++, in += 3, out += 2) {
+        if (lut->fmt == BMP_FMT565)
+            v = ((uint32_t)(in[2] >> 3) << 11) | ((uint32_t)(in[1] >> 2) << 5) | (in[0] >> 3);
+        else
+            v = ((uint32_t)(in[2] >> 3) << 10) | ((uint32_t)(in[1] >> 3) << 5) | (in[0] >> 3);
+        out[0] = (unsigned char)v;
+        out[1] = (unsigned char)(v >> 8);
+    }
+}
+
+//=================================================================
+// FormatHeader()
+//
+// Fills in the (host endian) header 'ohdr' for a 'width' by 'height'
+// image (top down if 'height' is negative) in pixel format 'fmt',
+// with other fields as for the header 'ihdr', and places any colour
+// masks the format needs in 'masks'.
+// Returns the number of mask bytes (which follow the header).
+//
+//=================================================================
+
+static uint32_t FormatHeader(pbmhdr_t ohdr, const pbmhdr_t ihdr, uint32_t width, int32_t height, uint32_t fmt, 
+                             unsigned char *masks)
+{
+    static const unsigned char masks565[MASKSSIZE] = {0x00, 0xf8, 0, 0, 0xe0, 0x07, 0, 0, 0x1f, 0, 0, 0};
+
+    uint32_t masklen = (fmt == BMP_FMT565) ? MASKSSIZE : 0;
+    uint32_t bpp     = (fmt == BMP_FMT555) ? 16 : fmt;
+
+    *ohdr = *ihdr;
+
+    ohdr->i.biSize         = INFOHDRSIZE;
+    ohdr->i.biWidth        = width;
+    ohdr->i.biHeight       = height;
+    ohdr->i.biBitCount     = bpp;
+    ohdr->i.biCompression  = masklen ? BMP_BITFIELDS : BMP_RGB;
+    ohdr->i.biClrUsed      = 0;
+    ohdr->i.biClrImportant = 0;
+    ohdr->f.bfOffBits      = HDRSIZE + masklen;
+    SetImageSizes(ohdr, PadRowLen(width, bpp) * BMPHEIGHT(ohdr));
+
+    memcpy(masks, masks565, masklen);
+
+    return masklen;
+}
+
+//=================================================================
+// ConvertSize()
+//
+// Returns the buffer size needed by ConvertBmpFormat() to convert
+// the image with (host endian) header 'hdr' to pixel format 'fmt':
+// the converted image, with room for colour masks, followed by a
+// row buffer when packing indexed or 32 bit pixels to 16 bits.
+// Returns 0 for an unsupported format, or rows that would exceed
+// BMP_MAXROWLEN.
+//
+//=================================================================
+
+static uint64_t ConvertSize(const pbmhdr_t hdr, uint32_t fmt)
+{
+    uint64_t o_padrowlen;
+
+    if (fmt != BMP_FMT555 && fmt != BMP_FMT565 && fmt != BMP_FMT24 && fmt != BMP_FMT32)
+        return 0;
+
+    o_padrowlen = PadRowLen(hdr->i.biWidth, (fmt == BMP_FMT555) ? 16 : fmt);
+    if (o_padrowlen > BMP_MAXROWLEN)
+        return 0;
+
+    return HDRSIZE + MASKSSIZE + o_padrowlen * BMPHEIGHT(hdr) + 
+           (((fmt == BMP_FMT555 || fmt == BMP_FMT565) && hdr->i.biBitCount != 24) ? 3 * (uint64_t)hdr->i.biWidth : 0);
+}
+
+//=================================================================
+// ConvertBmpTo24bit()
+//
+// Convert lower order bitmap to a 24 bit bitmap, and place in
+// allocated memory. Bitmap header pointed to by 'bmp',
+// with quad table referenced by 'r' and data bytes by 'data'.
+// On return, *newbmp set to point to image data, and return value
+// set to image size.
+//
+//=================================================================
+
+uint64_t ConvertBmpTo24bit(unsigned char **newbmp, const pbmhdr_t bmp, const prgbquad_t r, const unsigned char *data, 
+                           perrmsg_t e)
+{
+    uint64_t bufsize = 0;
+
+    *newbmp = NULL;
+
+    return ConvertBmpTo24bitBuf(newbmp, &bufsize, bmp, r, data, e);
+}
+
+//=================================================================
+// ConvertBmpTo24bitBuf()
+//
+// As for ConvertBmpTo24bit(), but converts into the caller's buffer
+// at *newbmp, of *bufsize bytes. If *newbmp is NULL, or the buffer
+// is too small, it is reallocated and *newbmp and *bufsize updated,
+// so that a buffer may be reused over many images. The caller
+// remains responsible for freeing the buffer, even on error.
+//
+//=================================================================
+
+uint64_t ConvertBmpTo24bitBuf(unsigned char **newbmp, uint64_t *bufsize, const pbmhdr_t bmp, const prgbquad_t r, 
+                              const unsigned char *data, perrmsg_t e)
+{
+    return ConvertBmpFormat(newbmp, bufsize, bmp, r, data, BMP_FMT24, e);
+}
+
+//=================================================================
+// ConvertBmpFormat()
+//
+// As for ConvertBmpTo24bitBuf(), but converts a bitmap of any depth
+// to the pixel format 'fmt': 24 bit, 32 bit BGRX (BMP_FMT32), or 16
+// bit 5-5-5 (BMP_FMT555) or 5-6-5 (BMP_FMT565). The table at 'r'
+// holds the colour table for indexed images, and any colour masks
+// for 16 and 32 bit ones. The converted image has a 40 byte
+// information header, followed by the colour masks for BMP_FMT565,
+// and has the same row order (bottom up or top down) as the input.
+// Returns the converted image size, or 0 on error, with a message
+// placed in 'e' (if not NULL). An error is also returned if the
+// converted rows would exceed BMP_MAXROWLEN.
+//
+//=================================================================
+
+uint64_t ConvertBmpFormat(unsigned char **newbmp, uint64_t *bufsize, const pbmhdr_t bmp, const prgbquad_t r, 
+                          const unsigned char *data, uint32_t fmt, perrmsg_t e)
+{
+    static const char *funcname = "ConvertBmpFormat()";
+
+    // Local variables
+    pbmhdr_t new_header;                                // Pointer to output header
+    cvtlut_t lut;                                       // Pixel conversion table
+    uint64_t i_padrowlen;                               // Input bitmap parameters
+    uint64_t o_imgsize, o_rowlen, o_padrowlen;          // Output bitmap parameters
+    uint64_t bufneed;                                   // Buffer size needed
+    uint32_t masklen;                                   // Bytes of colour masks after output header
+    uint32_t ncolours;                                  // Input colour table entries
+    unsigned char *p, *tmp = NULL;                      // Pointer to output buffer data area, and row buffer
+    uint32_t i;                                         // Indexing
+
+    // Header endian conversion on big endian machine
+    HDRENDIAN(bmp);
+
+    if (fmt != BMP_FMT555 && fmt != BMP_FMT565 && fmt != BMP_FMT24 && fmt != BMP_FMT32) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported output pixel format (%d).\n", funcname, fmt);
+            e->errnum = CBMP_ERR_BADFORMAT;
+        }
+        HDRENDIAN(bmp);
+        return 0;
+    }
+
+    // If bitmap already in the format return an error (byte count of 0)
+    if (PixelFormat(bmp, (const unsigned char *)r) == fmt) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to convert a bitmap already in %d bit format.\n", 
+                     funcname, bmp->i.biBitCount);
+            e->errnum = CBMP_ERR_CONVERROR;
+        }
+        HDRENDIAN(bmp);
+        return 0;
+    }
+
+    // Calculate input row length in bytes, as padded to 32 bits
+    i_padrowlen = PadRowLen(bmp->i.biWidth, bmp->i.biBitCount);
+
+    // Calculate output row length in bytes, and as padded to 32 bits
+    o_rowlen    = (uint64_t)bmp->i.biWidth * ((fmt == BMP_FMT555) ? 16 : fmt) / BYTEWIDTH;
+    o_padrowlen = 4 * ((o_rowlen+3)/4);
+
+    // Size of output image in bytes (not including header)
+    o_imgsize = o_padrowlen * BMPHEIGHT(bmp);
+
+    // Buffer needed for the image, and any row buffer for packing 16 bit pixels
+    bufneed = ConvertSize(bmp, fmt);
+
+    if (bufneed == 0 || bufneed > SIZE_MAX) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - image too large to convert to %d bit format.\n", funcname, 
+                     fmt);
+            e->errnum = CBMP_ERR_TOOBIG;
+        }
+        HDRENDIAN(bmp);
+        return 0;
+    }
+
+    // Allocate some memory for the new bitmap, if none big enough already
+    if (*newbmp == NULL || *bufsize < bufneed) {
+        if ((p = (unsigned char*)realloc(*newbmp, (size_t)bufneed)) == NULL) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                e->errnum = CBMP_ERR_MEM;
+            }
+            HDRENDIAN(bmp);
+            return 0;
+        }
+        *newbmp  = p;
+        *bufsize = bufneed;
+    }
+
+    // Row buffer for packing 16 bit pixels, after the image
+    if ((fmt == BMP_FMT555 || fmt == BMP_FMT565) && bmp->i.biBitCount != 24)
+        tmp = (*newbmp) + HDRSIZE + MASKSSIZE + o_imgsize;
+
+    // Cast start of allocated memory to a header structure, and construct the header (with
+    // other fields as for the original) and any colour masks
+    new_header = (pbmhdr_t) *newbmp;
+    masklen    = FormatHeader(new_header, bmp, bmp->i.biWidth, bmp->i.biHeight, fmt, (*newbmp) + HDRSIZE);
+
+    // Endian conversion (if required)
+    HDRENDIAN(new_header);
+
+    // Point to data area of allocated memory
+    p = (*newbmp) + HDRSIZE + masklen;
+
+    // Conversion table from the colour table or masks (which sit between the header and data)
+    ColourTable(bmp, &ncolours);
+    BuildConvertLut(&lut, bmp, (const unsigned char *)r, ncolours, fmt);
+
+    // Convert data, row at a time, in the order stored (so a top down image stays top down)
+    for (i = 0; i < BMPHEIGHT(bmp); i++) {
+
+        // Convert the current row
+        ConvertPixels(p, &data[i * i_padrowlen], bmp->i.biWidth, &lut, tmp);
+        p += o_rowlen;
+
+        // Pad new row to 32 bit boundary
+        memset(p, 0, (size_t)(o_padrowlen - o_rowlen));
+        p += o_padrowlen - o_rowlen;
+    }
+
+    // Header endian put back before exit
+    HDRENDIAN(bmp);
+
+    return o_imgsize + HDRSIZE + masklen;
+}
+
+//=============================================================
+// CheckControl()
+//
+// Validates the TransformBmp() control structure 'control',
+// returning BADSTATUS with an error message placed in 'e' (if
+// not NULL) for bad parameters, else GOODSTATUS.
+//
+//=============================================================
+
+static int CheckControl(const ptrans_t control, const char *funcname, perrmsg_t e)
+{
+    uint32_t t;
+
+    // Check control parameters
+    if (control->brightness < 0) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad brightness control parameter (%d).\n", funcname, control->brightness);
+            e->errnum = TBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    if (control->mono < 0 || control->mono >= 0x7) { 
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad monochrome control parameter (%d).\n", funcname, control->mono);
+            e->errnum = TBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    if ((control->levels != 0 && control->levels != BMP_LEVELSSTRETCH && control->levels != BMP_LEVELSEQUALIZE) ||
+        (control->levels == BMP_LEVELSSTRETCH && control->levelclip > BMP_MAXLEVELCLIP)) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad levels control parameters (%d %d).\n", funcname, 
+                     control->levels, control->levelclip);
+            e->errnum = TBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    if (control->filter != NULL) {
+        for (t = 0; t < control->filter->nterms && t < BMP_MAXTERMS && control->filter->divisor[t] > 0; t++)
+            ;
+
+        if (!(control->filter->size & 1) || control->filter->size > BMP_MAXKERNEL || control->filter->nterms == 0 || 
+            t < control->filter->nterms) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - bad convolution filter (size %d, %d terms).\n", funcname, 
+                         control->filter->size, control->filter->nterms);
+                e->errnum = TBMP_ERR_BADPARAM;
+            }
+            return BADSTATUS;
+        }
+    }
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// HasTransforms()
+//
+// Returns TRUE if any transformations are enabled in 'control'.
+//
+//=============================================================
+
+static int HasTransforms(const ptrans_t control)
+{
+    return control->reverse || control->brightness || control->contrast || control->grey   || 
+           control->flipv   || control->fliph      || control->mono     || control->levels || control->filter != NULL;
+}
+
+//=============================================================
+// Row transform kernels
+//
+// The row local transforms are done in two stages. The channel
+// stage (reverse, brightness, contrast and zeroing of unselected
+// mono colours) treats every byte independently, whilst the cross
+// channel stage (averaging for two colour mono and grey) combines
+// the three bytes of each pixel. As all channel operations come
+// before any cross channel ones, this gives identical results to
+// doing all the operations pixel by pixel. The channel operations
+// are compiled into a 256 entry table per colour, so the scalar
+// channel kernel is a table load per byte whatever the operations.
+// There are also x86 SIMD kernels, selected at run time from what
+// the CPU supports (SSE2, SSSE3 and AVX2), giving identical results,
+// though the channel ones only compute reverse, brightness and mono.
+// Pixels are either 3 byte BGR, or 4 byte BGRX, whose X byte is left
+// untouched. With 4 byte pixels, each is a whole 32 bit lane of a
+// vector, so the cross channel stage needs no byte shuffling.
+// Any levels adjustment (see MakeLevels()) is a stage of its own,
+// before the channel stage, with a table per colour likewise. Its
+// SIMD kernels compute a stretch with saturating byte arithmetic
+// and a 16 bit fixed point multiply, and look up an equalization's
+// single table 16 entries at a time with byte shuffles.
+//
+//=============================================================
+
+// Mono colour flag for each byte of a BGR triplet
+static const uint32_t chanmono[3] = {MONOBLUE, MONOGREEN, MONORED};
+
+// Multiplier stretching values 'low' to 'high' (above 'low') over 0 to 255, as 256 times 
+// the output for each step of the input, rounded up so that 'high' makes at least 255
+static uint32_t StretchMul(uint32_t low, uint32_t high)
+{
+    return (0xff00 + (high - low) - 1) / (high - low);
+}
+
+// Value 'v' stretched from 'low' to 'high' over 0 to 255 (see StretchMul())
+static uint32_t StretchValue(uint32_t v, uint32_t low, uint32_t high)
+{
+    v = (v > high) ? high : v;
+    v = (v < low)  ? 0 : v - low;
+
+    return (v * StretchMul(low, high)) >> 8;
+}
+
+// Scalar levels stage kernel for 'len' bytes of 'row', starting at the blue of a pixel
+static void LevelsScalar(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    uint32_t j;
+
+    for (j = 0; j < len; j += xf->pixbytes) {
+        row[j]   = xf->levlut[0][row[j]];
+        row[j+1] = xf->levlut[1][row[j+1]];
+        row[j+2] = xf->levlut[2][row[j+2]];
+    }
+}
+
+// Scalar channel stage kernel for 'len' bytes of 'row', starting at the blue of a pixel.
+// All the channel operations are folded into the tables, so this is just three loads.
+static void ChannelScalar(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    uint32_t j;
+
+    for (j = 0; j < len; j += xf->pixbytes) {
+        row[j]   = xf->lut[0][row[j]];
+        row[j+1] = xf->lut[1][row[j+1]];
+        row[j+2] = xf->lut[2][row[j+2]];
+    }
+}
+
+// Scalar cross channel stage kernel for 'width' pixels of 'row'
+static void CrossScalar(unsigned char *row, uint32_t width, const pxform_t xf)
+{
+    uint32_t j, val;
+
+    for (j = 0; j < xf->pixbytes*width; j += xf->pixbytes) {
+        // Sum of colours, of which unselected mono colours are already zero
+        val = row[j] + row[j+1] + row[j+2];
+
+        // Average the two components of a two colour mono, or all those 
+        // remaining for grey (which, for a two colour mono, is the same)
+        val /= xf->pair ? 2 : xf->greydiv;
+
+        row[j]   = (unsigned char)((xf->grey || (xf->mono & MONOBLUE))  ? val : 0);
+        row[j+1] = (unsigned char)((xf->grey || (xf->mono & MONOGREEN)) ? val : 0);
+        row[j+2] = (unsigned char)((xf->grey || (xf->mono & MONORED))   ? val : 0);
+    }
+}
+
+#ifdef X86SIMD
+
+// Apply channel stage to 16 bytes (a, c and mask as for ChannelSse2())
+__attribute__((target("sse2")))
+static __m128i ChannelVecSse2(__m128i v, const pxform_t xf, __m128i a, __m128i c, __m128i mask)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max  = _mm_set1_epi16(0xff);
+    const __m128i div  = _mm_set1_epi16(XFORMDIV100);
+    __m128i lo, hi;
+
+    v = _mm_xor_si128(v, _mm_set1_epi8((char)xf->reverse));
+
+    // x*b/100 computed as x*a + x*c/100, where b = 100a + c, saturated to 0xff
+    if (xf->brightness) {
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        lo = _mm_adds_epu16(_mm_mullo_epi16(lo, a), _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16(lo, c), div), 3));
+        hi = _mm_adds_epu16(_mm_mullo_epi16(hi, a), _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16(hi, c), div), 3));
+        lo = _mm_sub_epi16(lo, _mm_subs_epu16(lo, max));
+        hi = _mm_sub_epi16(hi, _mm_subs_epu16(hi, max));
+        v  = _mm_packus_epi16(lo, hi);
+    }
+
+    return _mm_and_si128(v, mask);
+}
+
+// SSE2 channel stage kernel, 48 bytes (16 pixels) at a time
+__attribute__((target("sse2")))
+static void ChannelSse2(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    const __m128i a = _mm_set1_epi16((short)xf->bright_a);
+    const __m128i c = _mm_set1_epi16((short)xf->bright_c);
+    __m128i m0, m1, m2;
+    uint32_t j;
+
+    m0 = _mm_loadu_si128((const __m128i *)&xf->monomask[0]);
+    m1 = _mm_loadu_si128((const __m128i *)&xf->monomask[16]);
+    m2 = _mm_loadu_si128((const __m128i *)&xf->monomask[32]);
+
+    for (j = 0; j + 48 <= len; j += 48) {
+        _mm_storeu_si128((__m128i *)&row[j],    ChannelVecSse2(_mm_loadu_si128((__m128i *)&row[j]),    xf, a, c, m0));
+        _mm_storeu_si128((__m128i *)&row[j+16], ChannelVecSse2(_mm_loadu_si128((__m128i *)&row[j+16]), xf, a, c, m1));
+        _mm_storeu_si128((__m128i *)&row[j+32], ChannelVecSse2(_mm_loadu_si128((__m128i *)&row[j+32]), xf, a, c, m2));
+    }
+
+    ChannelScalar(&row[j], len - j, xf);
+}
+
+// Apply channel stage to 32 bytes (a, c and mask as for ChannelAvx2())
+__attribute__((target("avx2")))
+static __m256i ChannelVecAvx2(__m256i v, const pxform_t xf, __m256i a, __m256i c, __m256i mask)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max  = _mm256_set1_epi16(0xff);
+    const __m256i div  = _mm256_set1_epi16(XFORMDIV100);
+    __m256i lo, hi;
+
+    v = _mm256_xor_si256(v, _mm256_set1_epi8((char)xf->reverse));
+
+    // As for the SSE2 version. Unpacking and packing are both within
+    // 128 bit lanes, so the byte order is preserved.
+    if (xf->brightness) {
+        lo = _mm256_unpacklo_epi8(v, zero);
+        hi = _mm256_unpackhi_epi8(v, zero);
+        lo = _mm256_adds_epu16(_mm256_mullo_epi16(lo, a), 
+                               _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_mullo_epi16(lo, c), div), 3));
+        hi = _mm256_adds_epu16(_mm256_mullo_epi16(hi, a), 
+                               _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_mullo_epi16(hi, c), div), 3));
+        lo = _mm256_min_epu16(lo, max);
+        hi = _mm256_min_epu16(hi, max);
+        v  = _mm256_packus_epi16(lo, hi);
+    }
+
+    return _mm256_and_si256(v, mask);
+}
+
+// AVX2 channel stage kernel, 96 bytes (32 pixels) at a time
+__attribute__((target("avx2")))
+static void ChannelAvx2(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    const __m256i a = _mm256_set1_epi16((short)xf->bright_a);
+    const __m256i c = _mm256_set1_epi16((short)xf->bright_c);
+    __m256i m0, m1, m2;
+    uint32_t j;
+
+    m0 = _mm256_loadu_si256((const __m256i *)&xf->monomask[0]);
+    m1 = _mm256_loadu_si256((const __m256i *)&xf->monomask[32]);
+    m2 = _mm256_loadu_si256((const __m256i *)&xf->monomask[64]);
+
+    for (j = 0; j + 96 <= len; j += 96) {
+        _mm256_storeu_si256((__m256i *)&row[j],    ChannelVecAvx2(_mm256_loadu_si256((__m256i *)&row[j]),    xf, a, c, m0));
+        _mm256_storeu_si256((__m256i *)&row[j+32], ChannelVecAvx2(_mm256_loadu_si256((__m256i *)&row[j+32]), xf, a, c, m1));
+        _mm256_storeu_si256((__m256i *)&row[j+64], ChannelVecAvx2(_mm256_loadu_si256((__m256i *)&row[j+64]), xf, a, c, m2));
+    }
+
+    ChannelScalar(&row[j], len - j, xf);
+}
+
+// Shuffles extracting the blue, green and red bytes of 16 pixels from
+// three consecutive 16 byte vectors, and replicating 16 byte values
+// into three vectors of triplets.
+static const char deinterleave[3][3][16] = {
+    {{ 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13}},
+    {{ 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14}},
+    {{ 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15}}
+};
+
+static const char replicate[3][16] = {
+    { 0,  0,  0,  1,  1,  1,  2,  2,  2,  3,  3,  3,  4,  4,  4,  5},
+    { 5,  5,  6,  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,  9, 10, 10},
+    {10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15}
+};
+
+// Average the colours of 16 pixels held in v0, v1 and v2 as for CrossScalar()
+__attribute__((target("ssse3")))
+static void CrossVecSsse3(__m128i *v0, __m128i *v1, __m128i *v2, const pxform_t xf)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i b, g, r, lo, hi, val;
+
+    b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(*v0, _mm_loadu_si128((const __m128i *)deinterleave[0][0])),
+                                  _mm_shuffle_epi8(*v1, _mm_loadu_si128((const __m128i *)deinterleave[0][1]))),
+                                  _mm_shuffle_epi8(*v2, _mm_loadu_si128((const __m128i *)deinterleave[0][2])));
+    g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(*v0, _mm_loadu_si128((const __m128i *)deinterleave[1][0])),
+                                  _mm_shuffle_epi8(*v1, _mm_loadu_si128((const __m128i *)deinterleave[1][1]))),
+                                  _mm_shuffle_epi8(*v2, _mm_loadu_si128((const __m128i *)deinterleave[1][2])));
+    r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(*v0, _mm_loadu_si128((const __m128i *)deinterleave[2][0])),
+                                  _mm_shuffle_epi8(*v1, _mm_loadu_si128((const __m128i *)deinterleave[2][1]))),
+                                  _mm_shuffle_epi8(*v2, _mm_loadu_si128((const __m128i *)deinterleave[2][2])));
+
+    // Sum the colours as 16 bit values
+    lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(g, zero)), _mm_unpacklo_epi8(r, zero));
+    hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(g, zero)), _mm_unpackhi_epi8(r, zero));
+
+    // Divide by 2 or 3 (nothing to do for 1)
+    if (xf->pair) {
+        lo = _mm_srli_epi16(lo, 1);
+        hi = _mm_srli_epi16(hi, 1);
+    } else if (xf->greydiv == 3) {
+        lo = _mm_mulhi_epu16(lo, _mm_set1_epi16(XFORMDIV3));
+        hi = _mm_mulhi_epu16(hi, _mm_set1_epi16(XFORMDIV3));
+    }
+    val = _mm_packus_epi16(lo, hi);
+
+    // Place the values back in the triplets, masking to the mono colours if not grey
+    *v0 = _mm_shuffle_epi8(val, _mm_loadu_si128((const __m128i *)replicate[0]));
+    *v1 = _mm_shuffle_epi8(val, _mm_loadu_si128((const __m128i *)replicate[1]));
+    *v2 = _mm_shuffle_epi8(val, _mm_loadu_si128((const __m128i *)replicate[2]));
+
+    if (!xf->grey) {
+        *v0 = _mm_and_si128(*v0, _mm_loadu_si128((const __m128i *)&xf->monomask[0]));
+        *v1 = _mm_and_si128(*v1, _mm_loadu_si128((const __m128i *)&xf->monomask[16]));
+        *v2 = _mm_and_si128(*v2, _mm_loadu_si128((const __m128i *)&xf->monomask[32]));
+    }
+}
+
+// SSSE3 cross channel stage kernel, 16 pixels at a time
+__attribute__((target("ssse3")))
+static void CrossSsse3(unsigned char *row, uint32_t width, const pxform_t xf)
+{
+    __m128i v0, v1, v2;
+    uint32_t j;
+
+    for (j = 0; j + 16 <= width; j += 16) {
+        v0 = _mm_loadu_si128((__m128i *)&row[3*j]);
+        v1 = _mm_loadu_si128((__m128i *)&row[3*j+16]);
+        v2 = _mm_loadu_si128((__m128i *)&row[3*j+32]);
+
+        CrossVecSsse3(&v0, &v1, &v2, xf);
+
+        _mm_storeu_si128((__m128i *)&row[3*j],    v0);
+        _mm_storeu_si128((__m128i *)&row[3*j+16], v1);
+        _mm_storeu_si128((__m128i *)&row[3*j+32], v2);
+    }
+
+    CrossScalar(&row[3*j], width - j, xf);
+}
+
+// AVX2 cross channel stage kernel, 32 pixels at a time. As the byte shuffles are within 
+// 128 bit lanes, each lane does 16 pixels, with the low lanes holding the first 48 bytes 
+// and the high lanes the next 48.
+__attribute__((target("avx2")))
+static void CrossAvx2(unsigned char *row, uint32_t width, const pxform_t xf)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i v0, v1, v2, b, g, r, lo, hi, val;
+    __m256i d[3][3], rep[3], mask[3];
+    uint32_t j, k, l;
+
+    for (k = 0; k < 3; k++) {
+        for (l = 0; l < 3; l++)
+            d[k][l] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)deinterleave[k][l]));
+        rep[k]  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)replicate[k]));
+        mask[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&xf->monomask[16*k]));
+    }
+
+    for (j = 0; j + 32 <= width; j += 32) {
+        v0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *)&row[3*j])),    
+                                     _mm_loadu_si128((__m128i *)&row[3*j+48]), 1);
+        v1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *)&row[3*j+16])), 
+                                     _mm_loadu_si128((__m128i *)&row[3*j+64]), 1);
+        v2 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *)&row[3*j+32])), 
+                                     _mm_loadu_si128((__m128i *)&row[3*j+80]), 1);
+
+        b = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, d[0][0]), _mm256_shuffle_epi8(v1, d[0][1])), 
+                                            _mm256_shuffle_epi8(v2, d[0][2]));
+        g = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, d[1][0]), _mm256_shuffle_epi8(v1, d[1][1])), 
+                                            _mm256_shuffle_epi8(v2, d[1][2]));
+        r = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, d[2][0]), _mm256_shuffle_epi8(v1, d[2][1])), 
+                                            _mm256_shuffle_epi8(v2, d[2][2]));
+
+        lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(g, zero)), 
+                              _mm256_unpacklo_epi8(r, zero));
+        hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(g, zero)), 
+                              _mm256_unpackhi_epi8(r, zero));
+
+        if (xf->pair) {
+            lo = _mm256_srli_epi16(lo, 1);
+            hi = _mm256_srli_epi16(hi, 1);
+        } else if (xf->greydiv == 3) {
+            lo = _mm256_mulhi_epu16(lo, _mm256_set1_epi16(XFORMDIV3));
+            hi = _mm256_mulhi_epu16(hi, _mm256_set1_epi16(XFORMDIV3));
+        }
+        val = _mm256_packus_epi16(lo, hi);
+
+        v0 = _mm256_shuffle_epi8(val, rep[0]);
+        v1 = _mm256_shuffle_epi8(val, rep[1]);
+        v2 = _mm256_shuffle_epi8(val, rep[2]);
+
+        if (!xf->grey) {
+            v0 = _mm256_and_si256(v0, mask[0]);
+            v1 = _mm256_and_si256(v1, mask[1]);
+            v2 = _mm256_and_si256(v2, mask[2]);
+        }
+
+        _mm_storeu_si128((__m128i *)&row[3*j],    _mm256_castsi256_si128(v0));
+        _mm_storeu_si128((__m128i *)&row[3*j+16], _mm256_castsi256_si128(v1));
+        _mm_storeu_si128((__m128i *)&row[3*j+32], _mm256_castsi256_si128(v2));
+        _mm_storeu_si128((__m128i *)&row[3*j+48], _mm256_extracti128_si256(v0, 1));
+        _mm_storeu_si128((__m128i *)&row[3*j+64], _mm256_extracti128_si256(v1, 1));
+        _mm_storeu_si128((__m128i *)&row[3*j+80], _mm256_extracti128_si256(v2, 1));
+    }
+
+    CrossScalar(&row[3*j], width - j, xf);
+}
+
+// SSE2 channel stage kernel for BGRX pixels, 16 bytes (4 pixels) at a time, 
+// with the X bytes (zero in the mono mask) restored from the input
+__attribute__((target("sse2")))
+static void ChannelSse2Bgrx(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    const __m128i a = _mm_set1_epi16((short)xf->bright_a);
+    const __m128i c = _mm_set1_epi16((short)xf->bright_c);
+    const __m128i x = _mm_set1_epi32((int)0xff000000);
+    __m128i m, v;
+    uint32_t j;
+
+    m = _mm_loadu_si128((const __m128i *)&xf->monomask[0]);
+
+    for (j = 0; j + 16 <= len; j += 16) {
+        v = _mm_loadu_si128((__m128i *)&row[j]);
+        _mm_storeu_si128((__m128i *)&row[j], _mm_or_si128(ChannelVecSse2(v, xf, a, c, m), _mm_and_si128(v, x)));
+    }
+
+    ChannelScalar(&row[j], len - j, xf);
+}
+
+// AVX2 channel stage kernel for BGRX pixels, 32 bytes (8 pixels) at a time
+__attribute__((target("avx2")))
+static void ChannelAvx2Bgrx(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    const __m256i a = _mm256_set1_epi16((short)xf->bright_a);
+    const __m256i c = _mm256_set1_epi16((short)xf->bright_c);
+    const __m256i x = _mm256_set1_epi32((int)0xff000000);
+    __m256i m, v;
+    uint32_t j;
+
+    m = _mm256_loadu_si256((const __m256i *)&xf->monomask[0]);
+
+    for (j = 0; j + 32 <= len; j += 32) {
+        v = _mm256_loadu_si256((__m256i *)&row[j]);
+        _mm256_storeu_si256((__m256i *)&row[j], _mm256_or_si256(ChannelVecAvx2(v, xf, a, c, m), _mm256_and_si256(v, x)));
+    }
+
+    ChannelScalar(&row[j], len - j, xf);
+}
+
+// SSE2 cross channel stage kernel for BGRX pixels, 4 at a time. The colours are
+// summed within each 32 bit lane, and the average replicated back with shifts.
+__attribute__((target("sse2")))
+static void CrossSse2Bgrx(unsigned char *row, uint32_t width, const pxform_t xf)
+{
+    const __m128i low = _mm_set1_epi32(0xff);
+    const __m128i x   = _mm_set1_epi32((int)0xff000000);
+    __m128i m, v, val;
+    uint32_t j;
+
+    m = xf->grey ? _mm_set1_epi32(0x00ffffff) : _mm_loadu_si128((const __m128i *)&xf->monomask[0]);
+
+    for (j = 0; j + 4 <= width; j += 4) {
+        v   = _mm_loadu_si128((__m128i *)&row[4*j]);
+        val = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(v, low), _mm_and_si128(_mm_srli_epi32(v, 8), low)), 
+                            _mm_and_si128(_mm_srli_epi32(v, 16), low));
+
+        // Divide by 2 or 3, the sum being in the low 16 bits of each lane
+        if (xf->pair)
+            val = _mm_srli_epi32(val, 1);
+        else if (xf->greydiv == 3)
+            val = _mm_mulhi_epu16(val, _mm_set1_epi32(XFORMDIV3));
+
+        val = _mm_or_si128(_mm_or_si128(val, _mm_slli_epi32(val, 8)), _mm_slli_epi32(val, 16));
+
+        _mm_storeu_si128((__m128i *)&row[4*j], _mm_or_si128(_mm_and_si128(val, m), _mm_and_si128(v, x)));
+    }
+
+    CrossScalar(&row[4*j], width - j, xf);
+}
+
+// AVX2 cross channel stage kernel for BGRX pixels, 8 at a time
+__attribute__((target("avx2")))
+static void CrossAvx2Bgrx(unsigned char *row, uint32_t width, const pxform_t xf)
+{
+    const __m256i low = _mm256_set1_epi32(0xff);
+    const __m256i x   = _mm256_set1_epi32((int)0xff000000);
+    __m256i m, v, val;
+    uint32_t j;
+
+    m = xf->grey ? _mm256_set1_epi32(0x00ffffff) : _mm256_loadu_si256((const __m256i *)&xf->monomask[0]);
+
+    for (j = 0; j + 8 <= width; j += 8) {
+        v   = _mm256_loadu_si256((__m256i *)&row[4*j]);
+        val = _mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(v, low), _mm256_and_si256(_mm256_srli_epi32(v, 8), low)), 
+                               _mm256_and_si256(_mm256_srli_epi32(v, 16), low));
+
+        if (xf->pair)
+            val = _mm256_srli_epi32(val, 1);
+        else if (xf->greydiv == 3)
+            val = _mm256_mulhi_epu16(val, _mm256_set1_epi32(XFORMDIV3));
+
+        val = _mm256_or_si256(_mm256_or_si256(val, _mm256_slli_epi32(val, 8)), _mm256_slli_epi32(val, 16));
+
+        _mm256_storeu_si256((__m256i *)&row[4*j], _mm256_or_si256(_mm256_and_si256(val, m), _mm256_and_si256(v, x)));
+    }
+
+    CrossScalar(&row[4*j], width - j, xf);
+}
+
+// Stretch 16 bytes between the limits 'low' and 'high', with the multipliers of the
+// low and high 8 bytes in 'mlo' and 'mhi'. Unpacking under zeros gives each value 
+// times 256, and the high half of its product with the multiplier is the result.
+__attribute__((target("sse2")))
+static __m128i StretchVecSse2(__m128i v, __m128i low, __m128i high, __m128i mlo, __m128i mhi)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    v = _mm_subs_epu8(_mm_min_epu8(v, high), low);
+
+    return _mm_packus_epi16(_mm_mulhi_epu16(_mm_unpacklo_epi8(zero, v), mlo), 
+                            _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, v), mhi));
+}
+
+// SSE2 levels stage stretch kernel, 48 bytes (16 BGR or 12 BGRX pixels) at a time
+__attribute__((target("sse2")))
+static void StretchSse2(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    __m128i low[3], high[3], mlo[3], mhi[3];
+    uint32_t j, k;
+
+    for (k = 0; k < 3; k++) {
+        low[k]  = _mm_loadu_si128((const __m128i *)&xf->levlow[16*k]);
+        high[k] = _mm_loadu_si128((const __m128i *)&xf->levhigh[16*k]);
+        mlo[k]  = _mm_loadu_si128((const __m128i *)&xf->levmul[16*k]);
+        mhi[k]  = _mm_loadu_si128((const __m128i *)&xf->levmul[16*k+8]);
+    }
+
+    for (j = 0; j + 48 <= len; j += 48)
+        for (k = 0; k < 3; k++)
+            _mm_storeu_si128((__m128i *)&row[j+16*k], 
+                             StretchVecSse2(_mm_loadu_si128((__m128i *)&row[j+16*k]), low[k], high[k], mlo[k], mhi[k]));
+
+    LevelsScalar(&row[j], len - j, xf);
+}
+
+// Stretch 32 bytes, as for StretchVecSse2(). Unpacking is within 128 bit lanes, so 
+// 'mlo' holds the multipliers of bytes 0 to 7 and 16 to 23, and 'mhi' the rest.
+__attribute__((target("avx2")))
+static __m256i StretchVecAvx2(__m256i v, __m256i low, __m256i high, __m256i mlo, __m256i mhi)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    v = _mm256_subs_epu8(_mm256_min_epu8(v, high), low);
+
+    return _mm256_packus_epi16(_mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, v), mlo), 
+                               _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, v), mhi));
+}
+
+// AVX2 levels stage stretch kernel, 96 bytes (32 BGR or 24 BGRX pixels) at a time
+__attribute__((target("avx2")))
+static void StretchAvx2(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    __m256i low[3], high[3], mlo[3], mhi[3];
+    uint32_t j, k;
+
+    for (k = 0; k < 3; k++) {
+        low[k]  = _mm256_loadu_si256((const __m256i *)&xf->levlow[32*k]);
+        high[k] = _mm256_loadu_si256((const __m256i *)&xf->levhigh[32*k]);
+        mlo[k]  = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&xf->levmul[32*k])),
+                                          _mm_loadu_si128((const __m128i *)&xf->levmul[32*k+16]), 1);
+        mhi[k]  = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&xf->levmul[32*k+8])),
+                                          _mm_loadu_si128((const __m128i *)&xf->levmul[32*k+24]), 1);
+    }
+
+    for (j = 0; j + 96 <= len; j += 96)
+        for (k = 0; k < 3; k++)
+            _mm256_storeu_si256((__m256i *)&row[j+32*k], 
+                                StretchVecAvx2(_mm256_loadu_si256((__m256i *)&row[j+32*k]), low[k], high[k], mlo[k], mhi[k]));
+
+    LevelsScalar(&row[j], len - j, xf);
+}
+
+// Look up 16 bytes in the 256 entry table held as the sixteen 16 entry vectors 't'.
+// At step k, values from 16k to 16k+15 have been brought down to 0 to 15, and adding
+// 0x70 (saturating) leaves just them without the top bit set, which makes a byte
+// shuffle give zero, so each value picks up its entry at exactly one step. Bytes 
+// cleared in 'keep' are left unchanged (the X bytes of BGRX pixels).
+__attribute__((target("ssse3")))
+static __m128i LookupVecSsse3(__m128i v, const __m128i *t, __m128i keep)
+{
+    const __m128i bias = _mm_set1_epi8(0x70);
+    const __m128i step = _mm_set1_epi8(16);
+    __m128i x = v, r = _mm_setzero_si128();
+    uint32_t k;
+
+    for (k = 0; k < 16; k++) {
+        r = _mm_or_si128(r, _mm_shuffle_epi8(t[k], _mm_adds_epu8(x, bias)));
+        x = _mm_sub_epi8(x, step);
+    }
+
+    return _mm_or_si128(_mm_and_si128(r, keep), _mm_andnot_si128(keep, v));
+}
+
+// SSSE3 levels stage kernel for a table common to all colours, 48 bytes at a time
+__attribute__((target("ssse3")))
+static void LookupSsse3(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    const __m128i keep = _mm_set1_epi32((xf->pixbytes == 4) ? 0x00ffffff : -1);
+    __m128i t[16];
+    uint32_t j, k;
+
+    for (k = 0; k < 16; k++)
+        t[k] = _mm_loadu_si128((const __m128i *)&xf->levlut[0][16*k]);
+
+    for (j = 0; j + 48 <= len; j += 48)
+        for (k = 0; k < 3; k++)
+            _mm_storeu_si128((__m128i *)&row[j+16*k], LookupVecSsse3(_mm_loadu_si128((__m128i *)&row[j+16*k]), t, keep));
+
+    LevelsScalar(&row[j], len - j, xf);
+}
+
+// Look up 32 bytes, as for LookupVecSsse3(), with the table vectors in both lanes of 't'
+__attribute__((target("avx2")))
+static __m256i LookupVecAvx2(__m256i v, const __m256i *t, __m256i keep)
+{
+    const __m256i bias = _mm256_set1_epi8(0x70);
+    const __m256i step = _mm256_set1_epi8(16);
+    __m256i x = v, r = _mm256_setzero_si256();
+    uint32_t k;
+
+    for (k = 0; k < 16; k++) {
+        r = _mm256_or_si256(r, _mm256_shuffle_epi8(t[k], _mm256_adds_epu8(x, bias)));
+        x = _mm256_sub_epi8(x, step);
+    }
+
+    return _mm256_or_si256(_mm256_and_si256(r, keep), _mm256_andnot_si256(keep, v));
+}
+
+// AVX2 levels stage kernel for a table common to all colours, 96 bytes at a time
+__attribute__((target("avx2")))
+static void LookupAvx2(unsigned char *row, uint32_t len, const pxform_t xf)
+{
+    const __m256i keep = _mm256_set1_epi32((xf->pixbytes == 4) ? 0x00ffffff : -1);
+    __m256i t[16];
+    uint32_t j, k;
+
+    for (k = 0; k < 16; k++)
+        t[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&xf->levlut[0][16*k]));
+
+    for (j = 0; j + 96 <= len; j += 96)
+        for (k = 0; k < 3; k++)
+            _mm256_storeu_si256((__m256i *)&row[j+32*k], 
+                                LookupVecAvx2(_mm256_loadu_si256((__m256i *)&row[j+32*k]), t, keep));
+
+    LevelsScalar(&row[j], len - j, xf);
+}
+
+#endif
+
+//=============================================================
+// Resize kernels
+//
+// Resizing is separable, with each output pixel a weighted sum
+// of a few input pixels along each axis in turn (see BuildAxis()).
+// Weights are fixed point, summing to 1 << RSZWEIGHTBITS, and
+// rows filtered along the first (horizontal) axis are held as 16
+// bit values with RSZFRACBITS fraction bits, so that the second
+// (vertical) axis is a multiply and add of 16 bit values, the
+// same in the scalar and SIMD kernels. Downscaling a box filter
+// by whole numbers is done instead by summing each block of input
+// pixels, a row at a time, and dividing the sums once per output
+// pixel. Pixels are BGR or BGRX, with each byte filtered alike.
+//
+//=============================================================
+
+// Scalar vertical filter kernel, for bytes 'j' to 'len' of a row, from the 'taps'
+// horizontally filtered 'rows', with 'weights'
+static void VertScalar(unsigned char *out, const int16_t **rows, const int16_t *weights, uint32_t taps, 
+                       uint32_t j, uint32_t len)
+{
+    uint32_t t;
+    int32_t sum;
+
+    for (; j < len; j++) {
+        sum = 1 << (RSZWEIGHTBITS + RSZFRACBITS - 1);
+        for (t = 0; t < taps; t++)
+            sum += weights[t] * rows[t][j];
+
+        sum >>= RSZWEIGHTBITS + RSZFRACBITS;
+        out[j] = (unsigned char)((sum > 0xff) ? 0xff : sum);
+    }
+}
+
+// Scalar box sum kernel, adding 'len' bytes of 'row' to the sums in 'acc'
+static void BoxSumScalar(uint32_t *acc, const unsigned char *row, uint32_t j, uint32_t len)
+{
+    for (; j < len; j++)
+        acc[j] += row[j];
+}
+
+#ifdef X86SIMD
+
+// SSE2 vertical filter kernel, 8 bytes at a time. Pairs of rows are interleaved
+// so that each 32 bit lane sums the products of a byte from both rows.
+__attribute__((target("sse2")))
+static void VertSse2(unsigned char *out, const int16_t **rows, const int16_t *weights, uint32_t taps, 
+                     uint32_t j, uint32_t len)
+{
+    const __m128i round = _mm_set1_epi32(1 << (RSZWEIGHTBITS + RSZFRACBITS - 1));
+    const __m128i zero  = _mm_setzero_si128();
+    __m128i lo, hi, r0, r1, w;
+    uint32_t t;
+
+    for (; j + 8 <= len; j += 8) {
+        lo = round;
+        hi = round;
+
+        for (t = 0; t < taps; t += 2) {
+            r0 = _mm_loadu_si128((const __m128i *)&rows[t][j]);
+            r1 = (t + 1 < taps) ? _mm_loadu_si128((const __m128i *)&rows[t+1][j]) : zero;
+            w  = _mm_set1_epi32((int)(((uint32_t)(uint16_t)((t + 1 < taps) ? weights[t+1] : 0) << 16) | 
+                                      (uint16_t)weights[t]));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), w));
+        }
+
+        lo = _mm_packs_epi32(_mm_srai_epi32(lo, RSZWEIGHTBITS + RSZFRACBITS), _mm_srai_epi32(hi, RSZWEIGHTBITS + RSZFRACBITS));
+        _mm_storel_epi64((__m128i *)&out[j], _mm_packus_epi16(lo, lo));
+    }
+
+    VertScalar(out, rows, weights, taps, j, len);
+}
+
+// AVX2 vertical filter kernel, 16 bytes at a time. The packs work within each
+// 128 bit lane, so the two halves of the result are gathered at the end.
+__attribute__((target("avx2")))
+static void VertAvx2(unsigned char *out, const int16_t **rows, const int16_t *weights, uint32_t taps, 
+                     uint32_t j, uint32_t len)
+{
+    const __m256i round = _mm256_set1_epi32(1 << (RSZWEIGHTBITS + RSZFRACBITS - 1));
+    const __m256i zero  = _mm256_setzero_si256();
+    __m256i lo, hi, r0, r1, w;
+    uint32_t t;
+
+    for (; j + 16 <= len; j += 16) {
+        lo = round;
+        hi = round;
+
+        for (t = 0; t < taps; t += 2) {
+            r0 = _mm256_loadu_si256((const __m256i *)&rows[t][j]);
+            r1 = (t + 1 < taps) ? _mm256_loadu_si256((const __m256i *)&rows[t+1][j]) : zero;
+            w  = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)((t + 1 < taps) ? weights[t+1] : 0) << 16) | 
+                                         (uint16_t)weights[t]));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(r0, r1), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(r0, r1), w));
+        }
+
+        lo = _mm256_packs_epi32(_mm256_srai_epi32(lo, RSZWEIGHTBITS + RSZFRACBITS), 
+                                _mm256_srai_epi32(hi, RSZWEIGHTBITS + RSZFRACBITS));
+        lo = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, lo), 0x08);
+        _mm_storeu_si128((__m128i *)&out[j], _mm256_castsi256_si128(lo));
+    }
+
+    VertScalar(out, rows, weights, taps, j, len);
+}
+
+// SSE2 box sum kernel, 16 bytes at a time
+__attribute__((target("sse2")))
+static void BoxSumSse2(uint32_t *acc, const unsigned char *row, uint32_t j, uint32_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v, lo, hi;
+
+    for (; j + 16 <= len; j += 16) {
+        v  = _mm_loadu_si128((const __m128i *)&row[j]);
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *)&acc[j],    _mm_add_epi32(_mm_loadu_si128((__m128i *)&acc[j]),    _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128((__m128i *)&acc[j+4],  _mm_add_epi32(_mm_loadu_si128((__m128i *)&acc[j+4]),  _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128((__m128i *)&acc[j+8],  _mm_add_epi32(_mm_loadu_si128((__m128i *)&acc[j+8]),  _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128((__m128i *)&acc[j+12], _mm_add_epi32(_mm_loadu_si128((__m128i *)&acc[j+12]), _mm_unpackhi_epi16(hi, zero)));
+    }
+
+    BoxSumScalar(acc, row, j, len);
+}
+
+// AVX2 box sum kernel, 16 bytes at a time
+__attribute__((target("avx2")))
+static void BoxSumAvx2(uint32_t *acc, const unsigned char *row, uint32_t j, uint32_t len)
+{
+    __m256i lo, hi;
+
+    for (; j + 16 <= len; j += 16) {
+        lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&row[j]));
+        hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&row[j+8]));
+        _mm256_storeu_si256((__m256i *)&acc[j],   _mm256_add_epi32(_mm256_loadu_si256((__m256i *)&acc[j]),   lo));
+        _mm256_storeu_si256((__m256i *)&acc[j+8], _mm256_add_epi32(_mm256_loadu_si256((__m256i *)&acc[j+8]), hi));
+    }
+
+    BoxSumScalar(acc, row, j, len);
+}
+
+#endif
+
+//=============================================================
+// Convolution kernels
+//
+// A convolution filter is applied as a sum of separable terms
+// (see BuildConv()). Each input row, with its edge pixels
+// repeated either side, is filtered horizontally for each term,
+// with weights of CONVWEIGHTBITS fraction bits whose magnitudes
+// sum to one, giving 16 bit values of CONVFRACBITS fraction bits,
+// as for the resize kernels. The vertical pass sums the products
+// of the term's vertical weights and its horizontally filtered
+// rows, as 32 bit values, adding them (or their magnitudes) to
+// those of the terms before, with the last term's sums rounded
+// and clamped to bytes. The vertical weights' magnitudes are
+// limited so that no sum overflows, giving the same results in
+// the scalar and SIMD kernels. Pixels are BGR or BGRX, with each
+// byte filtered alike.
+//
+//=============================================================
+
+// Scalar horizontal convolution kernel, for bytes 'j' to 'len' of a row, from the
+// padded row 'in' (starting 'taps'/2 pixels to the left), with 'weights'
+static void ConvHorzScalar(int16_t *out, const unsigned char *in, const int16_t *weights, uint32_t taps, 
+                           uint32_t pixbytes, uint32_t j, uint32_t len)
+{
+    uint32_t t;
+    int32_t sum;
+
+    for (; j < len; j++) {
+        sum = 1 << (CONVWEIGHTBITS - CONVFRACBITS - 1);
+        for (t = 0; t < taps; t++)
+            sum += weights[t] * in[j + t*pixbytes];
+
+        out[j] = (int16_t)(sum >> (CONVWEIGHTBITS - CONVFRACBITS));
+    }
+}
+
+// Scalar vertical convolution kernel, for bytes 'j' to 'len' of a row, from the 'taps'
+// horizontally filtered 'rows', with 'weights'. The sums are added to those in 'acc'
+// (CONVADD), after taking their magnitude (CONVABS), and either stored in 'acc' or
+// (CONVPACK) shifted down by 'shift' bits and clamped to bytes in 'out'.
+static void ConvVertScalar(unsigned char *out, int32_t *acc, const int16_t **rows, const int16_t *weights, 
+                           uint32_t taps, uint32_t flags, uint32_t shift, uint32_t j, uint32_t len)
+{
+    uint32_t t;
+    int32_t sum;
+
+    for (; j < len; j++) {
+        sum = 0;
+        for (t = 0; t < taps; t++)
+            sum += weights[t] * rows[t][j];
+
+        if ((flags & CONVABS) && sum < 0)
+            sum = -sum;
+        if (flags & CONVADD)
+            sum += acc[j];
+
+        if (flags & CONVPACK) {
+            sum = (sum + (1 << (shift - 1))) >> shift;
+            out[j] = (unsigned char)((sum < 0) ? 0 : (sum > 0xff) ? 0xff : sum);
+        } else
+            acc[j] = sum;
+    }
+}
+
+#ifdef X86SIMD
+
+// SSE2 horizontal convolution kernel, 8 bytes at a time. Pairs of taps are interleaved
+// so that each 32 bit lane sums the products of a byte at both taps.
+__attribute__((target("sse2")))
+static void ConvHorzSse2(int16_t *out, const unsigned char *in, const int16_t *weights, uint32_t taps, 
+                         uint32_t pixbytes, uint32_t j, uint32_t len)
+{
+    const __m128i round = _mm_set1_epi32(1 << (CONVWEIGHTBITS - CONVFRACBITS - 1));
+    const __m128i zero  = _mm_setzero_si128();
+    __m128i lo, hi, p0, p1, w;
+    uint32_t t;
+
+    for (; j + 8 <= len; j += 8) {
+        lo = round;
+        hi = round;
+
+        for (t = 0; t < taps; t += 2) {
+            p0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&in[j + t*pixbytes]), zero);
+            p1 = (t + 1 < taps) ? _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&in[j + (t+1)*pixbytes]), zero) : zero;
+            w  = _mm_set1_epi32((int)(((uint32_t)(uint16_t)((t + 1 < taps) ? weights[t+1] : 0) << 16) | 
+                                      (uint16_t)weights[t]));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(p0, p1), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(p0, p1), w));
+        }
+
+        _mm_storeu_si128((__m128i *)&out[j], _mm_packs_epi32(_mm_srai_epi32(lo, CONVWEIGHTBITS - CONVFRACBITS), 
+                                                             _mm_srai_epi32(hi, CONVWEIGHTBITS - CONVFRACBITS)));
+    }
+
+    ConvHorzScalar(out, in, weights, taps, pixbytes, j, len);
+}
+
+// AVX2 horizontal convolution kernel, 16 bytes at a time. The unpacks and packs both
+// work within each 128 bit lane, so the results come out in order.
+__attribute__((target("avx2")))
+static void ConvHorzAvx2(int16_t *out, const unsigned char *in, const int16_t *weights, uint32_t taps, 
+                         uint32_t pixbytes, uint32_t j, uint32_t len)
+{
+    const __m256i round = _mm256_set1_epi32(1 << (CONVWEIGHTBITS - CONVFRACBITS - 1));
+    const __m256i zero  = _mm256_setzero_si256();
+    __m256i lo, hi, p0, p1, w;
+    uint32_t t;
+
+    for (; j + 16 <= len; j += 16) {
+        lo = round;
+        hi = round;
+
+        for (t = 0; t < taps; t += 2) {
+            p0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)&in[j + t*pixbytes]));
+            p1 = (t + 1 < taps) ? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)&in[j + (t+1)*pixbytes])) : zero;
+            w  = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)((t + 1 < taps) ? weights[t+1] : 0) << 16) | 
+                                         (uint16_t)weights[t]));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(p0, p1), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(p0, p1), w));
+        }
+
+        _mm256_storeu_si256((__m256i *)&out[j], _mm256_packs_epi32(_mm256_srai_epi32(lo, CONVWEIGHTBITS - CONVFRACBITS), 
+                                                                   _mm256_srai_epi32(hi, CONVWEIGHTBITS - CONVFRACBITS)));
+    }
+
+    ConvHorzScalar(out, in, weights, taps, pixbytes, j, len);
+}
+
+// SSE2 vertical convolution kernel, 8 bytes at a time, as for VertSse2(), with the
+// magnitudes taken as (x ^ s) - s, for 's' the sign of x
+__attribute__((target("sse2")))
+static void ConvVertSse2(unsigned char *out, int32_t *acc, const int16_t **rows, const int16_t *weights, 
+                         uint32_t taps, uint32_t flags, uint32_t shift, uint32_t j, uint32_t len)
+{
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    const __m128i count = _mm_cvtsi32_si128((int)shift);
+    const __m128i zero  = _mm_setzero_si128();
+    __m128i lo, hi, r0, r1, w, s;
+    uint32_t t;
+
+    for (; j + 8 <= len; j += 8) {
+        lo = zero;
+        hi = zero;
+
+        for (t = 0; t < taps; t += 2) {
+            r0 = _mm_loadu_si128((const __m128i *)&rows[t][j]);
+            r1 = (t + 1 < taps) ? _mm_loadu_si128((const __m128i *)&rows[t+1][j]) : zero;
+            w  = _mm_set1_epi32((int)(((uint32_t)(uint16_t)((t + 1 < taps) ? weights[t+1] : 0) << 16) | 
+                                      (uint16_t)weights[t]));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), w));
+        }
+
+        if (flags & CONVABS) {
+            s  = _mm_srai_epi32(lo, 31);
+            lo = _mm_sub_epi32(_mm_xor_si128(lo, s), s);
+            s  = _mm_srai_epi32(hi, 31);
+            hi = _mm_sub_epi32(_mm_xor_si128(hi, s), s);
+        }
+
+        if (flags & CONVADD) {
+            lo = _mm_add_epi32(lo, _mm_loadu_si128((const __m128i *)&acc[j]));
+            hi = _mm_add_epi32(hi, _mm_loadu_si128((const __m128i *)&acc[j+4]));
+        }
+
+        if (flags & CONVPACK) {
+            lo = _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(lo, round), count), _mm_sra_epi32(_mm_add_epi32(hi, round), count));
+            _mm_storel_epi64((__m128i *)&out[j], _mm_packus_epi16(lo, lo));
+        } else {
+            _mm_storeu_si128((__m128i *)&acc[j],   lo);
+            _mm_storeu_si128((__m128i *)&acc[j+4], hi);
+        }
+    }
+
+    ConvVertScalar(out, acc, rows, weights, taps, flags, shift, j, len);
+}
+
+// AVX2 vertical convolution kernel, 16 bytes at a time. The unpacks work within each
+// 128 bit lane, so the sums are put back in order before adding to 'acc', and the
+// packed results gathered at the end.
+__attribute__((target("avx2")))
+static void ConvVertAvx2(unsigned char *out, int32_t *acc, const int16_t **rows, const int16_t *weights, 
+                         uint32_t taps, uint32_t flags, uint32_t shift, uint32_t j, uint32_t len)
+{
+    const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+    const __m128i count = _mm_cvtsi32_si128((int)shift);
+    const __m256i zero  = _mm256_setzero_si256();
+    __m256i lo, hi, r0, r1, w, a0, a1;
+    uint32_t t;
+
+    for (; j + 16 <= len; j += 16) {
+        lo = zero;
+        hi = zero;
+
+        for (t = 0; t < taps; t += 2) {
+            r0 = _mm256_loadu_si256((const __m256i *)&rows[t][j]);
+            r1 = (t + 1 < taps) ? _mm256_loadu_si256((const __m256i *)&rows[t+1][j]) : zero;
+            w  = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)((t + 1 < taps) ? weights[t+1] : 0) << 16) | 
+                                         (uint16_t)weights[t]));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(r0, r1), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(r0, r1), w));
+        }
+
+        // Bytes 0 to 7, and 8 to 15
+        a0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+        a1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+
+        if (flags & CONVABS) {
+            a0 = _mm256_abs_epi32(a0);
+            a1 = _mm256_abs_epi32(a1);
+        }
+
+        if (flags & CONVADD) {
+            a0 = _mm256_add_epi32(a0, _mm256_loadu_si256((const __m256i *)&acc[j]));
+            a1 = _mm256_add_epi32(a1, _mm256_loadu_si256((const __m256i *)&acc[j+8]));
+        }
+
+        if (flags & CONVPACK) {
+            a0 = _mm256_packs_epi32(_mm256_sra_epi32(_mm256_add_epi32(a0, round), count), 
+                                    _mm256_sra_epi32(_mm256_add_epi32(a1, round), count));
+            a0 = _mm256_permute4x64_epi64(a0, 0xd8);
+            a0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(a0, a0), 0x08);
+            _mm_storeu_si128((__m128i *)&out[j], _mm256_castsi256_si128(a0));
+        } else {
+            _mm256_storeu_si256((__m256i *)&acc[j],   a0);
+            _mm256_storeu_si256((__m256i *)&acc[j+8], a1);
+        }
+    }
+
+    ConvVertScalar(out, acc, rows, weights, taps, flags, shift, j, len);
+}
+
+#endif
+
+//=============================================================
+// Rotate kernels
+//
+// An image is rotated a square tile at a time, each output pixel
+// of the tile being copied from its input pixel, at a fixed step
+// from one output column, and from one output row, to the next.
+// For rotations of 90 and 270 degrees, output rows are input
+// columns, and 4 byte pixels are transposed a 4 x 4 (SSE2) or
+// 8 x 8 (AVX2) block at a time in registers, from as many input
+// rows, with the blocks' columns reversed when the rotation takes
+// input columns from right to left.
+//
+//=============================================================
+
+// Scalar rotate kernel, copying a pixel at a time
+static void RotTileScalar(unsigned char *out, int32_t ostride, const unsigned char *in, int64_t dx, int64_t dy, 
+                          uint32_t pixbytes, uint32_t w, uint32_t h)
+{
+    const unsigned char *s;
+    unsigned char *o;
+    uint32_t x, y;
+
+    for (y = 0; y < h; y++, out += ostride, in += dy) {
+        s = in;
+        o = out;
+
+        switch (pixbytes) {
+        case 1:
+            for (x = 0; x < w; x++, s += dx)
+                o[x] = *s;
+            break;
+        case 2:
+            for (x = 0; x < w; x++, s += dx, o += 2)
+                memcpy(o, s, 2);
+            break;
+        case 3:
+            for (x = 0; x < w; x++, s += dx, o += 3) {
+                o[0] = s[0];
+                o[1] = s[1];
+                o[2] = s[2];
+            }
+            break;
+        default:
+            for (x = 0; x < w; x++, s += dx, o += 4)
+                memcpy(o, s, 4);
+            break;
+        }
+    }
+}
+
+#ifdef X86SIMD
+
+// SSE2 rotate kernel, for 4 byte pixels with 'dy' of 4 or -4 (rotations of 90 and
+// 270 degrees), transposing 4 x 4 blocks
+__attribute__((target("sse2")))
+static void RotTileSse2(unsigned char *out, int32_t ostride, const unsigned char *in, int64_t dx, int64_t dy, 
+                        uint32_t pixbytes, uint32_t w, uint32_t h)
+{
+    const unsigned char *s;
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3, c[4];
+    uint32_t x, y, m, rev = (dy < 0) ? 3 : 0;
+
+    for (y = 0; y + 4 <= h; y += 4) {
+        for (x = 0; x + 4 <= w; x += 4) {
+            s  = in + x*dx + (y + rev)*dy;
+            r0 = _mm_loadu_si128((const __m128i *)s);
+            r1 = _mm_loadu_si128((const __m128i *)(s + dx));
+            r2 = _mm_loadu_si128((const __m128i *)(s + 2*dx));
+            r3 = _mm_loadu_si128((const __m128i *)(s + 3*dx));
+
+            t0   = _mm_unpacklo_epi32(r0, r1);
+            t1   = _mm_unpacklo_epi32(r2, r3);
+            t2   = _mm_unpackhi_epi32(r0, r1);
+            t3   = _mm_unpackhi_epi32(r2, r3);
+            c[0] = _mm_unpacklo_epi64(t0, t1);
+            c[1] = _mm_unpackhi_epi64(t0, t1);
+            c[2] = _mm_unpacklo_epi64(t2, t3);
+            c[3] = _mm_unpackhi_epi64(t2, t3);
+
+            for (m = 0; m < 4; m++)
+                _mm_storeu_si128((__m128i *)(out + (int64_t)(y + m)*ostride + 4*x), c[m ^ rev]);
+        }
+
+        RotTileScalar(out + (int64_t)y*ostride + 4*x, ostride, in + x*dx + y*dy, dx, dy, pixbytes, w - x, 4);
+    }
+
+    RotTileScalar(out + (int64_t)y*ostride, ostride, in + y*dy, dx, dy, pixbytes, w, h - y);
+}
+
+// AVX2 rotate kernel, as for RotTileSse2(), transposing 8 x 8 blocks. The unpacks
+// work within each 128 bit lane, so the lanes' halves are gathered at the end.
+__attribute__((target("avx2")))
+static void RotTileAvx2(unsigned char *out, int32_t ostride, const unsigned char *in, int64_t dx, int64_t dy, 
+                        uint32_t pixbytes, uint32_t w, uint32_t h)
+{
+    const unsigned char *s;
+    __m256i r[8], t[8], c[8];
+    uint32_t x, y, k, m, rev = (dy < 0) ? 7 : 0;
+
+    for (y = 0; y + 8 <= h; y += 8) {
+        for (x = 0; x + 8 <= w; x += 8) {
+            s = in + x*dx + (y + rev)*dy;
+            for (k = 0; k < 8; k++)
+                r[k] = _mm256_loadu_si256((const __m256i *)(s + k*dx));
+
+            for (k = 0; k < 8; k += 2) {
+                t[k]   = _mm256_unpacklo_epi32(r[k], r[k+1]);
+                t[k+1] = _mm256_unpackhi_epi32(r[k], r[k+1]);
+            }
+            for (k = 0; k < 8; k += 4) {
+                r[k]   = _mm256_unpacklo_epi64(t[k],   t[k+2]);
+                r[k+1] = _mm256_unpackhi_epi64(t[k],   t[k+2]);
+                r[k+2] = _mm256_unpacklo_epi64(t[k+1], t[k+3]);
+                r[k+3] = _mm256_unpackhi_epi64(t[k+1], t[k+3]);
+            }
+            for (k = 0; k < 4; k++) {
+                c[k]   = _mm256_permute2x128_si256(r[k], r[k+4], 0x20);
+                c[k+4] = _mm256_permute2x128_si256(r[k], r[k+4], 0x31);
+            }
+
+            for (m = 0; m < 8; m++)
+                _mm256_storeu_si256((__m256i *)(out + (int64_t)(y + m)*ostride + 4*x), c[m ^ rev]);
+        }
+
+        RotTileSse2(out + (int64_t)y*ostride + 4*x, ostride, in + x*dx + y*dy, dx, dy, pixbytes, w - x, 8);
+    }
+
+    RotTileSse2(out + (int64_t)y*ostride, ostride, in + y*dy, dx, dy, pixbytes, w, h - y);
+}
+
+#endif
+
+//=============================================================
+// SelectResizeKernels()
+//
+// Selects, in 'rk', the resize kernels for SIMD kernel 'level'.
+//
+//=============================================================
+
+static void SelectResizeKernels(prszkern_t rk, uint32_t level)
+{
+    rk->vertfn   = VertScalar;
+    rk->boxsumfn = BoxSumScalar;
+
+#ifdef X86SIMD
+    if (level >= SIMD_SSE2) {
+        rk->vertfn   = (level >= SIMD_AVX2) ? VertAvx2   : VertSse2;
+        rk->boxsumfn = (level >= SIMD_AVX2) ? BoxSumAvx2 : BoxSumSse2;
+    }
+#else
+    (void)level;
+#endif
+}
+
+//=============================================================
+// SelectConvKernels()
+//
+// Selects, in 'cv', the convolution kernels for SIMD kernel 'level'.
+//
+//=============================================================
+
+static void SelectConvKernels(pconv_t cv, uint32_t level)
+{
+    cv->horzfn = ConvHorzScalar;
+    cv->vertfn = ConvVertScalar;
+
+#ifdef X86SIMD
+    if (level >= SIMD_SSE2) {
+        cv->horzfn = (level >= SIMD_AVX2) ? ConvHorzAvx2 : ConvHorzSse2;
+        cv->vertfn = (level >= SIMD_AVX2) ? ConvVertAvx2 : ConvVertSse2;
+    }
+#else
+    (void)level;
+#endif
+}
+
+//=============================================================
+// SelectRotateKernel()
+//
+// Returns the rotate kernel for SIMD kernel 'level', for 'pixbytes'
+// byte pixels rotated by 'angle' degrees.
+//
+//=============================================================
+
+static rotfn_t SelectRotateKernel(uint32_t level, uint32_t pixbytes, uint32_t angle)
+{
+#ifdef X86SIMD
+    if (pixbytes == 4 && (angle == 90 || angle == 270) && level >= SIMD_SSE2)
+        return (level >= SIMD_AVX2) ? RotTileAvx2 : RotTileSse2;
+#else
+    (void)level;
+    (void)pixbytes;
+    (void)angle;
+#endif
+
+    return RotTileScalar;
+}
+
+//=============================================================
+// RotateOrigin()
+//
+// Returns the input pixel for the first output pixel of image
+// 'rows' (bottom up, 'stride' bytes apart), of 'width' x 'height'
+// pixels of 'pixbytes' bytes, rotated clockwise by 'angle' degrees,
+// setting 'dx' and 'dy' to the input bytes from one output column,
+// and one output row, to the next.
+//
+//=============================================================
+
+static const unsigned char *RotateOrigin(const unsigned char *rows, int32_t stride, uint32_t width, uint32_t height, 
+                                         uint32_t pixbytes, uint32_t angle, int64_t *dx, int64_t *dy)
+{
+    const int64_t right = (int64_t)(width - 1) * pixbytes;
+    const int64_t top   = (int64_t)(height - 1) * stride;
+
+    switch (angle) {
+    case 90:
+        // Output rows are input columns, from the right
+        *dx = stride;
+        *dy = -(int64_t)pixbytes;
+        return rows + right;
+    case 180:
+        *dx = -(int64_t)pixbytes;
+        *dy = -(int64_t)stride;
+        return rows + top + right;
+    case 270:
+        // Output rows are input columns, from the left, with input rows from the top
+        *dx = -(int64_t)stride;
+        *dy = pixbytes;
+        return rows + top;
+    }
+
+    *dx = pixbytes;
+    *dy = stride;
+    return rows;
+}
+
+// Kernel level in use, or -1 if not yet determined
+static int simdlevel = -1;
+
+//=============================================================
+// GetSimdLevel()
+//
+// Returns the SIMD kernel level in use (SIMD_SCALAR, SIMD_SSE2,
+// SIMD_SSSE3 or SIMD_AVX2). On first call, this is the highest
+// level supported by the CPU.
+//
+//=============================================================
+
+uint32_t GetSimdLevel(void)
+{
+    if (simdlevel < 0) {
+        simdlevel = SIMD_SCALAR;
+#ifdef X86SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            simdlevel = SIMD_SSE2;
+        if (__builtin_cpu_supports("ssse3"))
+            simdlevel = SIMD_SSSE3;
+        if (__builtin_cpu_supports("avx2"))
+            simdlevel = SIMD_AVX2;
+#endif
+    }
+
+    return (uint32_t)simdlevel;
+}
+
+//=============================================================
+// SetSimdLevel()
+//
+// Limits the SIMD kernels used to 'level' or below (e.g. to
+// force the scalar kernels with SIMD_SCALAR). Levels beyond
+// those supported are reduced to the highest supported. Returns
+// the level in use. Not to be called whilst transforms are active.
+//
+//=============================================================
+
+uint32_t SetSimdLevel(uint32_t level)
+{
+    simdlevel = -1;
+
+    if (level < GetSimdLevel())
+        simdlevel = (int)level;
+
+    return (uint32_t)simdlevel;
+}
+
+//=============================================================
+// BuildXform()
+//
+// Precomputes, in 'xf', the parameters for TransformRow() from
+// the transform controls in 'control', and the levels adjustment
+// 'lv' (NULL for none, whatever the controls' 'levels'), for
+// pixels of 'pixbytes' bytes (3 or 4), selecting the kernels for
+// SIMD kernel 'level'.
+//
+//=============================================================
+
+static void BuildXform(pxform_t xf, const ptrans_t control, const bmplevels_t *lv, uint32_t level, uint32_t pixbytes)
+{
+    uint32_t j, chan, val;
+    int64_t con;
+
+    xf->pixbytes   = pixbytes;
+    xf->flipv      = control->flipv;
+    xf->levels     = (lv != NULL) ? lv->mode : 0;
+    xf->reverse    = control->reverse ? 0xff : 0x00;
+    xf->brightness = control->brightness;
+    xf->mono       = control->mono;
+    xf->grey       = control->grey;
+
+    // Two colour mono, and divisor for grey
+    xf->pair       = (control->mono & (control->mono - 1)) ? TRUE : FALSE;
+    xf->greydiv    = !control->mono ? 3 : xf->pair ? 2 : 1;
+
+    // Brightness, b, as 100a + c, with a capped at 256 (where anything non-zero saturates)
+    xf->bright_a   = control->brightness / 100;
+    xf->bright_c   = control->brightness % 100;
+    if (xf->bright_a > 256)
+        xf->bright_a = 256;
+
+    // Byte masks, repeating every three vectors (or every vector for BGRX), selecting the
+    // mono colours, and never an X byte
+    for (j = 0; j < sizeof(xf->monomask); j++)
+        xf->monomask[j] = (j % pixbytes == 3) ? 0x00 : 
+                          (!control->mono || (control->mono & chanmono[j % pixbytes])) ? 0xff : 0x00;
+
+    // Compile the channel operations into a table for each colour
+    for (chan = 0; chan < 3; chan++) {
+        for (j = 0; j < 256; j++) {
+            // Reverse video---simply invert all the bits
+            val = j ^ xf->reverse;
+
+            // Scale each colour value by a constant (%), clipping at maximum
+            if (control->brightness) {
+                val = (val * control->brightness)/100;
+                val = (val > 0xff) ? 0xff : val;
+            }
+
+            // Scale distance from mid range by a constant (50% = unchanged), clipping at both extremes
+            if (control->contrast) {
+                con = 0x80 + (((int64_t)val - 0x80) * control->contrast)/50;
+                val = (con < 0) ? 0 : (con > 0xff) ? 0xff : (uint32_t)con;
+            }
+
+            // Zero all unspecified mono colours
+            if (control->mono && !(control->mono & chanmono[chan]))
+                val = 0;
+
+            xf->lut[chan][j] = (unsigned char)val;
+        }
+    }
+
+    // Levels tables, with a stretch's made from its limits, exactly as its SIMD kernels
+    // compute it, and the limits and multipliers for each byte, as for the mono masks
+    // (X bytes being stretched from 0 to 255, so unchanged)
+    if (lv != NULL) {
+        for (chan = 0; chan < 3; chan++)
+            for (j = 0; j < 256; j++)
+                xf->levlut[chan][j] = (lv->mode == BMP_LEVELSSTRETCH) ? 
+                                      (unsigned char)StretchValue(j, lv->low[chan], lv->high[chan]) : lv->lut[chan][j];
+
+        for (j = 0; j < sizeof(xf->levlow); j++) {
+            chan           = j % pixbytes;
+            xf->levlow[j]  = (chan == 3 || lv->mode != BMP_LEVELSSTRETCH) ? 0x00 : (unsigned char)lv->low[chan];
+            xf->levhigh[j] = (chan == 3 || lv->mode != BMP_LEVELSSTRETCH) ? 0xff : (unsigned char)lv->high[chan];
+            xf->levmul[j]  = (uint16_t)StretchMul(xf->levlow[j], xf->levhigh[j]);
+        }
+    }
+
+    xf->channel = control->reverse || control->brightness || control->contrast || control->mono;
+    xf->cross   = control->grey    || xf->pair;
+
+    xf->levelsfn  = LevelsScalar;
+    xf->channelfn = ChannelScalar;
+    xf->crossfn   = CrossScalar;
+
+#ifdef X86SIMD
+    // A stretch is computed, whilst other levels tables are looked up if common to all colours
+    if (xf->levels == BMP_LEVELSSTRETCH && level >= SIMD_SSE2)
+        xf->levelsfn = (level >= SIMD_AVX2) ? StretchAvx2 : StretchSse2;
+    else if (xf->levels && level >= SIMD_SSSE3 && 
+             !memcmp(xf->levlut[0], xf->levlut[1], 256) && !memcmp(xf->levlut[0], xf->levlut[2], 256))
+        xf->levelsfn = (level >= SIMD_AVX2) ? LookupAvx2 : LookupSsse3;
+
+    // Contrast is only in the tables, and products beyond 32 bits (which wrap in the 
+    // scalar code) are left to them
+    if (pixbytes == 4) {
+        if (level >= SIMD_SSE2 && !control->contrast && control->brightness <= 0xffffffffU/0xff)
+            xf->channelfn = (level >= SIMD_AVX2) ? ChannelAvx2Bgrx : ChannelSse2Bgrx;
+
+        if (level >= SIMD_SSE2)
+            xf->crossfn   = (level >= SIMD_AVX2) ? CrossAvx2Bgrx : CrossSse2Bgrx;
+    } else {
+        if (level >= SIMD_SSE2 && !control->contrast && control->brightness <= 0xffffffffU/0xff)
+            xf->channelfn = (level >= SIMD_AVX2) ? ChannelAvx2 : ChannelSse2;
+
+        if (level >= SIMD_SSSE3)
+            xf->crossfn   = (level >= SIMD_AVX2) ? CrossAvx2 : CrossSsse3;
+    }
+#endif
+}
+
+//=============================================================
+// TransformRow()
+//
+// Performs the TransformBmp() transformations that are local
+// to a row (i.e. all but a flip about the horizontal axis) on
+// the 'width' 24 bit (or 32 bit BGRX) pixels of 'row', as
+// precomputed in 'xf'.
+//
+//=============================================================
+
+static void TransformRow(unsigned char *row, uint32_t width, const pxform_t xf)
+{
+    unsigned char tmp, quad[4];
+    uint32_t j, k;
+
+    // Flip vertically if requested, swapping whole 4 byte pixels
+    if (xf->flipv && xf->pixbytes == 4) {
+        for (j = 0, k = 4*(width-1); j < k; j += 4, k -= 4) {
+            memcpy(quad, &row[j], 4);
+            memcpy(&row[j], &row[k], 4);
+            memcpy(&row[k], quad, 4);
+        }
+    } else if (xf->flipv) {
+        for (j = 0, k = 3*(width-1); j < k; j += 3, k -= 3) {
+            tmp = row[j];   row[j]   = row[k];   row[k]   = tmp;
+            tmp = row[j+1]; row[j+1] = row[k+1]; row[k+1] = tmp;
+            tmp = row[j+2]; row[j+2] = row[k+2]; row[k+2] = tmp;
+        }
+    }
+
+    if (xf->levels)
+        xf->levelsfn(row, xf->pixbytes*width, xf);
+
+    if (xf->channel)
+        xf->channelfn(row, xf->pixbytes*width, xf);
+
+    if (xf->cross)
+        xf->crossfn(row, width, xf);
+}
+
+//=============================================================
+// RoundDiv()
+//
+// Returns 'n' divided by 'd' (positive), rounded to the nearest
+// whole number, with halves rounded away from zero.
+//
+//=============================================================
+
+static int64_t RoundDiv(int64_t n, int64_t d)
+{
+    return (n < 0) ? -((-n + d/2) / d) : (n + d/2) / d;
+}
+
+//=============================================================
+// BuildConv()
+//
+// Prepares, in 'cv', the filter 'f' for 'pixbytes' byte pixels,
+// using the kernels for SIMD kernel 'level', with the vertical
+// weights reversed if 'flip' is set (for rows taken from the
+// top down). Each term's horizontal weights are scaled so that
+// their magnitudes sum to one, with the scale moved into its
+// vertical weights. The vertical weights are given as many
+// fraction bits (up to CONVVERTBITS) as keep the sum of their
+// magnitudes, over all terms, within CONVMAXSUM. Returns
+// GOODSTATUS, or BADSTATUS with a message placed in 'e' (if not
+// NULL) if the weights are too large for that.
+//
+//=============================================================
+
+static int BuildConv(pconv_t cv, const bmpfilter_t *f, uint32_t level, uint32_t pixbytes, uint32_t flip, 
+                     const char *funcname, perrmsg_t e)
+{
+    int64_t hsum[BMP_MAXTERMS], w, sum, big;
+    int32_t vbits;
+    uint32_t t, k;
+
+    cv->pixbytes  = pixbytes;
+    cv->taps      = f->size;
+    cv->radius    = f->size / 2;
+    cv->nterms    = f->nterms;
+    cv->magnitude = f->magnitude ? TRUE : FALSE;
+
+    // Horizontal weights, with magnitudes summing to one
+    for (t = 0; t < f->nterms; t++) {
+        for (hsum[t] = 0, k = 0; k < f->size; k++)
+            hsum[t] += (f->h[t][k] < 0) ? -(int64_t)f->h[t][k] : f->h[t][k];
+        if (hsum[t] == 0)
+            hsum[t] = 1;
+
+        for (k = 0; k < f->size; k++)
+            cv->h[t][k] = (int16_t)RoundDiv((int64_t)f->h[t][k] * (1 << CONVWEIGHTBITS), hsum[t]);
+    }
+
+    // Vertical weights, with the most fraction bits that fit
+    for (vbits = CONVVERTBITS; vbits >= 0; vbits--) {
+        for (sum = 0, big = 0, t = 0; t < f->nterms; t++) {
+            for (k = 0; k < f->size; k++) {
+                w    = RoundDiv((int64_t)f->v[t][k] * hsum[t] * ((int64_t)1 << vbits), f->divisor[t]);
+                w    = (w < 0) ? -w : w;
+                sum += w;
+                big  = (w > big) ? w : big;
+            }
+        }
+
+        if (sum <= CONVMAXSUM && big <= 0x7fff)
+            break;
+    }
+
+    if (vbits < 0) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - convolution filter weights too large.\n", funcname);
+            e->errnum = TBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    for (t = 0; t < f->nterms; t++)
+        for (k = 0; k < f->size; k++)
+            cv->v[t][flip ? f->size - 1 - k : k] = 
+                (int16_t)RoundDiv((int64_t)f->v[t][k] * hsum[t] * ((int64_t)1 << vbits), f->divisor[t]);
+
+    cv->shift = CONVFRACBITS + vbits;
+
+    SelectConvKernels(cv, level);
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// MakeFilter()
+//
+// Sets 'f' to a convolution filter of type 'type' for use with
+// TransformBmp() (see trans_t), with parameter 'param':
+//
+//     BMP_CONVBLUR    : blur of radius 'param' pixels (1 to 7),
+//                       with the binomial approximation to a
+//                       Gaussian, so is separable
+//     BMP_CONVSHARPEN : unsharp mask, adding 'param' percent
+//                       (1 to 1000) of the difference between
+//                       the image and a radius 2 blur of it
+//     BMP_CONVEDGE    : Sobel edge detection, as the sum of the
+//                       magnitudes of the horizontal and vertical
+//                       gradients, each a quarter of the Sobel sum
+//                       ('param' is unused)
+//
+// Returns GOODSTATUS, or BADSTATUS with a message placed in 'e'
+// (if not NULL) for a bad type or parameter.
+//
+//=============================================================
+
+int MakeFilter(pbmpfilter_t f, uint32_t type, uint32_t param, perrmsg_t e)
+{
+    static const char *funcname = "MakeFilter()";
+    static const int32_t sobel[2][3] = {{1, 2, 1}, {-1, 0, 1}};
+
+    int32_t binomial[BMP_MAXKERNEL];
+    uint32_t size, radius, k, j;
+
+    memset(f, 0, sizeof(bmpfilter_t));
+
+    if (type != BMP_CONVBLUR && type != BMP_CONVSHARPEN && type != BMP_CONVEDGE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad filter type (%d).\n", funcname, type);
+            e->errnum = FBMP_ERR_BADTYPE;
+        }
+        return BADSTATUS;
+    }
+
+    if ((type == BMP_CONVBLUR && (param < 1 || param > BMP_MAXKERNEL/2)) || 
+        (type == BMP_CONVSHARPEN && (param < 1 || param > 1000))) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad filter parameter (%d).\n", funcname, param);
+            e->errnum = FBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    if (type == BMP_CONVEDGE) {
+        // Horizontal gradient smoothed vertically, and vertical gradient smoothed horizontally
+        f->size      = 3;
+        f->nterms    = 2;
+        f->magnitude = TRUE;
+        for (k = 0; k < 3; k++) {
+            f->h[0][k] = sobel[1][k];
+            f->v[0][k] = sobel[0][k];
+            f->h[1][k] = sobel[0][k];
+            f->v[1][k] = sobel[1][k];
+        }
+        f->divisor[0] = 4;
+        f->divisor[1] = 4;
+        return GOODSTATUS;
+    }
+
+    // Binomial coefficients for the blur (radius 2 for the unsharp mask), summing to 4^radius
+    radius = (type == BMP_CONVBLUR) ? param : 2;
+    size   = 2*radius + 1;
+    for (binomial[0] = 1, k = 1; k < size; k++)
+        for (binomial[k] = 0, j = k; j > 0; j--)
+            binomial[j] += binomial[j-1];
+
+    f->size   = size;
+    f->nterms = 1;
+    for (k = 0; k < size; k++) {
+        f->h[0][k] = binomial[k];
+        f->v[0][k] = binomial[k];
+    }
+    f->divisor[0] = 1 << (4*radius);
+
+    // Unsharp mask as (100 + param)% of the image, less param% of the blur
+    if (type == BMP_CONVSHARPEN) {
+        f->nterms = 2;
+        for (k = 0; k < size; k++)
+            f->v[1][k] = -(int32_t)param * binomial[k];
+        memcpy(f->h[1], f->h[0], sizeof(f->h[0]));
+        f->divisor[1] = 100 << (4*radius);
+
+        memset(f->h[0], 0, sizeof(f->h[0]));
+        memset(f->v[0], 0, sizeof(f->v[0]));
+        f->h[0][radius]  = 1;
+        f->v[0][radius]  = 100 + (int32_t)param;
+        f->divisor[0]    = 100;
+    }
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// MakeKernelFilter()
+//
+// Sets 'f' to a convolution filter (see MakeFilter()) for the
+// 'size' x 'size' kernel of coefficients 'k', given a row at a
+// time from the top row down, divided by 'divisor' (or, if zero,
+// by the sum of the coefficients, or one if that is zero). The
+// size must be odd, up to BMP_MAXKERNEL, with coefficients of at
+// most CONVMAXCOEFF in magnitude, and divisor at most CONVMAXDIV.
+// A kernel whose rows are all multiples of one row is separable,
+// so is made a single term, and is otherwise made a term for each
+// row. Returns GOODSTATUS, or BADSTATUS with a message placed in
+// 'e' (if not NULL).
+//
+//=============================================================
+
+int MakeKernelFilter(pbmpfilter_t f, const int32_t *k, uint32_t size, int32_t divisor, perrmsg_t e)
+{
+    static const char *funcname = "MakeKernelFilter()";
+
+    uint32_t i, j, p, q, separable;
+    int64_t sum = 0;
+
+    memset(f, 0, sizeof(bmpfilter_t));
+
+    if (size == 0 || !(size & 1) || size > BMP_MAXKERNEL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad kernel size (%d, odd up to %d).\n", funcname, size, 
+                     BMP_MAXKERNEL);
+            e->errnum = FBMP_ERR_BADSIZE;
+        }
+        return BADSTATUS;
+    }
+
+    // Pivot (p, q) is the largest coefficient
+    for (p = q = i = 0; i < size*size; i++) {
+        if (k[i] > CONVMAXCOEFF || k[i] < -CONVMAXCOEFF)
+            break;
+        if ((k[i] < 0 ? -k[i] : k[i]) > (k[p*size+q] < 0 ? -k[p*size+q] : k[p*size+q])) {
+            p = i / size;
+            q = i % size;
+        }
+        sum += k[i];
+    }
+
+    if (divisor == 0)
+        divisor = sum ? (int32_t)sum : 1;
+
+    if (i < size*size || divisor > CONVMAXDIV || divisor < -CONVMAXDIV) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad kernel coefficient or divisor (magnitudes up to %d and %d).\n", 
+                     funcname, CONVMAXCOEFF, CONVMAXDIV);
+            e->errnum = FBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    f->size = size;
+
+    // Separable if every row is a multiple of the pivot's row
+    for (separable = TRUE, i = 0; separable && i < size; i++)
+        for (j = 0; separable && j < size; j++)
+            separable = ((int64_t)k[i*size+j] * k[p*size+q] == (int64_t)k[i*size+q] * k[p*size+j]);
+
+    // Rows are given top down, and the vertical coefficients are bottom up. A divisor's
+    // sign is moved to the vertical coefficients.
+    if (separable && k[p*size+q] != 0) {
+        f->nterms = 1;
+        for (j = 0; j < size; j++) {
+            f->h[0][j]          = k[p*size+j];
+            f->v[0][size-1-j]   = (divisor < 0) ? -k[j*size+q] : k[j*size+q];
+        }
+        f->divisor[0] = (divisor < 0 ? -divisor : divisor) * (k[p*size+q] < 0 ? -k[p*size+q] : k[p*size+q]);
+        if (k[p*size+q] < 0)
+            for (j = 0; j < size; j++)
+                f->v[0][j] = -f->v[0][j];
+        return GOODSTATUS;
+    }
+
+    f->nterms = size;
+    for (i = 0; i < size; i++) {
+        for (j = 0; j < size; j++)
+            f->h[i][j] = k[i*size+j];
+        f->v[i][size-1-i] = (divisor < 0) ? -1 : 1;
+        f->divisor[i]     = (divisor < 0) ? -divisor : divisor;
+    }
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// MakeTestIndexed()
+//
+// Makes, in allocated memory, a 'width' x 'height' bitmap file
+// image of 'bpp' bits per pixel (4 or 8), for TransformSelfTest(),
+// with a colour table of unequal ramps and indices rising (with
+// fixed noise) across the image, so that each region has
+// different levels from the whole. The information header is
+// 'infosize' bytes, any beyond the first 40 being filled with
+// 0xff, ahead of the colour table. Returns NULL if no memory.
+//
+//=============================================================
+
+static unsigned char *MakeTestIndexed(uint32_t width, uint32_t height, uint32_t bpp, uint32_t infosize)
+{
+    uint32_t ncolours  = 1U << bpp;
+    uint32_t padrowlen = PadRowLen(width, bpp);
+    uint32_t offbits   = FORMATHDRSIZE + infosize + ncolours * sizeof(rgbquad_t);
+    uint32_t i, x, y, idx;
+    unsigned char *buf, *row;
+    pbmhdr_t hdr;
+    prgbquad_t r;
+
+    if ((buf = (unsigned char *)calloc(1, offbits + padrowlen * height)) == NULL)
+        return NULL;
+
+    hdr = (pbmhdr_t)buf;
+    hdr->f.bfType[0]  = 'B';
+    hdr->f.bfType[1]  = 'M';
+    hdr->f.bfOffBits  = offbits;
+    hdr->i.biSize     = infosize;
+    hdr->i.biWidth    = width;
+    hdr->i.biHeight   = height;
+    hdr->i.biPlanes   = 1;
+    hdr->i.biBitCount = bpp;
+    hdr->i.biClrUsed  = ncolours;
+    SetImageSizes(hdr, (uint64_t)padrowlen * height);
+    HDRENDIAN(hdr);
+
+    memset(&buf[HDRSIZE], 0xff, infosize - INFOHDRSIZE);
+
+    for (r = (prgbquad_t)&buf[FORMATHDRSIZE + infosize], i = 0; i < ncolours; i++) {
+        r[i].Blue  = (unsigned char)(40 + i * 150 / (ncolours - 1));
+        r[i].Green = (unsigned char)(i * 255 / (ncolours - 1));
+        r[i].Red   = (unsigned char)(200 - i * 120 / (ncolours - 1));
+    }
+
+    for (row = &buf[offbits], y = 0; y < height; y++, row += padrowlen)
+        for (x = 0; x < width; x++) {
+            idx = ((x + y) * ncolours / (width + height) + (x * 7 + y * 5) % 3) % ncolours;
+            if (bpp == BYTEWIDTH)
+                row[x] = (unsigned char)idx;
+            else
+                row[x/2] |= (unsigned char)(idx << ((x & 1) ? 0 : 4));
+        }
+
+    return buf;
+}
+
+//=============================================================
+// TestPalettedRegions()
+//
+// Checks, for TransformSelfTest(), that clipped regions of 4 and 8
+// bit images transformed in their colour table by
+// TransformRegion() look the same as when expanded to 24 bits
+// first, for levels and flips. The 8 bit image is also checked
+// with a V4 information header (so its colour table is after the
+// 108 byte header) against the expansion of the 40 byte header
+// version, as is its own expansion. Returns GOODSTATUS if they match,
+// else BADSTATUS with details of the first mismatch placed in 'e'
+// (if not NULL).
+//
+//=============================================================
+
+static int TestPalettedRegions(perrmsg_t e)
+{
+    static const char *funcname = "TransformSelfTest()";
+    static const uint32_t bpps[3]  = {4, 8, 8};
+    static const uint32_t infos[3] = {INFOHDRSIZE, INFOHDRSIZE, V4HDRSIZE};
+    static const uint32_t modes[2] = {BMP_LEVELSSTRETCH, BMP_LEVELSEQUALIZE};
+
+    unsigned char *pal, *full, *check;
+    const unsigned char *irow, *frow;
+    uint64_t bufsize, checksize, fullsize;
+    uint32_t b, m, f, x, y, idx, ncolours, width = 64, height = 48;
+    rect_t rect = {8, 40, 30, 4};
+    bmview_t iview, fview;
+    bmhdr_t hdr;
+    trans_t control;
+
+    for (b = 0; b < 3; b++)
+        for (m = 0; m < 2; m++)
+            for (f = 0; f < 4; f++) {
+                memset(&control, 0, sizeof(trans_t));
+                control.levels    = modes[m];
+                control.levelclip = 50;
+                control.flipv     = f & 1;
+                control.fliph     = f >> 1;
+
+                full  = NULL;
+                check = NULL;
+                if ((pal = MakeTestIndexed(width, height, bpps[b], INFOHDRSIZE)) == NULL) {
+                    if (e != NULL) {
+                        snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                        e->errnum = TBMP_ERR_MEM;
+                    }
+                    return BADSTATUS;
+                }
+
+                if ((fullsize = ConvertBmpFormat(&full, &bufsize, (pbmhdr_t)pal, (prgbquad_t)&pal[HDRSIZE], 
+                                                 &pal[SWPEND32(((pbmhdr_t)pal)->f.bfOffBits)], BMP_FMT24, e)) == 0) {
+                    free(pal);
+                    return BADSTATUS;
+                }
+
+                // Swap in the same image with a larger information header, and check its expansion
+                if (infos[b] != INFOHDRSIZE) {
+                    free(pal);
+                    if ((pal = MakeTestIndexed(width, height, bpps[b], infos[b])) == NULL) {
+                        if (e != NULL) {
+                            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                            e->errnum = TBMP_ERR_MEM;
+                        }
+                        free(full);
+                        return BADSTATUS;
+                    }
+
+                    hdr = *(pbmhdr_t)pal;
+                    HDRENDIAN(&hdr);
+                    if ((checksize = ConvertBmpFormat(&check, &bufsize, (pbmhdr_t)pal, 
+                                                      (prgbquad_t)&pal[ColourTable(&hdr, &ncolours)], 
+                                                      &pal[hdr.f.bfOffBits], BMP_FMT24, e)) == 0) {
+                        free(pal);
+                        free(full);
+                        return BADSTATUS;
+                    }
+
+                    if (checksize != fullsize || memcmp(check + HDRSIZE, full + HDRSIZE, (size_t)fullsize - HDRSIZE)) {
+                        if (e != NULL) {
+                            snprintf(e->errbuf, e->errsize, "***Error: %s - %d bit image with a %d byte information "
+                                     "header expands differently.\n", funcname, bpps[b], infos[b]);
+                            e->errnum = TBMP_ERR_SELFTEST;
+                        }
+                        free(pal);
+                        free(full);
+                        free(check);
+                        return BADSTATUS;
+                    }
+                    free(check);
+                }
+
+                if (TransformRegion(pal, &rect, &iview, &control, e) == BADSTATUS ||
+                    TransformRegion(full, &rect, &fview, &control, e) == BADSTATUS) {
+                    free(pal);
+                    free(full);
+                    return BADSTATUS;
+                }
+
+                for (y = 0; y < (uint32_t)iview.hdr.i.biHeight; y++) {
+                    irow = iview.rows + (int64_t)y * iview.stride;
+                    frow = fview.rows + (int64_t)y * fview.stride;
+
+                    for (x = 0; x < iview.hdr.i.biWidth; x++) {
+                        idx = (bpps[b] == BYTEWIDTH) ? irow[x] : (irow[x/2] >> ((x & 1) ? 0 : 4)) & 0xf;
+                        if (iview.pal[idx].Blue != frow[3*x] || iview.pal[idx].Green != frow[3*x+1] || 
+                            iview.pal[idx].Red  != frow[3*x+2])
+                            break;
+                    }
+
+                    if (x < iview.hdr.i.biWidth) {
+                        if (e != NULL) {
+                            snprintf(e->errbuf, e->errsize, "***Error: %s - %d bit paletted region mismatch at pixel %d %d "
+                                     "(header %d, levels %d, flips %d %d).\n", funcname, bpps[b], x, y, infos[b], modes[m], 
+                                     control.flipv, control.fliph);
+                            e->errnum = TBMP_ERR_SELFTEST;
+                        }
+                        free(pal);
+                        free(full);
+                        return BADSTATUS;
+                    }
+                }
+
+                free(pal);
+                free(full);
+            }
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// TransformSelfTest()
+//
+// Checks the SIMD transform kernels supported by the CPU give
+// identical results to the scalar kernels, for 'iterations'
+// random rows, of 24 or 32 bit pixels, and transform controls
+// and levels adjustments (seeded from 'seed'). The resize and convolution kernels are
+// checked likewise, with random filter weights and rows, as are
+// the rotate kernels, with random tiles. Clipped regions of 4 and
+// 8 bit images (including one with a V4 header) transformed in
+// their colour table are then checked against the same made from
+// the 24 bit expansion.
+// Returns GOODSTATUS if all match, else BADSTATUS with details
+// of the first mismatch placed in 'e' (if not NULL).
+//
+//=============================================================
+
+int TransformSelfTest(uint32_t seed, uint32_t iterations, perrmsg_t e)
+{
+    static const char *funcname = "TransformSelfTest()";
+    static const uint32_t monos[7] = {MONOALL, MONORED, MONOGREEN, MONOBLUE, 
+                                      MONORED | MONOGREEN, MONOBLUE | MONOGREEN, MONORED | MONOBLUE};
+
+    unsigned char in[4*TESTROWPIXELS], ref[4*TESTROWPIXELS], row[4*TESTROWPIXELS];
+    int16_t hrows[TESTTAPS][4*TESTROWPIXELS], weights[TESTTAPS];
+    const int16_t *rows[TESTTAPS];
+    uint32_t refsums[4*TESTROWPIXELS], sums[4*TESTROWPIXELS];
+    unsigned char rotin[4*TESTROTPIXELS*TESTROTPIXELS];
+    unsigned char rotref[4*TESTROTPIXELS*TESTROTPIXELS], rotout[4*TESTROTPIXELS*TESTROTPIXELS];
+    unsigned char convin[4*TESTROWPIXELS + 4*BMP_MAXKERNEL];
+    int16_t convrows[BMP_MAXKERNEL][4*TESTROWPIXELS], convref[4*TESTROWPIXELS], convout[4*TESTROWPIXELS];
+    int16_t convh[BMP_MAXKERNEL], convv[BMP_MAXKERNEL];
+    const int16_t *convtaps[BMP_MAXKERNEL];
+    int32_t accin[4*TESTROWPIXELS], accref[4*TESTROWPIXELS], acc[4*TESTROWPIXELS];
+    const unsigned char *origin;
+    int64_t dx, dy;
+    trans_t control;
+    bmplevels_t lv;
+    xform_t xf;
+    rszkern_t rk;
+    conv_t cv;
+    uint32_t it, level, width, pixbytes, len, j, t, taps, left, tw, th, angle, flags, shift, lvmode;
+
+    srand(seed);
+
+    for (it = 0; it < iterations; it++) {
+        memset(&control, 0, sizeof(control));
+        control.reverse    = rand() & 1;
+        control.grey       = rand() & 1;
+        control.flipv      = rand() & 1;
+        control.mono       = monos[rand() % 7];
+        control.brightness = (rand() & 1) ? 0 : (rand() & 3) ? (uint32_t)(rand() % 400) : (uint32_t)rand();
+        control.contrast   = (rand() & 3) ? 0 : (uint32_t)(rand() % 101);
+
+        // Random levels: none, a stretch, a table common to all colours, or a table for each
+        lvmode = (uint32_t)rand() & 3;
+        lv.mode = (lvmode == 1) ? BMP_LEVELSSTRETCH : BMP_LEVELSEQUALIZE;
+        for (t = 0; t < 3; t++) {
+            lv.low[t]  = (uint32_t)rand() % 255;
+            lv.high[t] = lv.low[t] + 1 + (uint32_t)rand() % (255 - lv.low[t]);
+            for (j = 0; j < 256; j++)
+                lv.lut[t][j] = (lvmode == 2 && t) ? lv.lut[0][j] : (unsigned char)rand();
+        }
+
+        // Random widths, including those with partial vectors, of BGR or BGRX pixels
+        width    = 1 + rand() % TESTROWPIXELS;
+        pixbytes = 3 + (rand() & 1);
+        len      = pixbytes*width;
+
+        for (j = 0; j < len; j++)
+            in[j] = (unsigned char)rand();
+
+        // Reference result from the scalar kernels
+        memcpy(ref, in, len);
+        BuildXform(&xf, &control, lvmode ? &lv : NULL, SIMD_SCALAR, pixbytes);
+        TransformRow(ref, width, &xf);
+
+        for (level = SIMD_SSE2; level <= GetSimdLevel(); level++) {
+            memcpy(row, in, len);
+            BuildXform(&xf, &control, lvmode ? &lv : NULL, level, pixbytes);
+            TransformRow(row, width, &xf);
+
+            for (j = 0; j < len; j++) {
+                if (row[j] != ref[j]) {
+                    if (e != NULL) {
+                        snprintf(e->errbuf, e->errsize, 
+                                 "***Error: %s - SIMD level %d mismatch at byte %d of %d (%d byte pixels, levels %d rev %d bright %d con %d mono %d grey %d).\n",
+                                 funcname, level, j, len, pixbytes, lvmode, control.reverse, control.brightness, 
+                                 control.contrast, control.mono, control.grey);
+                        e->errnum = TBMP_ERR_SELFTEST;
+                    }
+                    return BADSTATUS;
+                }
+            }
+        }
+
+        // Resize kernels, for weights summing to one and filtered values of 0 to 255
+        taps = 1 + rand() % TESTTAPS;
+        for (left = 1 << RSZWEIGHTBITS, t = 0; t < taps; t++) {
+            weights[t] = (int16_t)((t == taps - 1) ? left : (uint32_t)rand() % (left + 1));
+            left      -= weights[t];
+            rows[t]    = hrows[t];
+            for (j = 0; j < len; j++)
+                hrows[t][j] = (int16_t)(rand() % ((0xff << RSZFRACBITS) + 1));
+        }
+
+        for (j = 0; j < len; j++)
+            refsums[j] = (uint32_t)rand() << 8;
+
+        VertScalar(ref, rows, weights, taps, 0, len);
+        memcpy(sums, refsums, len * sizeof(uint32_t));
+        BoxSumScalar(refsums, in, 0, len);
+
+        for (level = SIMD_SSE2; level <= GetSimdLevel(); level++) {
+            SelectResizeKernels(&rk, level);
+            rk.vertfn(row, rows, weights, taps, 0, len);
+            rk.boxsumfn(sums, in, 0, len);
+
+            for (j = 0; j < len && row[j] == ref[j] && sums[j] == refsums[j]; j++)
+                ;
+
+            if (j < len) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - SIMD level %d resize mismatch at byte %d of %d (%d taps).\n",
+                             funcname, level, j, len, taps);
+                    e->errnum = TBMP_ERR_SELFTEST;
+                }
+                return BADSTATUS;
+            }
+
+            // Each level adds to the sums again
+            for (j = 0; j < len; j++)
+                sums[j] -= in[j];
+        }
+
+        // Convolution kernels, with weight magnitudes summing to no more than one horizontally
+        // (of filtered values within the bounds that gives), and half CONVMAXSUM vertically,
+        // with sums so far of up to the other half
+        taps  = 1 + 2 * (rand() % (BMP_MAXKERNEL/2 + 1));
+        flags = rand() & (CONVADD | CONVABS | CONVPACK);
+        shift = CONVFRACBITS + rand() % (CONVVERTBITS + 1);
+
+        for (j = 0; j < len + (taps-1)*pixbytes; j++)
+            convin[j] = (unsigned char)rand();
+
+        for (left = 1 << CONVWEIGHTBITS, t = 0; t < taps; t++) {
+            convh[t] = (int16_t)((uint32_t)rand() % (left + 1));
+            left    -= convh[t];
+            convh[t] = (rand() & 1) ? -convh[t] : convh[t];
+        }
+
+        ConvHorzScalar(convref, convin, convh, taps, pixbytes, 0, len);
+
+        for (left = CONVMAXSUM/2, t = 0; t < taps; t++) {
+            convv[t]    = (int16_t)((uint32_t)rand() % (((left < 0x7fff) ? left : 0x7fff) + 1));
+            left       -= convv[t];
+            convv[t]    = (rand() & 1) ? -convv[t] : convv[t];
+            convtaps[t] = convrows[t];
+            for (j = 0; j < len; j++)
+                convrows[t][j] = (int16_t)(rand() % (2*(0xff << CONVFRACBITS) + 1) - (0xff << CONVFRACBITS));
+        }
+
+        for (j = 0; j < len; j++)
+            accin[j] = (int32_t)(((int64_t)rand() * rand()) % ((int64_t)(CONVMAXSUM/2) * (0xff << CONVFRACBITS)));
+
+        memcpy(accref, accin, len * sizeof(int32_t));
+        ConvVertScalar(ref, accref, convtaps, convv, taps, flags, shift, 0, len);
+
+        for (level = SIMD_SSE2; level <= GetSimdLevel(); level++) {
+            SelectConvKernels(&cv, level);
+            cv.horzfn(convout, convin, convh, taps, pixbytes, 0, len);
+
+            for (j = 0; j < len && convout[j] == convref[j]; j++)
+                ;
+
+            if (j == len) {
+                memcpy(acc, accin, len * sizeof(int32_t));
+                cv.vertfn(row, acc, convtaps, convv, taps, flags, shift, 0, len);
+
+                for (j = 0; j < len && ((flags & CONVPACK) ? row[j] == ref[j] : acc[j] == accref[j]); j++)
+                    ;
+            }
+
+            if (j < len) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - SIMD level %d convolution mismatch at byte %d of %d (%d taps, flags %d).\n",
+                             funcname, level, j, len, taps, flags);
+                    e->errnum = TBMP_ERR_SELFTEST;
+                }
+                return BADSTATUS;
+            }
+        }
+
+        // Rotate kernels, for a tile of 4 byte pixels turned 90 or 270 degrees, from an
+        // input 'th' pixels wide and 'tw' high
+        tw    = 1 + rand() % TESTROTPIXELS;
+        th    = 1 + rand() % TESTROTPIXELS;
+        angle = (rand() & 1) ? 90 : 270;
+
+        for (j = 0; j < sizeof(rotin); j++)
+            rotin[j] = (unsigned char)rand();
+
+        origin = RotateOrigin(rotin, 4*TESTROTPIXELS, th, tw, 4, angle, &dx, &dy);
+        RotTileScalar(rotref, 4*TESTROTPIXELS, origin, dx, dy, 4, tw, th);
+
+        for (level = SIMD_SSE2; level <= GetSimdLevel(); level++) {
+            memset(rotout, 0, sizeof(rotout));
+            SelectRotateKernel(level, 4, angle)(rotout, 4*TESTROTPIXELS, origin, dx, dy, 4, tw, th);
+
+            for (j = 0; j < th && !memcmp(&rotout[4*TESTROTPIXELS*j], &rotref[4*TESTROTPIXELS*j], 4*tw); j++)
+                ;
+
+            if (j < th) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - SIMD level %d rotate mismatch in row %d of %d x %d tile (%d degrees).\n",
+                             funcname, level, j, tw, th, angle);
+                    e->errnum = TBMP_ERR_SELFTEST;
+                }
+                return BADSTATUS;
+            }
+        }
+    }
+
+    return TestPalettedRegions(e);
+}
+
+//=============================================================
+// RunThreads()
+//
+// Runs 'fn' on each of the 'nthreads' argument blocks, of size
+// 'argsize', in the array 'args', in parallel. The calling thread
+// runs the first, and any that can't be given a thread of their
+// own. Returns when all have completed.
+//
+//=============================================================
+
+static void RunThreads(uint32_t nthreads, void *(*fn)(void *), void *args, size_t argsize)
+{
+#ifndef WIN32
+    pthread_t stacktids[STACKTHREADS], *tids = stacktids;
+    unsigned char stackstarted[STACKTHREADS], *started = stackstarted;
+#endif
+    uint32_t i;
+
+#ifndef WIN32
+    // Thread ids kept on the stack, unless there are too many threads
+    if (nthreads > STACKTHREADS && (tids = (pthread_t *)malloc(nthreads * (sizeof(pthread_t) + 1))) != NULL)
+        started = (unsigned char *)&tids[nthreads];
+
+    if (nthreads > 1 && tids != NULL) {
+
+        for (i = 1; i < nthreads; i++)
+            started[i] = (pthread_create(&tids[i], NULL, fn, (char *)args + i * argsize) == 0);
+
+        fn(args);
+
+        for (i = 1; i < nthreads; i++) {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            else
+                fn((char *)args + i * argsize);
+        }
+
+        if (tids != stacktids)
+            free(tids);
+        return;
+    }
+#endif
+
+    // Single threaded
+    for (i = 0; i < nthreads; i++)
+        fn((char *)args + i * argsize);
+}
+
+//=============================================================
+// Image statistics
+//
+// Statistics are gathered as histograms of each channel, and of
+// the luma, with each thread counting the rows it finishes, whilst
+// they are still in the cache, into its own bins, so that threads
+// never contend for a bin. The threads' bins are merged once they
+// are all done, and the other statistics found from the merged
+// histograms, a fixed amount of work whatever the image size.
+//
+//=============================================================
+
+// Counts the 'width' 24 bit (or 32 bit BGRX) pixels of 'row' into the histograms 'h',
+// alternate pixels into alternate copies. Each pixel's colours are loaded before any bin is
+// incremented, as the bins might otherwise (for all the compiler knows) alias them.
+static void CountRow(pstathist_t h, const unsigned char *row, uint32_t width, uint32_t pixbytes)
+{
+    uint32_t b0, g0, r0, b1, g1, r1;
+    uint32_t j;
+
+    for (j = 0; j + 1 < width; j += 2, row += 2 * pixbytes) {
+        b0 = row[0];
+        g0 = row[1];
+        r0 = row[2];
+        b1 = row[pixbytes];
+        g1 = row[pixbytes+1];
+        r1 = row[pixbytes+2];
+
+        h->bins[0][BMP_STATBLUE][b0]++;
+        h->bins[0][BMP_STATGREEN][g0]++;
+        h->bins[0][BMP_STATRED][r0]++;
+        h->bins[0][BMP_STATLUMA][(77 * r0 + 150 * g0 + 29 * b0 + 128) >> 8]++;
+
+        h->bins[1][BMP_STATBLUE][b1]++;
+        h->bins[1][BMP_STATGREEN][g1]++;
+        h->bins[1][BMP_STATRED][r1]++;
+        h->bins[1][BMP_STATLUMA][(77 * r1 + 150 * g1 + 29 * b1 + 128) >> 8]++;
+    }
+
+    if (j < width) {
+        h->bins[0][BMP_STATBLUE][row[0]]++;
+        h->bins[0][BMP_STATGREEN][row[1]]++;
+        h->bins[0][BMP_STATRED][row[2]]++;
+        h->bins[0][BMP_STATLUMA][LUMA(row)]++;
+    }
+}
+
+// Returns the square root of 'n', rounded to the nearest whole number
+static uint64_t SqrtU64(uint64_t n)
+{
+    uint64_t root = 0, bit = (uint64_t)1 << 62;
+
+    while (bit > n)
+        bit >>= 2;
+
+    for (; bit; bit >>= 2) {
+        if (n >= root + bit) {
+            n   -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+
+    // What's left of n is n - root*root, which is over root only when the root is nearer the next
+    return (n > root) ? root + 1 : root;
+}
+
+// Merges the 'n' threads' histograms 'hists' into 'stats', and finds the other statistics
+// from them
+static void MergeStats(pbmpstats_t stats, const stathist_t *hists, uint32_t n)
+{
+    uint64_t sum, var, frac;
+    uint32_t i, k, c, v;
+    int64_t d;
+
+    memset(stats, 0, sizeof(bmpstats_t));
+
+    for (i = 0; i < n; i++)
+        for (k = 0; k < 2; k++)
+            for (c = 0; c < BMP_STATCHANS; c++)
+                for (v = 0; v < 256; v++)
+                    stats->hist[c][v] += hists[i].bins[k][c][v];
+
+    for (v = 0; v < 256; v++)
+        stats->pixels += stats->hist[BMP_STATBLUE][v];
+
+    if (stats->pixels == 0)
+        return;
+
+    for (c = 0; c < BMP_STATCHANS; c++) {
+        for (v = 0; stats->hist[c][v] == 0; v++)
+            ;
+        stats->min[c] = v;
+
+        for (v = 255; stats->hist[c][v] == 0; v--)
+            ;
+        stats->max[c] = v;
+
+        for (sum = 0, v = 0; v < 256; v++)
+            sum += stats->hist[c][v] * v;
+        stats->mean[c] = (uint32_t)((sum * 100 + stats->pixels / 2) / stats->pixels);
+
+        // Variance (in ten thousandths) as the squared differences from the mean, each weighted
+        // by the fraction of the pixels having that value (with 24 fraction bits), so that
+        // nothing overflows for any size of image
+        for (var = 0, v = 0; v < 256; v++) {
+            frac = ((stats->hist[c][v] << 24) + stats->pixels / 2) / stats->pixels;
+            d    = (int64_t)v * 100 - stats->mean[c];
+            var += (uint64_t)(d * d) * frac;
+        }
+        stats->stddev[c] = (uint32_t)SqrtU64((var + (1 << 23)) >> 24);
+    }
+}
+
+//=============================================================
+// StatsBand()
+//
+// GetViewStats() worker thread, counting the band of rows
+// described by 'arg' (a pstatband_t) into its histograms.
+//
+//=============================================================
+
+static void *StatsBand(void *arg)
+{
+    pstatband_t band = (pstatband_t)arg;
+    const unsigned char *row;
+    uint32_t i;
+
+    for (i = band->first; i < band->last; i++) {
+        row = band->rows + (int64_t)i * band->stride;
+
+        if (band->lut != NULL) {
+            ConvertRow(band->rowbuf, row, band->width, (pcvtlut_t)band->lut);
+            row = band->rowbuf;
+        }
+
+        CountRow(band->hist, row, band->width, band->pixbytes);
+    }
+
+    return NULL;
+}
+
+//=============================================================
+// TransformBand()
+//
+// TransformBmp() worker thread, transforming the band of rows
+// described by 'arg' (a pxfband_t). When out of place, each row
+// is copied from the source just before it is transformed, so
+// it is transformed whilst still in the cache, and is counted
+// into any statistics as soon as it is done.
+//
+//=============================================================
+
+static void *TransformBand(void *arg)
+{
+    pxfband_t band = (pxfband_t)arg;
+    unsigned char *row;
+    uint32_t i;
+
+    // Do all the transforms local to each row
+    for (i = band->first; i < band->last; i++) {
+        row = band->rows + (int64_t)i * band->stride;
+
+        if (band->src != NULL) {
+            memcpy(row, band->src + (int64_t)i * band->srcstride, band->rowlen);
+            memset(row + band->rowlen, 0, band->padlen - band->rowlen);
+        }
+
+        if (band->xf != NULL)
+            TransformRow(row, band->width, band->xf);
+
+        if (band->hist != NULL)
+            CountRow(band->hist, row, band->width, band->pixbytes);
+    }
+
+    return NULL;
+}
+
+//=============================================================
+// ConvInputRow()
+//
+// Returns input row 'i' of the band 'band', with rows beyond the
+// image repeating its top or bottom row.
+//
+//=============================================================
+
+static const unsigned char *ConvInputRow(const pcvband_t band, int64_t i)
+{
+    uint32_t y = (i < 0) ? 0 : (i >= (int64_t)band->height) ? band->height - 1 : (uint32_t)i;
+
+    if (y < band->first && band->below != NULL)
+        return band->below + (uint64_t)(band->first - 1 - y) * band->rowlen;
+
+    if (y >= band->last && band->above != NULL)
+        return band->above + (uint64_t)(y - band->last) * band->rowlen;
+
+    return band->src + (int64_t)y * band->srcstride;
+}
+
+//=============================================================
+// ConvBand()
+//
+// Convolution worker thread, filtering the band of rows described
+// by 'arg' (a pcvband_t). Each input row is filtered horizontally
+// (for each term) once, into a ring of the last 'taps' filtered
+// rows, from which each output row is made as soon as the rows
+// either side of it are in. So each input row is read just before
+// the output row 'radius' rows below it is written, allowing the
+// filtering to be done in place, with the working rows staying in
+// the cache. Any row transforms are made on each output row as it
+// is written, and it is then counted into any statistics.
+//
+//=============================================================
+
+static void *ConvBand(void *arg)
+{
+    pcvband_t band = (pcvband_t)arg;
+    pconv_t cv     = band->cv;
+    uint32_t len   = band->rowlen;
+    uint32_t edge  = cv->radius * cv->pixbytes;
+    const int16_t *taprows[BMP_MAXKERNEL];
+    const unsigned char *in;
+    unsigned char *out;
+    uint32_t t, k, x, slot, flags;
+    int64_t i, y;
+
+    for (i = (int64_t)band->first - cv->radius; i < (int64_t)band->last + cv->radius; i++) {
+        // Input row, with its edge pixels repeated either side
+        in = ConvInputRow(band, i);
+        memcpy(band->edgerow + edge, in, len);
+        for (x = 0; x < edge; x += cv->pixbytes) {
+            memcpy(band->edgerow + x, in, cv->pixbytes);
+            memcpy(band->edgerow + edge + len + x, in + len - cv->pixbytes, cv->pixbytes);
+        }
+
+        // Horizontally filtered for each term, into the ring slot for the row
+        slot = (uint32_t)((i - band->first + cv->radius) % cv->taps);
+        for (t = 0; t < cv->nterms; t++)
+            cv->horzfn(band->hrows + ((uint64_t)t * cv->taps + slot) * len, band->edgerow, cv->h[t], cv->taps, 
+                       cv->pixbytes, 0, len);
+
+        // Output row with its last input row now filtered
+        y = i - cv->radius;
+        if (y < band->first)
+            continue;
+
+        out = band->rows + y * band->stride;
+
+        for (t = 0; t < cv->nterms; t++) {
+            for (k = 0; k < cv->taps; k++)
+                taprows[k] = band->hrows + ((uint64_t)t * cv->taps + (uint32_t)((y - band->first + k) % cv->taps)) * len;
+
+            flags = (t ? CONVADD : 0) | (cv->magnitude ? CONVABS : 0) | ((t == cv->nterms - 1) ? CONVPACK : 0);
+            cv->vertfn(out, band->acc, taprows, cv->v[t], cv->taps, flags, cv->shift, 0, len);
+        }
+
+        if (band->xf != NULL)
+            TransformRow(out, band->width, band->xf);
+
+        if (band->hist != NULL)
+            CountRow(band->hist, out, band->width, cv->pixbytes);
+
+        memset(out + len, 0, band->padlen - len);
+    }
+
+    return NULL;
+}
+
+//=============================================================
+// ConvolveRows()
+//
+// Filters the 'width' x 'height' image of rows 'src', 'srcstride'
+// bytes apart, with the prepared filter 'cv', followed by the row
+// transforms 'xf' (if not NULL), writing the result to the rows
+// 'dst', 'dststride' apart, zero padded to 'padlen' bytes. If 'src'
+// is NULL the image is filtered in place in 'dst'. The rows are
+// divided into bands filtered by 'threads' threads, each with its
+// own working rows. When in place, the rows within the filter's
+// radius of each band's edges are copied first, as the bands
+// either side overwrite them. The statistics of the result are
+// gathered into 'stats', if not NULL. Returns GOODSTATUS, or
+// BADSTATUS with a message placed in 'e' (if not NULL).
+//
+//=============================================================
+
+static int ConvolveRows(const pconv_t cv, pxform_t xf, unsigned char *dst, int32_t dststride, const unsigned char *src, 
+                        int32_t srcstride, uint32_t width, uint32_t height, uint32_t padlen, uint32_t threads, 
+                        pbmpstats_t stats, const char *funcname, perrmsg_t e)
+{
+    cvband_t stackbands[STACKTHREADS];                  // Thread bands, unless too many for the stack
+    pcvband_t bands = stackbands;                       // Thread bands
+    unsigned char *buf = NULL, *p;                      // Working memory
+    pstathist_t hists = NULL;                           // Histograms for each band
+    uint64_t rowlen, edgelen, hlen, acclen, halolen, size;
+    uint32_t nthreads, inplace, i, k, n;
+
+    if (width == 0 || height == 0) {
+        if (stats != NULL)
+            memset(stats, 0, sizeof(bmpstats_t));
+        return GOODSTATUS;
+    }
+
+    inplace = (src == NULL);
+    if (inplace) {
+        src       = dst;
+        srcstride = dststride;
+    }
+
+    nthreads = (threads > 1) ? threads : 1;
+    if (nthreads > height)
+        nthreads = height;
+
+    // Working rows for each band (each 32 byte aligned), and copies of the rows beyond
+    // each band when in place
+    rowlen  = (uint64_t)width * cv->pixbytes;
+    edgelen = (rowlen + 2 * cv->radius * cv->pixbytes + 31) & ~(uint64_t)31;
+    hlen    = ((uint64_t)cv->nterms * cv->taps * rowlen * sizeof(int16_t) + 31) & ~(uint64_t)31;
+    acclen  = (rowlen * sizeof(int32_t) + 31) & ~(uint64_t)31;
+    halolen = (inplace && nthreads > 1) ? (2 * cv->radius * rowlen + 31) & ~(uint64_t)31 : 0;
+    size    = nthreads * (edgelen + hlen + acclen + halolen);
+
+    if ((uint64_t)(size_t)size != size || (buf = (unsigned char *)malloc((size_t)size)) == NULL || 
+        (stats != NULL && (hists = (pstathist_t)calloc(nthreads, sizeof(stathist_t))) == NULL) ||
+        (nthreads > STACKTHREADS && (bands = (pcvband_t)malloc(nthreads * sizeof(cvband_t))) == NULL)) {
+        free(buf);
+        free(hists);
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = TBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
+
+    // Split into bands of (near) equal size
+    for (p = buf, i = 0; i < nthreads; i++) {
+        bands[i].cv        = cv;
+        bands[i].xf        = xf;
+        bands[i].rows      = dst;
+        bands[i].stride    = dststride;
+        bands[i].src       = src;
+        bands[i].srcstride = srcstride;
+        bands[i].width     = width;
+        bands[i].height    = height;
+        bands[i].first     = (uint32_t)(((uint64_t)height * i) / nthreads);
+        bands[i].last      = (uint32_t)(((uint64_t)height * (i+1)) / nthreads);
+        bands[i].rowlen    = (uint32_t)rowlen;
+        bands[i].padlen    = inplace ? (uint32_t)rowlen : padlen;
+        bands[i].edgerow   = p;
+        bands[i].hrows     = (int16_t *)(p + edgelen);
+        bands[i].acc       = (int32_t *)(p + edgelen + hlen);
+        bands[i].below     = NULL;
+        bands[i].above     = NULL;
+        bands[i].hist      = (hists != NULL) ? &hists[i] : NULL;
+        p                 += edgelen + hlen + acclen;
+
+        if (halolen) {
+            bands[i].below = p;
+            for (n = (bands[i].first < cv->radius) ? bands[i].first : cv->radius, k = 0; k < n; k++)
+                memcpy(p + k * rowlen, src + (int64_t)(bands[i].first - 1 - k) * srcstride, (size_t)rowlen);
+
+            bands[i].above = p + cv->radius * rowlen;
+            for (n = (height - bands[i].last < cv->radius) ? height - bands[i].last : cv->radius, k = 0; k < n; k++)
+                memcpy(p + (cv->radius + k) * rowlen, src + (int64_t)(bands[i].last + k) * srcstride, (size_t)rowlen);
+
+            p += halolen;
+        }
+    }
+
+    RunThreads(nthreads, ConvBand, bands, sizeof(cvband_t));
+
+    if (hists != NULL)
+        MergeStats(stats, hists, nthreads);
+
+    if (bands != stackbands)
+        free(bands);
+    free(buf);
+    free(hists);
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// GetViewStats()
+//
+// Gathers the statistics (see bmpstats_t) of the pixels of the
+// image region 'view' (see ClipView()) into 'stats', with its rows
+// divided between 'threads' threads, each counting into its own
+// histograms. Images that aren't 24 or 32 bit BGRX are counted a
+// row at a time as converted to 24 bits, so that 1, 4 and 8 bit
+// images are counted in the colours of their colour table. Run
+// length encoded images must be expanded first. Returns GOODSTATUS,
+// or BADSTATUS with a message placed in 'e' (if not NULL).
+//
+//=============================================================
+
+int GetViewStats(const pbmview_t view, uint32_t threads, pbmpstats_t stats, perrmsg_t e)
+{
+    static const char *funcname = "GetViewStats()";
+
+    statband_t stackbands[STACKTHREADS];                // Thread bands, unless too many for the stack
+    pstatband_t bands = stackbands;                     // Thread bands
+    pstathist_t hists = NULL;                           // Histograms for each band
+    unsigned char *rowbufs = NULL;                      // Converted row buffers for each band
+    cvtlut_t lut;                                       // Conversion to 24 bits
+    uint64_t rowlen;
+    uint32_t bpp, fmt, units, nthreads, convert, i;
+
+    bpp = view->hdr.i.biBitCount;
+    fmt = PixelFormat(&view->hdr, (const unsigned char *)view->pal);
+
+    if (ISRLE(&view->hdr) || (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32)) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to gather statistics of bitmap that's not 1, 4, 8, 16, "
+                     "24 or 32 bit uncompressed.\n", funcname);
+            e->errnum = HBMP_ERR_BADFORMAT;
+        }
+        return BADSTATUS;
+    }
+
+    convert = (fmt != BMP_FMT24 && fmt != BMP_FMT32);
+    rowlen  = ((uint64_t)view->hdr.i.biWidth * 3 + 31) & ~(uint64_t)31;
+
+    // Rows to divide between threads
+    units    = view->hdr.i.biHeight;
+    nthreads = (threads > 1) ? threads : 1;
+    if (nthreads > units && units)
+        nthreads = units;
+
+    if ((hists = (pstathist_t)calloc(nthreads, sizeof(stathist_t))) == NULL || 
+        (convert && ((uint64_t)(size_t)(nthreads * rowlen) != nthreads * rowlen || 
+                     (rowbufs = (unsigned char *)malloc((size_t)(nthreads * rowlen))) == NULL)) ||
+        (nthreads > STACKTHREADS && (bands = (pstatband_t)malloc(nthreads * sizeof(statband_t))) == NULL)) {
+        free(hists);
+        free(rowbufs);
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = HBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
+
+    if (convert)
+        BuildConvertLut(&lut, &view->hdr, (const unsigned char *)view->pal, view->ncolours, BMP_FMT24);
+
+    // Split into bands of (near) equal size
+    for (i = 0; i < nthreads; i++) {
+        bands[i].rows     = view->rows;
+        bands[i].stride   = view->stride;
+        bands[i].width    = view->hdr.i.biWidth;
+        bands[i].pixbytes = (fmt == BMP_FMT32) ? 4 : 3;
+        bands[i].first    = (uint32_t)(((uint64_t)units * i) / nthreads);
+        bands[i].last     = (uint32_t)(((uint64_t)units * (i+1)) / nthreads);
+        bands[i].lut      = convert ? &lut : NULL;
+        bands[i].rowbuf   = convert ? rowbufs + i * rowlen : NULL;
+        bands[i].hist     = &hists[i];
+    }
+
+    RunThreads(nthreads, StatsBand, bands, sizeof(statband_t));
+
+    MergeStats(stats, hists, nthreads);
+
+    if (bands != stackbands)
+        free(bands);
+    free(hists);
+    free(rowbufs);
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// GetBmpStats()
+//
+// Gathers the statistics of the region of bitmap image 'bmp'
+// defined by 'boundary' (or the whole image if NULL) into 'stats',
+// as for GetViewStats(), using 'threads' threads. The region is as
+// for ClipView(). Returns GOODSTATUS, or BADSTATUS with a message
+// placed in 'e' (if not NULL).
+//
+//=============================================================
+
+int GetBmpStats(const unsigned char *bmp, const prect_t boundary, uint32_t threads, pbmpstats_t stats, perrmsg_t e)
+{
+    bmview_t view;
+
+    if (ClipView((unsigned char *)bmp, boundary, &view, e) == BADSTATUS)
+        return BADSTATUS;
+
+    return GetViewStats(&view, threads, stats, e);
+}
+
+//=============================================================
+// MakeLevels()
+//
+// Sets 'lv' to the levels adjustment of type 'mode', for use with
+// TransformBmp() (see trans_t), from the statistics 'stats' of the
+// image to be adjusted:
+//
+//     BMP_LEVELSSTRETCH  : auto levels, stretching each colour
+//                          linearly from its least to greatest
+//                          value over 0 to 255, after first
+//                          clipping 'param' tenths of a percent
+//                          (0 to BMP_MAXLEVELCLIP) of the pixels
+//                          at each end
+//     BMP_LEVELSEQUALIZE : histogram equalization, mapping each
+//                          value through the cumulative luma
+//                          histogram, so the luma values are
+//                          spread evenly over 0 to 255, with the
+//                          same table for every colour, keeping
+//                          greys grey ('param' is unused)
+//
+// A colour with a single value (or an image with no pixels) is
+// left unchanged. Returns GOODSTATUS, or BADSTATUS with a message
+// placed in 'e' (if not NULL) for a bad mode or parameter.
+//
+//=============================================================
+
+int MakeLevels(pbmplevels_t lv, const pbmpstats_t stats, uint32_t mode, uint32_t param, perrmsg_t e)
+{
+    static const char *funcname = "MakeLevels()";
+
+    uint64_t clip, sum, first;
+    uint32_t c, v;
+
+    memset(lv, 0, sizeof(bmplevels_t));
+
+    if (mode != BMP_LEVELSSTRETCH && mode != BMP_LEVELSEQUALIZE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad levels mode (%d).\n", funcname, mode);
+            e->errnum = ABMP_ERR_BADMODE;
+        }
+        return BADSTATUS;
+    }
+
+    if (mode == BMP_LEVELSSTRETCH && param > BMP_MAXLEVELCLIP) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad levels parameter (%d).\n", funcname, param);
+            e->errnum = ABMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    lv->mode = mode;
+
+    for (c = 0; c < 3; c++) {
+        lv->low[c]  = 0;
+        lv->high[c] = 0xff;
+    }
+
+    if (mode == BMP_LEVELSSTRETCH) {
+        // The limits are the first values, from each end, with more than the clipped pixels beyond them
+        clip = stats->pixels * param / 1000;
+        for (c = 0; c < 3; c++) {
+            for (sum = 0, v = 0; v < 0xff && (sum += stats->hist[c][v]) <= clip; v++)
+                ;
+            lv->low[c] = v;
+            for (sum = 0, v = 0xff; v > 0 && (sum += stats->hist[c][v]) <= clip; v--)
+                ;
+            lv->high[c] = v;
+
+            if (lv->high[c] <= lv->low[c]) {
+                lv->low[c]  = 0;
+                lv->high[c] = 0xff;
+            }
+
+            for (v = 0; v < 256; v++)
+                lv->lut[c][v] = (unsigned char)StretchValue(v, lv->low[c], lv->high[c]);
+        }
+        return GOODSTATUS;
+    }
+
+    // Each value goes to the share of the pixels, beyond those of the least value, at or below it,
+    // rounded to the nearest
+    for (first = 0, v = 0; v < 256 && first == 0; v++)
+        first = stats->hist[BMP_STATLUMA][v];
+
+    for (sum = 0, v = 0; v < 256; v++) {
+        sum += stats->hist[BMP_STATLUMA][v];
+        lv->lut[0][v] = (stats->pixels == first) ? (unsigned char)v : (sum <= first) ? 0 : 
+                        (unsigned char)(((sum - first) * 0xff + (stats->pixels - first)/2) / (stats->pixels - first));
+    }
+
+    memcpy(lv->lut[1], lv->lut[0], 256);
+    memcpy(lv->lut[2], lv->lut[0], 256);
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// ViewLevels()
+//
+// Makes, in 'lv', the levels adjustment selected by 'control' for
+// the pixels of image region 'view' (see ClipView()), from their
+// statistics, gathered in a first pass over them before any are
+// transformed, with 'control->threads' threads. Returns
+// GOODSTATUS, or BADSTATUS with a message placed in 'e' (if not
+// NULL).
+//
+//=============================================================
+
+static int ViewLevels(pbmplevels_t lv, const pbmview_t view, const ptrans_t control, perrmsg_t e)
+{
+    bmpstats_t stats;
+
+    if (GetViewStats(view, control->threads, &stats, e) == BADSTATUS)
+        return BADSTATUS;
+
+    return MakeLevels(lv, &stats, control->levels, control->levelclip, e);
+}
+
+//=============================================================
+// FlipIndexRow()
+//
+// Reverses the order of the 'width' pixels of 'bpp' bits each
+// (1, 4 or 8) in the indexed image row 'row'.
+//
+//=============================================================
+
+static void FlipIndexRow(unsigned char *row, uint32_t width, uint32_t bpp)
+{
+    uint32_t mask = (1U << bpp) - 1;
+    uint32_t i, j, si, sj, a, b;
+    uint64_t bi, bj;                                    // Bit offsets of pixels i and j
+    unsigned char tmp;
+
+    if (bpp == BYTEWIDTH) {
+        for (i = 0, j = width-1; i < j && j < width; i++, j--) {
+            tmp = row[i]; row[i] = row[j]; row[j] = tmp;
+        }
+        return;
+    }
+
+    // Sub-byte pixels are packed most significant first
+    for (i = 0, j = width-1; i < j && j < width; i++, j--) {
+        bi = (uint64_t)i * bpp;
+        bj = (uint64_t)j * bpp;
+        si = BYTEWIDTH - bpp - (uint32_t)(bi % BYTEWIDTH);
+        sj = BYTEWIDTH - bpp - (uint32_t)(bj % BYTEWIDTH);
+        a  = (row[bi / BYTEWIDTH] >> si) & mask;
+        b  = (row[bj / BYTEWIDTH] >> sj) & mask;
+        row[bi / BYTEWIDTH] = (unsigned char)((row[bi / BYTEWIDTH] & ~(mask << si)) | (b << si));
+        row[bj / BYTEWIDTH] = (unsigned char)((row[bj / BYTEWIDTH] & ~(mask << sj)) | (a << sj));
+    }
+}
+
+//=============================================================
+// TransformIndexed()
+//
+// Transforms the 1, 4 or 8 bit indexed image region described by
+// 'view'. The colour transforms are all functions of a pixel's
+// colour alone, so are applied once to each entry of the colour
+// table, with the same row kernels as for 24 bit images, rather
+// than to every pixel. Only a flip about the vertical axis need
+// touch the pixel data, moving indices without changing them.
+// Any levels adjustment is 'lv' (see BuildXform()).
+//
+//=============================================================
+
+static void TransformIndexed(const pbmview_t view, const ptrans_t control, const bmplevels_t *lv)
+{
+    unsigned char colours[3*256];                       // Colour table as a row of 24 bit pixels
+    uint32_t bpp, ncolours, i;
+    xform_t xf;
+
+    bpp      = view->hdr.i.biBitCount;
+    ncolours = view->ncolours;
+    if (ncolours > (1U << bpp))
+        ncolours = 1U << bpp;
+
+    BuildXform(&xf, control, lv, GetSimdLevel(), 3);
+
+    // Colour transforms on the table entries
+    xf.flipv = FALSE;
+    if (ncolours && (xf.levels || xf.channel || xf.cross)) {
+        for (i = 0; i < ncolours; i++) {
+            colours[3*i]   = view->pal[i].Blue;
+            colours[3*i+1] = view->pal[i].Green;
+            colours[3*i+2] = view->pal[i].Red;
+        }
+
+        TransformRow(colours, ncolours, &xf);
+
+        for (i = 0; i < ncolours; i++) {
+            view->pal[i].Blue  = colours[3*i];
+            view->pal[i].Green = colours[3*i+1];
+            view->pal[i].Red   = colours[3*i+2];
+        }
+    }
+
+    // A flip about the vertical axis moves the indices
+    if (control->flipv)
+        for (i = 0; i < (uint32_t)view->hdr.i.biHeight; i++)
+            FlipIndexRow(view->rows + (int64_t)i * view->stride, view->hdr.i.biWidth, bpp);
+}
+
+//=============================================================
+// TransformBmp()
+//
+// Performs various transformations on a 24 bit bitmap (or, via
+// its colour table, a 1, 4 or 8 bit bitmap). Bitmap pointer
+// passed in, as 'bitmap', with transformation controlled by the
+// 'control' structure. A normal return passes back
+// GOODSTATUS, else BADSTATUS is returned with an error message
+// sent to buffer pointed to in 'e' (if not NULL).
+//
+// The transforms currently supports are:
+//     Reverse colours (negative)
+//     Adjust brightness
+//     Adjust contrast
+//     Convert to grey scale 
+//     Flip about vertical axis
+//     Flip about horizontal axis
+//     Extract a colour component 
+//        (red, green, blue, yellow, cyan or magenta)
+//     Auto levels or histogram equalization (see MakeLevels()),
+//        applied before the other colour transforms
+//
+// Levels are made from the statistics of the image as it stands
+// (before any filter), gathered in a first pass over its pixels.
+//
+// A flip about the horizontal axis moves no pixel data, but just
+// changes the image between bottom up and top down (i.e. negates
+// the header's height), reversing the order of its rows.
+//
+// If the control's 'stats' is set, the statistics of the result
+// (see GetViewStats()) are gathered into it, counting each row of
+// a 24 or 32 bit image as soon as it is transformed.
+//
+//=============================================================
+
+int TransformBmp (unsigned char *bitmap, const ptrans_t control, perrmsg_t e)
+{
+    pbmhdr_t hdr = (pbmhdr_t)bitmap;
+    bmview_t view;
+
+    // A view of the whole image
+    if (ClipView(bitmap, NULL, &view, e) == BADSTATUS || TransformView(&view, control, e) == BADSTATUS)
+        return BADSTATUS;
+
+    if (control->fliph) {
+        HDRENDIAN(hdr);
+        hdr->i.biHeight = -hdr->i.biHeight;
+        HDRENDIAN(hdr);
+    }
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// TransformView()
+//
+// Performs the transformations of TransformBmp() on just the
+// region of a 24 (or 32 bit BGRX) bitmap described by 'view' (see ClipView()),
+// in place in the original image. Flips are about the axes of the
+// region, and pixels outside it are untouched. A flip about the
+// horizontal axis reverses the row order of the view itself (its
+// first row and stride), rather than moving any rows. A 1, 4 or 8
+// bit image is transformed in its colour table (see
+// TransformIndexed()), so its colour transforms affect the whole
+// image.
+//
+//=============================================================
+
+int TransformView (const pbmview_t view, const ptrans_t control, perrmsg_t e)
+{
+    char *funcname = "TransformBmp()";
+
+    // Local variable declarations
+    xform_t xf;                                         // Precomputed row transforms
+    bmplevels_t lv;                                     // Levels adjustment, if any
+    conv_t cv;                                          // Prepared convolution filter
+    xfband_t stackbands[STACKTHREADS];                  // Thread bands, unless too many for the stack
+    pxfband_t bands = stackbands;                       // Thread bands
+    pstathist_t hists = NULL;                           // Histograms for each band, if gathering statistics
+    uint32_t units, nthreads;                           // Work division
+    uint32_t fmt;                                       // Pixel format
+    uint32_t i;                                         // Index
+
+    // Check the bitmap
+    fmt = PixelFormat(&view->hdr, (const unsigned char *)view->pal);
+    if (fmt != BMP_FMT24 && fmt != BMP_FMT32 && fmt != 8 && fmt != 4 && fmt != 1) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to transform bitmap that's not 1, 4, 8, 24 or 32 (BGRX) bit.\n", 
+                     funcname);
+            e->errnum = TBMP_ERR_CONVERROR;
+        }
+        return BADSTATUS;
+    }
+
+    // Check control parameters
+    if (CheckControl(control, funcname, e) == BADSTATUS)
+        return BADSTATUS;
+
+    // Filters work on the pixels themselves, so only 24 and 32 bit images can be filtered
+    if (control->filter != NULL && fmt != BMP_FMT24 && fmt != BMP_FMT32) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to filter bitmap that's not 24 or 32 (BGRX) bit.\n", 
+                     funcname);
+            e->errnum = TBMP_ERR_CONVERROR;
+        }
+        return BADSTATUS;
+    }
+
+    if (control->filter != NULL && 
+        BuildConv(&cv, control->filter, GetSimdLevel(), (fmt == BMP_FMT32) ? 4 : 3, control->fliph, funcname, e) == BADSTATUS)
+        return BADSTATUS;
+
+    // Nothing to do if no transforms enabled, so leave the data untouched (though any
+    // statistics are still wanted)
+    if (!HasTransforms(control))
+        return (control->stats != NULL) ? GetViewStats(view, control->threads, control->stats, e) : GOODSTATUS;
+
+    // Levels come from a first pass over the pixels
+    if (control->levels && ViewLevels(&lv, view, control, e) == BADSTATUS)
+        return BADSTATUS;
+
+    // Flip about the horizontal axis by viewing the rows from the other end
+    if (control->fliph) {
+        view->rows  += (int64_t)(view->hdr.i.biHeight - 1) * view->stride;
+        view->stride = -view->stride;
+    }
+
+    // Indexed images are transformed through their colour table
+    if (fmt <= BYTEWIDTH) {
+        TransformIndexed(view, control, control->levels ? &lv : NULL);
+        return (control->stats != NULL) ? GetViewStats(view, control->threads, control->stats, e) : GOODSTATUS;
+    }
+
+    BuildXform(&xf, control, control->levels ? &lv : NULL, GetSimdLevel(), (fmt == BMP_FMT32) ? 4 : 3);
+
+    // A filter makes each row afresh, with the row transforms made on it as it is written
+    if (control->filter != NULL)
+        return ConvolveRows(&cv, (xf.flipv || xf.levels || xf.channel || xf.cross) ? &xf : NULL, view->rows, view->stride, NULL, 0, 
+                            view->hdr.i.biWidth, view->hdr.i.biHeight, 0, control->threads, control->stats, funcname, e);
+
+    // Nothing left to do if the flip was all
+    if (!xf.flipv && !xf.levels && !xf.channel && !xf.cross)
+        return (control->stats != NULL) ? GetViewStats(view, control->threads, control->stats, e) : GOODSTATUS;
+
+    // Rows to divide between threads
+    units    = view->hdr.i.biHeight;
+    nthreads = (control->threads > 1) ? control->threads : 1;
+    if (nthreads > units && units)
+        nthreads = units;
+
+    if ((control->stats != NULL && (hists = (pstathist_t)calloc(nthreads, sizeof(stathist_t))) == NULL) ||
+        (nthreads > STACKTHREADS && (bands = (pxfband_t)malloc(nthreads * sizeof(xfband_t))) == NULL)) {
+        free(hists);
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = TBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
+
+    // Split into bands of (near) equal size
+    for (i = 0; i < nthreads; i++) {
+        bands[i].rows      = view->rows;
+        bands[i].xf        = &xf;
+        bands[i].width     = view->hdr.i.biWidth;
+        bands[i].stride    = view->stride;
+        bands[i].first     = (uint32_t)(((uint64_t)units * i) / nthreads);
+        bands[i].last      = (uint32_t)(((uint64_t)units * (i+1)) / nthreads);
+        bands[i].src       = NULL;
+        bands[i].pixbytes  = xf.pixbytes;
+        bands[i].hist      = (hists != NULL) ? &hists[i] : NULL;
+    }
+
+    RunThreads(nthreads, TransformBand, bands, sizeof(xfband_t));
+
+    if (hists != NULL)
+        MergeStats(control->stats, hists, nthreads);
+
+    if (bands != stackbands)
+        free(bands);
+    free(hists);
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// TransformViewTo()
+//
+// Performs the transformations of TransformView() on the region
+// described by 'src', but out of place, leaving the source image
+// untouched and writing the result to the caller's buffer given in
+// 'dst'. The caller sets dst->rows to the first (bottom) row of
+// the buffer and dst->stride to the bytes from one row to the next
+// (negative for a buffer stored top down), which must be at least
+// a row of the region's pixel data. The buffer must hold all the
+// region's rows, and rows are zero padded to 32 bits where the
+// stride allows. Each row is copied and transformed in a single
+// pass, so the image data is read and written only once. On
+// return the rest of 'dst' describes the result as a view (with
+// its header and colour table), for use with WriteView() etc.
+//
+// For a 1, 4 or 8 bit image with colour transforms, dst->pal must
+// point to space for the source's colour table, which is copied
+// and transformed. Otherwise, if dst->pal is NULL, the view shares
+// the source's table. With no transforms, the region is simply
+// copied, and may then be of any format. Any statistics are of the
+// result, as for TransformBmp(), whilst any levels are made from a
+// first pass over the source region. Returns GOODSTATUS, or
+// BADSTATUS with a message placed in 'e' (if not NULL).
+//
+//=============================================================
+
+int TransformViewTo (const pbmview_t src, pbmview_t dst, const ptrans_t control, perrmsg_t e)
+{
+    static const char *funcname = "TransformViewTo()";
+
+    xform_t xf;                                         // Precomputed row transforms
+    pxform_t pxf = NULL;                                // Row transforms, if any
+    bmplevels_t lv;                                     // Levels adjustment, if any
+    conv_t cv;                                          // Prepared convolution filter
+    xfband_t stackbands[STACKTHREADS];                  // Thread bands, unless too many for the stack
+    pxfband_t bands = stackbands;                       // Thread bands
+    pstathist_t hists = NULL;                           // Histograms for each band, if counted as copied
+    const unsigned char *srcrows;                       // Source rows in output order
+    int32_t srcstride;
+    uint64_t rowlen, padlen, absstride;                 // Row lengths
+    uint32_t units, nthreads;                           // Work division
+    uint32_t fmt, xforms, colour;
+    uint32_t i;
+
+    fmt    = PixelFormat(&src->hdr, (const unsigned char *)src->pal);
+    xforms = HasTransforms(control);
+    colour = control->reverse || control->brightness || control->contrast || control->grey || control->mono || 
+             control->levels;
+    rowlen = ((uint64_t)src->hdr.i.biWidth * src->hdr.i.biBitCount + 7) / BYTEWIDTH;
+
+    // Check the bitmap, if it is to be transformed
+    if (xforms && fmt != BMP_FMT24 && fmt != BMP_FMT32 && fmt != 8 && fmt != 4 && fmt != 1) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to transform bitmap that's not 1, 4, 8, 24 or 32 (BGRX) bit.\n", 
+                     funcname);
+            e->errnum = TBMP_ERR_CONVERROR;
+        }
+        return BADSTATUS;
+    }
+
+    // Check control parameters
+    if (CheckControl(control, funcname, e) == BADSTATUS)
+        return BADSTATUS;
+
+    // Filters work on the pixels themselves, so only 24 and 32 bit images can be filtered
+    if (control->filter != NULL && fmt != BMP_FMT24 && fmt != BMP_FMT32) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to filter bitmap that's not 24 or 32 (BGRX) bit.\n", 
+                     funcname);
+            e->errnum = TBMP_ERR_CONVERROR;
+        }
+        return BADSTATUS;
+    }
+
+    if (control->filter != NULL && 
+        BuildConv(&cv, control->filter, GetSimdLevel(), (fmt == BMP_FMT32) ? 4 : 3, control->fliph, funcname, e) == BADSTATUS)
+        return BADSTATUS;
+
+    // Check the destination
+    absstride = (dst->stride < 0) ? -(int64_t)dst->stride : dst->stride;
+    if (dst->rows == NULL || absstride < rowlen) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad destination buffer (stride %d, needs %d).\n", 
+                     funcname, dst->stride, (uint32_t)rowlen);
+            e->errnum = TBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    // Rows are padded (with zeros) to 32 bits, if the stride allows, so a buffer
+    // laid out as a bitmap's pixel data is valid as such
+    padlen = PadRowLen(src->hdr.i.biWidth, src->hdr.i.biBitCount);
+    if (padlen > absstride)
+        padlen = rowlen;
+
+    if (fmt <= BYTEWIDTH && colour && dst->pal == NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - no destination colour table for transforming indexed image.\n", 
+                     funcname);
+            e->errnum = TBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    // The destination describes the same region, in its own buffer
+    dst->hdr      = src->hdr;
+    dst->ncolours = src->ncolours;
+    SetImageSizes(&dst->hdr, PadRowLen(dst->hdr.i.biWidth, dst->hdr.i.biBitCount) * dst->hdr.i.biHeight);
+
+    if (dst->pal != NULL)
+        memcpy(dst->pal, src->pal, src->hdr.f.bfOffBits - HDRSIZE);
+    else
+        dst->pal = src->pal;
+
+    // Flip about the horizontal axis by copying the rows from the other end
+    srcrows   = src->rows;
+    srcstride = src->stride;
+    if (control->fliph) {
+        srcrows  += (int64_t)(src->hdr.i.biHeight - 1) * srcstride;
+        srcstride = -srcstride;
+    }
+
+    // Levels come from a first pass over the source pixels
+    if (control->levels && ViewLevels(&lv, src, control, e) == BADSTATUS)
+        return BADSTATUS;
+
+    // Row transforms for 24 and 32 bit images (indexed ones are done after the copy)
+    if (xforms && fmt > BYTEWIDTH) {
+        BuildXform(&xf, control, control->levels ? &lv : NULL, GetSimdLevel(), (fmt == BMP_FMT32) ? 4 : 3);
+        if (xf.flipv || xf.levels || xf.channel || xf.cross)
+            pxf = &xf;
+    }
+
+    // A filter makes each row from the source rows about it, rather than copying the row
+    if (control->filter != NULL)
+        return ConvolveRows(&cv, pxf, dst->rows, dst->stride, srcrows, srcstride, src->hdr.i.biWidth, 
+                            src->hdr.i.biHeight, (uint32_t)padlen, control->threads, control->stats, funcname, e);
+
+    // Rows to divide between threads
+    units    = src->hdr.i.biHeight;
+    nthreads = (control->threads > 1) ? control->threads : 1;
+    if (nthreads > units && units)
+        nthreads = units;
+
+    // Statistics of 24 and 32 bit rows are counted as they are made, whilst others are
+    // counted afterwards, in the colours they are finally given
+    if ((control->stats != NULL && (fmt == BMP_FMT24 || fmt == BMP_FMT32) && 
+         (hists = (pstathist_t)calloc(nthreads, sizeof(stathist_t))) == NULL) ||
+        (nthreads > STACKTHREADS && (bands = (pxfband_t)malloc(nthreads * sizeof(xfband_t))) == NULL)) {
+        free(hists);
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = TBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
+
+    // Split into bands of (near) equal size
+    for (i = 0; i < nthreads; i++) {
+        bands[i].rows      = dst->rows;
+        bands[i].xf        = pxf;
+        bands[i].width     = src->hdr.i.biWidth;
+        bands[i].stride    = dst->stride;
+        bands[i].first     = (uint32_t)(((uint64_t)units * i) / nthreads);
+        bands[i].last      = (uint32_t)(((uint64_t)units * (i+1)) / nthreads);
+        bands[i].src       = srcrows;
+        bands[i].srcstride = srcstride;
+        bands[i].rowlen    = (uint32_t)rowlen;
+        bands[i].padlen    = (uint32_t)padlen;
+        bands[i].pixbytes  = (fmt == BMP_FMT32) ? 4 : 3;
+        bands[i].hist      = (hists != NULL) ? &hists[i] : NULL;
+    }
+
+    RunThreads(nthreads, TransformBand, bands, sizeof(xfband_t));
+
+    if (hists != NULL)
+        MergeStats(control->stats, hists, nthreads);
+
+    if (bands != stackbands)
+        free(bands);
+    free(hists);
+
+    // Indexed images are transformed through their (copied) colour table
+    if (xforms && fmt <= BYTEWIDTH)
+        TransformIndexed(dst, control, control->levels ? &lv : NULL);
+
+    if (control->stats != NULL && fmt != BMP_FMT24 && fmt != BMP_FMT32)
+        return GetViewStats(dst, control->threads, control->stats, e);
+
+    return GOODSTATUS;
+}
+
+//=============================================================
+// TransformRegion()
+//
+// Performs the transformations of TransformBmp() in place on the
+// bitmap image 'bmp', for the region defined by 'boundary' (or the
+// whole image if NULL), describing the result in 'view' (see
+// ClipView()), as if the whole image had been transformed and then
+// clipped. For a 24 (or 32 bit BGRX) image, the region is taken as
+// a view of the image, so that only its pixels are transformed,
+// and no pixel data is moved. Flips move the region within the
+// image, so the view is taken from the mirrored position. A 1, 4
+// or 8 bit image's colour table is transformed for the colours of
+// the region (see TransformView()). A filter reads the pixels around the region too, so
+// with one the whole image is transformed first. Any statistics
+// (see trans_t) are of the region, and any levels are made from
+// the region, or, when a filtered image is transformed whole
+// first, from the whole image. Returns GOODSTATUS, or BADSTATUS
+// with a message placed in 'e' (if not NULL).
+//
+//=============================================================
+
+int TransformRegion (unsigned char *bmp, const prect_t boundary, pbmview_t view, const ptrans_t control, perrmsg_t e)
+{
+    bmhdr_t hdr;
+    rect_t src;
+    trans_t whole, colour;
+    uint32_t width, height, tmp;
+
+    // Indexed images are transformed largely in their colour table, which the whole image
+    // shares. The flips move indices, so are made on the whole image first, and the view
+    // then taken (with any sub-byte left edge of a mirrored region avoided). The colours
+    // of the view are then transformed, so that any levels and statistics are of just the
+    // region, as for a 24 bit image.
+    if (SWPEND16(((pbmhdr_t)bmp)->i.biBitCount) <= BYTEWIDTH) {
+        memset(&whole, 0, sizeof(trans_t));
+        whole.flipv   = control->flipv;
+        whole.fliph   = control->fliph;
+        whole.threads = control->threads;
+
+        colour       = *control;
+        colour.flipv = FALSE;
+        colour.fliph = FALSE;
+
+        if (TransformBmp(bmp, &whole, e) == BADSTATUS || ClipView(bmp, boundary, view, e) == BADSTATUS)
+            return BADSTATUS;
+
+        return TransformView(view, &colour, e);
+    }
+
+    // A filtered region is transformed whole, and the statistics then gathered from the view
+    if (control->filter != NULL && boundary != NULL) {
+        whole       = *control;
+        whole.stats = NULL;
+
+        if (TransformBmp(bmp, &whole, e) == BADSTATUS || ClipView(bmp, boundary, view, e) == BADSTATUS)
+            return BADSTATUS;
+
+        return (control->stats != NULL) ? GetViewStats(view, control->threads, control->stats, e) : GOODSTATUS;
+    }
+
+    if (boundary != NULL) {
+        hdr = *(pbmhdr_t)bmp;
+        HDRENDIAN(&hdr);
+
+        src    = *boundary;
+        width  = hdr.i.biWidth;
+        height = BMPHEIGHT(&hdr);
+
+        if (src.right > width)
+            src.right = width;
+        if (src.top > height)
+            src.top = height;
+
+        // Only a valid region is mirrored, so that a bad one is reported as given
+        if (src.left < src.right && src.bottom < src.top) {
+            if (control->flipv) {
+                tmp       = src.left;
+                src.left  = width - src.right;
+                src.right = width - tmp;
+            }
+            if (control->fliph) {
+                tmp        = src.bottom;
+                src.bottom = height - src.top;
+                src.top    = height - tmp;
+            }
+        }
+    }
+
+    if (ClipView(bmp, (boundary != NULL) ? &src : NULL, view, e) == BADSTATUS)
+        return BADSTATUS;
+
+    return TransformView(view, control, e);
+}
+
+//=============================================================
+// TransformBmpTo()
+//
+// Performs the transformations of TransformBmp() out of place,
+// on the region of bitmap image 'bmp' defined by 'boundary' (or
+// the whole image if NULL), leaving the image untouched and
+// writing the result to the caller's buffer given in 'dst' (see
+// TransformViewTo()). The region is as for ClipView(). Returns
+// GOODSTATUS, or BADSTATUS with a message placed in 'e' (if not
+// NULL).
+//
+//=============================================================
+
+int TransformBmpTo (const unsigned char *bmp, const prect_t boundary, pbmview_t dst, const ptrans_t control, 
+                    perrmsg_t e)
+{
+    bmview_t view;
+
+    if (ClipView((unsigned char *)bmp, boundary, &view, e) == BADSTATUS)
+        return BADSTATUS;
+
+    return TransformViewTo(&view, dst, control, e);
+}
+
+//=================================================================
+// ClipBitmap()
+//
+// Takes bitmap image passed in with 'bmp' (16, 24 or 32 bit) and
+// clips (trims) down to a sub-rectangular region defined in
+// 'boundary'. The image is updated in place, and the header
+// modified for the new image parameters, keeping its row order
+// (bottom up or top down). The final images size value is
+// returned in 'imgsize'. The functions will return BADSTATUS if
+// the specified clipping region does not lie fully within the
+// input image area. Otherwise, GOODSTATUS is returned.
+//
+//=================================================================
+
+uint32_t ClipBitmap(unsigned char* bmp, const prect_t boundary, uint64_t *imgsize)
+{
+    uint32_t newwidth, newheight, height;
+    uint32_t i, first;
+    uint64_t idx;
+    pbmhdr_t bm;
+    unsigned char *data;
+    uint64_t i_padrowlen, o_rowlen, o_padrowlen;
+    uint32_t pixbytes;
+
+    bm = (pbmhdr_t) bmp;
+
+    HDRENDIAN(bm);
+
+    data   = bmp + bm->f.bfOffBits;
+    height = BMPHEIGHT(bm);
+
+    // Clip top and bottom if outside image
+    if (boundary->right > bm->i.biWidth)
+        boundary->right = bm->i.biWidth;
+    if (boundary->top > height)
+        boundary->top = height;
+
+    // Check that the rectangle is valid
+    if (boundary->right <= boundary->left ||
+        boundary->top   <= boundary->bottom) {
+        HDRENDIAN(bm);
+        return BADSTATUS;
+    }
+
+    // New dimensions
+    newwidth  = boundary->right - boundary->left;
+    newheight = boundary->top - boundary->bottom;
+
+    // Input bitmaps padded row length, and output row lengths
+    pixbytes    = bm->i.biBitCount / BYTEWIDTH;
+    i_padrowlen = PadRowLen(bm->i.biWidth, bm->i.biBitCount);
+    o_rowlen    = (uint64_t)pixbytes * newwidth;
+    o_padrowlen = 4 * ((o_rowlen+3)/4);
+
+    // Calculate new sizes
+    SetImageSizes(bm, o_padrowlen * newheight);
+
+    // First stored row of the region, which for a top down image is its top row
+    first = BMPTOPDOWN(bm) ? height - boundary->top : boundary->bottom;
+
+    // Move relevant data to bottom of data buffer, a row at a time (rows may overlap
+    // their old positions), padding each to a 32 bit boundary
+    idx = 0;
+    for (i = first; i < first + newheight; i++) {
+        memmove(&data[idx], &data[i * i_padrowlen + (uint64_t)pixbytes * boundary->left], (size_t)o_rowlen);
+        memset(&data[idx + o_rowlen], 0, (size_t)(o_padrowlen - o_rowlen));
+        idx += o_padrowlen;
+    }
+
+    // Update height and widths in header
+    bm->i.biWidth  = newwidth;
+    bm->i.biHeight = BMPTOPDOWN(bm) ? -(int32_t)newheight : (int32_t)newheight;
+
+    // return new size
+    *imgsize = o_padrowlen * newheight + bm->f.bfOffBits;
+
+    HDRENDIAN(bm);
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// ClipView()
+//
+// Describes, in 'view', the sub-rectangular region of the bitmap
+// image 'bmp' defined by 'boundary' (with the same conventions as
+// ClipBitmap()), or the whole image if 'boundary' is NULL, without
+// copying or modifying any of the image. The view holds a header
+// for the region, the image's colour table and a pointer to, and
+// stride between, the region's rows in the original image, for use
+// with TransformView() and WriteView(). The view's rows are always
+// bottom up, so for a top down image it starts from the last row
+// stored, with a negative stride, and its header has a positive
+// height. A 1, 4 or 8 bit image's region is described with its
+// colour table (wherever it is in the image) following a 40 byte
+// header. The region's left edge must fall on a byte boundary in
+// the pixel data (a multiple of 8 pixels for a 1 bit image, and 2
+// for a 4 bit image), else VBMP_ERR_BADALIGN. Returns GOODSTATUS, or
+// BADSTATUS with a message placed in 'e' (if not NULL).
+//
+//=================================================================
+
+int ClipView(unsigned char *bmp, const prect_t boundary, pbmview_t view, perrmsg_t e)
+{
+    static const char *funcname = "ClipView()";
+
+    rect_t rect;                                        // Clipped region
+    uint32_t bpp;
+
+    view->hdr = *(pbmhdr_t)bmp;
+    HDRENDIAN(&view->hdr);
+
+    bpp            = view->hdr.i.biBitCount;
+    view->pal      = (prgbquad_t)(bmp + ColourTable(&view->hdr, &view->ncolours));
+    view->stride   = (int32_t)PadRowLen(view->hdr.i.biWidth, bpp);
+    view->rows     = bmp + view->hdr.f.bfOffBits;
+
+    // An indexed region is described with its colour table straight after a 40 byte header
+    if (bpp <= BYTEWIDTH) {
+        if (view->hdr.i.biClrUsed || view->ncolours != (1U << bpp))
+            view->hdr.i.biClrUsed = view->ncolours;
+        view->hdr.i.biSize    = INFOHDRSIZE;
+        view->hdr.f.bfOffBits = HDRSIZE + view->ncolours * sizeof(rgbquad_t);
+    }
+
+    if (BMPTOPDOWN(&view->hdr)) {
+        view->hdr.i.biHeight = BMPHEIGHT(&view->hdr);
+        view->rows  += (int64_t)(view->hdr.i.biHeight - 1) * view->stride;
+        view->stride = -view->stride;
+    }
+
+    if (boundary == NULL)
+        return GOODSTATUS;
+
+    rect = *boundary;
+
+    if (rect.right > view->hdr.i.biWidth)
+        rect.right = view->hdr.i.biWidth;
+    if (rect.top > (uint32_t)view->hdr.i.biHeight)
+        rect.top = view->hdr.i.biHeight;
+
+    if (rect.right <= rect.left || rect.top <= rect.bottom) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad clipping rectangle (%d %d %d %d).\n", 
+                     funcname, rect.left, rect.right, rect.bottom, rect.top);
+            e->errnum = VBMP_ERR_BADCLIP;
+        }
+        return BADSTATUS;
+    }
+
+    // The rows are referenced in place, so must start on a byte
+    if ((rect.left * bpp) % BYTEWIDTH) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - left edge of region (%d) must be a multiple of %d pixels "
+                     "for a %d bit image.\n", funcname, rect.left, BYTEWIDTH / bpp, bpp);
+            e->errnum = VBMP_ERR_BADALIGN;
+        }
+        return BADSTATUS;
+    }
+
+    view->rows += (int64_t)rect.bottom * view->stride + (uint64_t)rect.left * bpp / BYTEWIDTH;
+
+    // Header for the region's image parameters
+    view->hdr.i.biWidth  = rect.right - rect.left;
+    view->hdr.i.biHeight = rect.top - rect.bottom;
+    SetImageSizes(&view->hdr, PadRowLen(view->hdr.i.biWidth, bpp) * view->hdr.i.biHeight);
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// ClipBitmapTo()
+//
+// Copies the sub-rectangular region of the bitmap image 'bmp'
+// defined by 'boundary' (as for ClipView()) to the caller's buffer
+// given in 'dst' (see TransformViewTo()), leaving the image
+// untouched. Unlike ClipBitmap(), the image may be of any format.
+// Returns GOODSTATUS, or BADSTATUS with a message placed in 'e'
+// (if not NULL).
+//
+//=================================================================
+
+int ClipBitmapTo(const unsigned char *bmp, const prect_t boundary, pbmview_t dst, perrmsg_t e)
+{
+    trans_t control;
+
+    memset(&control, 0, sizeof(trans_t));
+
+    return TransformBmpTo(bmp, boundary, dst, &control, e);
+}
+
+//=================================================================
+// RotateBand()
+//
+// RotateViewTo() worker thread body. Makes the band of output rows
+// described by 'arg' a row of tiles at a time (see Rotate kernels),
+// zeroing the padding of each row.
+//
+//=================================================================
+
+static void *RotateBand(void *arg)
+{
+    protband_t b = (protband_t)arg;
+    unsigned char *out;
+    uint32_t x, y, w, h, i;
+
+    for (y = b->first; y < b->last; y += h) {
+        h   = (b->last - y < ROTBLOCK) ? b->last - y : ROTBLOCK;
+        out = b->rows + (int64_t)y * b->stride;
+
+        for (x = 0; x < b->width; x += w) {
+            w = (b->width - x < b->tilewidth) ? b->width - x : b->tilewidth;
+            b->tilefn(out + (uint64_t)x * b->pixbytes, b->stride, b->src + x * b->dx + y * b->dy, b->dx, b->dy, 
+                      b->pixbytes, w, h);
+        }
+
+        if (b->padlen > b->rowlen)
+            for (i = 0; i < h; i++)
+                memset(out + (int64_t)i * b->stride + b->rowlen, 0, b->padlen - b->rowlen);
+    }
+
+    return NULL;
+}
+
+//=================================================================
+// CheckRotate()
+//
+// Checks that the image with (host endian) header 'hdr' can be
+// rotated by 'angle' degrees. Returns GOODSTATUS, or BADSTATUS
+// with a message placed in 'e' (if not NULL).
+//
+//=================================================================
+
+static int CheckRotate(const pbmhdr_t hdr, uint32_t angle, const char *funcname, perrmsg_t e)
+{
+    if (angle != 0 && angle != 90 && angle != 180 && angle != 270) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad rotation angle (%d).\n", funcname, angle);
+            e->errnum = RBMP_ERR_BADANGLE;
+        }
+        return BADSTATUS;
+    }
+
+    if (hdr->i.biBitCount % BYTEWIDTH || ISRLE(hdr)) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to rotate bitmap that's not 8, 16, 24 or 32 bit.\n", 
+                     funcname);
+            e->errnum = RBMP_ERR_BADFORMAT;
+        }
+        return BADSTATUS;
+    }
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// RotateViewTo()
+//
+// Rotates the region described by 'src' clockwise by 'angle'
+// degrees (0, 90, 180 or 270), writing the result to the caller's
+// buffer given in 'dst', as for TransformViewTo(), with the width
+// and height exchanged for 90 and 270 degrees. For these, rather
+// than reading the input a column at a time for each output row,
+// the output is made a square tile at a time, so that the input
+// rows a tile is made from stay in the cache, with SIMD transposes
+// of 32 bit pixels. Otherwise rows are copied whole. Bands of tiles are divided between 'threads' threads.
+// The image must be of 8, 16, 24 or 32 bit pixels, and is
+// otherwise unchanged, sharing the source's colour table if
+// dst->pal is NULL. Returns GOODSTATUS, or BADSTATUS with a message
+// placed in 'e' (if not NULL).
+//
+//=================================================================
+
+int RotateViewTo(const pbmview_t src, pbmview_t dst, uint32_t angle, uint32_t threads, perrmsg_t e)
+{
+    static const char *funcname = "RotateViewTo()";
+
+    rotband_t stackbands[STACKTHREADS];                 // Thread bands, unless too many for the stack
+    protband_t bands = stackbands;                      // Thread bands
+    const unsigned char *origin;                        // Input pixel for first output pixel
+    int64_t dx, dy;                                     // Input steps for output columns and rows
+    uint64_t rowlen, padlen, absstride;                 // Row lengths
+    uint32_t pixbytes, width, height, tiles, nthreads, i;
+    uint32_t tmp;
+    rotfn_t tilefn;
+
+    if (CheckRotate(&src->hdr, angle, funcname, e) == BADSTATUS)
+        return BADSTATUS;
+
+    pixbytes = src->hdr.i.biBitCount / BYTEWIDTH;
+    width    = (angle == 90 || angle == 270) ? (uint32_t)src->hdr.i.biHeight : src->hdr.i.biWidth;
+    height   = (angle == 90 || angle == 270) ? src->hdr.i.biWidth : (uint32_t)src->hdr.i.biHeight;
+    rowlen   = (uint64_t)width * pixbytes;
+
+    // Check the destination
+    absstride = (dst->stride < 0) ? -(int64_t)dst->stride : dst->stride;
+    if (dst->rows == NULL || absstride < rowlen) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad destination buffer (stride %d, needs %d).\n", 
+                     funcname, dst->stride, (uint32_t)rowlen);
+            e->errnum = RBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    // Rows are padded (with zeros) to 32 bits, if the stride allows
+    padlen = PadRowLen(width, src->hdr.i.biBitCount);
+    if (padlen > absstride)
+        padlen = rowlen;
+
+    // The destination describes the rotated image, in its own buffer
+    dst->hdr            = src->hdr;
+    dst->hdr.i.biWidth  = width;
+    dst->hdr.i.biHeight = height;
+    dst->ncolours       = src->ncolours;
+    if (angle == 90 || angle == 270) {
+        tmp                        = dst->hdr.i.biXPxlsPerMeter;
+        dst->hdr.i.biXPxlsPerMeter = dst->hdr.i.biYPxlsPerMeter;
+        dst->hdr.i.biYPxlsPerMeter = tmp;
+    }
+    SetImageSizes(&dst->hdr, PadRowLen(width, dst->hdr.i.biBitCount) * height);
+
+    if (dst->pal != NULL)
+        memcpy(dst->pal, src->pal, src->hdr.f.bfOffBits - HDRSIZE);
+    else
+        dst->pal = src->pal;
+
+    origin = RotateOrigin(src->rows, src->stride, src->hdr.i.biWidth, src->hdr.i.biHeight, pixbytes, angle, &dx, &dy);
+    tilefn = SelectRotateKernel(GetSimdLevel(), pixbytes, angle);
+
+    // Rows of tiles to divide between threads
+    tiles    = (height + ROTBLOCK - 1) / ROTBLOCK;
+    nthreads = (threads > 1) ? threads : 1;
+    if (nthreads > tiles && tiles)
+        nthreads = tiles;
+
+    if (nthreads > STACKTHREADS && (bands = (protband_t)malloc(nthreads * sizeof(rotband_t))) == NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = RBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
+
+    // Split into bands of (near) equal numbers of tile rows
+    for (i = 0; i < nthreads; i++) {
+        bands[i].rows      = dst->rows;
+        bands[i].stride    = dst->stride;
+        bands[i].src       = origin;
+        bands[i].dx        = dx;
+        bands[i].dy        = dy;
+        bands[i].pixbytes  = pixbytes;
+        bands[i].width     = width;
+        bands[i].tilewidth = (angle == 90 || angle == 270) ? ROTBLOCK : width;
+        bands[i].first     = (uint32_t)((((uint64_t)tiles * i) / nthreads) * ROTBLOCK);
+        bands[i].last      = (uint32_t)((((uint64_t)tiles * (i+1)) / nthreads) * ROTBLOCK);
+        bands[i].rowlen    = (uint32_t)rowlen;
+        bands[i].padlen    = (uint32_t)padlen;
+        bands[i].tilefn    = tilefn;
+
+        if (bands[i].last > height)
+            bands[i].last = height;
+    }
+
+    RunThreads(nthreads, RotateBand, bands, sizeof(rotband_t));
+
+    if (bands != stackbands)
+        free(bands);
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// RotateBmp()
+//
+// Makes, in *newbmp, a copy of the whole of bitmap image 'bmp'
+// rotated clockwise by 'angle' degrees (see RotateViewTo()), using
+// 'threads' threads. The copy is stored bottom up, with the same
+// header (for its new dimensions) and colour table or masks as the
+// input. If *newbmp is NULL, or *bufsize too small, the buffer is
+// reallocated and *newbmp and *bufsize updated, as for
+// ConvertBmpFormat(), and the caller remains responsible for
+// freeing it. Returns the rotated image size, or 0 on error, with
+// a message placed in 'e' (if not NULL).
+//
+//=================================================================
+
+uint64_t RotateBmp(unsigned char **newbmp, uint64_t *bufsize, const unsigned char *bmp, uint32_t angle, 
+                   uint32_t threads, perrmsg_t e)
+{
+    static const char *funcname = "RotateBmp()";
+
+    bmview_t view, dst;
+    uint64_t padrowlen, bufneed;
+    uint32_t width, height;
+    unsigned char *p;
+
+    ClipView((unsigned char *)bmp, NULL, &view, NULL);
+
+    if (CheckRotate(&view.hdr, angle, funcname, e) == BADSTATUS)
+        return 0;
+
+    width     = (angle == 90 || angle == 270) ? (uint32_t)view.hdr.i.biHeight : view.hdr.i.biWidth;
+    height    = (angle == 90 || angle == 270) ? view.hdr.i.biWidth : (uint32_t)view.hdr.i.biHeight;
+    padrowlen = PadRowLen(width, view.hdr.i.biBitCount);
+    bufneed   = view.hdr.f.bfOffBits + padrowlen * height;
+
+    if (padrowlen > BMP_MAXROWLEN || bufneed > SIZE_MAX) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - image too large to rotate.\n", funcname);
+            e->errnum = RBMP_ERR_TOOBIG;
+        }
+        return 0;
+    }
+
+    // Allocate some memory for the new bitmap, if none big enough already
+    if (*newbmp == NULL || *bufsize < bufneed) {
+        if ((p = (unsigned char*)realloc(*newbmp, (size_t)bufneed)) == NULL) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                e->errnum = RBMP_ERR_MEM;
+            }
+            return 0;
+        }
+        *newbmp  = p;
+        *bufsize = bufneed;
+    }
+
+    dst.rows   = *newbmp + view.hdr.f.bfOffBits;
+    dst.stride = (int32_t)padrowlen;
+    dst.pal    = NULL;
+
+    if (RotateViewTo(&view, &dst, angle, threads, e) == BADSTATUS)
+        return 0;
+
+    // Header, and anything between it and the data, as for the input
+    memcpy(*newbmp + HDRSIZE, view.pal, view.hdr.f.bfOffBits - HDRSIZE);
+    *(pbmhdr_t)*newbmp = dst.hdr;
+    HDRENDIAN((pbmhdr_t)*newbmp);
+
+    return bufneed;
+}
+
+//=================================================================
+// WriteVectors()
+//
+// Writes out all 'cnt' I/O vectors in 'iov' to the output file,
+// retrying on short writes. The vectors are consumed in the
+// process. Returns GOODSTATUS, or BADSTATUS on a write failure.
+//
+//=================================================================
+
+#ifndef WIN32
+static int WriteVectors(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t len;
+
+    while (cnt) {
+        if ((len = writev(fd, iov, cnt)) < 0)
+            return BADSTATUS;
+
+        // Skip over completely written vectors, and adjust any partial one
+        while (cnt && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt) {
+            iov->iov_base  = (char *)iov->iov_base + len;
+            iov->iov_len  -= len;
+        }
+    }
+
+    return GOODSTATUS;
+}
+#else
+static int WriteVectors(FILE *fp, struct iovec *iov, int cnt)
+{
+    for (; cnt; iov++, cnt--)
+        if (fwrite(iov->iov_base, 1, iov->iov_len, fp) != iov->iov_len)
+            return BADSTATUS;
+
+    return GOODSTATUS;
+}
+#endif
+
+//=================================================================
+// WriteBitmap()
+//
+// Writes the bitmap image 'bmp' to the file 'fname'. If 'boundary'
+// is not NULL, only the rectangular region it defines (with the
+// same conventions as ClipBitmap()) is written, with an updated
+// header, directly from the rows of the unmodified input image---
+// i.e. no compaction of the data is required. The region's left
+// edge must fall on a byte boundary in the pixel data. Returns
+// as for WriteView().
+//
+//=================================================================
+
+int WriteBitmap(const char *fname, const unsigned char *bmp, const prect_t boundary, perrmsg_t e)
+{
+    bmview_t view;
+
+    if (ClipView((unsigned char *)bmp, boundary, &view, e) == BADSTATUS)
+        return BADSTATUS;
+
+    return WriteView(fname, &view, e);
+}
+
+//=================================================================
+// WriteView()
+//
+// Writes the bitmap image region described by 'view' (see
+// ClipView()) to the file 'fname', straight from the rows of the
+// original image. Data is output with gathered writes and any
+// failure, including short writes, returns BADSTATUS with a
+// message placed in 'e' (if not NULL). Otherwise GOODSTATUS is
+// returned. Header sizes too large for their 32 bit fields are
+// written as 0 (see SetImageSizes()).
+//
+//=================================================================
+
+int WriteView(const char *fname, const pbmview_t view, perrmsg_t e)
+{
+    static const char *funcname = "WriteBitmap()";
+    static const unsigned char zeros[4] = {0, 0, 0, 0};
+
+    bmhdr_t hdr;                                        // File endian copy of header
+    struct iovec iov[MAXIOVECS];                        // Gathered output vectors
+    uint32_t o_rowlen, o_padrowlen;                     // Row lengths
+    uint32_t i;
+    int cnt, status = GOODSTATUS;
+#ifndef WIN32
+    int fd;
+#else
+    FILE *fd;
+#endif
+
+    o_rowlen    = (uint32_t)(((uint64_t)view->hdr.i.biWidth * view->hdr.i.biBitCount + 7) / BYTEWIDTH);
+    o_padrowlen = 4 * ((o_rowlen+3)/4);
+
+#ifndef WIN32
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+#else
+    if ((fd = fopen(fname, "wb")) == NULL) {
+#endif
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for writing.\n", funcname, fname);
+            e->errnum = WBMP_ERR_OPEN;
+        }
+        return BADSTATUS;
+    }
+
+    // Sizes from the row layout, as the header's image size may be zero for uncompressed images
+    hdr = view->hdr;
+    SetImageSizes(&hdr, (uint64_t)o_padrowlen * hdr.i.biHeight);
+    HDRENDIAN(&hdr);
+
+    // Header, followed by the colour table (if any)
+    iov[0].iov_base = (void *)&hdr;
+    iov[0].iov_len  = HDRSIZE;
+    iov[1].iov_base = (void *)view->pal;
+    iov[1].iov_len  = view->hdr.f.bfOffBits - HDRSIZE;
+    cnt = 2;
+
+    if (view->stride == (int32_t)o_padrowlen) {
+        // Whole, padded rows in order, so the pixel data is contiguous
+        iov[cnt].iov_base = (void *)view->rows;
+        iov[cnt].iov_len  = (size_t)o_padrowlen * view->hdr.i.biHeight;
+        status = WriteVectors(fd, iov, cnt + 1);
+    } else {
+        // The retained section of each row, straight from the input, plus padding
+        for (i = 0; i < view->hdr.i.biHeight && status == GOODSTATUS; i++) {
+            iov[cnt].iov_base = (void *)(view->rows + (int64_t)i * view->stride);
+            iov[cnt].iov_len  = o_rowlen;
+            cnt++;
+
+            if (o_padrowlen != o_rowlen) {
+                iov[cnt].iov_base = (void *)zeros;
+                iov[cnt].iov_len  = o_padrowlen - o_rowlen;
+                cnt++;
+            }
+
+            // Flush when vector array full, or at the last row
+            if (cnt >= MAXIOVECS-1 || i == view->hdr.i.biHeight-1) {
+                status = WriteVectors(fd, iov, cnt);
+                cnt = 0;
+            }
+        }
+    }
+
+#ifndef WIN32
+    if (close(fd) < 0)
+#else
+    if (fclose(fd) != 0)
+#endif
+        status = BADSTATUS;
+
+    if (status == BADSTATUS && e != NULL) {
+        snprintf(e->errbuf, e->errsize, "***Error: %s - failed writing to %s.\n", funcname, fname);
+        e->errnum = WBMP_ERR_WRITE;
+    }
+
+    return status;
+}
+
+//=================================================================
+// WriteViewFormat()
+//
+// Writes the bitmap image region described by 'view' (see
+// ClipView()) to the file 'fname' as for WriteView(), but with its
+// pixels converted to format 'fmt' (see ConvertBmpFormat()). Rows
+// are converted a strip at a time into a single buffer, so that
+// the whole converted image is never held in memory. A view that
+// is already in the format is written unchanged. Returns
+// GOODSTATUS, or BADSTATUS with a message placed in 'e' (if not
+// NULL).
+//
+//=================================================================
+
+int WriteViewFormat(const char *fname, const pbmview_t view, uint32_t fmt, perrmsg_t e)
+{
+    static const char *funcname = "WriteViewFormat()";
+
+    bmhdr_t hdr;                                        // Output header
+    unsigned char masks[MASKSSIZE];                     // Output colour masks
+    cvtlut_t lut;                                       // Pixel conversion table
+    struct iovec iov[2];                                // Gathered output vectors
+    unsigned char *buf, *tmp;                           // Converted strip, and row buffer
+    uint32_t width, height, masklen;
+    uint64_t o_rowlen;
+    uint32_t o_padrowlen, striprows, rows;
+    uint32_t i, j;
+    int status;
+#ifndef WIN32
+    int fd;
+#else
+    FILE *fd;
+#endif
+
+    if (PixelFormat(&view->hdr, (const unsigned char *)view->pal) == fmt)
+        return WriteView(fname, view, e);
+
+    if (fmt != BMP_FMT555 && fmt != BMP_FMT565 && fmt != BMP_FMT24 && fmt != BMP_FMT32) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported output pixel format (%d).\n", funcname, fmt);
+            e->errnum = WBMP_ERR_BADFORMAT;
+        }
+        return BADSTATUS;
+    }
+
+    width  = view->hdr.i.biWidth;
+    height = view->hdr.i.biHeight;
+
+    masklen     = FormatHeader(&hdr, &view->hdr, width, height, fmt, masks);
+    o_rowlen    = (uint64_t)width * hdr.i.biBitCount / BYTEWIDTH;
+
+    if (o_rowlen > BMP_MAXROWLEN) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - image too large to write in %d bit format.\n", funcname, 
+                     fmt);
+            e->errnum = WBMP_ERR_TOOBIG;
+        }
+        return BADSTATUS;
+    }
+    o_padrowlen = 4 * (((uint32_t)o_rowlen+3)/4);
+
+    BuildConvertLut(&lut, &view->hdr, (const unsigned char *)view->pal, view->ncolours, fmt);
+
+    // Strip buffer, cleared so that the row padding is zero, followed by the row buffer
+    striprows = CONVSTRIPSIZE / o_padrowlen;
+    if (striprows == 0)
+        striprows = 1;
+    if (striprows > height)
+        striprows = height;
+
+    if ((buf = (unsigned char *)calloc(1, (size_t)striprows * o_padrowlen + (size_t)3 * width)) == NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = WBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
+    tmp = buf + (size_t)striprows * o_padrowlen;
+
+#ifndef WIN32
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+#else
+    if ((fd = fopen(fname, "wb")) == NULL) {
+#endif
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for writing.\n", funcname, fname);
+            e->errnum = WBMP_ERR_OPEN;
+        }
+        free(buf);
+        return BADSTATUS;
+    }
+
+    HDRENDIAN(&hdr);
+
+    // Header, followed by any colour masks
+    iov[0].iov_base = (void *)&hdr;
+    iov[0].iov_len  = HDRSIZE;
+    iov[1].iov_base = (void *)masks;
+    iov[1].iov_len  = masklen;
+
+    status = WriteVectors(fd, iov, 2);
+
+    for (i = 0; i < height && status == GOODSTATUS; i += rows) {
+        rows = (height - i < striprows) ? height - i : striprows;
+
+        for (j = 0; j < rows; j++)
+            ConvertPixels(&buf[(size_t)j * o_padrowlen], view->rows + (int64_t)(i + j) * view->stride, width, &lut, tmp);
+
+        iov[0].iov_base = (void *)buf;
+        iov[0].iov_len  = (size_t)rows * o_padrowlen;
+
+        status = WriteVectors(fd, iov, 1);
+    }
+
+#ifndef WIN32
+    if (close(fd) < 0)
+#else
+    if (fclose(fd) != 0)
+#endif
+        status = BADSTATUS;
+
+    free(buf);
+
+    if (status == BADSTATUS && e != NULL) {
+        snprintf(e->errbuf, e->errsize, "***Error: %s - failed writing to %s.\n", funcname, fname);
+        e->errnum = WBMP_ERR_WRITE;
+    }
+
+    return status;
+}
+
+//=================================================================
+// EncodeRleRow()
+//
+// Run length encodes the 'width' pixel indexes 'pix' of one row
+// into 'out', as RLE8 or, for 'bpp' of 4, RLE4, returning the
+// number of bytes used (at most 2*width + 2). Runs of three or
+// more equal pixels are encoded runs, as are isolated pairs and
+// singles, whilst other stretches use absolute mode, so that
+// uncompressible data costs little more than its packed size.
+// No end of line is added.
+//
+//=================================================================
+
+static uint32_t EncodeRleRow(unsigned char *out, const unsigned char *pix, uint32_t width, uint32_t bpp)
+{
+    uint32_t i, j, n, k, o = 0;
+
+    for (i = 0; i < width; i += n) {
+        // Length of run of equal pixels from i
+        for (n = 1; i + n < width && n < 255 && pix[i+n] == pix[i]; n++)
+            ;
+
+        if (n < 3) {
+            // Gather pixels up to the next run of three, for absolute mode
+            for (j = i; j < width && j - i < 255; j++)
+                if (j + 2 < width && pix[j] == pix[j+1] && pix[j] == pix[j+2])
+                    break;
+
+            if (j - i >= 3) {
+                n = j - i;
+                out[o++] = 0;
+                out[o++] = n;
+                if (bpp == BYTEWIDTH) {
+                    memcpy(&out[o], &pix[i], n);
+                    o += n;
+                } else {
+                    for (k = 0; k < n; k += 2)
+                        out[o++] = (pix[i+k] << 4) | ((k + 1 < n) ? pix[i+k+1] : 0);
+                }
+
+                // Absolute runs are padded to a 16 bit boundary
+                if (o & 1)
+                    out[o++] = 0;
+                continue;
+            }
+        }
+
+        out[o++] = n;
+        out[o++] = (bpp == BYTEWIDTH) ? pix[i] : (pix[i] << 4) | pix[i];
+    }
+
+    return o;
+}
+
+//=================================================================
+// WriteRleView()
+//
+// Writes the 8 or 4 bit bitmap image region described by 'view'
+// (see ClipView()) to the file 'fname', RLE8 or RLE4 encoded (see
+// EncodeRleRow()), with each row ended by an end of line, and the
+// last by an end of bitmap. The image is encoded into a single
+// buffer, grown as required, and written out with the header and
+// colour table in one gathered write. The encoded data must fit
+// in the 32 bit biSizeImage header field. Returns GOODSTATUS, or
+// BADSTATUS with a message placed in 'e' (if not NULL).
+//
+//=================================================================
+
+int WriteRleView(const char *fname, const pbmview_t view, perrmsg_t e)
+{
+    static const char *funcname = "WriteRleView()";
+
+    bmhdr_t hdr;                                        // File endian copy of header
+    struct iovec iov[3];                                // Gathered output vectors
+    unsigned char *buf, *tmp_buf, *pix, *row;           // Encoded data, and row pixel indexes
+    uint64_t bufsize, len;                              // Encoded data buffer size, and length
+    uint32_t width, bpp, x, i;
+    int status;
+#ifndef WIN32
+    int fd;
+#else
+    FILE *fd;
+#endif
+
+    width = view->hdr.i.biWidth;
+    bpp   = view->hdr.i.biBitCount;
+
+    if (bpp != 8 && bpp != 4) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - only 8 and 4 bit images can be run length encoded.\n", 
+                     funcname);
+            e->errnum = WBMP_ERR_BADRLE;
+        }
+        return BADSTATUS;
+    }
+
+    // Start with room for a well compressed image, plus the worst case for one row
+    bufsize = (uint64_t)width * view->hdr.i.biHeight / 4 + 2 * (uint64_t)width + 4;
+    buf     = (bufsize <= SIZE_MAX) ? (unsigned char *)malloc((size_t)bufsize) : NULL;
+    pix     = (unsigned char *)malloc(width);
+
+    if (buf == NULL || pix == NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = WBMP_ERR_MEM;
+        }
+        free(buf);
+        free(pix);
+        return BADSTATUS;
+    }
+
+    for (len = 0, i = 0; i < view->hdr.i.biHeight; i++) {
+        // Make sure there's room for the worst case row
+        if (bufsize - len < 2 * (uint64_t)width + 4) {
+            tmp_buf = buf;
+            bufsize = 2 * bufsize + 2 * (uint64_t)width + 4;
+            if (bufsize > SIZE_MAX || (buf = (unsigned char *)realloc(tmp_buf, (size_t)bufsize)) == NULL) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                    e->errnum = WBMP_ERR_MEM;
+                }
+                free(tmp_buf);
+                free(pix);
+                return BADSTATUS;
+            }
+        }
+
+        row = view->rows + (int64_t)i * view->stride;
+
+        if (bpp == BYTEWIDTH) {
+            len += EncodeRleRow(&buf[len], row, width, bpp);
+        } else {
+            for (x = 0; x < width; x++)
+                pix[x] = (row[x >> 1] >> ((x & 1) ? 0 : 4)) & 0xf;
+            len += EncodeRleRow(&buf[len], pix, width, bpp);
+        }
+
+        // End of line, or end of bitmap for the last row
+        buf[len++] = 0;
+        buf[len++] = (i == view->hdr.i.biHeight - 1) ? 1 : 0;
+    }
+
+    free(pix);
+
+    if (len > 0xffffffffULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - run length encoded data too large for header.\n", funcname);
+            e->errnum = WBMP_ERR_TOOBIG;
+        }
+        free(buf);
+        return BADSTATUS;
+    }
+
+#ifndef WIN32
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+#else
+    if ((fd = fopen(fname, "wb")) == NULL) {
+#endif
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for writing.\n", funcname, fname);
+            e->errnum = WBMP_ERR_OPEN;
+        }
+        free(buf);
+        return BADSTATUS;
+    }
+
+    hdr = view->hdr;
+    hdr.i.biCompression = (bpp == BYTEWIDTH) ? BMP_RLE8 : BMP_RLE4;
+    SetImageSizes(&hdr, len);
+    HDRENDIAN(&hdr);
+
+    // Header, colour table and encoded data
+    iov[0].iov_base = (void *)&hdr;
+    iov[0].iov_len  = HDRSIZE;
+    iov[1].iov_base = (void *)view->pal;
+    iov[1].iov_len  = view->hdr.f.bfOffBits - HDRSIZE;
+    iov[2].iov_base = (void *)buf;
+    iov[2].iov_len  = (size_t)len;
+
+    status = WriteVectors(fd, iov, 3);
+
+#ifndef WIN32
+    if (close(fd) < 0)
+#else
+    if (fclose(fd) != 0)
+#endif
+        status = BADSTATUS;
+
+    free(buf);
+
+    if (status == BADSTATUS && e != NULL) {
+        snprintf(e->errbuf, e->errsize, "***Error: %s - failed writing to %s.\n", funcname, fname);
+        e->errnum = WBMP_ERR_WRITE;
+    }
+
+    return status;
+}
+
+//=================================================================
+// ReadStrip()
+//
+// Reads the 'cnt' input rows of the stream described by 'st' from
+// stored row 'srow' into its input strip, decoding them if run
+// length encoded. Returns GOODSTATUS, or BADSTATUS with an error
+// message placed in 'e' (if not NULL).
+//
+//=================================================================
+
+static int ReadStrip(const pstrm_t st, uint32_t srow, uint32_t cnt, const char *funcname, perrmsg_t e)
+{
+    rlepos_t pos;                                       // Run length decoder position
+    uint32_t k;
+
+    if (st->rle != NULL) {
+        // Decode the strip's rows from their indexed positions in the compressed data
+        for (k = 0; k < cnt; k++) {
+            pos = st->rowpos[srow + k];
+            RleRow(st->rle, st->rlesize, st->hdr.i.biBitCount, st->hdr.i.biWidth, &pos, srow + k,
+                   &st->istrip[(size_t)k * st->i_padrowlen]);
+        }
+    } else if (fseeko(st->ifp, (off_t)(st->hdr.f.bfOffBits + (uint64_t)srow * st->i_padrowlen), SEEK_SET) != 0 ||
+               fread(st->istrip, 1, (size_t)cnt * st->i_padrowlen, st->ifp) != (size_t)cnt * st->i_padrowlen) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        return BADSTATUS;
+    }
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// StreamRows()
+//
+// Returns the first stored input row of the strip of 'cnt' rows
+// making output rows 'o' onwards of the stream described by 'st',
+// and sets 'reverse' if the strip's rows are taken in reverse of
+// their stored order. This is when flipping about the horizontal
+// axis (for 'control'), or when stored top down, but not both.
+// When reversing, output strips are taken from the end of the
+// stored rows back.
+//
+//=================================================================
+
+static uint32_t StreamRows(const pstrm_t st, const ptrans_t control, uint32_t o, uint32_t cnt, uint32_t *reverse)
+{
+    *reverse = (control->fliph != 0) ^ st->topdown;
+
+    return *reverse ? st->hdr.i.biHeight - st->rect.bottom - o - cnt : st->rect.bottom + o;
+}
+
+//=================================================================
+// StreamLevels()
+//
+// Makes, in 'lv', the levels adjustment selected by 'control' for
+// the stream described by 'st', from the statistics of the input
+// pixels that are output, counted into 'hist' (left cleared) in a
+// first pass over the strips, before they are read again to be
+// output. Returns GOODSTATUS, or BADSTATUS with an error message
+// placed in 'e' (if not NULL).
+//
+//=================================================================
+
+static int StreamLevels(const pstrm_t st, const ptrans_t control, pstathist_t hist, pbmplevels_t lv, 
+                        const char *funcname, perrmsg_t e)
+{
+    bmpstats_t stats;
+    unsigned char *row;
+    uint32_t height, left, o, k, cnt, srow, reverse;
+
+    // The columns output, which a flip about the vertical axis takes from the other side
+    height = st->rect.top - st->rect.bottom;
+    left   = control->flipv ? st->hdr.i.biWidth - st->rect.right : st->rect.left;
+
+    for (o = 0; o < height; o += cnt) {
+        cnt  = (height - o > st->striprows) ? st->striprows : height - o;
+        srow = StreamRows(st, control, o, cnt, &reverse);
+
+        if (ReadStrip(st, srow, cnt, funcname, e) == BADSTATUS)
+            return BADSTATUS;
+
+        for (k = 0; k < cnt; k++) {
+            row = &st->istrip[(size_t)k * st->i_padrowlen];
+            if (st->convert) {
+                ConvertRow(st->rowbuf, row, st->hdr.i.biWidth, &st->lut);
+                row = st->rowbuf;
+            }
+            CountRow(hist, &row[(size_t)3 * left], st->rect.right - st->rect.left, 3);
+        }
+    }
+
+    MergeStats(&stats, hist, 1);
+    memset(hist, 0, sizeof(stathist_t));
+
+    return MakeLevels(lv, &stats, control->levels, control->levelclip, e);
+}
+
+//=================================================================
+// StreamStrips()
+//
+// Processes the output rows of the stream described by 'st' a
+// strip at a time, reading the required input rows, converting
+// and transforming them a row at a time, with any levels
+// adjustment 'lv', and writing the retained part of each row.
+// Returns GOODSTATUS, or BADSTATUS with an error message placed
+// in 'e' (if not NULL).
+//
+//=================================================================
+
+static int StreamStrips(const pstrm_t st, const ptrans_t control, const bmplevels_t *lv, const char *funcname, perrmsg_t e)
+{
+    unsigned char *irow, *row;                          // Pointers to row data
+    xform_t xf;                                         // Precomputed row transforms
+    uint32_t height, transform, reverse;
+    uint32_t o, k, cnt, srow;                           // Row indexes and counts
+
+    height    = st->rect.top - st->rect.bottom;
+    transform = HasTransforms(control);
+
+    BuildXform(&xf, control, lv, GetSimdLevel(), 3);
+
+    for (o = 0; o < height; o += cnt) {
+
+        cnt = height - o;
+        if (cnt > st->striprows)
+            cnt = st->striprows;
+
+        srow = StreamRows(st, control, o, cnt, &reverse);
+
+        if (ReadStrip(st, srow, cnt, funcname, e) == BADSTATUS)
+            return BADSTATUS;
+
+        for (k = 0; k < cnt; k++) {
+            irow = &st->istrip[(size_t)(reverse ? cnt-1-k : k) * st->i_padrowlen];
+
+            // Convert to 24 bits if required
+            if (st->convert) {
+                ConvertRow(st->rowbuf, irow, st->hdr.i.biWidth, &st->lut);
+                row = st->rowbuf;
+            } else {
+                row = irow;
+            }
+
+            if (transform)
+                TransformRow(row, st->hdr.i.biWidth, &xf);
+
+            // Place the retained part of the row in the output strip (padding already zero)
+            memcpy(&st->ostrip[(size_t)k * st->o_padrowlen], &row[(size_t)3 * st->rect.left], st->o_rowlen);
+
+            if (st->hist != NULL)
+                CountRow(st->hist, &row[(size_t)3 * st->rect.left], st->rect.right - st->rect.left, 3);
+        }
+
+        if (fwrite(st->ostrip, 1, (size_t)cnt * st->o_padrowlen, st->ofp) != (size_t)cnt * st->o_padrowlen) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - failed writing output.\n", funcname);
+                e->errnum = SBMP_ERR_WRITE;
+            }
+            return BADSTATUS;
+        }
+    }
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// StreamBitmap()
+//
+// Converts (if not 24 bit), transforms and clips the bitmap file
+// 'ifname', writing the result to the file 'ofname', with the same
+// results as ConvertBmpTo24bit(), TransformBmp() and WriteBitmap().
+// The image is never fully resident. Instead, strips of up to
+// 'striprows' rows are read, processed a row at a time, and written
+// out in turn, bounding memory use to the strip size. Only the rows
+// within the clipping rectangle 'boundary' (if not NULL) are read,
+// and a flip about the horizontal axis is done by reading strips
+// from the top of the input down, reversing their rows (as for a
+// top down input without a flip, the output always being bottom up). Run length
+// encoded data is read whole, but only in its compressed form, and
+// indexed by row so that strips decode just the rows they need. Any
+// statistics (see TransformBmp()) are of the rows output, counted as
+// each is placed in its strip. Any levels are made from a first
+// pass over the region's strips, which are then read (or decoded)
+// again to be output, rather than the image being held. Returns
+// GOODSTATUS, or BADSTATUS with a message placed in 'e' (if not
+// NULL). Header errors are reported with the GetBitmap() codes.
+//
+//=================================================================
+
+int StreamBitmap(const char *ifname, const char *ofname, const ptrans_t control, const prect_t boundary, 
+                 uint32_t striprows, perrmsg_t e)
+{
+    static const char *funcname = "StreamBitmap()";
+
+    strm_t st;                                          // Stream state
+    bmplevels_t lv;                                     // Levels adjustment, if any
+    bmhdr_t ohdr;                                       // Output header
+    unsigned char *buf, *extra;                         // Buffer memory, and extra header bytes
+    uint32_t extralen, palsize, ncolours;               // Header sizes, and colour table entries
+    uint64_t paloff;                                    // Colour table offset in file
+    uint64_t size, bufsize, histlen;                    // File, buffer and histogram sizes
+    rlepos_t pos;                                       // Run length decoder position
+    uint32_t i;
+    int64_t len;
+    int status;
+
+    st.rle    = NULL;
+    st.rowpos = NULL;
+
+    // A filter needs the rows either side of each, so is not applied to strips
+    if (control->filter != NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - convolution filters cannot be streamed.\n", funcname);
+            e->errnum = TBMP_ERR_BADPARAM;
+        }
+        return BADSTATUS;
+    }
+
+    if ((st.ifp = fopen(ifname, "rb")) == NULL || fseeko(st.ifp, 0, SEEK_END) != 0 || (len = ftello(st.ifp)) < 0) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for reading.\n", funcname, ifname);
+            e->errnum = GBMP_ERR_OPEN;
+        }
+        if (st.ifp != NULL)
+            fclose(st.ifp);
+        return BADSTATUS;
+    }
+    size = (uint64_t)len;
+    rewind(st.ifp);
+
+    // Get the header and validate it
+    if (fread(&st.hdr, 1, HDRSIZE, st.ifp) != HDRSIZE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file reading header.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        fclose(st.ifp);
+        return BADSTATUS;
+    }
+    HDRENDIAN(&st.hdr);
+
+    if (CheckHeader(&st.hdr, size, funcname, e) == BADSTATUS || CheckControl(control, funcname, e) == BADSTATUS) {
+        fclose(st.ifp);
+        return BADSTATUS;
+    }
+
+    st.convert = (st.hdr.i.biBitCount != 24);
+
+    // Rows are addressed by their stored order from here, with the output always bottom up
+    st.topdown        = BMPTOPDOWN(&st.hdr);
+    st.hdr.i.biHeight = BMPHEIGHT(&st.hdr);
+
+    // Work out the output region
+    st.rect.left   = 0;
+    st.rect.right  = st.hdr.i.biWidth;
+    st.rect.bottom = 0;
+    st.rect.top    = st.hdr.i.biHeight;
+
+    if (boundary != NULL) {
+        st.rect = *boundary;
+
+        if (st.rect.right > st.hdr.i.biWidth)
+            st.rect.right = st.hdr.i.biWidth;
+        if (st.rect.top > st.hdr.i.biHeight)
+            st.rect.top = st.hdr.i.biHeight;
+
+        if (st.rect.right <= st.rect.left || st.rect.top <= st.rect.bottom) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - bad clipping rectangle (%d %d %d %d).\n", 
+                         funcname, st.rect.left, st.rect.right, st.rect.bottom, st.rect.top);
+                e->errnum = SBMP_ERR_BADCLIP;
+            }
+            fclose(st.ifp);
+            return BADSTATUS;
+        }
+    }
+
+    // Output rows are 24 bits, so may be longer than any input row
+    if (3 * (uint64_t)st.hdr.i.biWidth > BMP_MAXROWLEN) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - image too large (%u pixel rows).\n", funcname, 
+                     st.hdr.i.biWidth);
+            e->errnum = GBMP_ERR_BADSIZE;
+        }
+        fclose(st.ifp);
+        return BADSTATUS;
+    }
+
+    st.i_padrowlen = (uint32_t)PadRowLen(st.hdr.i.biWidth, st.hdr.i.biBitCount);
+    st.o_rowlen    = 3 * (st.rect.right - st.rect.left);
+    st.o_padrowlen = 4 * ((st.o_rowlen+3)/4);
+
+    if (striprows == 0 || striprows > st.rect.top - st.rect.bottom)
+        striprows = st.rect.top - st.rect.bottom;
+    st.striprows = striprows;
+
+    // Construct output header. A converted image has no colour table, whilst 
+    // 24 bit images keep anything between the header and the data.
+    ohdr = st.hdr;
+    if (st.convert) {
+        ohdr.f.bfOffBits      = HDRSIZE;
+        ohdr.i.biSize         = INFOHDRSIZE;
+        ohdr.i.biCompression  = BMP_RGB;
+        ohdr.i.biBitCount     = 24;
+        ohdr.i.biClrUsed      = 0;
+        ohdr.i.biClrImportant = 0;
+    }
+    if (st.convert || boundary != NULL) {
+        ohdr.i.biWidth        = st.rect.right - st.rect.left;
+        ohdr.i.biHeight       = st.rect.top - st.rect.bottom;
+        SetImageSizes(&ohdr, (uint64_t)st.o_padrowlen * ohdr.i.biHeight);
+    }
+    HDRENDIAN(&ohdr);
+
+    // Colour table (or colour masks) to read, or extra header bytes to pass through
+    extralen = st.hdr.f.bfOffBits - HDRSIZE;
+    paloff   = !st.convert ? HDRSIZE : ColourTable(&st.hdr, &ncolours);
+    palsize  = (st.hdr.i.biBitCount <= BYTEWIDTH) ? ncolours * sizeof(rgbquad_t) : MASKSSIZE + 4;
+    palsize  = !st.convert ? extralen : (palsize > extralen) ? extralen : palsize;
+
+    // One allocation for any histograms (for the statistics, or first for the levels), the
+    // strips, the conversion row and any extra header bytes
+    histlen = (control->stats != NULL || control->levels) ? sizeof(stathist_t) : 0;
+    bufsize = histlen + (uint64_t)striprows * ((uint64_t)st.i_padrowlen + st.o_padrowlen) + 3 * (uint64_t)st.hdr.i.biWidth + 
+              (st.convert ? 0 : extralen);
+
+    if (bufsize > SIZE_MAX || (buf = (unsigned char *)calloc(1, (size_t)bufsize)) == NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = SBMP_ERR_MEM;
+        }
+        fclose(st.ifp);
+        return BADSTATUS;
+    }
+    st.hist   = (control->stats != NULL) ? (pstathist_t)buf : NULL;
+    st.istrip = buf + histlen;
+    st.ostrip = st.istrip + (size_t)striprows * st.i_padrowlen;
+    st.rowbuf = st.ostrip + (size_t)striprows * st.o_padrowlen;
+    extra     = st.rowbuf + (size_t)3 * st.hdr.i.biWidth;
+
+    memset(st.pal, 0, sizeof(st.pal));
+
+    status = GOODSTATUS;
+
+    if ((paloff != HDRSIZE && fseeko(st.ifp, (off_t)paloff, SEEK_SET) != 0) ||
+        fread(st.convert ? (void *)st.pal : (void *)extra, 1, palsize, st.ifp) != palsize) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        status = BADSTATUS;
+    } else if (ISRLE(&st.hdr) && 
+               ((st.rle    = (unsigned char *)malloc(st.hdr.i.biSizeImage)) == NULL ||
+                (st.rowpos = (prlepos_t)malloc(st.hdr.i.biHeight * sizeof(rlepos_t))) == NULL)) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = SBMP_ERR_MEM;
+        }
+        status = BADSTATUS;
+    } else if (st.rle != NULL && 
+               (fseeko(st.ifp, st.hdr.f.bfOffBits, SEEK_SET) != 0 || 
+                fread(st.rle, 1, st.hdr.i.biSizeImage, st.ifp) != st.hdr.i.biSizeImage)) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        status = BADSTATUS;
+    } else if ((st.ofp = fopen(ofname, "wb")) == NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for writing.\n", funcname, ofname);
+            e->errnum = SBMP_ERR_OPEN;
+        }
+        status = BADSTATUS;
+    } else {
+        if (st.convert)
+            BuildConvertLut(&st.lut, &st.hdr, (unsigned char *)st.pal, palsize / sizeof(rgbquad_t), BMP_FMT24);
+
+        // Index the decoder position at the start of each row with a parse only pass
+        if (st.rle != NULL) {
+            st.rlesize = st.hdr.i.biSizeImage;
+            memset(&pos, 0, sizeof(rlepos_t));
+            for (i = 0; i < st.hdr.i.biHeight; i++) {
+                st.rowpos[i] = pos;
+                RleRow(st.rle, st.rlesize, st.hdr.i.biBitCount, st.hdr.i.biWidth, &pos, i, NULL);
+            }
+        }
+
+        // Make any levels from a first pass over the region, then output the header, and
+        // any extra header bytes, then the image
+        if (control->levels && StreamLevels(&st, control, (pstathist_t)buf, &lv, funcname, e) == BADSTATUS) {
+            status = BADSTATUS;
+        } else if (fwrite(&ohdr, 1, HDRSIZE, st.ofp) != HDRSIZE || 
+                   (!st.convert && fwrite(extra, 1, extralen, st.ofp) != extralen)) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - failed writing to %s.\n", funcname, ofname);
+                e->errnum = SBMP_ERR_WRITE;
+            }
+            status = BADSTATUS;
+        } else {
+            status = StreamStrips(&st, control, control->levels ? &lv : NULL, funcname, e);
+        }
+
+        if (status == GOODSTATUS && st.hist != NULL)
+            MergeStats(control->stats, st.hist, 1);
+
+        if (fclose(st.ofp) != 0 && status == GOODSTATUS) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - failed writing to %s.\n", funcname, ofname);
+                e->errnum = SBMP_ERR_WRITE;
+            }
+            status = BADSTATUS;
+        }
+    }
+
+    fclose(st.ifp);
+    free(st.rowpos);
+    free(st.rle);
+    free(buf);
+
+    return status;
+}
+
+//=================================================================
+// PlanPipeline()
+//
+// Plans the list of 'nops' operations 'ops', to be applied in turn
+// to the bitmap image 'bmp', as a single pass over just the part of
+// the image the result needs (see RunPipeline()), placing the plan
+// in 'plan'. Clips are of the image as it stands after the
+// operations before them, so each is mirrored through any flips so
+// far and folded into the one region of the input that is read.
+// Flips, which move pixels without changing them, are combined and
+// made as the region is output. The point operations are grouped
+// into stages, a run of them in the order TransformBmp() applies
+// them (reverse, brightness, contrast, mono, grey) forming a single
+// stage, with the same results, so a mono followed by a grey gives
+// a grey scale of just the mono colours. Any other order starts a
+// new stage. A stretch or equalization, whose levels are made from
+// the region of the input read (see RunPipeline()), must come
+// before any other point operation, starting the first stage.
+// There may be one resize, of the region as it stands, with a zero
+// width or height keeping the region's shape. Clips after it are
+// folded into the region of the resized image that is output, and
+// stages after it are applied to the resized rows (the flips still
+// being made as the rows are output). Rotations are of the whole
+// input, made first (see RunPipeline()), so any clips before them
+// are mapped onto the rotated image, and any flips before them
+// exchanged as needed. A rotation must come before any resize.
+// The output is 24 bit, unless a BMP_OP_FORMAT selects another
+// format.
+// Returns GOODSTATUS, or BADSTATUS with a message placed in 'e' (if
+// not NULL).
+//
+//=================================================================
+
+int PlanPipeline(const unsigned char *bmp, const pbmpop_t ops, uint32_t nops, pbmplan_t plan, perrmsg_t e)
+{
+    static const char *funcname = "PlanPipeline()";
+
+    bmhdr_t hdr;                                        // Host endian copy of header
+    ptrans_t stage = NULL;                              // Stage being added to
+    prect_t cur;                                        // Region clips are folded into
+    rect_t r;                                           // Clip, in the unflipped region
+    uint32_t width, height, tmp;
+    uint32_t rank, last = 0;                            // Order of point operations within a stage
+    uint32_t i;
+
+    hdr = *(pbmhdr_t)bmp;
+    HDRENDIAN(&hdr);
+
+    memset(plan, 0, sizeof(bmplan_t));
+    plan->rect.left   = 0;
+    plan->rect.right  = hdr.i.biWidth;
+    plan->rect.bottom = 0;
+    plan->rect.top    = BMPHEIGHT(&hdr);
+    plan->fmt         = BMP_FMT24;
+
+    for (i = 0; i < nops; i++) {
+        switch (ops[i].op) {
+        case BMP_OP_CLIP:
+            // Limited to the image as it stands, as for ClipView()
+            cur    = plan->width ? &plan->crop : &plan->rect;
+            width  = cur->right - cur->left;
+            height = cur->top - cur->bottom;
+
+            r = ops[i].rect;
+            if (r.right > width)
+                r.right = width;
+            if (r.top > height)
+                r.top = height;
+
+            if (r.right <= r.left || r.top <= r.bottom) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - bad clipping rectangle (%d %d %d %d).\n", 
+                             funcname, ops[i].rect.left, ops[i].rect.right, ops[i].rect.bottom, ops[i].rect.top);
+                    e->errnum = PBMP_ERR_BADCLIP;
+                }
+                return BADSTATUS;
+            }
+
+            if (plan->flipv) {
+                tmp     = r.left;
+                r.left  = width - r.right;
+                r.right = width - tmp;
+            }
+            if (plan->fliph) {
+                tmp      = r.bottom;
+                r.bottom = height - r.top;
+                r.top    = height - tmp;
+            }
+
+            cur->right  = cur->left   + r.right;
+            cur->left   = cur->left   + r.left;
+            cur->top    = cur->bottom + r.top;
+            cur->bottom = cur->bottom + r.bottom;
+            break;
+
+        case BMP_OP_ROTATE:
+            if (ops[i].arg != 0 && ops[i].arg != 90 && ops[i].arg != 180 && ops[i].arg != 270) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - bad rotation angle (%d).\n", funcname, ops[i].arg);
+                    e->errnum = PBMP_ERR_BADOP;
+                }
+                return BADSTATUS;
+            }
+
+            if (plan->width) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - a rotation must come before any resize.\n", 
+                             funcname);
+                    e->errnum = PBMP_ERR_BADOP;
+                }
+                return BADSTATUS;
+            }
+
+            // Dimensions of the whole image as rotated so far
+            width  = (plan->rotate == 90 || plan->rotate == 270) ? BMPHEIGHT(&hdr) : hdr.i.biWidth;
+            height = (plan->rotate == 90 || plan->rotate == 270) ? hdr.i.biWidth : BMPHEIGHT(&hdr);
+
+            // The region read, turned with the image clockwise about its centre
+            r = plan->rect;
+            switch (ops[i].arg) {
+            case 90:
+                plan->rect.left   = r.bottom;
+                plan->rect.right  = r.top;
+                plan->rect.bottom = width - r.right;
+                plan->rect.top    = width - r.left;
+                break;
+            case 180:
+                plan->rect.left   = width - r.right;
+                plan->rect.right  = width - r.left;
+                plan->rect.bottom = height - r.top;
+                plan->rect.top    = height - r.bottom;
+                break;
+            case 270:
+                plan->rect.left   = height - r.top;
+                plan->rect.right  = height - r.bottom;
+                plan->rect.bottom = r.left;
+                plan->rect.top    = r.right;
+                break;
+            }
+
+            // A quarter turn exchanges which way flips are made
+            if (ops[i].arg == 90 || ops[i].arg == 270) {
+                tmp               = plan->flipv;
+                plan->flipv       = plan->fliph;
+                plan->fliph       = tmp;
+            }
+            plan->rotate = (plan->rotate + ops[i].arg) % 360;
+            break;
+
+        case BMP_OP_RESIZE:
+            width  = plan->rect.right - plan->rect.left;
+            height = plan->rect.top - plan->rect.bottom;
+
+            if (plan->width) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - only one resize may be made.\n", funcname);
+                    e->errnum = PBMP_ERR_TOOMANY;
+                }
+                return BADSTATUS;
+            }
+
+            if (ops[i].arg != BMP_FILTERBOX && ops[i].arg != BMP_FILTERBILINEAR) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - unknown resize filter (%d).\n", funcname, ops[i].arg);
+                    e->errnum = PBMP_ERR_BADOP;
+                }
+                return BADSTATUS;
+            }
+
+            plan->width  = ops[i].rect.right;
+            plan->height = ops[i].rect.top;
+            plan->filter = ops[i].arg;
+
+            // A missing dimension is in proportion to the other
+            if (plan->width == 0 && plan->height != 0)
+                plan->width  = (uint32_t)(((uint64_t)plan->height * width + height/2) / height);
+            else if (plan->height == 0 && plan->width != 0)
+                plan->height = (uint32_t)(((uint64_t)plan->width * height + width/2) / width);
+
+            if (plan->width == 0 || plan->height == 0 || plan->width > BMP_MAXROWLEN/4 || 
+                plan->height > 0x7fffffffU) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - bad resize dimensions (%d %d).\n", 
+                             funcname, ops[i].rect.right, ops[i].rect.top);
+                    e->errnum = PBMP_ERR_BADSIZE;
+                }
+                return BADSTATUS;
+            }
+
+            plan->crop.left   = 0;
+            plan->crop.right  = plan->width;
+            plan->crop.bottom = 0;
+            plan->crop.top    = plan->height;
+
+            // Later point operations are made on the resized rows
+            plan->prestages = plan->nstages;
+            stage           = NULL;
+            break;
+
+        case BMP_OP_FLIPV:
+            plan->flipv = !plan->flipv;
+            break;
+
+        case BMP_OP_FLIPH:
+            plan->fliph = !plan->fliph;
+            break;
+
+        case BMP_OP_FORMAT:
+            if (ops[i].arg != BMP_FMT555 && ops[i].arg != BMP_FMT565 && ops[i].arg != BMP_FMT24 && 
+                ops[i].arg != BMP_FMT32) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported output pixel format (%d).\n", 
+                             funcname, ops[i].arg);
+                    e->errnum = PBMP_ERR_BADFORMAT;
+                }
+                return BADSTATUS;
+            }
+            plan->fmt = ops[i].arg;
+            break;
+
+        case BMP_OP_STRETCH:
+        case BMP_OP_EQUALIZE:
+            // Levels are made from the statistics of the region read, so come before any
+            // other point operation changes its pixels
+            if (plan->nstages) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - levels must come before other point operations.\n", 
+                             funcname);
+                    e->errnum = PBMP_ERR_BADOP;
+                }
+                return BADSTATUS;
+            }
+
+            if (ops[i].op == BMP_OP_STRETCH && ops[i].arg > BMP_MAXLEVELCLIP) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - bad stretch operation parameter (%d).\n", 
+                             funcname, ops[i].arg);
+                    e->errnum = PBMP_ERR_BADOP;
+                }
+                return BADSTATUS;
+            }
+
+            stage            = &plan->stages[plan->nstages++];
+            stage->levels    = (ops[i].op == BMP_OP_STRETCH) ? BMP_LEVELSSTRETCH : BMP_LEVELSEQUALIZE;
+            stage->levelclip = (ops[i].op == BMP_OP_STRETCH) ? ops[i].arg : 0;
+            last             = 0;
+            break;
+
+        case BMP_OP_REVERSE:
+        case BMP_OP_BRIGHTNESS:
+        case BMP_OP_CONTRAST:
+        case BMP_OP_MONO:
+        case BMP_OP_GREY:
+            if (ops[i].op == BMP_OP_MONO && (ops[i].arg == MONOALL || ops[i].arg >= 0x7)) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - bad monochrome operation parameter (%d).\n", 
+                             funcname, ops[i].arg);
+                    e->errnum = PBMP_ERR_BADOP;
+                }
+                return BADSTATUS;
+            }
+
+            // A new stage, unless following the stage's operations in order
+            rank = ops[i].op - BMP_OP_REVERSE + 1;
+            if (stage == NULL || rank <= last) {
+                if (plan->nstages == BMP_MAXSTAGES) {
+                    if (e != NULL) {
+                        snprintf(e->errbuf, e->errsize, "***Error: %s - too many stages of operations (maximum %d).\n", 
+                                 funcname, BMP_MAXSTAGES);
+                        e->errnum = PBMP_ERR_TOOMANY;
+                    }
+                    return BADSTATUS;
+                }
+                stage = &plan->stages[plan->nstages++];
+            }
+            last = rank;
+
+            switch (ops[i].op) {
+            case BMP_OP_REVERSE:    stage->reverse    = TRUE;        break;
+            case BMP_OP_BRIGHTNESS: stage->brightness = ops[i].arg;  break;
+            case BMP_OP_CONTRAST:   stage->contrast   = ops[i].arg;  break;
+            case BMP_OP_MONO:       stage->mono       = ops[i].arg;  break;
+            case BMP_OP_GREY:       stage->grey       = TRUE;        break;
+            }
+            break;
+
+        default:
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unknown operation (%d).\n", funcname, ops[i].op);
+                e->errnum = PBMP_ERR_BADOP;
+            }
+            return BADSTATUS;
+        }
+    }
+
+    if (plan->width == 0)
+        plan->prestages = plan->nstages;
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// AxisTaps()
+//
+// Returns the number of input pixels each output pixel is made
+// from, when resizing 'in' pixels to 'out' with 'filter'.
+//
+//=================================================================
+
+static uint32_t AxisTaps(uint32_t in, uint32_t out, uint32_t filter)
+{
+    uint32_t taps;
+
+    if (filter == BMP_FILTERBILINEAR)
+        taps = 2;
+    else
+        taps = (in % out == 0) ? in / out : in / out + 2;
+
+    return (taps > in) ? in : taps;
+}
+
+//=================================================================
+// BuildAxis()
+//
+// Fills in the filter 'ax' (whose taps and tables are already set
+// up) for output pixels 'from' to 'from'+'n'-1 of 'in' input pixels
+// resized to 'out' with 'filter'. The centres of the output pixels
+// are spread evenly over the input, with a box filter weighting
+// each input pixel by how much of it the output pixel covers, and
+// bilinear weighting the two input pixels either side of the centre
+// by nearness. The weights are exact to the nearest fixed point
+// value, with any rounding error taken up by the largest.
+//
+//=================================================================
+
+static void BuildAxis(prszaxis_t ax, uint32_t in, uint32_t out, uint32_t from, uint32_t n, uint32_t filter)
+{
+    int16_t *w;
+    uint64_t a, b, lo, hi, c;
+    uint32_t i, j, k, last, f, frac, big;
+    int32_t sum;
+
+    for (i = 0; i < n; i++) {
+        w = &ax->weights[(size_t)i * ax->taps];
+        memset(w, 0, ax->taps * sizeof(int16_t));
+
+        if (filter == BMP_FILTERBILINEAR) {
+            // Centre of the output pixel in the input, in units of 1/(2*out) of an input pixel
+            c    = (2 * (uint64_t)(from + i) + 1) * in;
+            c    = (c > out) ? c - out : 0;
+            j    = (uint32_t)(c / (2 * (uint64_t)out));
+            frac = (uint32_t)((((c % (2 * (uint64_t)out)) << RSZWEIGHTBITS) + out) / (2 * (uint64_t)out));
+
+            if (j >= in - 1) {
+                j    = in - 1;
+                frac = 0;
+            }
+
+            f = (j + ax->taps > in) ? in - ax->taps : j;
+            w[j - f] = (int16_t)((1 << RSZWEIGHTBITS) - frac);
+            if (frac)
+                w[j + 1 - f] = (int16_t)frac;
+        } else {
+            // Output pixel covers the input from a to b, in units of 1/out of an input pixel
+            a    = (uint64_t)(from + i) * in;
+            b    = a + in;
+            j    = (uint32_t)(a / out);
+            last = (uint32_t)((b - 1) / out);
+
+            f = (j + ax->taps > in) ? in - ax->taps : j;
+            for (k = j; k <= last; k++) {
+                lo = ((uint64_t)k * out > a) ? (uint64_t)k * out : a;
+                hi = ((uint64_t)(k + 1) * out < b) ? (uint64_t)(k + 1) * out : b;
+                w[k - f] = (int16_t)((((hi - lo) << RSZWEIGHTBITS) + in/2) / in);
+            }
+        }
+
+        for (sum = 0, big = 0, k = 0; k < ax->taps; k++) {
+            sum += w[k];
+            if (w[k] > w[big])
+                big = k;
+        }
+        w[big] = (int16_t)(w[big] + (1 << RSZWEIGHTBITS) - sum);
+
+        ax->first[i] = f;
+    }
+}
+
+//=================================================================
+// HorzFilter()
+//
+// Filters the working row 'in', of 'pixbytes' byte pixels, with
+// 'ax', making 'width' pixels of 16 bit values (see the resize
+// kernels) in 'out'.
+//
+//=================================================================
+
+static void HorzFilter(int16_t *out, const unsigned char *in, const prszaxis_t ax, uint32_t width, uint32_t pixbytes)
+{
+    const unsigned char *p;
+    const int16_t *w;
+    uint32_t x, c, t;
+    int32_t sum;
+
+    for (x = 0; x < width; x++) {
+        p = in + (size_t)ax->first[x] * pixbytes;
+        w = &ax->weights[(size_t)x * ax->taps];
+
+        for (c = 0; c < pixbytes; c++) {
+            sum = 1 << (RSZWEIGHTBITS - RSZFRACBITS - 1);
+            for (t = 0; t < ax->taps; t++)
+                sum += w[t] * p[t*pixbytes + c];
+
+            *out++ = (int16_t)(sum >> (RSZWEIGHTBITS - RSZFRACBITS));
+        }
+    }
+}
+
+//=================================================================
+// BoxReduce()
+//
+// Makes 'width' pixels of 'pixbytes' bytes in 'out', each the
+// average of the 'fx' pixels of sums in 'acc' it covers, with each
+// sum being of 'fy' rows.
+//
+//=================================================================
+
+static void BoxReduce(unsigned char *out, const uint32_t *acc, uint32_t width, uint32_t fx, uint32_t fy, 
+                      uint32_t pixbytes)
+{
+    const uint32_t n = fx * fy;
+    uint32_t x, c, k, sum;
+
+    for (x = 0; x < width; x++, acc += fx * pixbytes) {
+        for (c = 0; c < pixbytes; c++) {
+            for (sum = n / 2, k = 0; k < fx; k++)
+                sum += acc[k*pixbytes + c];
+
+            *out++ = (unsigned char)(sum / n);
+        }
+    }
+}
+
+//=================================================================
+// PipeRow()
+//
+// Makes row 'y' (from the bottom) of the region being read by the
+// pipeline 'p' in the working format, with the stages before any
+// resize applied, in 'buf' (which has room for the region's row,
+// and any pixels before it in the row's first byte). Returns the
+// start of the row made, or, if 'direct' and there is nothing to
+// do to the input row, the input row itself.
+//
+//=================================================================
+
+static const unsigned char *PipeRow(const ppipe_t p, uint32_t y, unsigned char *buf, uint32_t direct)
+{
+    const unsigned char *in;
+    unsigned char *row = buf;
+    uint32_t width, s;
+
+    width = p->rect.right - p->rect.left;
+    in    = p->rows + (int64_t)(p->rect.bottom + y) * p->stride + p->offset;
+
+    if (!p->convert) {
+        if (direct && p->npre == 0)
+            return in;
+        memcpy(row, in, (size_t)width * p->workbytes);
+    } else {
+        ConvertRow(row, in, width + p->skip, &p->lut);
+        row += (size_t)p->skip * p->workbytes;
+    }
+
+    for (s = 0; s < p->npre; s++)
+        TransformRow(row, width, &p->xf[s]);
+
+    return row;
+}
+
+//=================================================================
+// PipeBand()
+//
+// RunPipeline() worker thread, making the band of rows of the
+// current strip described by 'arg' (a ppipeband_t). Each row of
+// the region is converted to the working format, put through the
+// transform stages and packed to the output format (if not the
+// working format), all whilst in the cache, straight into the
+// output strip. When resizing, the input rows each output row is
+// made from are converted and transformed in turn, then filtered,
+// and the stages after the resize applied to the output row.
+//
+//=================================================================
+
+static void *PipeBand(void *arg)
+{
+    ppipeband_t band = (ppipeband_t)arg;
+    ppipe_t p = band->p;
+    const unsigned char *in;
+    const int16_t *weights;
+    unsigned char *out, *row;
+    uint32_t width, len, y, k, s, t, slot, iy;
+
+    width = p->resize ? p->crop.right - p->crop.left : p->rect.right - p->rect.left;
+    len   = width * p->workbytes;
+
+    for (t = 0; t < p->ay.taps; t++)
+        band->tags[t] = ~0U;
+
+    for (k = band->first; k < band->last; k++) {
+        out = p->ostrip + (size_t)k * p->o_padrowlen;
+
+        if (!p->resize) {
+            y   = p->fliph ? p->rect.top - p->rect.bottom - 1 - (p->strip + k) : p->strip + k;
+            row = (p->pack || p->skip) ? band->rowbuf : out;
+            in  = PipeRow(p, y, row, TRUE);
+
+            if (p->pack)
+                ConvertPixels(out, in, width, &p->olut, NULL);
+            else if (in != out)
+                memcpy(out, in, len);
+
+            continue;
+        }
+
+        // Row of the resized image, and its working row
+        y   = p->fliph ? p->crop.top - 1 - (p->strip + k) : p->crop.bottom + p->strip + k;
+        row = p->pack ? band->orow : out;
+
+        if (p->fx) {
+            // Sum the block of rows under the output row, over the columns output
+            memset(band->sums, 0, (size_t)len * p->fx * sizeof(uint32_t));
+            for (t = 0; t < p->fy; t++) {
+                in = PipeRow(p, y * p->fy + t, band->rowbuf, TRUE);
+                p->rk.boxsumfn(band->sums, in + (size_t)p->crop.left * p->fx * p->workbytes, 0, len * p->fx);
+            }
+            BoxReduce(row, band->sums, width, p->fx, p->fy, p->workbytes);
+        } else {
+            // Filter each input row under the output row, unless still held from the last
+            for (t = 0; t < p->ay.taps; t++) {
+                iy   = p->ay.first[y - p->crop.bottom] + t;
+                slot = iy % p->ay.taps;
+
+                if (band->tags[slot] != iy) {
+                    in = PipeRow(p, iy, band->rowbuf, TRUE);
+                    HorzFilter(&band->hrows[(size_t)slot * len], in, &p->ax, width, p->workbytes);
+                    band->tags[slot] = iy;
+                }
+                band->taprows[t] = &band->hrows[(size_t)slot * len];
+            }
+
+            weights = &p->ay.weights[(size_t)(y - p->crop.bottom) * p->ay.taps];
+            p->rk.vertfn(row, band->taprows, weights, p->ay.taps, 0, len);
+        }
+
+        for (s = p->npre; s < p->nxforms; s++)
+            TransformRow(row, width, &p->xf[s]);
+
+        if (p->pack)
+            ConvertPixels(out, row, width, &p->olut, NULL);
+    }
+
+    return NULL;
+}
+
+//=================================================================
+// RunPipeline()
+//
+// Makes the result of the operations planned in 'plan' (see
+// PlanPipeline()) from the bitmap image 'bmp', writing it to the
+// file 'ofname', without modifying the image. Only the planned
+// region of the input is read, and it is converted, transformed
+// (and resized) and packed a row at a time, in a single pass, into
+// strips of up to 'striprows' output rows (or about CONVSTRIPSIZE
+// bytes if 0), each written out in turn, so that no more than a few
+// rows of the input are ever held in the working format. The rows
+// of a strip are divided between 'threads' threads. The output
+// header and anything between it and the data are as for the input,
+// if no conversion is needed, or otherwise as for
+// ConvertBmpFormat(). A planned rotation needs the whole input,
+// which is first rotated into a copy (see RotateBmp()). Planned
+// levels are made from a first pass over the region read (from
+// the first byte of its rows, for fewer than 8 bits per pixel),
+// gathering its statistics where it lies, before it is read again
+// to be output. Returns GOODSTATUS, or BADSTATUS with a message
+// placed in 'e' (if not NULL).
+//
+//=================================================================
+
+int RunPipeline(const unsigned char *bmp, const pbmplan_t plan, const char *ofname, uint32_t striprows, 
+                uint32_t threads, perrmsg_t e)
+{
+    static const char *funcname = "RunPipeline()";
+
+    pipe_t p;                                           // Pipeline state
+    pipeband_t stackbands[STACKTHREADS];                // Thread bands, unless too many for the stack
+    ppipeband_t bands = stackbands;                     // Thread bands
+    bmview_t view;                                      // Whole input image
+    bmhdr_t hdr, workhdr;                               // Output and working format headers
+    trans_t flip;                                       // Flip only stage
+    bmpstats_t stats;                                   // Statistics of the region read, for levels
+    bmplevels_t lv;                                     // Levels of the first stage, if any
+    rect_t region;                                      // Region counted for the levels
+    unsigned char masks[MASKSSIZE];                     // Output colour masks
+    const unsigned char *extra;                         // Bytes between output header and data
+    uint32_t ncolours;                                  // Input colour table entries
+    struct iovec iov[2];                                // Gathered output vectors
+    unsigned char *buf, *tb;                            // Strip and row buffers, and a thread's buffers
+    unsigned char *tables = NULL;                       // Resize filter tables
+    unsigned char *expanded, *rotated;                  // Expanded and rotated copies of the input
+    bmplan_t rplan;                                     // Plan for the rotated copy
+    uint32_t srcfmt, work, extralen;                    // Formats
+    uint32_t inwidth, inheight, width, height, nthreads, cnt, i, o;
+    uint64_t o_rowlen, w_rowlen, r_rowlen, bufsize;     // Row lengths
+    uint64_t sumsize, tapsize, hrowsize, tblsize;       // Thread and table buffer sizes
+    int status;
+#ifndef WIN32
+    int fd;
+#else
+    FILE *fd;
+#endif
+
+    // A rotation is made first, into a rotated copy of the whole input (expanded to
+    // 24 bits if of fewer than 8, or run length encoded), and the rest of the plan
+    // run on that
+    if (plan->rotate) {
+        hdr = *(pbmhdr_t)bmp;
+        HDRENDIAN(&hdr);
+
+        rplan        = *plan;
+        rplan.rotate = 0;
+        expanded     = NULL;
+        rotated      = NULL;
+        bufsize      = 0;
+        status       = GOODSTATUS;
+
+        if (hdr.i.biBitCount < BYTEWIDTH || ISRLE(&hdr)) {
+            if (ConvertBmpFormat(&expanded, &bufsize, (pbmhdr_t)bmp, (prgbquad_t)(bmp + ColourTable(&hdr, &ncolours)), 
+                                 bmp + hdr.f.bfOffBits, BMP_FMT24, e) == 0)
+                status = BADSTATUS;
+            bmp     = expanded;
+            bufsize = 0;
+        }
+
+        if (status == GOODSTATUS && RotateBmp(&rotated, &bufsize, bmp, plan->rotate, threads, e) == 0)
+            status = BADSTATUS;
+
+        if (status == GOODSTATUS)
+            status = RunPipeline(rotated, &rplan, ofname, striprows, threads, e);
+
+        free(expanded);
+        free(rotated);
+
+        return status;
+    }
+
+    // A view of the whole input, with its rows bottom up
+    ClipView((unsigned char *)bmp, NULL, &view, NULL);
+
+    if (plan->fmt != BMP_FMT555 && plan->fmt != BMP_FMT565 && plan->fmt != BMP_FMT24 && plan->fmt != BMP_FMT32) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported output pixel format (%d).\n", funcname, plan->fmt);
+            e->errnum = PBMP_ERR_BADFORMAT;
+        }
+        return BADSTATUS;
+    }
+
+    if (ISRLE(&view.hdr)) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - run length encoded input must be expanded first.\n", 
+                     funcname);
+            e->errnum = PBMP_ERR_BADFORMAT;
+        }
+        return BADSTATUS;
+    }
+
+    if (plan->rect.right > view.hdr.i.biWidth || plan->rect.top > (uint32_t)view.hdr.i.biHeight ||
+        plan->rect.right <= plan->rect.left || plan->rect.top <= plan->rect.bottom ||
+        (plan->width && (plan->crop.right > plan->width || plan->crop.top > plan->height || 
+                         plan->crop.right <= plan->crop.left || plan->crop.top <= plan->crop.bottom))) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - bad clipping rectangle (%d %d %d %d).\n", 
+                     funcname, plan->rect.left, plan->rect.right, plan->rect.bottom, plan->rect.top);
+            e->errnum = PBMP_ERR_BADCLIP;
+        }
+        return BADSTATUS;
+    }
+
+    memset(&p, 0, sizeof(pipe_t));
+
+    // Region read, and the image output (the region, or part of it resized)
+    inwidth  = plan->rect.right - plan->rect.left;
+    inheight = plan->rect.top - plan->rect.bottom;
+    width    = plan->width ? plan->crop.right - plan->crop.left : inwidth;
+    height   = plan->width ? plan->crop.top - plan->crop.bottom : inheight;
+    srcfmt   = PixelFormat(&view.hdr, (const unsigned char *)view.pal);
+    work     = (plan->fmt == BMP_FMT32) ? BMP_FMT32 : BMP_FMT24;
+
+    // Output header, and anything after it, as for the input if no conversion is needed
+    if (srcfmt == plan->fmt && srcfmt == work) {
+        hdr            = view.hdr;
+        hdr.i.biWidth  = width;
+        hdr.i.biHeight = height;
+        extra          = (const unsigned char *)view.pal;
+        extralen       = view.hdr.f.bfOffBits - HDRSIZE;
+    } else {
+        extralen       = FormatHeader(&hdr, &view.hdr, width, height, plan->fmt, masks);
+        extra          = masks;
+    }
+
+    // Working rows have room for the pixels before the region in its first byte
+    o_rowlen = (uint64_t)width * hdr.i.biBitCount / BYTEWIDTH;
+    w_rowlen = (uint64_t)(inwidth + BYTEWIDTH) * (work / BYTEWIDTH);
+    r_rowlen = (uint64_t)width * (work / BYTEWIDTH);
+
+    if (o_rowlen > BMP_MAXROWLEN || w_rowlen > BMP_MAXROWLEN) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - image too large to output in %d bit format.\n", funcname, 
+                     plan->fmt);
+            e->errnum = PBMP_ERR_TOOBIG;
+        }
+        return BADSTATUS;
+    }
+
+    p.rows        = view.rows;
+    p.stride      = view.stride;
+    p.rect        = plan->rect;
+    p.fliph       = plan->fliph;
+    p.bpp         = view.hdr.i.biBitCount;
+    p.offset      = (uint64_t)plan->rect.left * p.bpp / BYTEWIDTH;
+    p.skip        = (uint32_t)(((uint64_t)plan->rect.left * p.bpp) % BYTEWIDTH) / p.bpp;
+    p.convert     = (srcfmt != work);
+    p.pack        = (plan->fmt != work);
+    p.workbytes   = work / BYTEWIDTH;
+    p.o_padrowlen = (uint32_t)PadRowLen(width, hdr.i.biBitCount);
+    SetImageSizes(&hdr, (uint64_t)p.o_padrowlen * height);
+
+    if (p.convert)
+        BuildConvertLut(&p.lut, &view.hdr, (const unsigned char *)view.pal, view.ncolours, work);
+
+    if (p.pack) {
+        workhdr                 = view.hdr;
+        workhdr.i.biBitCount    = 24;
+        workhdr.i.biCompression = BMP_RGB;
+        BuildConvertLut(&p.olut, &workhdr, NULL, 0, plan->fmt);
+    }
+
+    // Levels, which can only be in the first stage, from a first pass over the region read
+    if (plan->nstages && plan->stages[0].levels) {
+        region       = plan->rect;
+        region.left -= p.skip;
+
+        if (GetBmpStats(bmp, &region, threads, &stats, e) == BADSTATUS || 
+            MakeLevels(&lv, &stats, plan->stages[0].levels, plan->stages[0].levelclip, e) == BADSTATUS)
+            return BADSTATUS;
+    }
+
+    // Transform stages, with the flip about the vertical axis made by the first (or, when
+    // resizing, the first after the resize), or by a flip only stage if there is none
+    p.nxforms = 0;
+    p.npre    = plan->width ? plan->prestages : plan->nstages;
+    for (i = 0; i < plan->nstages; i++) {
+        flip       = plan->stages[i];
+        flip.flipv = (i == (plan->width ? plan->prestages : 0)) ? plan->flipv : FALSE;
+        flip.fliph = FALSE;
+
+        if (CheckControl(&flip, funcname, e) == BADSTATUS)
+            return BADSTATUS;
+
+        BuildXform(&p.xf[p.nxforms++], &flip, flip.levels ? &lv : NULL, GetSimdLevel(), p.workbytes);
+    }
+
+    if (plan->flipv && p.nxforms == p.npre && (plan->width || p.nxforms == 0)) {
+        memset(&flip, 0, sizeof(trans_t));
+        flip.flipv = TRUE;
+        BuildXform(&p.xf[p.nxforms++], &flip, NULL, GetSimdLevel(), p.workbytes);
+        if (!plan->width)
+            p.npre = p.nxforms;
+    }
+
+    // Resize filters, as whole number box ratios or as tables for the columns and rows output
+    sumsize = tapsize = hrowsize = 0;
+    if (plan->width) {
+        p.resize = TRUE;
+        p.crop   = plan->crop;
+        SelectResizeKernels(&p.rk, GetSimdLevel());
+
+        if (plan->filter == BMP_FILTERBOX && inwidth % plan->width == 0 && inheight % plan->height == 0) {
+            p.fx    = inwidth / plan->width;
+            p.fy    = inheight / plan->height;
+            sumsize = r_rowlen * p.fx * sizeof(uint32_t);
+        } else {
+            p.ax.taps = AxisTaps(inwidth, plan->width, plan->filter);
+            p.ay.taps = AxisTaps(inheight, plan->height, plan->filter);
+            tapsize   = p.ay.taps * (sizeof(int16_t *) + sizeof(uint32_t));
+            hrowsize  = p.ay.taps * r_rowlen * sizeof(int16_t);
+
+            tblsize = (uint64_t)width * (sizeof(uint32_t) + p.ax.taps * sizeof(int16_t)) + 
+                      (uint64_t)height * (sizeof(uint32_t) + p.ay.taps * sizeof(int16_t));
+
+            if (tblsize > SIZE_MAX || (tables = (unsigned char *)malloc((size_t)tblsize)) == NULL) {
+                if (e != NULL) {
+                    snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                    e->errnum = PBMP_ERR_MEM;
+                }
+                return BADSTATUS;
             }
-            free(buf);
-            return BADSTATUS;
+
+            p.ax.first   = (uint32_t *)tables;
+            p.ay.first   = p.ax.first + width;
+            p.ax.weights = (int16_t *)(p.ay.first + height);
+            p.ay.weights = p.ax.weights + (size_t)width * p.ax.taps;
+
+            BuildAxis(&p.ax, inwidth,  plan->width,  plan->crop.left,   width,  plan->filter);
+            BuildAxis(&p.ay, inheight, plan->height, plan->crop.bottom, height, plan->filter);
         }
-        buf[i] = (unsigned char)(byte & BYTEMASK);
     }
 
-    // If not a 24 bit bitmap, point to the colour table
-    if ((*bmp)->i.biBitCount != 24) 
-        // Cast the colour table to an RGB Quad structure array
-        *r = (prgbquad_t) &buf[HDRSIZE];
+    // Strip size, and a thread for each band of it
+    if (striprows == 0)
+        striprows = CONVSTRIPSIZE / p.o_padrowlen;
+    if (striprows == 0)
+        striprows = 1;
+    if (striprows > height)
+        striprows = height;
 
-    // Point to data
-    *data = &buf[(*bmp)->f.bfOffBits];
+    nthreads = (threads > 1) ? threads : 1;
+    if (nthreads > striprows)
+        nthreads = striprows;
 
-    // Check it's a bitmap
-    if ((*bmp)->f.bfType[0] != 'B' || (*bmp)->f.bfType[1] != 'M') {
+    // One buffer for the strip (cleared, so the row padding is zero) and each thread's rows,
+    // with each thread's buffers kept aligned
+    w_rowlen = (tapsize + sumsize + hrowsize + w_rowlen + (p.resize ? r_rowlen : 0) + 63) & ~(uint64_t)63;
+    bufsize  = (((uint64_t)striprows * p.o_padrowlen + 63) & ~(uint64_t)63) + nthreads * w_rowlen;
+
+    if (bufsize > SIZE_MAX || (buf = (unsigned char *)calloc(1, (size_t)bufsize)) == NULL) {
         if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - not a bitmap file.\n", funcname);
-            e->errnum = GBMP_ERR_NOTBMP;
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = PBMP_ERR_MEM;
         }
-        free(buf);
+        free(tables);
         return BADSTATUS;
     }
 
-    // Check there's only one plane
-    if ((*bmp)->i.biPlanes != 1) {
+    if (nthreads > STACKTHREADS && (bands = (ppipeband_t)malloc(nthreads * sizeof(pipeband_t))) == NULL) {
         if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported number of planes (%d).\n", 
-                          funcname, (*bmp)->i.biPlanes);
-            e->errnum = GBMP_ERR_BADPLANES;
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = PBMP_ERR_MEM;
         }
+        free(tables);
         free(buf);
         return BADSTATUS;
     }
 
-    // Check valid bits per pixel
-    if ((*bmp)->i.biBitCount != 1 && (*bmp)->i.biBitCount != 4 && 
-        (*bmp)->i.biBitCount != 8 && (*bmp)->i.biBitCount != 24) {
+    p.ostrip = buf;
+    for (i = 0; i < nthreads; i++) {
+        tb = buf + (((size_t)striprows * p.o_padrowlen + 63) & ~(size_t)63) + (size_t)(i * w_rowlen);
+
+        bands[i].p       = &p;
+        bands[i].taprows = (const int16_t **)tb;
+        bands[i].tags    = (uint32_t *)(tb + p.ay.taps * sizeof(int16_t *));
+        bands[i].sums    = (uint32_t *)(tb + tapsize);
+        bands[i].hrows   = (int16_t *)(tb + tapsize + sumsize);
+        bands[i].rowbuf  = tb + tapsize + sumsize + hrowsize;
+        bands[i].orow    = bands[i].rowbuf + (size_t)(inwidth + BYTEWIDTH) * p.workbytes;
+    }
+
+#ifndef WIN32
+    if ((fd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+#else
+    if ((fd = fopen(ofname, "wb")) == NULL) {
+#endif
         if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - invalid bits per pixel (%d).\n", 
-                          funcname, (*bmp)->i.biBitCount);
-            e->errnum = GBMP_ERR_BADPIXELS;
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to open %s for writing.\n", funcname, ofname);
+            e->errnum = PBMP_ERR_OPEN;
         }
+        if (bands != stackbands)
+            free(bands);
+        free(tables);
         free(buf);
         return BADSTATUS;
     }
 
-    // Check there's no compression
-    if ((*bmp)->i.biCompression != 0) {
-        if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - unsupported compressed format (%d).\n", 
-                          funcname, (*bmp)->i.biCompression);
-            e->errnum = GBMP_ERR_BADCOMPRESS;
+    HDRENDIAN(&hdr);
+
+    // Header, followed by any colour table or masks
+    iov[0].iov_base = (void *)&hdr;
+    iov[0].iov_len  = HDRSIZE;
+    iov[1].iov_base = (void *)extra;
+    iov[1].iov_len  = extralen;
+
+    status = WriteVectors(fd, iov, 2);
+
+    for (o = 0; o < height && status == GOODSTATUS; o += cnt) {
+        cnt     = (height - o < striprows) ? height - o : striprows;
+        p.strip = o;
+
+        // Split the strip into bands of (near) equal size
+        for (i = 0; i < nthreads; i++) {
+            bands[i].first = (uint32_t)(((uint64_t)cnt * i) / nthreads);
+            bands[i].last  = (uint32_t)(((uint64_t)cnt * (i+1)) / nthreads);
         }
-        free(buf);
-        return BADSTATUS;
+
+        RunThreads(nthreads, PipeBand, bands, sizeof(pipeband_t));
+
+        iov[0].iov_base = (void *)p.ostrip;
+        iov[0].iov_len  = (size_t)cnt * p.o_padrowlen;
+
+        status = WriteVectors(fd, iov, 1);
     }
 
-    // Header endian put back before exit
-    HDRENDIAN(*bmp);
+#ifndef WIN32
+    if (close(fd) < 0)
+#else
+    if (fclose(fd) != 0)
+#endif
+        status = BADSTATUS;
 
-    return GOODSTATUS;
+    if (bands != stackbands)
+        free(bands);
+    free(tables);
+    free(buf);
+
+    if (status == BADSTATUS && e != NULL) {
+        snprintf(e->errbuf, e->errsize, "***Error: %s - failed writing to %s.\n", funcname, ofname);
+        e->errnum = PBMP_ERR_WRITE;
+    }
+
+    return status;
 }
 
 //=================================================================
-// ConvertBmpTo24bit()
+// CreateBmpPool()
 //
-// Convert lower order bitmap to a 24 bit bitmap, and place in
-// allocated memory. Bitmap header pointed to by 'bmp',
-// with quad table referenced by 'r' and data bytes by 'data'.
-// On return, *newbmp set to point to image data, and return value
-// set to image size.
+// Creates a buffer pool, from which image buffers may be taken
+// (see BmpPoolAlloc()) and to which they are returned for reuse
+// (see BmpPoolFree()), so that a process handling many images
+// stops allocating once the pool holds buffers of the sizes it
+// needs. Buffers are kept in size classes, no more than 25%
+// larger than the sizes asked for. At most 'limit' bytes of free
+// buffers are retained, or any amount if 'limit' is 0. A pool may
+// be shared between threads. Returns NULL if no memory is
+// available.
 //
 //=================================================================
 
-uint32_t ConvertBmpTo24bit(unsigned char **newbmp, const pbmhdr_t bmp, const prgbquad_t r, const unsigned char *data, 
-                           perrmsg_t e)
+pbmpool_t CreateBmpPool(uint64_t limit)
 {
-    static const char *funcname = "ConvertBmpTo24bit()";
-
-    // Local variables
-    pbmhdr_t new_header;                                // Pointer to output header
-    uint32_t i_rowlen, i_padrowlen, i_partialbits;      // Input bitmap parameters
-    uint32_t i_pixelsperbyte, i_pixelsinbyte;           // Pixel counts
-    uint32_t o_imgsize, o_rowlen, o_padrowlen;          // Output bitmap parameters
-    unsigned char *p;                                   // Pointer to output buffer data area
-    const unsigned char *this_row;                      // Pointer to input row data
-    uint32_t i, j, k, idx, oidx;                        // Indexing
-
-    // Header endian conversion on big endian machine
-    HDRENDIAN(bmp);
+    pbmpool_t pool;
 
-    // If bitmap already 24 bits return an error (byte count of 0)
-    if (bmp->i.biBitCount > BYTEWIDTH) {
-        if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to convert a bitmap already in 24 bit format.\n", funcname);
-            e->errnum = CBMP_ERR_CONVERROR;
-        }
-        return 0;
-    }
+    if ((pool = (pbmpool_t)calloc(1, sizeof(struct bmpool_s))) == NULL)
+        return NULL;
 
-    // Number of pixels in each (whole) byte. Either 1, 2 or 8.
-    i_pixelsperbyte = BYTEWIDTH/bmp->i.biBitCount;
+    pool->limit = limit;
+#ifndef WIN32
+    pthread_mutex_init(&pool->lock, NULL);
+#endif
 
-    // Number pixels in last byte. Zero indicates no partial byte.
-    i_partialbits = bmp->i.biWidth % i_pixelsperbyte;                           
+    return pool;
+}
 
-    // Calculate input row length in bytes, and as padded to 32 bits
-    i_rowlen = bmp->i.biWidth/i_pixelsperbyte + (i_partialbits ? 1 : 0);
-    i_padrowlen = 4 * ((i_rowlen+3)/4);
+//=================================================================
+// DestroyBmpPool()
+//
+// Frees the pool 'pool' and the free buffers it holds. Any buffers
+// taken from the pool must have been returned to it first.
+//
+//=================================================================
 
-    // Calculate output row length in bytes, and as padded to 32 bits
-    o_rowlen    = (bmp->i.biWidth * 3);
-    o_padrowlen = 4 * ((o_rowlen+3)/4);
+void DestroyBmpPool(pbmpool_t pool)
+{
+    ppoolblk_t blk;
+    uint32_t cls;
 
-    // Size of 24 bit image in bytes (not including header)
-    o_imgsize = o_padrowlen * bmp->i.biHeight;
+    if (pool == NULL)
+        return;
 
-    // Allocate some memory for the new 24 bit bitmap
-    if ((*newbmp = (unsigned char*)malloc(o_imgsize + HDRSIZE)) == NULL) {
-        if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
-            e->errnum = CBMP_ERR_MEM;
+    for (cls = 0; cls < POOLCLASSES; cls++) {
+        while ((blk = pool->free[cls]) != NULL) {
+            pool->free[cls] = blk->b.next;
+            free(blk);
         }
-        return 0;
     }
 
-    // Cast start of allocated memory to a header structure
-    new_header = (pbmhdr_t) *newbmp;
+#ifndef WIN32
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    free(pool);
+}
 
-    // Copy the old bitmap header to the new one (most fields common)
-    *new_header = *bmp;
+//=================================================================
+// BmpPoolAlloc()
+//
+// Takes a buffer of at least 'size' bytes from the pool 'pool',
+// reusing a free buffer of the size class if there is one, else
+// allocating a new one. The buffer must be released with
+// BmpPoolFree(), and not free(). Returns NULL if no memory is
+// available.
+//
+//=================================================================
 
-    // Update format table for 24 bits
-    new_header->f.bfSize    = o_imgsize + HDRSIZE;
-    new_header->f.bfOffBits = HDRSIZE;
+void *BmpPoolAlloc(pbmpool_t pool, uint64_t size)
+{
+    ppoolblk_t blk;
+    uint32_t cls;
+    uint64_t clssize;
 
-    // Update information table for 24 bits
-    new_header->i.biBitCount  = 24;
-    new_header->i.biSizeImage = o_imgsize;
+    if ((cls = PoolClass(size)) >= POOLCLASSES)
+        return NULL;
 
-    // Don't assume original bitmap had the colour fields at 0
-    new_header->i.biClrUsed      = 0;                   
-    new_header->i.biClrImportant = 0;
+    clssize = PoolClassSize(cls);
 
-    // Endian conversion (if required)
-    HDRENDIAN(new_header);
+#ifndef WIN32
+    pthread_mutex_lock(&pool->lock);
+#endif
+    if ((blk = pool->free[cls]) != NULL) {
+        pool->free[cls]       = blk->b.next;
+        pool->stats.retained -= clssize;
+        pool->stats.inuse    += clssize;
+        pool->stats.reuses++;
+    }
+#ifndef WIN32
+    pthread_mutex_unlock(&pool->lock);
+#endif
 
-    // Point to data area of allocated memory
-    p = (*newbmp) + HDRSIZE;
+    if (blk == NULL) {
+        if (clssize + POOLHDRSIZE > SIZE_MAX || (blk = (ppoolblk_t)malloc((size_t)(clssize + POOLHDRSIZE))) == NULL)
+            return NULL;
 
-    // Clear output buffer index
-    oidx = 0;
+        blk->b.pool = pool;
+        blk->b.cls  = cls;
 
-    // Convert data, row at a time
-    for (i = 0; i < bmp->i.biHeight; i++) {
+#ifndef WIN32
+        pthread_mutex_lock(&pool->lock);
+#endif
+        pool->stats.inuse += clssize;
+        pool->stats.allocs++;
+#ifndef WIN32
+        pthread_mutex_unlock(&pool->lock);
+#endif
+    }
 
-        // Point to start of current row
-        this_row = &data[i * i_padrowlen];
+    return (void *)(blk + 1);
+}
 
-        // For each input byte in the row
-        for (j = 0; j < i_rowlen; j++) {
+//=================================================================
+// BmpPoolFree()
+//
+// Returns the buffer 'buf', taken with BmpPoolAlloc(), to its
+// pool, or frees it if the pool already retains its limit of free
+// buffers. A NULL buffer is ignored.
+//
+//=================================================================
 
-            // Calculate number of pixels in this byte. 
-            // Only partial count if at last byte and i_partialbits not zero
-            i_pixelsinbyte = ((j == (i_rowlen-1)) && i_partialbits) ? i_partialbits : i_pixelsperbyte;
+void BmpPoolFree(void *buf)
+{
+    ppoolblk_t blk;
+    pbmpool_t pool;
+    uint64_t clssize;
 
-            // For each pixel, calculate 24 bit triplet
-            for (k = 0; k < i_pixelsinbyte; k++) {
-                // Calculate RGB quad index using appropriate bits from byte (MSB first)
-                idx = (this_row[j] >> ((i_pixelsperbyte-1-k) * bmp->i.biBitCount)) & ((1 << bmp->i.biBitCount) - 1);
-                p[oidx++] = r[idx].Blue;
-                p[oidx++] = r[idx].Green;
-                p[oidx++] = r[idx].Red;
-            }
-        }
+    if (buf == NULL)
+        return;
 
-        // Pad new row to 32 bit boundary
-        for (j = 0; j < (o_padrowlen-o_rowlen); j++)
-            p[oidx++] = 0x00;
-    }
+    blk     = (ppoolblk_t)buf - 1;
+    pool    = blk->b.pool;
+    clssize = PoolClassSize(blk->b.cls);
 
-    // Header endian put back before exit
-    HDRENDIAN(bmp);
+#ifndef WIN32
+    pthread_mutex_lock(&pool->lock);
+#endif
+    pool->stats.inuse -= clssize;
+    if (pool->limit == 0 || pool->stats.retained + clssize <= pool->limit) {
+        blk->b.next             = pool->free[blk->b.cls];
+        pool->free[blk->b.cls]  = blk;
+        pool->stats.retained   += clssize;
+        blk = NULL;
+    }
+#ifndef WIN32
+    pthread_mutex_unlock(&pool->lock);
+#endif
 
-    return o_imgsize + HDRSIZE;
+    free(blk);
 }
 
-//=============================================================
-// TransformBmp()
-//
-// Performs various transformations on a 24 bit bitmap. Bitmap
-// pointer passed in, as 'bitmap', with transformation controlled
-// by the 'control' structure. A normal return passes back
-// GOODSTATUS, else BADSTATUS is returned with an error message
-// sent to buffer pointed to in 'e' (if not NULL).
+//=================================================================
+// GetBmpPoolStats()
 //
-// The transforms currently supports are:
-//     Reverse colours (negative)
-//     Adjust brightness
-//     Adjust contrast
-//     Convert to grey scale 
-//     Flip about vertical axis
-//     Flip about horizontal axis
-//     Extract a colour component 
-//        (red, green, blue, yellow, cyan or magenta)
+// Places in 'stats' the allocation statistics of pool 'pool'. The
+// count of buffers allocated stops rising once the pool serves
+// all requests from its free buffers.
 //
-//=============================================================
+//=================================================================
 
-int TransformBmp (unsigned char *bitmap, const ptrans_t control, perrmsg_t e)
+void GetBmpPoolStats(pbmpool_t pool, pbmpoolstats_t stats)
 {
-    char *funcname = "TransformBmp()";
+#ifndef WIN32
+    pthread_mutex_lock(&pool->lock);
+#endif
+    *stats = pool->stats;
+#ifndef WIN32
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
 
-    // Local variable declarations
-    unsigned char *data, *row, *irow, tmp;              // Pointers to pixel data
-    pbmhdr_t hdr;                                       // Pointer to bitmap header
-    rgbquad_t value;                                    // Temporary RGB store
-    uint32_t width, height, rowlen, padrowlen;          // Bitmap size parameters
-    uint32_t val;                                       // General purpose store
-    uint32_t i, j;                                      // Indexes
+//=================================================================
+// CreateBmpContext()
+//
+// Creates an image context, holding one bitmap image at a time
+// (see LoadBmpContext(), ReadBmpContext() and ConvertBmpContext()),
+// with its buffers drawn from the pool 'pool'. A context keeps its
+// buffers from one image to the next, so that, once they are large
+// enough, processing an image through a context makes no
+// allocations. If 'pool' is NULL, the context has a pool of its
+// own. Returns NULL if no memory is available.
+//
+//=================================================================
 
-    // Point to bitmap data and header sections
-    data = bitmap + HDRSIZE;
-    hdr  = (pbmhdr_t) bitmap;
+pbmpctx_t CreateBmpContext(pbmpool_t pool)
+{
+    pbmpctx_t ctx;
 
-    // Header endian conversion for big endian machines. 
-    HDRENDIAN(hdr);
+    if ((ctx = (pbmpctx_t)calloc(1, sizeof(struct bmpctx_s))) == NULL)
+        return NULL;
 
-    // Check the bitmap
-    if (hdr->i.biBitCount != 24) {
-        if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - attempt to transform bitmap that's not 24 bit.\n", funcname);
-            e->errnum = TBMP_ERR_CONVERROR;
+    if (pool == NULL) {
+        if ((pool = CreateBmpPool(0)) == NULL) {
+            free(ctx);
+            return NULL;
         }
-        return BADSTATUS;
+        ctx->ownpool = TRUE;
     }
 
-    // Check control parameters
-    if (control->brightness < 0) {
-        if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - bad brightness control parameter (%d).\n", funcname, control->brightness);
-            e->errnum = TBMP_ERR_BADPARAM;
-        }
-        return BADSTATUS;
-    }
+    ctx->pool     = pool;
+    ctx->map.mode = LBMP_READ;
+    ctx->map.pool = pool;
 
-    if (control->mono < 0 || control->mono >= 0x7) { 
-        if (e != NULL) {
-            snprintf(e->errbuf, e->errsize, "***Error: %s - bad monochrome control parameter (%d).\n", funcname, control->mono);
-            e->errnum = TBMP_ERR_BADPARAM;
-        }
-        return BADSTATUS;
-    }
+    return ctx;
+}
 
-    // Calculate bitmap size parameters
-    width     = hdr->i.biWidth;
-    height    = hdr->i.biHeight;
-    rowlen    = width * 3;
-    padrowlen = 4 * ((rowlen+3)/4);
+//=================================================================
+// DestroyBmpContext()
+//
+// Releases the buffers of context 'ctx' (see ReleaseBmpContext())
+// and frees it, along with any pool of its own.
+//
+//=================================================================
 
-    // Undo any endian conversion
-    HDRENDIAN(hdr);
+void DestroyBmpContext(pbmpctx_t ctx)
+{
+    if (ctx == NULL)
+        return;
 
-    // Process row at a time...
-    for (i = 0; i < height; i++) {
-        row = &data[i * padrowlen];
+    ReleaseBmpContext(ctx);
 
-        // Flip horizontally if requested
-        if (i < height/2 && control->fliph) {
-            irow = &data[(height-1-i) * padrowlen];
-            for (j = 0; j < rowlen; j++) {
-                tmp = row[j];
-                row[j] = irow[j];
-                irow[j] = tmp;
-            }
-        }
+    if (ctx->ownpool)
+        DestroyBmpPool(ctx->pool);
 
-        // For each pixel in the row
-        for (j = 0; j < rowlen; j += 3) {
+    free(ctx);
+}
 
-            // Flip vertically if requested
-            if (j < rowlen/2 && control->flipv) {
-                value.Blue  = row[j];
-                value.Green = row[j+1];
-                value.Red   = row[j+2];
+//=================================================================
+// LoadBmpContext()
+//
+// Loads the bitmap file 'fname' into context 'ctx', as for
+// LoadBitmap() in mode 'mode', replacing any image it held. In
+// LBMP_READ mode the file is read into the context's read buffer.
+// Returns GOODSTATUS, or BADSTATUS with a message placed in 'e'
+// (if not NULL).
+//
+//=================================================================
 
-                row[j]   = row[rowlen-1-j-2];
-                row[j+1] = row[rowlen-1-j-1];
-                row[j+2] = row[rowlen-1-j-0];
+int LoadBmpContext(pbmpctx_t ctx, const char *fname, uint32_t mode, perrmsg_t e)
+{
+    pbmhdr_t bmp;
+    prgbquad_t r;
+    unsigned char *data;
 
-                row[rowlen-1-j-2] = value.Blue;
-                row[rowlen-1-j-1] = value.Green;
-                row[rowlen-1-j] = value.Red;
-            }
+    ctx->image = NULL;
 
-            // Extract colour values for pixel
-            value.Blue  = row[j];
-            value.Green = row[j+1];
-            value.Red   = row[j+2];
+    if (LoadBitmap(fname, mode, &ctx->map, &bmp, &r, &data, e) == BADSTATUS)
+        return BADSTATUS;
 
-            // Reverse video---simply invert all the bits
-            if (control->reverse) {
-                value.Blue  ^= 0xff;
-                value.Green ^= 0xff;
-                value.Red   ^= 0xff;
-            } 
-            
-            // Scale each colour value by a constant (%), clipping at maximum
-            if (control->brightness) {
-                val = ((uint32_t)value.Blue  * control->brightness)/100;
-                value.Blue  = (uint8_t)((val > 0xff) ? 0xff : val & 0xff);
+    ctx->image = (unsigned char *)bmp;
 
-                val = ((uint32_t)value.Green * control->brightness)/100;
-                value.Green = (uint8_t)((val > 0xff) ? 0xff : val & 0xff);
+    return GOODSTATUS;
+}
 
-                val = ((uint32_t)value.Red   * control->brightness)/100;
-                value.Red   = (uint8_t)((val > 0xff) ? 0xff : val & 0xff);
-            } 
-            
-            // Extract the monochrome colours
-            if (control->mono) {
+//=================================================================
+// ReadBmpContext()
+//
+// Reads a bitmap from the stream 'fp' into the read buffer of
+// context 'ctx', as for GetBitmap(), replacing any image it held.
+// Returns GOODSTATUS, or BADSTATUS with a message placed in 'e'
+// (if not NULL).
+//
+//=================================================================
 
-                // Zero all unspecified colours
-                value.Blue  = (control->mono & MONOBLUE)  ? value.Blue  : 0;
-                value.Green = (control->mono & MONOGREEN) ? value.Green : 0;
-                value.Red   = (control->mono & MONORED)   ? value.Red   : 0;
+int ReadBmpContext(pbmpctx_t ctx, FILE *fp, perrmsg_t e)
+{
+    static const char *funcname = "ReadBmpContext()";
 
-                // If not RGB monochromatic...
-                if (control->mono & (control->mono - 1)) {
+    bmhdr_t hdr;                                        // Host endian copy of header
+    uint64_t size;                                      // File image size
 
-                    // Average the two components (one is already zeroed)
-                    val = (value.Blue + value.Green + value.Red) / 2;
+    ctx->image = NULL;
 
-                    // Set the two enabled colours to be the averaged value
-                    value.Blue  = (uint8_t)((control->mono & MONOBLUE)  ? val : 0);
-                    value.Green = (uint8_t)((control->mono & MONOGREEN) ? val : 0);
-                    value.Red   = (uint8_t)((control->mono & MONORED)   ? val : 0);
-                } 
-            } 
+    if (fread(&hdr, 1, HDRSIZE, fp) != HDRSIZE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file reading header.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        return BADSTATUS;
+    }
+    HDRENDIAN(&hdr);
 
-            // Grey---values are uniformly set to average of all three
-            if (control->grey) {
+    if (CheckHeader(&hdr, UINT64_MAX, funcname, e) == BADSTATUS)
+        return BADSTATUS;
 
-                val = (value.Blue + value.Green + value.Red);
+    size = ImageSize(&hdr);
 
-                // If monochrome specified, reduce averaging divisor
-                // appropriate to number of colours remaining (normalise)
-                val /= (!control->mono ? 3 : (control->mono & (control->mono - 1)) ? 2 : 1) ;
+    if (MapBuffer(&ctx->map, size) == BADSTATUS) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = GBMP_ERR_MEM;
+        }
+        return BADSTATUS;
+    }
 
-                value.Blue  = (uint8_t)val;
-                value.Green = (uint8_t)val;
-                value.Red   = (uint8_t)val;
-            } 
+    // Header already read, so place it and then read the remainder
+    memcpy(ctx->map.base, &hdr, HDRSIZE);
+    HDRENDIAN((pbmhdr_t)ctx->map.base);
 
-            // Write back transformed values
-            row[j]   = value.Blue;
-            row[j+1] = value.Green;
-            row[j+2] = value.Red;
+    if (fread(&ctx->map.base[HDRSIZE], 1, (size_t)size - HDRSIZE, fp) != (size_t)size - HDRSIZE) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unexpected end of file.\n", funcname);
+            e->errnum = GBMP_ERR_EOF;
+        }
+        return BADSTATUS;
+    }
+    ctx->map.size = size;
 
+    // Expand any run length encoded data
+    if (ISRLE(&hdr) && ExpandMap(&ctx->map, &hdr) == BADSTATUS) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+            e->errnum = GBMP_ERR_MEM;
         }
+        return BADSTATUS;
     }
 
+    ctx->image = ctx->map.base;
+
     return GOODSTATUS;
 }
 
 //=================================================================
-// ClipBitmap()
+// ConvertBmpContext()
 //
-// Takes bitmap image passed in with 'bmp' and clips (trims) down
-// to a sub-rectangular region defined in 'boundary'. The image
-// is updated in place, and the header modified for the new image
-// parameters. The final images size value is returned in 
-// 'imgsize'. The functions will return BADSTATUS if the specified
-// clipping region does not lie fully within the input image area.
-// Otherwise, GOODSTATUS is returned.
+// Converts the image held by context 'ctx' to pixel format 'fmt',
+// as for ConvertBmpFormat(), into the context's conversion buffer,
+// which then holds the context's image. An image already in the
+// format is left as it is. Returns GOODSTATUS, or BADSTATUS with a
+// message placed in 'e' (if not NULL).
 //
 //=================================================================
 
-uint32_t ClipBitmap(unsigned char* bmp, const prect_t boundary, uint32_t *imgsize)
+int ConvertBmpContext(pbmpctx_t ctx, uint32_t fmt, perrmsg_t e)
 {
-    uint32_t newwidth, newheight;
-    uint32_t i, j, idx;
-    pbmhdr_t bm;
-    unsigned char *this_row;
-    unsigned char *data;
-    uint32_t i_padrowlen;
+    static const char *funcname = "ConvertBmpContext()";
 
-    bm = (pbmhdr_t) bmp;
-    data = bmp + HDRSIZE;
-
-    HDRENDIAN(bm);
-
-    // Clip top and bottom if outside image
-    if (boundary->right > bm->i.biWidth)
-        boundary->right = bm->i.biWidth;
-    if (boundary->top > bm->i.biHeight)
-        boundary->right = bm->i.biHeight;
+    bmhdr_t hdr;                                        // Host endian copy of header
+    unsigned char *src, *old = NULL;                    // Image to convert, and conversion buffer it's in
+    uint64_t bufneed;                                   // Conversion buffer size needed
+    uint32_t ncolours;                                  // Colour table entries
 
-    // Check that the rectangle is valid
-    if (boundary->right <= boundary->left ||
-        boundary->top   <= boundary->bottom)
+    if ((src = ctx->image) == NULL) {
+        if (e != NULL) {
+            snprintf(e->errbuf, e->errsize, "***Error: %s - no image to convert.\n", funcname);
+            e->errnum = CBMP_ERR_CONVERROR;
+        }
         return BADSTATUS;
+    }
 
-    // New dimensions
-    newwidth  = boundary->right - boundary->left;
-    newheight = boundary->top - boundary->bottom;
+    if (GetPixelFormat(src) == fmt)
+        return GOODSTATUS;
 
-    // Input bitmaps padded row length
-    i_padrowlen = 4 * ((3*bm->i.biWidth+3)/4);
+    hdr = *(pbmhdr_t)src;
+    HDRENDIAN(&hdr);
 
-    // Calculate new sizes
-    bm->i.biSizeImage = (4 * ((3*newwidth+3)/4)) * newheight;
-    bm->f.bfSize = bm->i.biSizeImage + bm->f.bfOffBits;
+    // An image already converted is converted again into a new buffer
+    if (src == ctx->work) {
+        old           = ctx->work;
+        ctx->work     = NULL;
+        ctx->worksize = 0;
+    }
 
-    // Copy relevant data to bottom of data buffer
-    idx = 0;
-    for (i = boundary->bottom; i < boundary->top; i++) {
-        this_row = &data[i * i_padrowlen];
-        for (j = boundary->left; j < boundary->right; j++) {
-            data[idx++] = this_row[3*j];
-            data[idx++] = this_row[3*j+1];
-            data[idx++] = this_row[3*j+2];
-        }
-        // Pad to 32 bit boundary
-        while(idx % 4) {
-            data[idx++] = 0;
+    // Make sure the buffer is large enough, so that ConvertBmpFormat() won't reallocate it. Any
+    // error in the format is left to ConvertBmpFormat() to report.
+    bufneed = ConvertSize(&hdr, fmt);
+    if (bufneed != 0 && ctx->worksize < bufneed) {
+        BmpPoolFree(ctx->work);
+        ctx->worksize = 0;
+
+        if ((ctx->work = (unsigned char *)BmpPoolAlloc(ctx->pool, bufneed)) == NULL) {
+            if (e != NULL) {
+                snprintf(e->errbuf, e->errsize, "***Error: %s - unable to allocate memory.\n", funcname);
+                e->errnum = CBMP_ERR_MEM;
+            }
+            BmpPoolFree(old);
+            ctx->image = NULL;
+            return BADSTATUS;
         }
+        ctx->worksize = PoolBufSize(ctx->work);
     }
 
-    // Update height and widths in header
-    bm->i.biWidth  = newwidth;
-    bm->i.biHeight = newheight;
-
-    // return new size
-    *imgsize = bm->i.biSizeImage + HDRSIZE;
+    if (ConvertBmpFormat(&ctx->work, &ctx->worksize, (pbmhdr_t)src, (prgbquad_t)(src + ColourTable(&hdr, &ncolours)), 
+                         src + hdr.f.bfOffBits, fmt, e) == 0) {
+        BmpPoolFree(old);
+        ctx->image = (old != NULL) ? NULL : src;
+        return BADSTATUS;
+    }
 
-    HDRENDIAN(bm);
+    BmpPoolFree(old);
+    ctx->image = ctx->work;
 
     return GOODSTATUS;
 }
+
+//=================================================================
+// GetBmpContextImage()
+//
+// Returns the bitmap file image held by context 'ctx', loaded or
+// converted, or NULL if none. The image may be used with the other
+// library functions, such as TransformBmp(), ClipView() and
+// WriteView(), and remains valid until the context's next load,
+// read, conversion or release.
+//
+//=================================================================
+
+unsigned char *GetBmpContextImage(pbmpctx_t ctx)
+{
+    return ctx->image;
+}
+
+//=================================================================
+// ReleaseBmpContext()
+//
+// Returns the buffers of context 'ctx' to its pool (or unmaps a
+// mapped image), leaving it holding no image. Called to give up
+// the memory of a context kept for later use.
+//
+//=================================================================
+
+void ReleaseBmpContext(pbmpctx_t ctx)
+{
+    UnloadBitmap(&ctx->map);
+    BmpPoolFree(ctx->work);
+
+    ctx->work     = NULL;
+    ctx->worksize = 0;
+    ctx->image    = NULL;
+}
@@ -30,6 +30,29 @@
 #define INFOHDRSIZE          0x28
 #define HDRSIZE              (FORMATHDRSIZE+INFOHDRSIZE)
 
+// Image sizes are held as 64 bit byte counts, so images (and files) may
+// exceed 4 GB. Only a padded row is limited, to fit a signed 32 bit row
+// stride. Where a size does not fit its 32 bit header field (bfSize or
+// biSizeImage) it is written as 0, and uncompressed data sizes are always
+// calculated from the image dimensions when read, rather than from these
+// fields. Run length encoded data must still fit in biSizeImage.
+#define BMP_MAXROWLEN        0x7ffffffcU
+
+// Compression types (biCompression)
+#define BMP_RGB              0       // Uncompressed
+#define BMP_RLE8             1       // Run length encoded 8 bit
+#define BMP_RLE4             2       // Run length encoded 4 bit
+#define BMP_BITFIELDS        3       // 16 or 32 bit, with red, green and blue masks
+#define BMP_ALPHABITFIELDS   6       // 16 or 32 bit, with red, green, blue and alpha masks
+
+// Pixel formats (see GetPixelFormat()). Other than 16 bit 5-5-5, given
+// as 15, and 5-6-5, given as 16, these are the bits per pixel.
+#define BMP_FMTOTHER         0       // 16 or 32 bit with other colour masks
+#define BMP_FMT555           15      // 16 bit, 5 bits each of red, green and blue
+#define BMP_FMT565           16      // 16 bit, 5 bits red, 6 green and 5 blue
+#define BMP_FMT24            24      // 24 bit BGR
+#define BMP_FMT32            32      // 32 bit BGRX (or BGRA), the 4 byte working format
+
 // TransformBmp monochrome unary flags
 #define MONOALL              0
 #define MONORED              1
@@ -38,6 +61,87 @@
 
 #define TBMP_ERR_BADPARAM    1
 #define TBMP_ERR_CONVERROR   2
+#define TBMP_ERR_SELFTEST    3
+#define TBMP_ERR_MEM         4
+
+// Pipeline operations (see PlanPipeline())
+#define BMP_OP_CLIP          1       // Clip to 'rect' of the image as it stands
+#define BMP_OP_REVERSE       2       // Reverse colours
+#define BMP_OP_BRIGHTNESS    3       // Brightness of 'arg' percent
+#define BMP_OP_CONTRAST      4       // Contrast of 'arg' percent
+#define BMP_OP_MONO          5       // Extract the 'arg' mono colours (MONOxxx flags)
+#define BMP_OP_GREY          6       // Grey scale
+#define BMP_OP_FLIPV         7       // Flip about vertical axis
+#define BMP_OP_FLIPH         8       // Flip about horizontal axis
+#define BMP_OP_FORMAT        9       // Output in pixel format 'arg' (BMP_FMTxxx)
+#define BMP_OP_RESIZE        10      // Resize to 'rect.right' x 'rect.top' with filter 'arg' (BMP_FILTERxxx)
+#define BMP_OP_ROTATE        11      // Rotate clockwise by 'arg' degrees (0, 90, 180 or 270)
+#define BMP_OP_STRETCH       12      // Auto levels, clipping 'arg' tenths of a percent at each end
+#define BMP_OP_EQUALIZE      13      // Histogram equalization
+
+// Resize filters
+#define BMP_FILTERBOX        0       // Average of the pixels covered (area)
+#define BMP_FILTERBILINEAR   1       // Bilinear interpolation
+
+// Convolution filters (see MakeFilter())
+#define BMP_CONVBLUR         1       // Gaussian (binomial) blur of 'param' pixels radius
+#define BMP_CONVSHARPEN      2       // Unsharp mask, sharpening by 'param' percent
+#define BMP_CONVEDGE         3       // Sobel edge magnitude
+
+// Largest convolution kernel side, and most separable terms in a filter
+#define BMP_MAXKERNEL        15
+#define BMP_MAXTERMS         BMP_MAXKERNEL
+
+// MakeFilter and MakeKernelFilter error codes
+#define FBMP_ERR_BADTYPE     1
+#define FBMP_ERR_BADPARAM    2
+#define FBMP_ERR_BADSIZE     3
+
+#define BMP_STATBLUE         0       // Statistics channels (see bmpstats_t)
+#define BMP_STATGREEN        1
+#define BMP_STATRED          2
+#define BMP_STATLUMA         3       // Luma, (77 red + 150 green + 29 blue + 128) / 256 (rounded)
+#define BMP_STATCHANS        4
+
+// GetViewStats and GetBmpStats error codes
+#define HBMP_ERR_BADFORMAT   1
+#define HBMP_ERR_MEM         2
+
+// Levels adjustments (see MakeLevels())
+#define BMP_LEVELSSTRETCH    1       // Stretch each colour's range to 0 to 255, clipping a few pixels
+#define BMP_LEVELSEQUALIZE   2       // Equalize the luma histogram
+#define BMP_MAXLEVELCLIP     499     // Most tenths of a percent clipped at each end by a stretch
+
+// MakeLevels error codes
+#define ABMP_ERR_BADMODE     1
+#define ABMP_ERR_BADPARAM    2
+
+// Most stages of point operations in a planned pipeline
+#define BMP_MAXSTAGES        8
+
+// PlanPipeline and RunPipeline error codes
+#define PBMP_ERR_BADOP       1
+#define PBMP_ERR_BADCLIP     2
+#define PBMP_ERR_TOOMANY     3
+#define PBMP_ERR_BADFORMAT   4
+#define PBMP_ERR_TOOBIG      5
+#define PBMP_ERR_MEM         6
+#define PBMP_ERR_OPEN        7
+#define PBMP_ERR_WRITE       8
+#define PBMP_ERR_BADSIZE     9
+
+// RotateViewTo and RotateBmp error codes
+#define RBMP_ERR_BADANGLE    1
+#define RBMP_ERR_BADFORMAT   2
+#define RBMP_ERR_BADPARAM    3
+#define RBMP_ERR_MEM         4
+#define RBMP_ERR_TOOBIG      5
+
+// Transform SIMD kernel levels
+#define SIMD_SCALAR          0
+#define SIMD_SSE2            1
+#define SIMD_SSSE3           2
+#define SIMD_AVX2            3
 
 // GetBitmap Error codes
 #define GBMP_ERR_MEM         1
@@ -46,10 +150,40 @@
 #define GBMP_ERR_BADPLANES   4
 #define GBMP_ERR_BADPIXELS   5
 #define GBMP_ERR_BADCOMPRESS 6
+#define GBMP_ERR_OPEN        7
+#define GBMP_ERR_MAP         8
+#define GBMP_ERR_BADSIZE     9
+#define GBMP_ERR_BADHEADER   10
+
+// LoadBitmap() modes
+#define LBMP_READ            0       // Single bulk read into an allocated buffer
+#define LBMP_MAPRO           1       // Read only memory mapped file
+#define LBMP_MAPCOPY         2       // Private (copy on write) memory mapped file
+
+// WriteBitmap error codes
+#define WBMP_ERR_OPEN        1
+#define WBMP_ERR_WRITE       2
+#define WBMP_ERR_BADCLIP     3
+#define WBMP_ERR_BADRLE      4
+#define WBMP_ERR_MEM         5
+#define WBMP_ERR_BADFORMAT   6
+#define WBMP_ERR_TOOBIG      7
+
+// ClipView error codes
+#define VBMP_ERR_BADCLIP     WBMP_ERR_BADCLIP
+#define VBMP_ERR_BADALIGN    8
 
-// ConvertBmpTo24bit error codes
+// StreamBitmap error codes (input file errors use GetBitmap codes)
+#define SBMP_ERR_OPEN        10
+#define SBMP_ERR_WRITE       11
+#define SBMP_ERR_MEM         12
+#define SBMP_ERR_BADCLIP     13
+
+// ConvertBmpTo24bit (and ConvertBmpFormat) error codes
 #define CBMP_ERR_MEM         1
 #define CBMP_ERR_CONVERROR   2
+#define CBMP_ERR_BADFORMAT   3
+#define CBMP_ERR_TOOBIG      4
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
@@ -70,7 +204,7 @@
     (_hdr)->f.bfOffBits        = SWPEND32((_hdr)->f.bfOffBits);       \
     (_hdr)->i.biSize           = SWPEND32((_hdr)->i.biSize);          \
     (_hdr)->i.biWidth          = SWPEND32((_hdr)->i.biWidth);         \
-    (_hdr)->i.biHeight         = SWPEND32((_hdr)->i.biHeight);        \
+    (_hdr)->i.biHeight         = (int32_t)SWPEND32((uint32_t)(_hdr)->i.biHeight); \
     (_hdr)->i.biPlanes         = SWPEND16((_hdr)->i.biPlanes);        \
     (_hdr)->i.biBitCount       = SWPEND16((_hdr)->i.biBitCount);      \
     (_hdr)->i.biCompression    = SWPEND32((_hdr)->i.biCompression);   \
@@ -103,7 +237,7 @@ typedef struct {
 typedef struct {
     uint32_t biSize;
     uint32_t biWidth;
-    uint32_t biHeight;
+    int32_t  biHeight;                  // Negative for rows stored top down
     uint16_t biPlanes;
     uint16_t biBitCount;
     uint32_t biCompression;
@@ -135,19 +269,104 @@ typedef struct {
 #pragma pack ()                      
 #endif
 
+// Height of the image with (host endian) header '_hdr', and whether its
+// rows are stored top down (a negative height), rather than bottom up
+#define BMPHEIGHT(_hdr)  ((uint32_t)(((_hdr)->i.biHeight < 0) ? -(int64_t)(_hdr)->i.biHeight : (_hdr)->i.biHeight))
+#define BMPTOPDOWN(_hdr) ((_hdr)->i.biHeight < 0)
+
+// Convolution filter for TransformBmp(), as set by MakeFilter() or MakeKernelFilter().
+// The kernel is the sum of 'nterms' separable terms, each the product of a horizontal
+// and a vertical vector of 'size' coefficients, divided by the term's divisor. The
+// terms are summed, or for 'magnitude' their absolute values are summed, with the
+// result clamped to 0 to 255.
+typedef struct {
+    uint32_t size;                      // Kernel side in pixels (odd, up to BMP_MAXKERNEL)
+    uint32_t nterms;                    // Number of separable terms
+    uint32_t magnitude;                 // Sum the magnitudes of the terms, rather than the terms
+    int32_t  h[BMP_MAXTERMS][BMP_MAXKERNEL]; // Horizontal coefficients of each term, left to right
+    int32_t  v[BMP_MAXTERMS][BMP_MAXKERNEL]; // Vertical coefficients of each term, bottom to top
+    int32_t  divisor[BMP_MAXTERMS];     // Divisor of each term (positive)
+} bmpfilter_t, *pbmpfilter_t;
+
+// Image statistics, from GetViewStats(), or gathered as TransformBmp() makes its pixels
+// when trans_t 'stats' is set. Each channel (BMP_STATxxx) has a histogram of its values,
+// with the other statistics found from it. The mean and standard deviation are in
+// hundredths (so a mean of 127.5 is 12750).
+typedef struct {
+    uint64_t pixels;                    // Pixels counted
+    uint64_t hist[BMP_STATCHANS][256];  // Number of pixels with each value
+    uint32_t min[BMP_STATCHANS];        // Least value (0 if no pixels)
+    uint32_t max[BMP_STATCHANS];        // Greatest value
+    uint32_t mean[BMP_STATCHANS];       // Mean value, in hundredths
+    uint32_t stddev[BMP_STATCHANS];     // Standard deviation, in hundredths
+} bmpstats_t, *pbmpstats_t;
+
+// Levels adjustment, as made by MakeLevels() from an image's statistics. Each value v of
+// colour c (0 blue, 1 green, 2 red) becomes lut[c][v]. For a stretch, the values from
+// low[c] to high[c] are spread linearly over 0 to 255, and TransformBmp() makes its tables
+// from these limits. An equalization's three tables are the same.
+typedef struct {
+    uint32_t mode;                      // BMP_LEVELSSTRETCH or BMP_LEVELSEQUALIZE
+    uint32_t low[3];                    // Stretch: values at or below which become 0
+    uint32_t high[3];                   // Stretch: values at or above which become 255 (above low)
+    unsigned char lut[3][256];          // Table for each colour
+} bmplevels_t, *pbmplevels_t;
+
 // Control structure for TransformBmp()
 typedef struct {
     uint32_t clip;                      // Clip the bitmap
     uint32_t reverse;                   // Reverse colours when non-zero
     uint32_t brightness;                // Percentage brighteness---100% is normal, 0 is disable
-    uint32_t contrast;                  // Percentage contrast---not yet implemented
+    uint32_t contrast;                  // Percentage contrast---50% is normal, 0 is disable
     uint32_t grey;                      // Grey scale when non-zero
     uint32_t flipv;                     // Flip about vertical axis when non-zero
     uint32_t fliph;                     // Flip about horizontal axis when non-zero
     uint32_t mono;                      // Unary colour enable flags (bits 0 = Red, 1 = Green, 2 = Blue.
                                         //     All 0 disables monochromatic extraction
+    uint32_t threads;                   // Number of threads to use---0 or 1 is single threaded
+    const bmpfilter_t *filter;          // Convolution filter, applied before the other transforms (NULL for none)
+    pbmpstats_t stats;                  // Statistics of the transformed pixels, gathered when not NULL
+    uint32_t levels;                    // Levels adjustment (BMP_LEVELSxxx) made from the pixels first, 0 is disable
+    uint32_t levelclip;                 // Tenths of a percent of pixels clipped at each end by BMP_LEVELSSTRETCH
 } trans_t, *ptrans_t;
 
+// Buffer pool (see CreateBmpPool()) and image context (see
+// CreateBmpContext()), both opaque
+typedef struct bmpool_s *pbmpool_t;
+typedef struct bmpctx_s *pbmpctx_t;
+
+// Buffer pool statistics, from GetBmpPoolStats()
+typedef struct {
+    uint64_t allocs;                    // Buffers allocated from the system
+    uint64_t reuses;                    // Buffers reused from the pool
+    uint64_t inuse;                     // Bytes of buffers taken from the pool
+    uint64_t retained;                  // Bytes of free buffers held for reuse
+} bmpoolstats_t, *pbmpoolstats_t;
+
+// Loaded file image descriptor used by LoadBitmap() and UnloadBitmap().
+// Zero before first use, other than optionally setting a buffer pool to
+// draw read buffers from. In LBMP_READ mode an existing buffer is reused
+// if large enough, so the same descriptor may be loaded repeatedly.
+typedef struct {
+    unsigned char *base;                // Start of file image
+    uint64_t size;                      // Size of file image in bytes
+    uint64_t bufsize;                   // Size of allocated buffer (LBMP_READ only)
+    uint32_t mode;                      // Mode image was loaded with
+    pbmpool_t pool;                     // Pool for read buffers (NULL to use malloc())
+} bmpmap_t, *pbmpmap_t;
+
+// Clipped region of a bitmap image, as set by ClipView(), referencing
+// the rows of the original image in place. The header describes the
+// region as an image in its own right (with any colour table, at
+// 'pal', following a 40 byte header).
+typedef struct {
+    bmhdr_t hdr;                        // Header for the region (host endian)
+    prgbquad_t pal;                     // Original image's colour table
+    uint32_t ncolours;                  // Number of colour table entries
+    unsigned char *rows;                // First (bottom) row of the region
+    int32_t stride;                     // Bytes from one row to the next (may be negative)
+} bmview_t, *pbmview_t;
+
 typedef struct {
     uint32_t left;
     uint32_t right;
@@ -155,10 +374,74 @@ typedef struct {
     uint32_t bottom;
 } rect_t, *prect_t;
 
+// A pipeline operation, one of a list applied in order (see PlanPipeline())
+typedef struct {
+    uint32_t op;                        // Operation (BMP_OP_xxx)
+    uint32_t arg;                       // Percentage, mono colour flags, pixel format, filter, angle or clip
+    rect_t   rect;                      // Clipping rectangle, or size (right and top) to resize to
+} bmpop_t, *pbmpop_t;
+
+// A pipeline of operations as planned by PlanPipeline(), for RunPipeline()
+typedef struct {
+    rect_t   rect;                      // Region of the input read (as for ClipView())
+    uint32_t fmt;                       // Output pixel format
+    uint32_t flipv;                     // Flip about vertical axis
+    uint32_t fliph;                     // Flip about horizontal axis
+    uint32_t nstages;                   // Number of point operation stages
+    trans_t  stages[BMP_MAXSTAGES];     // Point operations, applied a stage at a time
+    uint32_t prestages;                 // Number of stages applied before any resize
+    uint32_t width;                     // Width region is resized to (0 if not resized)
+    uint32_t height;                    // Height region is resized to
+    uint32_t filter;                    // Resize filter (BMP_FILTERxxx)
+    rect_t   crop;                      // Region of the resized image output
+    uint32_t rotate;                    // Clockwise rotation of the whole input, made first (degrees)
+} bmplan_t, *pbmplan_t;
+
 // Exported functions
-extern int      GetBitmap         (FILE *, pbmhdr_t *, prgbquad_t *, unsigned char **, perrmsg_t);
-extern uint32_t ConvertBmpTo24bit (unsigned char **, const pbmhdr_t, const prgbquad_t, const unsigned char *, perrmsg_t);
-extern int      TransformBmp      (unsigned char *,  const ptrans_t, perrmsg_t);
-extern uint32_t ClipBitmap        (unsigned char*,   const prect_t, uint32_t *);
+extern int      GetBitmap            (FILE *, pbmhdr_t *, prgbquad_t *, unsigned char **, perrmsg_t);
+extern int      LoadBitmap           (const char *, uint32_t, pbmpmap_t, pbmhdr_t *, prgbquad_t *, unsigned char **, perrmsg_t);
+extern void     UnloadBitmap         (pbmpmap_t);
+extern uint64_t ConvertBmpTo24bit    (unsigned char **, const pbmhdr_t, const prgbquad_t, const unsigned char *, perrmsg_t);
+extern uint64_t ConvertBmpTo24bitBuf (unsigned char **, uint64_t *, const pbmhdr_t, const prgbquad_t, const unsigned char *, perrmsg_t);
+extern uint64_t ConvertBmpFormat     (unsigned char **, uint64_t *, const pbmhdr_t, const prgbquad_t, const unsigned char *, uint32_t, 
+                                      perrmsg_t);
+extern uint32_t GetPixelFormat       (const unsigned char *);
+extern int      TransformBmp         (unsigned char *,  const ptrans_t, perrmsg_t);
+extern int      TransformView        (const pbmview_t,  const ptrans_t, perrmsg_t);
+extern int      TransformViewTo      (const pbmview_t,  pbmview_t, const ptrans_t, perrmsg_t);
+extern int      TransformBmpTo       (const unsigned char *, const prect_t, pbmview_t, const ptrans_t, perrmsg_t);
+extern int      TransformRegion      (unsigned char *, const prect_t, pbmview_t, const ptrans_t, perrmsg_t);
+extern int      MakeFilter           (pbmpfilter_t, uint32_t, uint32_t, perrmsg_t);
+extern int      MakeKernelFilter     (pbmpfilter_t, const int32_t *, uint32_t, int32_t, perrmsg_t);
+extern int      GetViewStats         (const pbmview_t, uint32_t, pbmpstats_t, perrmsg_t);
+extern int      GetBmpStats          (const unsigned char *, const prect_t, uint32_t, pbmpstats_t, perrmsg_t);
+extern int      MakeLevels           (pbmplevels_t, const pbmpstats_t, uint32_t, uint32_t, perrmsg_t);
+extern uint32_t GetSimdLevel         (void);
+extern uint32_t SetSimdLevel         (uint32_t);
+extern int      TransformSelfTest    (uint32_t, uint32_t, perrmsg_t);
+extern uint32_t ClipBitmap           (unsigned char*,   const prect_t, uint64_t *);
+extern int      ClipView             (unsigned char *,  const prect_t, pbmview_t, perrmsg_t);
+extern int      ClipBitmapTo         (const unsigned char *, const prect_t, pbmview_t, perrmsg_t);
+extern int      RotateViewTo         (const pbmview_t,  pbmview_t, uint32_t, uint32_t, perrmsg_t);
+extern uint64_t RotateBmp            (unsigned char **, uint64_t *, const unsigned char *, uint32_t, uint32_t, perrmsg_t);
+extern int      WriteBitmap          (const char *, const unsigned char *, const prect_t, perrmsg_t);
+extern int      WriteView            (const char *, const pbmview_t, perrmsg_t);
+extern int      WriteRleView         (const char *, const pbmview_t, perrmsg_t);
+extern int      WriteViewFormat      (const char *, const pbmview_t, uint32_t, perrmsg_t);
+extern int      StreamBitmap         (const char *, const char *, const ptrans_t, const prect_t, uint32_t, perrmsg_t);
+extern int      PlanPipeline         (const unsigned char *, const pbmpop_t, uint32_t, pbmplan_t, perrmsg_t);
+extern int      RunPipeline          (const unsigned char *, const pbmplan_t, const char *, uint32_t, uint32_t, perrmsg_t);
+extern pbmpool_t CreateBmpPool       (uint64_t);
+extern void     DestroyBmpPool       (pbmpool_t);
+extern void    *BmpPoolAlloc         (pbmpool_t, uint64_t);
+extern void     BmpPoolFree          (void *);
+extern void     GetBmpPoolStats      (pbmpool_t, pbmpoolstats_t);
+extern pbmpctx_t CreateBmpContext    (pbmpool_t);
+extern void     DestroyBmpContext    (pbmpctx_t);
+extern int      LoadBmpContext       (pbmpctx_t, const char *, uint32_t, perrmsg_t);
+extern int      ReadBmpContext       (pbmpctx_t, FILE *, perrmsg_t);
+extern int      ConvertBmpContext    (pbmpctx_t, uint32_t, perrmsg_t);
+extern unsigned char *GetBmpContextImage (pbmpctx_t);
+extern void     ReleaseBmpContext    (pbmpctx_t);
 
 #endif
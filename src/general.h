@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <endian.h>
+#include <unistd.h>
 #endif
 
 // Only define if not already (windows.h defines this)
@@ -117,6 +118,4 @@ typedef struct {
     unsigned int errnum;	// Error code
 } errmsg_t, *perrmsg_t;
 
-extern int getopt(int, char **, char *);
-
 #endif
@@ -23,27 +23,520 @@
 // Main command line entry point for bitmap program.
 //
 // Display bitmap header information, and convert low order
-// bitmaps to 24 bits if an output file specified.
+// bitmaps to 24 bits if an output file specified, or process a
+// batch of files (see batch.c). A single file's output is made
+// by a pipeline of operations (see PlanPipeline()), from the
+// options and any given with -P.
 //
 //=============================================================
 
+#include <string.h>
+
 #include "main.h"
 
+// A pipeline operation name for -P, with its operation and number of numeric parameters
+typedef struct {
+    const char *name;
+    uint32_t op;
+    uint32_t nargs;
+} pipeop_t;
+
+static const pipeop_t pipeops[] = {
+    {"clip",     BMP_OP_CLIP,       4},
+    {"reverse",  BMP_OP_REVERSE,    0},
+    {"bright",   BMP_OP_BRIGHTNESS, 1},
+    {"contrast", BMP_OP_CONTRAST,   1},
+    {"mono",     BMP_OP_MONO,       0},
+    {"grey",     BMP_OP_GREY,       0},
+    {"flipv",    BMP_OP_FLIPV,      0},
+    {"fliph",    BMP_OP_FLIPH,      0},
+    {"bits",     BMP_OP_FORMAT,     1},
+    {"resize",   BMP_OP_RESIZE,     2},
+    {"rotate",   BMP_OP_ROTATE,     1},
+    {"stretch",  BMP_OP_STRETCH,    0},
+    {"equalize", BMP_OP_EQUALIZE,   0}
+};
+
+#define NUMPIPEOPS (sizeof(pipeops) / sizeof(pipeops[0]))
+
+// Resize filter names, indexed by filter (BMP_FILTERxxx)
+static const char *filternames[] = {"box", "bilinear"};
+
+#define NUMFILTERS (sizeof(filternames) / sizeof(filternames[0]))
+
+// Convolution filter names for -f, indexed by type less one (BMP_CONVxxx), then
+// the name for a filter given by its kernel
+static const char *convnames[] = {"blur", "sharpen", "edge", "kernel"};
+
+#define NUMCONVS (sizeof(convnames) / sizeof(convnames[0]))
+
+// Statistics channel names for -S, indexed by channel (BMP_STATxxx)
+static const char *statnames[BMP_STATCHANS] = {"Blue", "Green", "Red", "Luma"};
+
+//=================================================================
+// MonoFlags()
+//
+// Returns the mono colour flags for the colour named by 'name'
+// (by its first letter), or MONOALL if not a colour.
+//
+//=================================================================
+
+static uint32_t MonoFlags(const char *name)
+{
+    switch (name[0]) {
+    case 'R': case 'r': return MONORED;
+    case 'G': case 'g': return MONOGREEN;
+    case 'B': case 'b': return MONOBLUE;
+    case 'Y': case 'y': return MONORED  | MONOGREEN;
+    case 'C': case 'c': return MONOBLUE | MONOGREEN;
+    case 'M': case 'm': return MONORED  | MONOBLUE;
+    }
+
+    return MONOALL;
+}
+
+//=================================================================
+// ParseFilter()
+//
+// Sets 'filter' to the resize filter named at 'p' (after any
+// spaces), or to BMP_FILTERBOX if none is named. Returns the
+// position after the name, or NULL if it is not a filter.
+//
+//=================================================================
+
+static const char *ParseFilter(const char *p, uint32_t *filter)
+{
+    const char *name;
+    uint32_t len, k;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    for (name = p; isalpha((unsigned char)*p); p++)
+        ;
+    len = (uint32_t)(p - name);
+
+    *filter = BMP_FILTERBOX;
+    if (len == 0)
+        return p;
+
+    for (k = 0; k < NUMFILTERS && (strlen(filternames[k]) != len || strncmp(filternames[k], name, len)); k++)
+        ;
+    if (k == NUMFILTERS) {
+        fprintf(stderr, "***Error: bad resize filter (%.*s).\n", (int)len, name);
+        return NULL;
+    }
+
+    *filter = k;
+
+    return p;
+}
+
+//=================================================================
+// ParseClip()
+//
+// Sets 'clip' to the auto levels clip percentage at 'p' (after any
+// spaces), in tenths of a percent, given with at most one decimal
+// place (e.g. 0.5). Returns the position after it, or NULL if it is
+// missing or beyond BMP_MAXLEVELCLIP.
+//
+//=================================================================
+
+static const char *ParseClip(const char *p, uint32_t *clip)
+{
+    const char *start;
+    uint32_t val = 0;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    for (start = p; isdigit((unsigned char)*p) && val <= BMP_MAXLEVELCLIP; p++)
+        val = 10*val + (uint32_t)(*p - '0');
+    val *= 10;
+
+    if (*p == '.' && isdigit((unsigned char)p[1])) {
+        val += (uint32_t)(p[1] - '0');
+        p   += 2;
+    }
+
+    if (p == start || val > BMP_MAXLEVELCLIP || isdigit((unsigned char)*p)) {
+        fprintf(stderr, "***Error: bad auto levels clip (0 to %d.%d percent).\n", BMP_MAXLEVELCLIP / 10, 
+                BMP_MAXLEVELCLIP % 10);
+        return NULL;
+    }
+
+    *clip = val;
+
+    return p;
+}
+
+//=================================================================
+// ParseConvolution()
+//
+// Sets 'f' to the convolution filter of the -f specification 'spec'.
+// This is a filter named in convnames[] and its parameter (see
+// MakeFilter()), or "kernel" followed by a divisor and the square
+// kernel's coefficients, a row at a time from the top row down (see
+// MakeKernelFilter()), all separated by spaces.
+//
+//=================================================================
+
+static int ParseConvolution(const char *spec, pbmpfilter_t f, perrmsg_t e)
+{
+    const char *p = spec, *name;
+    char *end;
+    int32_t coeffs[BMP_MAXKERNEL*BMP_MAXKERNEL], divisor;
+    uint32_t len, k, n, size, param;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    for (name = p; isalpha((unsigned char)*p); p++)
+        ;
+    len = (uint32_t)(p - name);
+
+    for (k = 0; k < NUMCONVS && (strlen(convnames[k]) != len || strncmp(convnames[k], name, len)); k++)
+        ;
+    if (k == NUMCONVS) {
+        fprintf(stderr, "***Error: bad 'filter' specification (%.*s).\n", (len != 0) ? (int)len : 1, name);
+        return BADSTATUS;
+    }
+
+    if (k < NUMCONVS - 1) {
+        param = (uint32_t)strtoul(p, &end, 0);
+        if (MakeFilter(f, k + 1, param, e) == BADSTATUS) {
+            fprintf(stderr, "%s", e->errbuf);
+            return BADSTATUS;
+        }
+        p = end;
+    } else {
+        divisor = (int32_t)strtol(p, &end, 0);
+        for (n = 0, p = end; n < BMP_MAXKERNEL*BMP_MAXKERNEL; n++, p = end) {
+            coeffs[n] = (int32_t)strtol(p, &end, 0);
+            if (end == p)
+                break;
+        }
+
+        for (size = 1; size * size < n; size += 2)
+            ;
+        if (size * size != n) {
+            fprintf(stderr, "***Error: bad 'filter' kernel (%d coefficients, needs 1, 9, 25 ... %d).\n", n, 
+                    BMP_MAXKERNEL*BMP_MAXKERNEL);
+            return BADSTATUS;
+        }
+
+        if (MakeKernelFilter(f, coeffs, size, divisor, e) == BADSTATUS) {
+            fprintf(stderr, "%s", e->errbuf);
+            return BADSTATUS;
+        }
+    }
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p != '\0') {
+        fprintf(stderr, "***Error: bad 'filter' specification at '%s'.\n", p);
+        return BADSTATUS;
+    }
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// AddOp()
+//
+// Appends operation 'op', with parameter 'arg' and (for a clip or
+// resize) rectangle 'rect', to the 'nops' operations of 'ops'.
+//
+//=================================================================
+
+static int AddOp(pbmpop_t ops, uint32_t *nops, uint32_t op, uint32_t arg, const prect_t rect)
+{
+    if (*nops == PIPEMAXOPS) {
+        fprintf(stderr, "***Error: too many pipeline operations (maximum %d).\n", PIPEMAXOPS);
+        return BADSTATUS;
+    }
+
+    memset(&ops[*nops], 0, sizeof(bmpop_t));
+    ops[*nops].op  = op;
+    ops[*nops].arg = arg;
+    if (rect != NULL)
+        ops[*nops].rect = *rect;
+    (*nops)++;
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// ParsePipeline()
+//
+// Appends the operations of the -P specification 'spec' to the
+// 'nops' operations of 'ops'. The specification is a list of
+// operations separated by commas, each named as in pipeops[] and
+// followed by its parameters, separated by spaces.
+//
+//=================================================================
+
+static int ParsePipeline(const char *spec, pbmpop_t ops, uint32_t *nops)
+{
+    const char *p = spec, *name;
+    char *end;
+    unsigned long args[4];
+    rect_t rect;
+    uint32_t len, k, a, arg;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '\0')
+            return GOODSTATUS;
+
+        for (name = p; isalpha((unsigned char)*p); p++)
+            ;
+        len = (uint32_t)(p - name);
+
+        for (k = 0; k < NUMPIPEOPS && (strlen(pipeops[k].name) != len || strncmp(pipeops[k].name, name, len)); k++)
+            ;
+        if (k == NUMPIPEOPS) {
+            fprintf(stderr, "***Error: bad 'pipeline' operation (%.*s).\n", (len != 0) ? (int)len : 1, name);
+            return BADSTATUS;
+        }
+
+        for (a = 0; a < pipeops[k].nargs; a++) {
+            args[a] = strtoul(p, &end, 0);
+            if (end == p) {
+                fprintf(stderr, "***Error: missing 'pipeline' %s parameter.\n", pipeops[k].name);
+                return BADSTATUS;
+            }
+            p = end;
+        }
+
+        arg = pipeops[k].nargs ? (uint32_t)args[0] : 0;
+
+        switch (pipeops[k].op) {
+        case BMP_OP_MONO:
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if ((arg = MonoFlags(p)) == MONOALL) {
+                fprintf(stderr, "***Error: bad 'pipeline' mono colour specification.\n");
+                return BADSTATUS;
+            }
+            while (isalpha((unsigned char)*p))
+                p++;
+            break;
+        case BMP_OP_BRIGHTNESS:
+            if (arg == 0) {
+                fprintf(stderr, "***Error: bad 'pipeline' bright specification (brightness > 0).\n");
+                return BADSTATUS;
+            }
+            break;
+        case BMP_OP_CONTRAST:
+            if (arg > 100) {
+                fprintf(stderr, "***Error: bad 'pipeline' contrast specification.\n");
+                return BADSTATUS;
+            }
+            break;
+        case BMP_OP_RESIZE:
+            if ((p = ParseFilter(p, &arg)) == NULL)
+                return BADSTATUS;
+            break;
+        case BMP_OP_STRETCH:
+            if ((p = ParseClip(p, &arg)) == NULL)
+                return BADSTATUS;
+            break;
+        }
+
+        if (pipeops[k].op == BMP_OP_RESIZE) {
+            rect.left   = 0;
+            rect.right  = (uint32_t)args[0];
+            rect.bottom = 0;
+            rect.top    = (uint32_t)args[1];
+        } else {
+            rect.left   = (uint32_t)args[0];
+            rect.right  = (uint32_t)args[1];
+            rect.bottom = (uint32_t)args[2];
+            rect.top    = (uint32_t)args[3];
+        }
+
+        if (AddOp(ops, nops, pipeops[k].op, arg, 
+                  (pipeops[k].op == BMP_OP_CLIP || pipeops[k].op == BMP_OP_RESIZE) ? &rect : NULL) == BADSTATUS)
+            return BADSTATUS;
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p != ',' && *p != '\0') {
+            fprintf(stderr, "***Error: bad 'pipeline' specification at '%s'.\n", p);
+            return BADSTATUS;
+        }
+    }
+}
+
+//=================================================================
+// OptionOps()
+//
+// Places in 'ops' the pipeline operations for the rotation by
+// 'rotate' degrees, transform 'control', clipping rectangle 'rect'
+// (if not NULL) and resize to 'size' with 'filter' (if not NULL)
+// of the options, setting 'nops' to their number. Any rotation is
+// of the input, so comes first. The transforms have always been applied
+// before the clip, and as the colour transforms act on each pixel
+// alone (with any levels found from the pixels output), they are
+// placed after the clip (so that only the pixels output are
+// transformed), leaving the flips before it. They also come after
+// any resize, so are made on the resized pixels, which is quicker
+// for a reduction, though not quite the same as resizing the
+// transformed image, as the saturation of brightness, clamping of
+// contrast and rounding of grey don't commute with the averaging
+// of the resize filters.
+//
+//=================================================================
+
+static int OptionOps(pbmpop_t ops, uint32_t *nops, uint32_t rotate, const ptrans_t control, const prect_t rect, 
+                     const prect_t size, uint32_t filter)
+{
+    int status = GOODSTATUS;
+
+    *nops = 0;
+
+    if (rotate)
+        status |= AddOp(ops, nops, BMP_OP_ROTATE, rotate, NULL);
+    if (control->flipv)
+        status |= AddOp(ops, nops, BMP_OP_FLIPV, 0, NULL);
+    if (control->fliph)
+        status |= AddOp(ops, nops, BMP_OP_FLIPH, 0, NULL);
+    if (rect != NULL)
+        status |= AddOp(ops, nops, BMP_OP_CLIP, 0, rect);
+    if (size != NULL)
+        status |= AddOp(ops, nops, BMP_OP_RESIZE, filter, size);
+    if (control->levels)
+        status |= AddOp(ops, nops, (control->levels == BMP_LEVELSSTRETCH) ? BMP_OP_STRETCH : BMP_OP_EQUALIZE, 
+                        control->levelclip, NULL);
+    if (control->reverse)
+        status |= AddOp(ops, nops, BMP_OP_REVERSE, 0, NULL);
+    if (control->brightness)
+        status |= AddOp(ops, nops, BMP_OP_BRIGHTNESS, control->brightness, NULL);
+    if (control->contrast)
+        status |= AddOp(ops, nops, BMP_OP_CONTRAST, control->contrast, NULL);
+    if (control->mono)
+        status |= AddOp(ops, nops, BMP_OP_MONO, control->mono, NULL);
+    if (control->grey)
+        status |= AddOp(ops, nops, BMP_OP_GREY, 0, NULL);
+
+    return status;
+}
+
+//=================================================================
+// WriteViewAs()
+//
+// Writes the image region 'view' to 'ofname' in the format selected
+// by 'outflags'. Indexed images kept paletted (OUTKEEPPAL) are
+// written as they are, with 8 and 4 bit images run length encoded
+// for OUTRLE. Otherwise the pixels are converted to any output
+// format given with OUTBPP(), whilst other depths are always
+// written uncompressed.
+//
+//=================================================================
+
+int WriteViewAs(const char *ofname, const pbmview_t view, uint32_t outflags, perrmsg_t e)
+{
+    uint32_t bpp = view->hdr.i.biBitCount;
+
+    if ((outflags & OUTKEEPPAL) && bpp <= BYTEWIDTH) {
+        if ((outflags & OUTRLE) && (bpp == 8 || bpp == 4))
+            return WriteRleView(ofname, view, e);
+
+        return WriteView(ofname, view, e);
+    }
+
+    if (OUTBPP(outflags))
+        return WriteViewFormat(ofname, view, OUTBPP(outflags), e);
+
+    return WriteView(ofname, view, e);
+}
+
+//=================================================================
+// WriteOutput()
+//
+// Transforms the bitmap 'bmp' as specified by 'control', and
+// writes it to 'ofname', clipped to 'rect' if not NULL (see
+// TransformRegion()), in the format selected by 'outflags' (see
+// WriteViewAs()).
+//
+//=================================================================
+
+int WriteOutput(const char *ofname, unsigned char *bmp, const ptrans_t control, const prect_t rect, uint32_t outflags, 
+                perrmsg_t e)
+{
+    bmview_t view;
+
+    if (TransformRegion(bmp, rect, &view, control, e) == BADSTATUS)
+        return BADSTATUS;
+
+    return WriteViewAs(ofname, &view, outflags, e);
+}
+
+//=================================================================
+// PrintStats()
+//
+// Prints the statistics 'stats' of an image to stdout, followed
+// by the histograms if 'debug' is non-zero.
+//
+//=================================================================
+
+static void PrintStats(const pbmpstats_t stats, int debug)
+{
+    uint32_t c, v;
+
+    fprintf(stdout, "Pixels: %llu\n", (unsigned long long)stats->pixels);
+    fprintf(stdout, "          min  max     mean   stddev\n");
+    for (c = 0; c < BMP_STATCHANS; c++)
+        fprintf(stdout, "%-6s    %3d  %3d  %3d.%02d  %3d.%02d\n", statnames[c], stats->min[c], stats->max[c], 
+                stats->mean[c] / 100, stats->mean[c] % 100, stats->stddev[c] / 100, stats->stddev[c] % 100);
+
+    if (debug) {
+        fprintf(stdout, "Value");
+        for (c = 0; c < BMP_STATCHANS; c++)
+            fprintf(stdout, " %12s", statnames[c]);
+        fprintf(stdout, "\n");
+
+        for (v = 0; v < 256; v++) {
+            fprintf(stdout, "%5d", v);
+            for (c = 0; c < BMP_STATCHANS; c++)
+                fprintf(stdout, " %12llu", (unsigned long long)stats->hist[c][v]);
+            fprintf(stdout, "\n");
+        }
+    }
+}
+
+//=================================================================
+// main()
+//
+// Command line entry point.
+//
+//=================================================================
+
 int main(int argc, char **argv)
 {
     trans_t control;
-    int option, debug = 0, convert = FALSE, grey = FALSE;
-    uint32_t i, imgsize;
+    int option, debug = 0, convert = FALSE, grey = FALSE, selftest = FALSE, showstats = FALSE;
+    uint32_t i, indexed, striprows = 0, outflags = 0, nops, filter = BMP_FILTERBOX, rotate = 0;
+    uint64_t imgsize, bufsize = 0;
     unsigned char *data, *newdata, reverse = 0x00, dim = 100;
     long tmp;
-    rect_t rect;
+    rect_t rect, size;
+    char *end;
+    bmpop_t ops[PIPEMAXOPS];
+    bmplan_t plan;
 
     char *ifname = DEFAULTIFNAME, *ofname = NULL;
-    FILE *ifp, *ofp;
+    char *listname = NULL, *pattern = NULL, *outdir = NULL, *tilespec = NULL, *pipespec = NULL, *sizespec = NULL;
+    char *convspec = NULL;
+    bmpfilter_t conv;
+    bmpstats_t stats;
     errmsg_t err;
+    bmpmap_t map = {NULL, 0, 0, LBMP_READ, NULL};
 
     // Bitmap structure pointers
-    pbmhdr_t bmp, nbmp;                 // Header
+    pbmhdr_t bmp;                       // Header
     prgbquad_t r;                       // RGB Quad table
 
     // Default the transformation controls
@@ -55,6 +548,11 @@ int main(int argc, char **argv)
     control.flipv      = FALSE;
     control.fliph      = FALSE;
     control.mono       = MONOALL;
+    control.threads    = 1;
+    control.filter     = NULL;
+    control.stats      = NULL;
+    control.levels     = 0;
+    control.levelclip  = 0;
 
     rect.top    = 100;
     rect.bottom = 0;
@@ -62,7 +560,7 @@ int main(int argc, char **argv)
     rect.right  = 100;
 
     // Process command line options
-    while ((option = getopt(argc, argv, "c:m:HVgb:rhdi:o:C:")) != EOF) {
+    while ((option = getopt(argc, argv, "c:m:HVgb:rhdkpei:o:C:s:j:L:G:D:T:B:P:z:R:f:Sa:E")) != EOF) {
         switch (option) {
         case 'C':
             control.clip = TRUE;
@@ -102,6 +600,23 @@ int main(int argc, char **argv)
             }
             control.contrast = (uint32_t) tmp;
             break;
+        case 's':
+            tmp = strtol(optarg, NULL, 0);
+            if (tmp <= 0) {
+                fprintf(stderr, "***Error: bad 'strip' specification (rows > 0).\n");
+                return BADSTATUS;
+            }
+            striprows = (uint32_t) tmp;
+            break;
+        case 'j':
+            tmp = strtol(optarg, NULL, 0);
+            if (tmp < 0) {
+                fprintf(stderr, "***Error: bad 'threads' specification (threads >= 0).\n");
+                return BADSTATUS;
+            }
+            // Zero selects a thread for each online processor
+            control.threads = tmp ? (uint32_t) tmp : NUMCPUS;
+            break;
         case 'g':
             control.grey = TRUE;
             break;
@@ -112,26 +627,7 @@ int main(int argc, char **argv)
             control.flipv = TRUE;
             break;
         case 'm':
-            switch (optarg[0]) {
-            case 'R': case 'r':
-                control.mono = MONORED;
-                break;
-            case 'G': case 'g':
-                control.mono = MONOGREEN;
-                break;
-            case 'B': case 'b':
-                control.mono = MONOBLUE;
-                break;
-            case 'Y': case 'y':
-                control.mono = MONORED | MONOGREEN;
-                break;
-            case 'C': case 'c':
-                control.mono = MONOBLUE | MONOGREEN;
-                break;
-            case 'M': case 'm':
-                control.mono = MONORED | MONOBLUE;
-                break;
-            default:
+            if ((control.mono = MonoFlags(optarg)) == MONOALL) {
                 fprintf(stderr, "***Error: bad monochrome colour specification\n");
                 return BADSTATUS;
             }
@@ -146,9 +642,86 @@ int main(int argc, char **argv)
             ofname = optarg;
             convert = TRUE;
             break;
+        case 'T':
+            tilespec = optarg;
+            break;
+        case 'L':
+            listname = optarg;
+            break;
+        case 'G':
+            pattern = optarg;
+            break;
+        case 'D':
+            outdir = optarg;
+            break;
         case 'd':
             debug++;
             break;
+        case 'k':
+            selftest = TRUE;
+            break;
+        case 'p':
+            outflags |= OUTKEEPPAL;
+            break;
+        case 'e':
+            // Only paletted images can be run length encoded
+            outflags |= OUTKEEPPAL | OUTRLE;
+            break;
+        case 'B':
+            tmp = strtol(optarg, NULL, 0);
+            if (tmp != BMP_FMT555 && tmp != BMP_FMT565 && tmp != BMP_FMT24 && tmp != BMP_FMT32) {
+                fprintf(stderr, "***Error: bad 'bits per pixel' specification (15, 16, 24 or 32).\n");
+                return BADSTATUS;
+            }
+            outflags = (outflags & ~OUTBPPMASK) | ((uint32_t)tmp << OUTBPPSHIFT);
+            break;
+        case 'P':
+            pipespec = optarg;
+            break;
+        case 'z':
+            sizespec    = optarg;
+            size.left   = 0;
+            size.right  = (uint32_t)strtoul(optarg, &end, 0);
+            size.bottom = 0;
+            size.top    = (uint32_t)strtoul(end, &end, 0);
+            if ((end = (char *)ParseFilter(end, &filter)) == NULL || *end != '\0' || (size.right == 0 && size.top == 0)) {
+                fprintf(stderr, "***Error: bad 'resize' specification (\"<width> <height> [box|bilinear]\").\n");
+                return BADSTATUS;
+            }
+            break;
+        case 'R':
+            tmp = strtol(optarg, NULL, 0);
+            if (tmp != 90 && tmp != 180 && tmp != 270) {
+                fprintf(stderr, "***Error: bad 'rotate' specification (90, 180 or 270).\n");
+                return BADSTATUS;
+            }
+            rotate = (uint32_t) tmp;
+            break;
+        case 'f':
+            convspec = optarg;
+            break;
+        case 'S':
+            showstats = TRUE;
+            break;
+        case 'a':
+            if ((end = (char *)ParseClip(optarg, &control.levelclip)) == NULL || *end != '\0') {
+                if (end != NULL)
+                    fprintf(stderr, "***Error: bad 'auto levels' specification (percent clipped at each end).\n");
+                return BADSTATUS;
+            }
+            if (control.levels == BMP_LEVELSEQUALIZE) {
+                fprintf(stderr, "***Error: auto levels and equalization cannot be used together.\n");
+                return BADSTATUS;
+            }
+            control.levels = BMP_LEVELSSTRETCH;
+            break;
+        case 'E':
+            if (control.levels == BMP_LEVELSSTRETCH) {
+                fprintf(stderr, "***Error: auto levels and equalization cannot be used together.\n");
+                return BADSTATUS;
+            }
+            control.levels = BMP_LEVELSEQUALIZE;
+            break;
         case 'h':
         default:
             USAGE;
@@ -164,14 +737,63 @@ int main(int argc, char **argv)
         return BADSTATUS;
     }
 
-    // Open input file for reading
-    if ((ifp = fopen(ifname, "rb")) == NULL) {
-        fprintf(stderr, "***Error: unable to open input file for reading.\n");
+    // Check the SIMD transform kernels against the scalar ones, if requested
+    if (selftest) {
+        if (TransformSelfTest(SELFTESTSEED, SELFTESTITERS, &err) == BADSTATUS) {
+            fprintf(stderr, "%s", err.errbuf);
+            return BADSTATUS;
+        }
+        fprintf(stderr, "Transform self test passed (SIMD level %d)\n", GetSimdLevel());
+        return GOODSTATUS;
+    }
+
+    // A pipeline makes each output file from a full colour image
+    if ((pipespec != NULL || sizespec != NULL || rotate) && (tilespec != NULL || (outflags & OUTKEEPPAL))) {
+        fprintf(stderr, "***Error: a pipeline, resize or rotation cannot be used with -T, -p or -e.\n");
         return BADSTATUS;
     }
 
-    // Read in bitmap file, setting pointers to the headers and data
-    if (GetBitmap(ifp, &bmp, &r, &data, &err) == BADSTATUS) {
+    // A filter is one of the transforms, which a pipeline plans as separate operations
+    if (convspec != NULL) {
+        if (pipespec != NULL || sizespec != NULL || rotate) {
+            fprintf(stderr, "***Error: a filter cannot be used with -P, -z or -R.\n");
+            return BADSTATUS;
+        }
+
+        if (ParseConvolution(convspec, &conv, &err) == BADSTATUS)
+            return BADSTATUS;
+        control.filter = &conv;
+    }
+
+    // Statistics are gathered as the transforms make each row of a single image, which
+    // a pipeline doesn't do
+    if (showstats) {
+        if (pipespec != NULL || sizespec != NULL || rotate || listname != NULL || pattern != NULL) {
+            fprintf(stderr, "***Error: statistics cannot be gathered with -P, -z, -R, -L or -G.\n");
+            return BADSTATUS;
+        }
+        control.stats = &stats;
+    }
+
+    // The options' operations come first in any pipeline, then any output format, then the -P operations
+    if (OptionOps(ops, &nops, rotate, &control, (control.clip == TRUE) ? &rect : NULL, (sizespec != NULL) ? &size : NULL, 
+                  filter) == BADSTATUS || 
+        (OUTBPP(outflags) && AddOp(ops, &nops, BMP_OP_FORMAT, OUTBPP(outflags), NULL) == BADSTATUS) ||
+        (pipespec != NULL && ParsePipeline(pipespec, ops, &nops) == BADSTATUS))
+        return BADSTATUS;
+
+    // Process a batch of files, rather than a single file, if requested
+    if (listname != NULL || pattern != NULL)
+        return RunBatch(listname, pattern, outdir, &control, (control.clip == TRUE) ? &rect : NULL, striprows,
+                        control.threads, outflags, (pipespec != NULL || sizespec != NULL || rotate) ? ops : NULL, nops);
+
+    // Map in bitmap file, setting pointers to the headers and data. Unless tiling,
+    // keeping the palette, filtering or gathering statistics, the image is only read
+    // (inspected, or put through a pipeline), so map read only, else map a private copy
+    // which may be modified in place. Either way, only pages referenced are read.
+    if (LoadBitmap(ifname, (ofname == NULL || (convspec == NULL && !showstats && 
+                                               (striprows || (tilespec == NULL && !(outflags & OUTKEEPPAL))))) ? 
+                   LBMP_MAPRO : LBMP_MAPCOPY, &map, &bmp, &r, &data, &err) == BADSTATUS) {
         fprintf(stderr, "%s", err.errbuf);
         return BADSTATUS;
     }
@@ -181,8 +803,10 @@ int main(int argc, char **argv)
         DISPLAYTABLES(bmp);
 
 
-    // If not a 24 bit bitmap, display the colour table and convert to 24 bit if specified
-    if (r != NULL) {
+    indexed = (SWPEND16(bmp->i.biBitCount) <= BYTEWIDTH);
+
+    // If an indexed bitmap, display the colour table
+    if (indexed) {
         // Print out the table
         if (debug) 
             for (i = 0; i < (1U << SWPEND16(bmp->i.biBitCount)); i++) 
@@ -190,48 +814,120 @@ int main(int argc, char **argv)
                     i, (int)r[i].Red, (int)r[i].Green, (int)r[i].Blue);
     }
 
+    // If streaming, process the file in strips of rows rather than as a whole image
+    // (tiles are all cut from the one whole image, and kept palettes are transformed
+    // in place in the image, so neither is streamed, whilst streamed output is always 24 bit,
+    // and filters need the rows about each)
+    if (striprows && ofname != NULL && tilespec == NULL && !((outflags & OUTKEEPPAL) && indexed) && 
+        !OUTBPP(outflags) && pipespec == NULL && sizespec == NULL && !rotate && convspec == NULL) {
+        UnloadBitmap(&map);
+
+        if (StreamBitmap(ifname, ofname, &control, (control.clip == TRUE) ? &rect : NULL, striprows, &err) == BADSTATUS) {
+            fprintf(stderr, "%s", err.errbuf);
+            return BADSTATUS;
+        }
+
+        if (showstats)
+            PrintStats(&stats, debug);
+
+        return GOODSTATUS;
+    }
+
+    // A single output file is made with one pass over just the pixels it needs, unless
+    // keeping the palette, when the colour table is transformed in place, filtering or
+    // gathering statistics. Run length encoded images have no rows to pick from, so are
+    // expanded first.
+    if (ofname != NULL && tilespec == NULL && !((outflags & OUTKEEPPAL) && indexed) && convspec == NULL && !showstats) {
+        newdata = (unsigned char *)bmp;
+        if (SWPEND32(bmp->i.biCompression) == BMP_RLE8 || SWPEND32(bmp->i.biCompression) == BMP_RLE4) {
+            newdata = NULL;
+            if (ConvertBmpFormat(&newdata, &bufsize, bmp, r, data, BMP_FMT24, &err) == 0) {
+                fprintf(stderr, "%s", err.errbuf);
+                UnloadBitmap(&map);
+                return BADSTATUS;
+            }
+        }
+
+        if (PlanPipeline(newdata, ops, nops, &plan, &err) == BADSTATUS || 
+            RunPipeline(newdata, &plan, ofname, striprows, control.threads, &err) == BADSTATUS) {
+            fprintf(stderr, "%s", err.errbuf);
+            if (newdata != (unsigned char *)bmp)
+                free(newdata);
+            UnloadBitmap(&map);
+            return BADSTATUS;
+        }
+
+        if (debug) {
+            fprintf(stdout, "Pipeline: region %d %d %d %d, %d stage(s), flips %d %d, %d bits\n", plan.rect.left, 
+                    plan.rect.right, plan.rect.bottom, plan.rect.top, plan.nstages, plan.flipv, plan.fliph, plan.fmt);
+            if (plan.width)
+                fprintf(stdout, "          resized to %d x %d (%s), output %d %d %d %d, %d stage(s) before\n", 
+                        plan.width, plan.height, filternames[plan.filter], plan.crop.left, plan.crop.right, 
+                        plan.crop.bottom, plan.crop.top, plan.prestages);
+            if (plan.rotate)
+                fprintf(stdout, "          input rotated %d degrees\n", plan.rotate);
+        }
+
+        if (newdata != (unsigned char *)bmp)
+            free(newdata);
+        UnloadBitmap(&map);
+        return GOODSTATUS;
+    }
+
     // By default, new data is the input bitmap
     newdata = (unsigned char *)bmp;
     imgsize = SWPEND32(bmp->f.bfSize);
 
-    // If conversion enabled, convert to 24 bits
-    if (convert && r != NULL) {
-        if ((imgsize = ConvertBmpTo24bit(&newdata, bmp, r, data, &err)) == 0) {
+    // The statistics of a run length encoded input are gathered from it expanded
+    if (showstats && ofname == NULL && 
+        (SWPEND32(bmp->i.biCompression) == BMP_RLE8 || SWPEND32(bmp->i.biCompression) == BMP_RLE4))
+        convert = TRUE;
+
+    // If conversion enabled, convert to the working format (see WORKFMT()), unless keeping
+    // the palette, when only the colour table is transformed
+    if (convert && GetPixelFormat(newdata) != WORKFMT(outflags) && !((outflags & OUTKEEPPAL) && indexed)) {
+        newdata = NULL;
+        if ((imgsize = ConvertBmpFormat(&newdata, &bufsize, bmp, r, data, WORKFMT(outflags), &err)) == 0) {
             // Error in conversion. Print error message and return bad status.
             fprintf(stdout, "%s", err.errbuf);
             return BADSTATUS;
         }
     } 
 
-    // If an output file specified, do any transforms required and dump to file
-    if (ofname != NULL) {
-        nbmp = (pbmhdr_t) newdata;
-
-        // Transform the data as specified
-        if (TransformBmp (newdata, &control, &err) == BADSTATUS) {
-            fprintf(stdout, "%s", err.errbuf);
+    // If tiling, transform the whole image once and write each tile from it, with the
+    // clipping rectangle (if any) being the area tiled
+    if (ofname != NULL && tilespec != NULL) {
+        if (TransformBmp(newdata, &control, &err) == BADSTATUS) {
+            fprintf(stderr, "%s", err.errbuf);
             return BADSTATUS;
         }
 
-        if (control.clip == TRUE) {
-            if (ClipBitmap(newdata, &rect, &imgsize) == BADSTATUS) {
-                fprintf(stderr, "***Error: ClipBitmap encountered a problem.\n");
-                return BADSTATUS;
-            }
+        if (RunTiles(ofname, newdata, tilespec, (control.clip == TRUE) ? &rect : NULL, control.threads, outflags) == BADSTATUS)
+            return BADSTATUS;
+
+    // If an output file specified, do any transforms required and dump to file, clipping
+    // to the rectangle if specified
+    } else if (ofname != NULL) {
+        if (WriteOutput(ofname, newdata, &control, (control.clip == TRUE) ? &rect : NULL, outflags, &err) == BADSTATUS) {
+            fprintf(stderr, "%s", err.errbuf);
+            return BADSTATUS;
         }
 
-        // Open file for writing
-        if ((ofp = fopen(ofname, "wb")) == NULL) {
-            fprintf(stderr, "***Error: unable to open output file.\n");
+    // With no output, any statistics are of the input image (or its clipped region)
+    } else if (showstats) {
+        if (GetBmpStats(newdata, (control.clip == TRUE) ? &rect : NULL, control.threads, &stats, &err) == BADSTATUS) {
+            fprintf(stderr, "%s", err.errbuf);
             return BADSTATUS;
         }
+    }
 
-        // Output image
-        for (i = 0; i < imgsize; i++) 
-            putc(newdata[i], ofp);
+    if (showstats)
+        PrintStats(&stats, debug);
 
-        fclose(ofp);
-    }
+    if (newdata != (unsigned char *)bmp)
+        free(newdata);
+
+    UnloadBitmap(&map);
 
     return GOODSTATUS;
 }
@@ -28,14 +28,44 @@
 
 #define ERRBUFSIZE    1024
 #define DEFAULTIFNAME "test.bmp"
+#define SELFTESTSEED  1
+#define SELFTESTITERS 100000
+#define PIPEMAXOPS    64
+
+// Output format flags
+#define OUTKEEPPAL    0x1               // Keep 1, 4 and 8 bit images paletted
+#define OUTRLE        0x2               // Run length encode 4 and 8 bit output
+#define OUTBPPSHIFT   8                 // Output pixel format (BMP_FMTxxx, 0 for working format)
+#define OUTBPPMASK    0xff00
+
+#define OUTBPP(_f)    (((_f) & OUTBPPMASK) >> OUTBPPSHIFT)
+
+// Working pixel format that images are converted to for transforming: 32 bit BGRX
+// when the output is 32 bit, else 24 bit
+#define WORKFMT(_f)   ((OUTBPP(_f) == BMP_FMT32) ? BMP_FMT32 : BMP_FMT24)
+
+#ifndef WIN32
+#define NUMCPUS       ((uint32_t)sysconf(_SC_NPROCESSORS_ONLN))
+#else
+#define NUMCPUS       1
+#endif
 
 #define USAGE \
-fprintf(stderr, "\nUsage: bmp [-dhrgVH] [-b <val>] [-c <val>] [-m <colour>]\n"        \
-             "           [-C <rect quad>] [-i <file>] [-o <file>]\n\n"                \
+fprintf(stderr, "\nUsage: bmp [-dhkpergVHSE] [-b <val>] [-c <val>] [-m <colour>]\n"   \
+             "           [-C <rect quad>] [-s <rows>] [-j <threads>] [-B <bits>]\n"   \
+             "           [-i <file>] [-o <file>] [-P <ops>] [-z <size>] [-R <deg>]\n" \
+             "           [-L <file>] [-G <pattern>] [-D <dir>] [-T <tiles>]\n"        \
+             "           [-f <filter>] [-a <pct>]\n\n"                                \
              "    -h Display this message\n"                                          \
              "    -d Increase debug output level (default no debug output)\n"         \
+             "    -k Check SIMD transform kernels against scalar versions and exit\n" \
+             "    -p Keep 1, 4 and 8 bit output paletted (transform colour table)\n"  \
+             "    -e Run length encode 4 and 8 bit output (implies -p)\n"             \
+             "    -B Output bits per pixel: 15 (5-5-5), 16 (5-6-5), 24 or 32\n"       \
              "    -b Change image brightness by specified percent (100%% = normal)\n" \
              "    -c Change image contrast by specified percent (50%% = normal)\n"    \
+             "    -a Auto levels, stretching colours clipping percent at each end\n"  \
+             "    -E Equalize the image's luma histogram, keeping greys grey\n"       \
              "    -g Change image to grey scale\n"                                    \
              "    -r Reverse image colours\n"                                         \
              "    -V Flip image about vertical axis\n"                                \
@@ -48,31 +78,57 @@ fprintf(stderr, "\nUsage: bmp [-dhrgVH] [-b <val>] [-c <val>] [-m <colour>]\n"
              "         C[yan]\n"                                                      \
              "         M[agenta]\n"                                                   \
              "    -C Clip image to rectangle\n"                                       \
+             "    -s Stream image in strips of specified number of rows\n"            \
+             "    -j Threads for transforms, or batch files at once (0 = per CPU)\n"  \
              "    -i Input filename (default %s)\n"                                   \
              "    -o Output filename (default no output)\n"                           \
+             "    -L Batch process file of 'input output' lines ('-' for stdin)\n"    \
+             "    -G Batch process files matching pattern (output to -D directory)\n" \
+             "    -D Output directory for batch files without an output name\n"       \
+             "    -T Output tiles: \"<cols> <rows>\" grid or @<file> of rectangles\n" \
+             "    -P Pipeline of operations, applied in order after any options:\n"   \
+             "         clip <left> <right> <bottom> <top>, reverse, grey,\n"          \
+             "         bright <val>, contrast <val>, mono <colour>, flipv, fliph,\n"  \
+             "         bits <bits>, resize <width> <height> [<filter>],\n"            \
+             "         rotate <angle>, stretch <pct>, equalize\n"                     \
+             "         (separated by commas)\n"                                       \
+             "    -z Resize to \"<width> <height> [box|bilinear]\" (0 keeps shape)\n" \
+             "    -R Rotate clockwise 90, 180 or 270 degrees, before other options\n" \
+             "    -f Filter before other transforms: blur <radius>, sharpen <pct>,\n" \
+             "         edge, or kernel <divisor> <coefficients, top row first>\n"     \
+             "    -S Print statistics of the output (input without -o) image,\n"      \
+             "         with histograms at debug level 1 or more\n"                    \
              "\n", DEFAULTIFNAME)
 
 #define DISPLAYTABLES(_bmp) {                                                                     \
-        HDRENDIAN(_bmp);                                                                          \
+        /* Converted copy, as the header may be in a read only mapping */                         \
+        bmhdr_t _h = *(_bmp);                                                                     \
+        HDRENDIAN(&_h);                                                                           \
         /* The Format table */                                                                    \
-        fprintf(stderr, "Type               = %c%c\n",     _bmp->f.bfType[0], _bmp->f.bfType[1]); \
-        fprintf(stderr, "File Size          = 0x%08x\n",   _bmp->f.bfSize);                       \
-        fprintf(stderr, "Offset             = 0x%08x\n\n", _bmp->f.bfOffBits);                    \
+        fprintf(stderr, "Type               = %c%c\n",     _h.f.bfType[0], _h.f.bfType[1]);       \
+        fprintf(stderr, "File Size          = 0x%08x\n",   _h.f.bfSize);                          \
+        fprintf(stderr, "Offset             = 0x%08x\n\n", _h.f.bfOffBits);                       \
         /* The information table */                                                               \
-        fprintf(stderr, "Size               = 0x%08x\n",   _bmp->i.biSize);                       \
-        fprintf(stderr, "Width              = 0x%08x\n",   _bmp->i.biWidth);                      \
-        fprintf(stderr, "Height             = 0x%08x\n",   _bmp->i.biHeight);                     \
-        fprintf(stderr, "Planes             = 0x%04x\n",   _bmp->i.biPlanes);                     \
-        fprintf(stderr, "Bits per Pixel     = 0x%04x\n",   _bmp->i.biBitCount);                   \
-        fprintf(stderr, "Compression        = 0x%08x\n",   _bmp->i.biCompression);                \
-        fprintf(stderr, "Image Size         = 0x%08x\n",   _bmp->i.biSizeImage);                  \
-        fprintf(stderr, "X Pixels per Meter = 0x%08x\n",   _bmp->i.biXPxlsPerMeter);              \
-        fprintf(stderr, "Y Pixles per Meter = 0x%08x\n",   _bmp->i.biYPxlsPerMeter);              \
-        fprintf(stderr, "Colour Used        = 0x%08x\n",   _bmp->i.biClrUsed);                    \
-        fprintf(stderr, "Colour Important   = 0x%08x\n",   _bmp->i.biClrImportant);               \
-        HDRENDIAN(_bmp);                                                                          \
+        fprintf(stderr, "Size               = 0x%08x\n",   _h.i.biSize);                          \
+        fprintf(stderr, "Width              = 0x%08x\n",   _h.i.biWidth);                         \
+        fprintf(stderr, "Height             = 0x%08x\n",   _h.i.biHeight);                        \
+        fprintf(stderr, "Planes             = 0x%04x\n",   _h.i.biPlanes);                        \
+        fprintf(stderr, "Bits per Pixel     = 0x%04x\n",   _h.i.biBitCount);                      \
+        fprintf(stderr, "Compression        = 0x%08x\n",   _h.i.biCompression);                   \
+        fprintf(stderr, "Image Size         = 0x%08x\n",   _h.i.biSizeImage);                     \
+        fprintf(stderr, "X Pixels per Meter = 0x%08x\n",   _h.i.biXPxlsPerMeter);                 \
+        fprintf(stderr, "Y Pixles per Meter = 0x%08x\n",   _h.i.biYPxlsPerMeter);                 \
+        fprintf(stderr, "Colour Used        = 0x%08x\n",   _h.i.biClrUsed);                       \
+        fprintf(stderr, "Colour Important   = 0x%08x\n",   _h.i.biClrImportant);                  \
 }
 
+// Exported functions
+extern int WriteViewAs  (const char *, const pbmview_t, uint32_t, perrmsg_t);
+extern int WriteOutput  (const char *, unsigned char *, const ptrans_t, const prect_t, uint32_t, perrmsg_t);
+extern int RunTiles     (const char *, unsigned char *, const char *, const prect_t, uint32_t, uint32_t);
+extern int RunBatch     (const char *, const char *, const char *, const ptrans_t, const prect_t, uint32_t, uint32_t, uint32_t,
+                         const pbmpop_t, uint32_t);
+
 // Imported objects
 extern char * optarg;
 
@@ -0,0 +1,337 @@
+//=============================================================
+// tile.c                                    Date: 2026/10/17
+//
+// Copyright (c) 2003-2024 Simon Southwell
+//
+// This file is part of bmp.
+//
+// bmp is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// bmp is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with bmp. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+//
+// Tile splitting for the bitmap program. An image, already read
+// (and converted and transformed) once, is cut into a grid of
+// adjoining tiles, or a list of rectangles, with each tile written
+// straight from the image's rows (see ClipView()) by a pool of
+// writer threads.
+//
+//=============================================================
+
+#include <string.h>
+
+#include "main.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#define TILELINESIZE  1024
+#define TILENAMESIZE  4096
+
+// A single tile, with its grid position (or list index as column)
+typedef struct {
+    rect_t rect;
+    uint32_t col;
+    uint32_t row;
+} tile_t, *ptile_t;
+
+// State shared by all the tile writers
+typedef struct {
+    unsigned char *bmp;                                 // Image to be tiled
+    const char *ofname;                                 // Output name the tile names are based on
+    ptile_t tiles;                                      // Tile list
+    uint32_t ntiles;                                    // Number of tiles in list
+    uint32_t listsize;                                  // Allocated size of tile list
+    uint32_t grid;                                      // Tiles are a grid, rather than a list
+    uint32_t next;                                      // Next tile to be written
+    uint32_t failed;                                    // Count of failed tiles
+    uint32_t outflags;                                  // Output format flags
+#ifndef WIN32
+    pthread_mutex_t lock;                               // Guards tile taking and reporting
+#endif
+} tileset_t, *ptileset_t;
+
+//=================================================================
+// AddTile()
+//
+// Appends a tile for rectangle 'rect' to the tile list.
+//
+//=================================================================
+
+static int AddTile(ptileset_t t, const prect_t rect, uint32_t col, uint32_t row)
+{
+    ptile_t tiles;
+
+    if (t->ntiles == t->listsize) {
+        t->listsize = t->listsize ? 2 * t->listsize : 64;
+        if ((tiles = (ptile_t)realloc(t->tiles, t->listsize * sizeof(tile_t))) == NULL) {
+            fprintf(stderr, "***Error: unable to allocate memory.\n");
+            return BADSTATUS;
+        }
+        t->tiles = tiles;
+    }
+
+    t->tiles[t->ntiles].rect = *rect;
+    t->tiles[t->ntiles].col  = col;
+    t->tiles[t->ntiles].row  = row;
+    t->ntiles++;
+
+    return GOODSTATUS;
+}
+
+//=================================================================
+// ParseTiles()
+//
+// Builds the tile list from 'spec'. This is either "<cols> <rows>",
+// for a grid of adjoining tiles over 'region' (column 0 on the
+// left, and row 0 at the bottom), or "@<file>" for a file of
+// rectangles, one per line, each given as for the -C option.
+//
+//=================================================================
+
+static int ParseTiles(ptileset_t t, const char *spec, const prect_t region)
+{
+    FILE *fp;
+    char line[TILELINESIZE];
+    char *p, *end;
+    rect_t rect;
+    unsigned long cols, rows, c, r;
+    uint32_t width, height;
+    int status = GOODSTATUS;
+
+    if (spec[0] != '@') {
+        cols = strtoul(spec, &end, 0);
+        rows = strtoul(end, &p, 0);
+
+        width  = region->right - region->left;
+        height = region->top - region->bottom;
+
+        if (cols == 0 || rows == 0 || p == end || cols > width || rows > height) {
+            fprintf(stderr, "***Error: bad 'tile' specification (1 to image size columns and rows).\n");
+            return BADSTATUS;
+        }
+
+        t->grid = TRUE;
+
+        for (r = 0; status == GOODSTATUS && r < rows; r++) {
+            for (c = 0; status == GOODSTATUS && c < cols; c++) {
+                rect.left   = region->left   + (uint32_t)(((uint64_t)width  * c)     / cols);
+                rect.right  = region->left   + (uint32_t)(((uint64_t)width  * (c+1)) / cols);
+                rect.bottom = region->bottom + (uint32_t)(((uint64_t)height * r)     / rows);
+                rect.top    = region->bottom + (uint32_t)(((uint64_t)height * (r+1)) / rows);
+                status = AddTile(t, &rect, (uint32_t)c, (uint32_t)r);
+            }
+        }
+
+        return status;
+    }
+
+    if ((fp = fopen(&spec[1], "r")) == NULL) {
+        fprintf(stderr, "***Error: unable to open tile file %s for reading.\n", &spec[1]);
+        return BADSTATUS;
+    }
+
+    t->grid = FALSE;
+
+    while (status == GOODSTATUS && fgets(line, TILELINESIZE, fp) != NULL) {
+        for (p = line; *p == ' ' || *p == '\t'; p++)
+            ;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+
+        rect.left   = strtoul(p,   &end, 0);
+        rect.right  = strtoul(end, &end, 0);
+        rect.bottom = strtoul(end, &end, 0);
+        rect.top    = strtoul(end, &end, 0);
+        status = AddTile(t, &rect, t->ntiles, 0);
+    }
+
+    fclose(fp);
+
+    return status;
+}
+
+//=================================================================
+// TileName()
+//
+// Places in 'name' the output file name for tile 't', formed from
+// 'ofname' with "_<col>_<row>" (for a grid) or "_<index>" (for a
+// list) inserted before any extension.
+//
+//=================================================================
+
+static void TileName(char *name, const char *ofname, const ptile_t tile, uint32_t grid)
+{
+    const char *ext, *p;
+    char suffix[32];
+
+    // Extension is from the last '.' of the final path component
+    for (ext = NULL, p = ofname; *p != '\0'; p++) {
+        if (*p == '.')
+            ext = p;
+        else if (*p == '/' || *p == '\\')
+            ext = NULL;
+    }
+    if (ext == NULL)
+        ext = p;
+
+    if (grid)
+        snprintf(suffix, sizeof(suffix), "_%d_%d", tile->col, tile->row);
+    else
+        snprintf(suffix, sizeof(suffix), "_%d", tile->col);
+
+    snprintf(name, TILENAMESIZE, "%.*s%s%s", (int)(ext - ofname), ofname, suffix, ext);
+}
+
+//=================================================================
+// TileWriter()
+//
+// Tile writer thread body. Takes tiles from the shared list until
+// none remain, writing each as a view of the image.
+//
+//=================================================================
+
+static void *TileWriter(void *arg)
+{
+    ptileset_t t = (ptileset_t)arg;
+    char name[TILENAMESIZE];
+    char errbuf[ERRBUFSIZE];
+    errmsg_t err;
+    bmview_t view;
+    ptile_t tile;
+    int status;
+
+    err.errbuf  = errbuf;
+    err.errsize = ERRBUFSIZE;
+
+    for (;;) {
+#ifndef WIN32
+        pthread_mutex_lock(&t->lock);
+#endif
+        tile = (t->next < t->ntiles) ? &t->tiles[t->next++] : NULL;
+#ifndef WIN32
+        pthread_mutex_unlock(&t->lock);
+#endif
+        if (tile == NULL)
+            break;
+
+        TileName(name, t->ofname, tile, t->grid);
+
+        err.errnum = 0;
+        if ((status = ClipView(t->bmp, &tile->rect, &view, &err)) == GOODSTATUS)
+            status = WriteViewAs(name, &view, t->outflags, &err);
+
+        if (status == BADSTATUS) {
+#ifndef WIN32
+            pthread_mutex_lock(&t->lock);
+#endif
+            t->failed++;
+            fprintf(stderr, "%s", err.errbuf);
+#ifndef WIN32
+            pthread_mutex_unlock(&t->lock);
+#endif
+        }
+    }
+
+    return NULL;
+}
+
+//=================================================================
+// RunTiles()
+//
+// Writes the tiles of bitmap image 'bmp' specified by 'spec' (see
+// ParseTiles()), over 'region' of the image or, if NULL, the whole
+// image, using 'writers' concurrent threads, in the format selected
+// by 'outflags' (see WriteViewAs()). The tile file names are based
+// on 'ofname' (see TileName()). Returns BADSTATUS if any tile could
+// not be written.
+//
+//=================================================================
+
+int RunTiles(const char *ofname, unsigned char *bmp, const char *spec, const prect_t region, uint32_t writers, 
+             uint32_t outflags)
+{
+    tileset_t t;
+    bmhdr_t hdr;
+    rect_t whole;
+    uint32_t i;
+#ifndef WIN32
+    pthread_t *tids;
+#endif
+
+    memset(&t, 0, sizeof(tileset_t));
+    t.bmp      = bmp;
+    t.ofname   = ofname;
+    t.outflags = outflags;
+
+    // Grid covers the given region, limited to the image
+    hdr = *(pbmhdr_t)bmp;
+    HDRENDIAN(&hdr);
+
+    whole.left   = 0;
+    whole.right  = hdr.i.biWidth;
+    whole.bottom = 0;
+    whole.top    = BMPHEIGHT(&hdr);
+
+    if (region != NULL) {
+        whole.left   = region->left;
+        whole.bottom = region->bottom;
+        if (region->right < whole.right)
+            whole.right = region->right;
+        if (region->top < whole.top)
+            whole.top = region->top;
+
+        if (whole.right <= whole.left || whole.top <= whole.bottom) {
+            fprintf(stderr, "***Error: bad clipping rectangle for tiles.\n");
+            return BADSTATUS;
+        }
+    }
+
+    if (ParseTiles(&t, spec, &whole) == BADSTATUS) {
+        free(t.tiles);
+        return BADSTATUS;
+    }
+
+    if (writers > t.ntiles)
+        writers = t.ntiles;
+    if (writers == 0)
+        writers = 1;
+
+#ifndef WIN32
+    pthread_mutex_init(&t.lock, NULL);
+
+    if ((tids = (pthread_t *)malloc(writers * sizeof(pthread_t))) == NULL)
+        writers = 1;
+
+    // The calling thread is one of the writers
+    for (i = 1; i < writers; i++)
+        if (pthread_create(&tids[i], NULL, TileWriter, &t) != 0)
+            break;
+    writers = i;
+
+    TileWriter(&t);
+
+    for (i = 1; i < writers; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+    pthread_mutex_destroy(&t.lock);
+#else
+    TileWriter(&t);
+#endif
+
+    free(t.tiles);
+
+    return t.failed ? BADSTATUS : GOODSTATUS;
+}